@@ -1,6 +1,8 @@
 #pragma once
 
+#include <atomic>
 #include <memory>
+#include <mutex>
 #include <vector>
 
 namespace wing {
@@ -28,4 +30,74 @@ class ArenaAllocator {
   size_t offset_{BlockSize + 1};
 };
 
+/**
+ * An arena that can be used by multiple threads at the same time.
+ * Allocations bump an atomic offset in the current block, so the fast path is
+ * a single fetch_add. Only switching to a new block takes the mutex.
+ * All the returned addresses are aligned to 8 bytes.
+ */
+class ConcurrentArenaAllocator {
+ public:
+  constexpr static size_t BlockSize = 64 * 1024;
+
+  ConcurrentArenaAllocator() = default;
+  ConcurrentArenaAllocator(const ConcurrentArenaAllocator&) = delete;
+  ConcurrentArenaAllocator& operator=(const ConcurrentArenaAllocator&) = delete;
+
+  uint8_t* Allocate(size_t size) {
+    size = (size + 7) & ~size_t(7);
+    /* Large allocations get their own block, so they don't waste the rest of
+     * the current block. */
+    if (size > BlockSize / 4) {
+      std::unique_lock lck(mu_);
+      return NewBlock(size)->data;
+    }
+    while (true) {
+      Block* block = current_.load(std::memory_order_acquire);
+      if (block != nullptr) {
+        size_t off = block->used.fetch_add(size, std::memory_order_relaxed);
+        if (off + size <= block->capacity) {
+          return block->data + off;
+        }
+      }
+      std::unique_lock lck(mu_);
+      /* Another thread may have switched the block already. */
+      if (current_.load(std::memory_order_relaxed) == block) {
+        current_.store(NewBlock(BlockSize), std::memory_order_release);
+      }
+    }
+  }
+
+  /* The total number of bytes of all the blocks */
+  size_t MemoryUsage() const {
+    return memory_usage_.load(std::memory_order_relaxed);
+  }
+
+ private:
+  struct Block {
+    std::atomic<size_t> used{0};
+    size_t capacity{0};
+    std::unique_ptr<uint8_t[]> buf;
+    uint8_t* data{nullptr};
+  };
+
+  // Require: mu_ held
+  Block* NewBlock(size_t capacity) {
+    auto block = std::make_unique<Block>();
+    block->capacity = capacity;
+    /* new[] of uint8_t is only guaranteed to be aligned to
+     * __STDCPP_DEFAULT_NEW_ALIGNMENT__, which is at least 8 bytes. */
+    block->buf = std::unique_ptr<uint8_t[]>(new uint8_t[capacity]);
+    block->data = block->buf.get();
+    memory_usage_.fetch_add(capacity, std::memory_order_relaxed);
+    blocks_.push_back(std::move(block));
+    return blocks_.back().get();
+  }
+
+  std::mutex mu_;
+  std::vector<std::unique_ptr<Block>> blocks_;
+  std::atomic<Block*> current_{nullptr};
+  std::atomic<size_t> memory_usage_{0};
+};
+
 }  // namespace wing
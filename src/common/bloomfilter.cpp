@@ -1,19 +1,145 @@
 #include "common/bloomfilter.hpp"
 
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define WING_BLOOM_AVX2
+#endif
+
 #include "common/serializer.hpp"
 
 namespace wing {
 
 namespace utils {
 
-void BloomFilter::Create(
-    size_t key_n, size_t bits_per_key, std::string& bloom_bits) {
+/* The first word of the header is the number of bits in the legacy format,
+ * which never has the highest bit set. */
+static constexpr uint64_t kBlockedTag = uint64_t(1) << 63;
+
+static constexpr size_t kLineBits = BloomFilter::kLineSize * 8;
+
+/* The position of the i-th probe in a line is the highest 9 bits of
+ * (hash * kProbeSalts[i]) as a 32-bit integer. */
+alignas(32) static constexpr uint32_t
+    kProbeSalts[BloomFilter::kMaxLineProbes] = {
+    0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU, 0x705495c7U,
+    0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U};
+
+struct FilterInfo {
+  bool blocked;
+  /* The number of bits in the legacy format, or the number of lines. */
+  size_t size;
+  size_t hash_num;
+  const char* array;
+};
+
+static FilterInfo ParseHeader(const char* bloom_bits) {
+  auto des = utils::Deserializer(bloom_bits);
+  uint64_t size = des.Read<uint64_t>();
+  des.Read<uint64_t>();  // key_n
+  size_t bits_per_key = des.Read<uint64_t>();
+  FilterInfo ret;
+  ret.blocked = size & kBlockedTag;
+  ret.size = size & ~kBlockedTag;
+  if (ret.blocked) {
+    ret.hash_num = BloomFilter::BlockedProbes(bits_per_key);
+  } else {
+    ret.hash_num =
+        std::min<size_t>(30, std::max<size_t>(1, bits_per_key * 0.69));
+  }
+  ret.array = des.data();
+  return ret;
+}
+
+/* The line of a hash. The higher 32 bits choose the line, and the lower 32
+ * bits choose the probes in it. */
+static const char* LineOf(const FilterInfo& info, size_t h) {
+  size_t line = ((h >> 32) * info.size) >> 32;
+  return info.array + line * BloomFilter::kLineSize;
+}
+
+static uint32_t ProbeOf(size_t h, size_t i) {
+  return (static_cast<uint32_t>(h) * kProbeSalts[i]) >> 23;
+}
+
+static bool FindInLine(const char* line, size_t h, size_t hash_num) {
+  for (size_t i = 0; i < hash_num; i++) {
+    uint32_t pos = ProbeOf(h, i);
+    if (!(line[pos / 8] & (1 << (pos & 7)))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+#ifdef WING_BLOOM_AVX2
+
+/* Check all the probes at once. The bit pos of the line is bit (pos & 31) of
+ * the (pos >> 5)-th 32-bit word, since x86 is little-endian. */
+__attribute__((target("avx2"))) static bool FindInLineAVX2(
+    const char* line, size_t h, size_t hash_num) {
+  __m256i salts =
+      _mm256_load_si256(reinterpret_cast<const __m256i*>(kProbeSalts));
+  __m256i pos = _mm256_srli_epi32(
+      _mm256_mullo_epi32(_mm256_set1_epi32(static_cast<uint32_t>(h)), salts),
+      23);
+  __m256i words = _mm256_i32gather_epi32(
+      reinterpret_cast<const int*>(line), _mm256_srli_epi32(pos, 5), 4);
+  __m256i bits = _mm256_sllv_epi32(_mm256_set1_epi32(1),
+      _mm256_and_si256(pos, _mm256_set1_epi32(31)));
+  /* Only the first hash_num lanes are probes. */
+  __m256i lanes = _mm256_cmpgt_epi32(_mm256_set1_epi32(hash_num),
+      _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+  return _mm256_testc_si256(words, _mm256_and_si256(bits, lanes));
+}
+
+/* The probe of a line is selected once at startup. A lookup during static
+ * initialization before it is set takes the scalar probe, which gives the
+ * same results. */
+static const bool kHasAVX2 = []() {
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2");
+}();
+
+#endif
+
+static bool FindInBlocked(const FilterInfo& info, size_t h) {
+  const char* line = LineOf(info, h);
+#ifdef WING_BLOOM_AVX2
+  if (kHasAVX2) {
+    return FindInLineAVX2(line, h, info.hash_num);
+  }
+#endif
+  return FindInLine(line, h, info.hash_num);
+}
+
+static bool FindInLegacy(const FilterInfo& info, size_t h) {
+  size_t bits = info.size;
+  // use the double-hashing in leveldb, i.e. h_k = h1 + k * h2
+  const size_t delta = Hash8(h, 0x202403211957);
+  size_t bitpos = h % bits, dpos = delta % bits;
+  for (size_t j = 0; j < info.hash_num; j++) {
+    if (!(info.array[bitpos / 8] & (1 << (bitpos & 7)))) {
+      return false;
+    }
+    bitpos += dpos, bitpos >= bits ? bitpos -= bits : 0;
+  }
+  return true;
+}
+
+void BloomFilter::Create(size_t key_n, size_t bits_per_key,
+    std::string& bloom_bits, Format format) {
   size_t bits = key_n * bits_per_key;
   bits = std::max<size_t>(64, bits);
+  uint64_t size = bits;
+  if (format == Format::kBlocked) {
+    size = (bits + kLineBits - 1) / kLineBits;
+    bits = size * kLineBits;
+    size |= kBlockedTag;
+  }
   size_t bytes = (bits + 7) / 8;
-  bloom_bits.resize(bytes + sizeof(uint64_t) * 3, 0);
+  bloom_bits.assign(bytes + kHeaderSize, 0);
   utils::Serializer(bloom_bits.data())
-      .Write<uint64_t>(bits)
+      .Write<uint64_t>(size)
       .Write<uint64_t>(key_n)
       .Write<uint64_t>(bits_per_key);
 }
@@ -24,17 +150,21 @@ void BloomFilter::Add(std::string_view key, std::string& bloom_bits) {
 }
 
 void BloomFilter::Add(size_t h, std::string& bloom_bits) {
-  auto des = utils::Deserializer(bloom_bits.data());
-  size_t bits = des.Read<uint64_t>();
-  size_t key_n = des.Read<uint64_t>();
-  size_t bits_per_key = des.Read<uint64_t>();
-  size_t hash_num =
-      std::min<size_t>(30, std::max<size_t>(1, bits_per_key * 0.69));
-  auto* array = const_cast<char*>(des.data());
+  auto info = ParseHeader(bloom_bits.data());
+  if (info.blocked) {
+    auto* line = const_cast<char*>(LineOf(info, h));
+    for (size_t i = 0; i < info.hash_num; i++) {
+      uint32_t pos = ProbeOf(h, i);
+      line[pos / 8] |= (1 << (pos & 7));
+    }
+    return;
+  }
+  size_t bits = info.size;
+  auto* array = const_cast<char*>(info.array);
   // use the double-hashing in leveldb, i.e. h1 + i * h2
   const size_t delta = Hash8(h, 0x202403211957);
   size_t bitpos = h % bits, dpos = delta % bits;
-  for (size_t j = 0; j < hash_num; j++) {
+  for (size_t j = 0; j < info.hash_num; j++) {
     array[bitpos / 8] |= (1 << (bitpos & 7));
     bitpos += dpos, bitpos >= bits ? bitpos -= bits : 0;
   }
@@ -46,23 +176,41 @@ bool BloomFilter::Find(std::string_view key, std::string_view bloom_bits) {
 }
 
 bool BloomFilter::Find(size_t h, std::string_view bloom_bits) {
-  auto des = utils::Deserializer(bloom_bits.data());
-  size_t bits = des.Read<uint64_t>();
-  size_t key_n = des.Read<uint64_t>();
-  size_t bits_per_key = des.Read<uint64_t>();
-  size_t hash_num =
-      std::min<size_t>(30, std::max<size_t>(1, bits_per_key * 0.69));
-  auto* array = des.data();
-  // use the double-hashing in leveldb, i.e. h_k = h1 + k * h2
-  const size_t delta = Hash8(h, 0x202403211957);
-  size_t bitpos = h % bits, dpos = delta % bits;
-  for (size_t j = 0; j < hash_num; j++) {
-    if (!(array[bitpos / 8] & (1 << (bitpos & 7)))) {
-      return false;
+  auto info = ParseHeader(bloom_bits.data());
+  return info.blocked ? FindInBlocked(info, h) : FindInLegacy(info, h);
+}
+
+namespace bloom_internal {
+
+bool FindScalar(size_t h, std::string_view bloom_bits) {
+  auto info = ParseHeader(bloom_bits.data());
+  return info.blocked ? FindInLine(LineOf(info, h), h, info.hash_num)
+                      : FindInLegacy(info, h);
+}
+
+}  // namespace bloom_internal
+
+void BloomFilter::Find(std::span<const size_t> hashes,
+    std::string_view bloom_bits, BitVector& result) {
+  auto info = ParseHeader(bloom_bits.data());
+  if (!info.blocked) {
+    for (size_t i = 0; i < hashes.size(); i++) {
+      result[i] = FindInLegacy(info, hashes[i]);
     }
-    bitpos += dpos, bitpos >= bits ? bitpos -= bits : 0;
+    return;
+  }
+  /* Prefetch the lines several keys ahead, so that the cache misses of
+   * different keys overlap. */
+  constexpr size_t kPrefetchDistance = 8;
+  for (size_t i = 0; i < std::min(kPrefetchDistance, hashes.size()); i++) {
+    __builtin_prefetch(LineOf(info, hashes[i]));
+  }
+  for (size_t i = 0; i < hashes.size(); i++) {
+    if (i + kPrefetchDistance < hashes.size()) {
+      __builtin_prefetch(LineOf(info, hashes[i + kPrefetchDistance]));
+    }
+    result[i] = FindInBlocked(info, hashes[i]);
   }
-  return true;
 }
 
 }  // namespace utils
@@ -1,20 +1,54 @@
 #pragma once
 
+#include <algorithm>
+#include <span>
+
+#include "common/bitvector.hpp"
 #include "common/murmurhash.hpp"
 
 namespace wing {
 
 namespace utils {
 
+/**
+ * The bloom filter buffer is | header (3 * u64) | bit array |. The header
+ * tells the format of the filter:
+ *
+ * kBlocked: The bit array is divided into 64-byte lines, and all the probes
+ * of a key hit the same line, so a lookup touches one cache line if the bit
+ * array is aligned to 64 bytes (see kHeaderSize).
+ *
+ * kLegacy: The probes of a key are scattered across the whole bit array. It
+ * is only created for compatibility, but filters of both formats can be read.
+ */
 class BloomFilter {
  public:
+  enum class Format { kLegacy, kBlocked };
+
+  /* The size of the header before the bit array. */
+  static constexpr size_t kHeaderSize = 3 * sizeof(uint64_t);
+
+  /* The size of a line of the blocked format. */
+  static constexpr size_t kLineSize = 64;
+
+  /* The maximum number of probes of a key in a line. */
+  static constexpr size_t kMaxLineProbes = 8;
+
+  /* The number of probes of a key in the blocked format. */
+  static size_t BlockedProbes(double bits_per_key) {
+    /* The optimal number of probes, ln2 * bits_per_key, rounded to the
+     * nearest. */
+    return std::min<size_t>(
+        kMaxLineProbes, std::max<size_t>(1, bits_per_key * 0.69 + 0.5));
+  }
+
   static size_t BloomHash(std::string_view key) {
     return Hash(key.data(), key.size(), 0x1145141919810);
   }
 
   /* Create a bloom filter buffer */
-  static void Create(
-      size_t key_n, size_t bits_per_key, std::string& bloom_bits);
+  static void Create(size_t key_n, size_t bits_per_key, std::string& bloom_bits,
+      Format format = Format::kBlocked);
 
   /* Add a key to the bloom filter */
   static void Add(std::string_view key, std::string& bloom_bits);
@@ -27,8 +61,27 @@ class BloomFilter {
 
   /* Check if a key (i.e. BloomHash(key)) may be added */
   static bool Find(size_t hash1, std::string_view bloom_bits);
+
+  /**
+   * Check a batch of key hashes. The i-th bit of result is set if hashes[i]
+   * may be added, and the size of result must be at least hashes.size(). The
+   * lines are prefetched before they are probed, and the probes of a key are
+   * checked together with AVX2 if the CPU supports it.
+   */
+  static void Find(std::span<const size_t> hashes, std::string_view bloom_bits,
+      BitVector& result);
 };
 
+namespace bloom_internal {
+
+/**
+ * Find(hash1, bloom_bits) with the scalar probe, even if the CPU supports
+ * AVX2. Only the tests use it, to check that both probes agree.
+ */
+bool FindScalar(size_t hash1, std::string_view bloom_bits);
+
+}  // namespace bloom_internal
+
 }  // namespace utils
 
 }  // namespace wing
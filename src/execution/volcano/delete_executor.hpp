@@ -52,11 +52,9 @@ class DeleteExecutor : public Executor {
     }
     // Release the iterator.
     ch_ = nullptr;
-    // Delete the tuples.
-    for (auto& a : obsolete_tuple_primary_keys_) {
-      if (!handle_->Delete(a)) {
-        throw DBException("Delete operation failed.");
-      }
+    // Delete the tuples in one batch.
+    if (!handle_->DeleteBatch(obsolete_tuple_primary_keys_)) {
+      throw DBException("Delete operation failed.");
     }
     return reinterpret_cast<const uint8_t*>(&delete_row_counts_);
   }
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <span>
+#include <unordered_map>
 #include <vector>
 
 #include "catalog/db.hpp"
@@ -39,12 +41,12 @@ class FKChecker {
       a->Init();
   }
 
-  void InsertCheck(SingleTuple x) {
+  void InsertCommit(SingleTuple raw_x) {
     for (uint32_t i = 0; i < fk_schema_.size(); i++) {
+      auto key_view = Tuple::GetFieldView(raw_x.Data(), fk_offsets_[i],
+          fk_schema_[i].type_, fk_schema_[i].size_);
       auto key =
-          x.Read<StaticFieldRef>(fk_schema_[i].index_ * sizeof(StaticFieldRef));
-      auto key_view = StaticFieldRef::GetView(
-          &key, fk_schema_[i].type_, fk_schema_[i].size_);
+          StaticFieldRef::CreateFromStringView(key_view, fk_schema_[i].type_);
       if (auto ret = fk_check_in_refcounts_[i]->Search(key_view); ret) {
         size_t value =
             SingleTuple(ret).Read<size_t>(Tuple::GetOffsetOfStaticField(0)) + 1;
@@ -61,25 +63,59 @@ class FKChecker {
     }
   }
 
-  void InsertCommit(SingleTuple raw_x) {
+  /**
+   * Check a batch of rows serialized in the storage format, and update the
+   * refcounts. The referred keys of the batch are searched by MultiSearch,
+   * so that the storage can share the reads of keys that are close.
+   */
+  void InsertCheckBatch(std::span<const std::string_view> raw_rows) {
     for (uint32_t i = 0; i < fk_schema_.size(); i++) {
-      auto key_view = Tuple::GetFieldView(raw_x.Data(), fk_offsets_[i],
-          fk_schema_[i].type_, fk_schema_[i].size_);
-      auto key =
-          StaticFieldRef::CreateFromStringView(key_view, fk_schema_[i].type_);
-      if (auto ret = fk_check_in_refcounts_[i]->Search(key_view); ret) {
-        size_t value =
-            SingleTuple(ret).Read<size_t>(Tuple::GetOffsetOfStaticField(0)) + 1;
-        _update(i, key, fk_schema_[i].type_, fk_schema_[i].size_, key_view,
-            value, false);
-        continue;
+      auto type = fk_schema_[i].type_;
+      auto size = fk_schema_[i].size_;
+      // The distinct referred keys and the number of rows referring to them.
+      std::vector<std::string_view> keys;
+      std::vector<StaticFieldRef> key_refs;
+      std::vector<size_t> counts;
+      std::unordered_map<std::string_view, size_t> key_ids;
+      for (auto row : raw_rows) {
+        // The view points to the row, so it is valid in the whole batch.
+        auto key_view =
+            Tuple::GetFieldView(row.data(), fk_offsets_[i], type, size);
+        auto [it, inserted] = key_ids.emplace(key_view, keys.size());
+        if (inserted) {
+          keys.push_back(key_view);
+          key_refs.push_back(_read_raw_key(i, row));
+          counts.push_back(0);
+        }
+        counts[it->second] += 1;
       }
-      if (!fk_check_[i]->Search(key_view)) {
-        throw DBException("Primary key does not exist.");
+      // The returned rows are valid until the next MultiSearch, so read the
+      // refcounts first.
+      auto refs = fk_check_in_refcounts_[i]->MultiSearch(keys);
+      std::vector<size_t> values(keys.size(), 0);
+      std::vector<bool> exists(keys.size(), false);
+      std::vector<std::string_view> missing;
+      for (size_t j = 0; j < keys.size(); j++) {
+        if (refs[j]) {
+          exists[j] = true;
+          values[j] = SingleTuple(refs[j]).Read<size_t>(
+              Tuple::GetOffsetOfStaticField(0));
+        } else {
+          missing.push_back(keys[j]);
+        }
+      }
+      if (!missing.empty()) {
+        for (auto ret : fk_check_[i]->MultiSearch(missing)) {
+          if (!ret) {
+            throw DBException("Primary key does not exist.");
+          }
+        }
+      }
+      for (size_t j = 0; j < keys.size(); j++) {
+        // Create a new entry if it does not exist.
+        _update(i, key_refs[j], type, size, keys[j], values[j] + counts[j],
+            !exists[j]);
       }
-      // Create a new entry.
-      _update(
-          i, key, fk_schema_[i].type_, fk_schema_[i].size_, key_view, 1, true);
     }
   }
 
@@ -112,6 +148,20 @@ class FKChecker {
   }
 
  private:
+  // Read the i-th referred key from a row serialized in the storage format.
+  StaticFieldRef _read_raw_key(uint32_t i, std::string_view raw_row) {
+    auto type = fk_schema_[i].type_;
+    auto data = reinterpret_cast<const uint8_t*>(raw_row.data());
+    if (type == FieldType::CHAR || type == FieldType::VARCHAR) {
+      auto offset_pos =
+          *reinterpret_cast<const uint32_t*>(data + fk_offsets_[i]);
+      return StaticFieldRef::CreateStringRef(
+          reinterpret_cast<const StaticStringField*>(data + offset_pos));
+    }
+    return StaticFieldRef::CreateFromStringView(
+        {raw_row.data() + fk_offsets_[i], fk_schema_[i].size_}, type);
+  }
+
   void _update(uint32_t i, StaticFieldRef key, FieldType key_type,
       uint32_t key_size, std::string_view key_view, size_t new_value,
       bool is_insert) {
@@ -158,11 +158,26 @@ class BPlusTreeTable : public AbstractBPlusTreeTable {
       last_ = std::move(ret.value());
       return reinterpret_cast<const uint8_t*>(last_.data());
     }
+    std::vector<const uint8_t*> MultiSearch(
+        std::span<const std::string_view> keys) override {
+      std::vector<const uint8_t*> ret(keys.size(), nullptr);
+      batch_.resize(keys.size());
+      for (size_t i = 0; i < keys.size(); i++) {
+        auto value = tree_.Get(keys[i]);
+        if (value.has_value()) {
+          batch_[i] = std::move(value.value());
+          ret[i] = reinterpret_cast<const uint8_t*>(batch_[i].data());
+        }
+      }
+      return ret;
+    }
 
    private:
     tree_t& tree_;
     std::unique_ptr<TxnExecCtx> ctx_;
     std::string last_;
+    /* The rows returned by the last MultiSearch. */
+    std::vector<std::string> batch_;
     friend class BPlusTreeTable<KeyCompare>;
   };
 
@@ -0,0 +1,397 @@
+#include "storage/lsm/async_io.hpp"
+
+#include <unistd.h>
+#if defined(__linux__)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "common/logging.hpp"
+
+namespace wing {
+
+namespace lsm {
+
+static void ExecuteSync(AsyncReadRequest* req) {
+  ssize_t ret;
+#if defined(__linux__)
+  ret = ::pread(req->fd, req->data, req->n, req->offset);
+#elif defined(__MINGW64__)
+  ::lseek(req->fd, req->offset, SEEK_SET);
+  ret = ::read(req->fd, req->data, req->n);
+#endif
+  req->result = ret < 0 ? -errno : ret;
+}
+
+/**
+ * The completion of a request is published under the mutex of its stripe,
+ * and the waiters are woken up by the condition variable of the stripe. A
+ * waiter can return and destroy the request as soon as done is set, so the
+ * completing thread must not touch the request after that. The stripes are
+ * never destroyed, since the reaper may still run at exit.
+ */
+struct WaitStripe {
+  std::mutex mu;
+  std::condition_variable cv;
+};
+
+static constexpr size_t kWaitStripes = 64;
+
+static WaitStripe& StripeOf(const AsyncReadRequest* req) {
+  static WaitStripe* stripes = new WaitStripe[kWaitStripes];
+  return stripes[(reinterpret_cast<uintptr_t>(req) >> 6) % kWaitStripes];
+}
+
+static void Complete(AsyncReadRequest* req) {
+  auto& stripe = StripeOf(req);
+  {
+    std::unique_lock lck(stripe.mu);
+    req->done.store(true, std::memory_order_release);
+  }
+  stripe.cv.notify_all();
+}
+
+void AsyncReadRequest::Wait() {
+  if (!pending) {
+    return;
+  }
+  if (!done.load(std::memory_order_acquire)) {
+    auto& stripe = StripeOf(this);
+    std::unique_lock lck(stripe.mu);
+    stripe.cv.wait(
+        lck, [&]() { return done.load(std::memory_order_acquire); });
+  }
+  pending = false;
+}
+
+class ThreadPoolReader final : public AsyncReader {
+ public:
+  ThreadPoolReader(size_t num_threads) {
+    for (size_t i = 0; i < num_threads; i++) {
+      threads_.emplace_back([this]() { Work(); });
+    }
+  }
+
+  ~ThreadPoolReader() {
+    {
+      std::unique_lock lck(mu_);
+      stop_ = true;
+    }
+    cv_.notify_all();
+    for (auto& t : threads_) {
+      t.join();
+    }
+  }
+
+  using AsyncReader::Submit;
+
+  void Submit(std::span<AsyncReadRequest* const> reqs) override {
+    {
+      std::unique_lock lck(mu_);
+      for (auto req : reqs) {
+        req->pending = true;
+        queue_.push_back(req);
+      }
+    }
+    if (reqs.size() == 1) {
+      cv_.notify_one();
+    } else {
+      cv_.notify_all();
+    }
+  }
+
+  const char* name() const override { return "thread_pool"; }
+
+ private:
+  void Work() {
+    std::unique_lock lck(mu_);
+    while (true) {
+      cv_.wait(lck, [&]() { return stop_ || !queue_.empty(); });
+      if (queue_.empty()) {
+        return;
+      }
+      auto req = queue_.front();
+      queue_.pop_front();
+      lck.unlock();
+      ExecuteSync(req);
+      Complete(req);
+      lck.lock();
+    }
+  }
+
+  std::mutex mu_;
+  std::condition_variable cv_;
+  std::deque<AsyncReadRequest*> queue_;
+  bool stop_{false};
+  std::vector<std::thread> threads_;
+};
+
+#if defined(__linux__)
+
+/**
+ * io_uring through raw system calls, so that liburing is not required. The
+ * submission queue is protected by a mutex, and a batch of requests is
+ * submitted by one io_uring_enter. A background thread waits for
+ * completions.
+ */
+class IOUringReader final : public AsyncReader {
+ public:
+  /* Return nullptr if io_uring is not available. */
+  static std::unique_ptr<IOUringReader> Create(unsigned entries) {
+    auto ret = std::unique_ptr<IOUringReader>(new IOUringReader());
+    if (!ret->Init(entries)) {
+      return nullptr;
+    }
+    ret->reaper_ = std::thread([r = ret.get()]() { r->Reap(); });
+    return ret;
+  }
+
+  ~IOUringReader() {
+    if (reaper_.joinable()) {
+      /* A NOP with user_data 0 stops the reaper. The reaper can't exit
+       * without it, so retry until the ring accepts it. */
+      AsyncReadRequest* stop = nullptr;
+      while (true) {
+        std::unique_lock lck(sq_mu_);
+        if (PushSQEs(IORING_OP_NOP, {&stop, 1}) == 1) {
+          break;
+        }
+        lck.unlock();
+        std::this_thread::yield();
+      }
+      reaper_.join();
+    }
+    if (sqes_ != nullptr) {
+      ::munmap(sqes_, sqes_size_);
+    }
+    if (sq_ring_ != nullptr) {
+      ::munmap(sq_ring_, sq_ring_size_);
+    }
+    if (cq_ring_ != nullptr && cq_ring_ != sq_ring_) {
+      ::munmap(cq_ring_, cq_ring_size_);
+    }
+    if (ring_fd_ >= 0) {
+      ::close(ring_fd_);
+    }
+  }
+
+  using AsyncReader::Submit;
+
+  void Submit(std::span<AsyncReadRequest* const> reqs) override {
+    for (auto req : reqs) {
+      req->pending = true;
+    }
+    /* Bound the requests in flight so that the completion queue never
+     * overflows. The requests beyond the bound are executed synchronously. */
+    size_t queued = Reserve(reqs.size());
+    size_t submitted = 0;
+    if (queued > 0) {
+      std::unique_lock lck(sq_mu_);
+      while (submitted < queued) {
+        size_t n = std::min<size_t>(queued - submitted, sq_entries_);
+        size_t ret = PushSQEs(IORING_OP_READ, reqs.subspan(submitted, n));
+        submitted += ret;
+        if (ret < n) {
+          break;
+        }
+      }
+    }
+    inflight_.fetch_sub(queued - submitted, std::memory_order_relaxed);
+    for (auto req : reqs.subspan(submitted)) {
+      ExecuteSync(req);
+      Complete(req);
+    }
+  }
+
+  const char* name() const override { return "io_uring"; }
+
+ private:
+  IOUringReader() = default;
+
+  bool Init(unsigned entries) {
+    io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    ring_fd_ = ::syscall(__NR_io_uring_setup, entries, &p);
+    if (ring_fd_ < 0) {
+      return false;
+    }
+    sq_ring_size_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_ring_size_ = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    bool single_mmap = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) {
+      sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+    }
+    sq_ring_ = Map(sq_ring_size_, IORING_OFF_SQ_RING);
+    if (sq_ring_ == nullptr) {
+      return false;
+    }
+    cq_ring_ =
+        single_mmap ? sq_ring_ : Map(cq_ring_size_, IORING_OFF_CQ_RING);
+    if (cq_ring_ == nullptr) {
+      return false;
+    }
+    sqes_size_ = p.sq_entries * sizeof(io_uring_sqe);
+    sqes_ = static_cast<io_uring_sqe*>(Map(sqes_size_, IORING_OFF_SQES));
+    if (sqes_ == nullptr) {
+      return false;
+    }
+    auto sq = static_cast<char*>(sq_ring_);
+    sq_tail_ = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+    sq_mask_ = *reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+    sq_array_ = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+    auto cq = static_cast<char*>(cq_ring_);
+    cq_head_ = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+    cq_mask_ = *reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<io_uring_cqe*>(cq + p.cq_off.cqes);
+    sq_entries_ = p.sq_entries;
+    cq_entries_ = p.cq_entries;
+    return true;
+  }
+
+  void* Map(size_t size, off_t offset) {
+    void* ptr = ::mmap(nullptr, size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ring_fd_, offset);
+    return ptr == MAP_FAILED ? nullptr : ptr;
+  }
+
+  /* Reserve at most n slots of the completion queue. Return the number. */
+  size_t Reserve(size_t n) {
+    unsigned cur = inflight_.load(std::memory_order_relaxed);
+    size_t ret;
+    do {
+      ret = std::min<size_t>(n, cq_entries_ - std::min(cur, cq_entries_));
+    } while (!inflight_.compare_exchange_weak(
+        cur, cur + ret, std::memory_order_relaxed));
+    return ret;
+  }
+
+  /**
+   * Push an SQE for each request and submit them with as few io_uring_enter
+   * calls as possible, usually one. Return the number of SQEs submitted;
+   * the others are taken back. It gives up instead of spinning if the ring
+   * accepts nothing (e.g. EAGAIN when the kernel is short of resources).
+   */
+  // REQUIRES: sq_mu_ held, reqs.size() <= sq_entries_
+  size_t PushSQEs(uint8_t opcode, std::span<AsyncReadRequest* const> reqs) {
+    /* Every SQE is consumed by io_uring_enter or taken back before the lock
+     * is released, so the submission queue has room for sq_entries_ SQEs. */
+    unsigned tail = *sq_tail_;
+    for (size_t i = 0; i < reqs.size(); i++) {
+      unsigned index = (tail + i) & sq_mask_;
+      io_uring_sqe* sqe = &sqes_[index];
+      memset(sqe, 0, sizeof(*sqe));
+      sqe->opcode = opcode;
+      sqe->user_data = reinterpret_cast<uint64_t>(reqs[i]);
+      if (reqs[i] != nullptr) {
+        sqe->fd = reqs[i]->fd;
+        sqe->addr = reinterpret_cast<uint64_t>(reqs[i]->data);
+        sqe->len = reqs[i]->n;
+        sqe->off = reqs[i]->offset;
+      }
+      sq_array_[index] = index;
+    }
+    __atomic_store_n(sq_tail_, tail + reqs.size(), __ATOMIC_RELEASE);
+    size_t submitted = 0;
+    while (submitted < reqs.size()) {
+      int ret = ::syscall(__NR_io_uring_enter, ring_fd_,
+          reqs.size() - submitted, 0, 0, nullptr, 0);
+      if (ret > 0) {
+        submitted += ret;
+        continue;
+      }
+      if (ret < 0 && errno == EINTR) {
+        continue;
+      }
+      /* Take the SQEs not consumed back. */
+      __atomic_store_n(sq_tail_, tail + submitted, __ATOMIC_RELEASE);
+      break;
+    }
+    return submitted;
+  }
+
+  void Reap() {
+    while (true) {
+      unsigned head = *cq_head_;
+      unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+      if (head == tail) {
+        int ret = ::syscall(__NR_io_uring_enter, ring_fd_, 0, 1,
+            IORING_ENTER_GETEVENTS, nullptr, 0);
+        if (ret < 0 && errno != EINTR) {
+          DB_ERR("io_uring_enter error! Error: {}", errno);
+        }
+        continue;
+      }
+      for (; head != tail; head++) {
+        io_uring_cqe* cqe = &cqes_[head & cq_mask_];
+        auto req = reinterpret_cast<AsyncReadRequest*>(cqe->user_data);
+        int res = cqe->res;
+        __atomic_store_n(cq_head_, head + 1, __ATOMIC_RELEASE);
+        if (req == nullptr) {
+          return;
+        }
+        inflight_.fetch_sub(1, std::memory_order_relaxed);
+        req->result = res;
+        Complete(req);
+      }
+    }
+  }
+
+  int ring_fd_{-1};
+  void* sq_ring_{nullptr};
+  void* cq_ring_{nullptr};
+  size_t sq_ring_size_{0};
+  size_t cq_ring_size_{0};
+  io_uring_sqe* sqes_{nullptr};
+  size_t sqes_size_{0};
+  unsigned* sq_tail_{nullptr};
+  unsigned sq_mask_{0};
+  unsigned* sq_array_{nullptr};
+  unsigned* cq_head_{nullptr};
+  unsigned* cq_tail_{nullptr};
+  unsigned cq_mask_{0};
+  io_uring_cqe* cqes_{nullptr};
+  unsigned sq_entries_{0};
+  unsigned cq_entries_{0};
+  std::mutex sq_mu_;
+  std::atomic<unsigned> inflight_{0};
+  std::thread reaper_;
+};
+
+#endif
+
+/* The number of SQEs of io_uring. The completion queue is twice as large. */
+static constexpr unsigned kIOUringEntries = 128;
+/* The number of threads if io_uring is not available. */
+static constexpr size_t kReaderThreads = 4;
+
+std::unique_ptr<AsyncReader> AsyncReader::Create(bool use_io_uring) {
+#if defined(__linux__)
+  if (use_io_uring) {
+    auto ret = IOUringReader::Create(kIOUringEntries);
+    if (ret != nullptr) {
+      return ret;
+    }
+    DB_INFO("io_uring is not available. Use a thread pool instead.");
+  }
+#endif
+  return std::make_unique<ThreadPoolReader>(kReaderThreads);
+}
+
+AsyncReader& AsyncReader::Get() {
+  static std::unique_ptr<AsyncReader> reader = Create(true);
+  return *reader;
+}
+
+}  // namespace lsm
+
+}  // namespace wing
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <span>
+
+#include "storage/lsm/common.hpp"
+
+namespace wing {
+
+namespace lsm {
+
+/* A read request which is completed asynchronously. */
+struct AsyncReadRequest {
+  int fd{-1};
+  char* data{nullptr};
+  size_t n{0};
+  offset_t offset{0};
+  /* The number of bytes read, or -errno. It is valid after done is set. */
+  ssize_t result{0};
+  /* Whether the request is submitted and not completed. */
+  bool pending{false};
+  std::atomic<bool> done{false};
+
+  /**
+   * Wait until the request is completed. The request may be destroyed once
+   * it returns, because the completing thread no longer touches it.
+   */
+  void Wait();
+};
+
+/**
+ * It reads files asynchronously. Requests are submitted to an io_uring
+ * instance, and a background thread reaps the completions. If io_uring is not
+ * available (e.g. it is disabled by seccomp), the requests are executed by a
+ * pool of threads with pread.
+ */
+class AsyncReader {
+ public:
+  virtual ~AsyncReader() = default;
+
+  /**
+   * Submit the requests together. The buffer req->data must be valid until
+   * req->done is set. It is set by another thread, or by the caller if the
+   * request is executed synchronously because there are too many requests in
+   * flight.
+   */
+  virtual void Submit(std::span<AsyncReadRequest* const> reqs) = 0;
+
+  /* Submit a single request. */
+  void Submit(AsyncReadRequest* req) { Submit({&req, 1}); }
+
+  /* The name of the backend, 'io_uring' or 'thread_pool'. */
+  virtual const char* name() const = 0;
+
+  /**
+   * Create a reader. If use_io_uring is false or io_uring is not available, a
+   * thread pool is used.
+   */
+  static std::unique_ptr<AsyncReader> Create(bool use_io_uring);
+
+  /* The reader shared by the whole process. */
+  static AsyncReader& Get();
+};
+
+}  // namespace lsm
+
+}  // namespace wing
@@ -0,0 +1,99 @@
+#include "storage/lsm/blob.hpp"
+
+#include <cstring>
+#include <filesystem>
+
+namespace wing {
+
+namespace lsm {
+
+std::string BlobIndex::Encode() const {
+  std::string ret(kEncodedSize, 0);
+  memcpy(ret.data(), &file_id_, sizeof(uint64_t));
+  memcpy(ret.data() + sizeof(uint64_t), &offset_, sizeof(uint64_t));
+  memcpy(ret.data() + 2 * sizeof(uint64_t), &size_, sizeof(uint64_t));
+  return ret;
+}
+
+BlobIndex BlobIndex::Decode(Slice data) {
+  if (data.size() != kEncodedSize) {
+    DB_ERR("Invalid blob index of size {}", data.size());
+  }
+  BlobIndex ret;
+  memcpy(&ret.file_id_, data.data(), sizeof(uint64_t));
+  memcpy(&ret.offset_, data.data() + sizeof(uint64_t), sizeof(uint64_t));
+  memcpy(&ret.size_, data.data() + 2 * sizeof(uint64_t), sizeof(uint64_t));
+  return ret;
+}
+
+BlobFile::BlobFile(BlobFileInfo info, BlobGarbage garbage)
+  : info_(std::move(info)),
+    garbage_count_(garbage.count_),
+    garbage_size_(garbage.size_) {
+  file_ = std::make_unique<ReadFile>(info_.filename_, false);
+}
+
+BlobFile::~BlobFile() {
+  if (remove_tag_) {
+    file_.reset();
+    std::filesystem::remove(info_.filename_);
+  }
+}
+
+void BlobFile::Get(const BlobIndex& index, std::string* value) const {
+  value->resize(index.size_);
+  size_t read = 0;
+  while (read < index.size_) {
+    ssize_t ret = file_->Read(value->data() + read, index.size_ - read,
+        static_cast<offset_t>(index.offset_ + read));
+    if (ret <= 0) {
+      DB_ERR("Blob file {} is truncated at {}", info_.filename_,
+          index.offset_ + read);
+    }
+    read += ret;
+  }
+}
+
+void BlobChanges::Merge(const BlobChanges& changes) {
+  new_files_.insert(
+      new_files_.end(), changes.new_files_.begin(), changes.new_files_.end());
+  for (auto& [file_id, garbage] : changes.garbage_) {
+    garbage_[file_id].count_ += garbage.count_;
+    garbage_[file_id].size_ += garbage.size_;
+  }
+}
+
+BlobIndex BlobFileBuilder::Add(Slice value) {
+  if (writer_ && writer_->size() + value.size() > target_size_) {
+    FinishFile();
+  }
+  if (!writer_) {
+    auto [filename, id] = file_gen_->GenerateBlob();
+    writer_ = std::make_unique<FileWriter>(
+        std::make_unique<SeqWriteFile>(filename, use_direct_io_),
+        write_buffer_size_);
+    current_ = BlobFileInfo{id, 0, 0, filename};
+  }
+  BlobIndex index{current_.file_id_, writer_->size(), value.size()};
+  writer_->AppendString(value);
+  current_.count_ += 1;
+  current_.size_ += value.size();
+  return index;
+}
+
+void BlobFileBuilder::FinishFile() {
+  writer_->Flush();
+  writer_.reset();
+  files_.push_back(std::move(current_));
+}
+
+std::vector<BlobFileInfo> BlobFileBuilder::Finish() {
+  if (writer_) {
+    FinishFile();
+  }
+  return std::move(files_);
+}
+
+}  // namespace lsm
+
+}  // namespace wing
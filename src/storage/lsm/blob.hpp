@@ -0,0 +1,161 @@
+#pragma once
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "storage/lsm/file.hpp"
+#include "storage/lsm/format.hpp"
+
+namespace wing {
+
+namespace lsm {
+
+/**
+ * The value of a RecordType::BlobIndex record. It points to a value stored
+ * in a blob file, which is encoded as | file id | offset | size | (u64).
+ */
+struct BlobIndex {
+  static constexpr size_t kEncodedSize = 3 * sizeof(uint64_t);
+
+  /* The id of the blob file */
+  uint64_t file_id_;
+  /* The offset of the value in the blob file */
+  uint64_t offset_;
+  /* The size of the value */
+  uint64_t size_;
+
+  std::string Encode() const;
+
+  static BlobIndex Decode(Slice data);
+};
+
+struct BlobFileInfo {
+  /* The ID of the blob file, which is allocated by FileNameGenerator */
+  uint64_t file_id_;
+  /* The number of values in the blob file */
+  uint64_t count_;
+  /* The total size of the values */
+  uint64_t size_;
+  /* The path of the blob file */
+  std::string filename_;
+};
+
+/* The values of a blob file which are no longer referenced. */
+struct BlobGarbage {
+  uint64_t count_{0};
+  uint64_t size_{0};
+};
+
+/**
+ * A blob file stores the values whose size is at least
+ * Options::min_blob_size. They are appended one after another, and only
+ * their BlobIndex is stored in SSTables, so compactions rewrite the small
+ * indexes instead of the large values (key-value separation).
+ *
+ * A value becomes garbage once its BlobIndex is dropped by a compaction, or
+ * the value is moved to a new blob file by the garbage collection. The blob
+ * file is removed from the Version once all its values are garbage, and the
+ * file is deleted when no Version references it.
+ */
+class BlobFile {
+ public:
+  BlobFile(BlobFileInfo info, BlobGarbage garbage = {});
+
+  ~BlobFile();
+
+  /* Read the value pointed to by index. */
+  void Get(const BlobIndex& index, std::string* value) const;
+
+  const BlobFileInfo& GetInfo() const { return info_; }
+
+  void AddGarbage(const BlobGarbage& garbage) {
+    garbage_count_.fetch_add(garbage.count_, std::memory_order_relaxed);
+    garbage_size_.fetch_add(garbage.size_, std::memory_order_relaxed);
+  }
+
+  BlobGarbage GetGarbage() const {
+    return BlobGarbage{garbage_count_.load(std::memory_order_relaxed),
+        garbage_size_.load(std::memory_order_relaxed)};
+  }
+
+  /* Whether all the values are garbage. */
+  bool IsObsolete() const { return GetGarbage().count_ >= info_.count_; }
+
+  void SetRemoveTag(bool remove_tag) { remove_tag_ = remove_tag; }
+
+ private:
+  BlobFileInfo info_;
+  /* The blob file is read with pread, without O_DIRECT, since the values are
+   * not aligned. */
+  std::unique_ptr<ReadFile> file_;
+  std::atomic<uint64_t> garbage_count_{0};
+  std::atomic<uint64_t> garbage_size_{0};
+  /* If it is true, then the blob file will be removed in deconstruction. */
+  bool remove_tag_{false};
+};
+
+/* The blob files of a Version, ordered by ID, i.e. by age. */
+using BlobFileSet = std::map<uint64_t, std::shared_ptr<BlobFile>>;
+
+/* The blob files written by flushes or compactions, and the garbage found. */
+struct BlobChanges {
+  std::vector<BlobFileInfo> new_files_;
+  std::unordered_map<uint64_t, BlobGarbage> garbage_;
+
+  void AddGarbage(const BlobIndex& index) {
+    auto& garbage = garbage_[index.file_id_];
+    garbage.count_ += 1;
+    garbage.size_ += index.size_;
+  }
+
+  void Merge(const BlobChanges& changes);
+};
+
+/* How a flush or a compaction writes and relocates values in blob files. */
+struct BlobJobOptions {
+  /* The values of at least min_blob_size bytes are moved to blob files. */
+  size_t min_blob_size;
+  /* The target size of blob files */
+  size_t blob_file_size;
+  /* The blob files of the input, which are read by relocation */
+  const BlobFileSet* files{nullptr};
+  /* The values in the blob files with smaller IDs are relocated. */
+  uint64_t gc_before_file_id{0};
+};
+
+/* It appends values to blob files, and starts a new one at target_size. */
+class BlobFileBuilder {
+ public:
+  BlobFileBuilder(FileNameGenerator* gen, size_t target_size,
+      size_t write_buffer_size, bool use_direct_io)
+    : file_gen_(gen),
+      target_size_(target_size),
+      write_buffer_size_(write_buffer_size),
+      use_direct_io_(use_direct_io) {}
+
+  /* Append the value and return its index. */
+  BlobIndex Add(Slice value);
+
+  /* Finish the current blob file and return all the blob files written. */
+  std::vector<BlobFileInfo> Finish();
+
+ private:
+  void FinishFile();
+
+  FileNameGenerator* file_gen_;
+  size_t target_size_;
+  size_t write_buffer_size_;
+  bool use_direct_io_;
+  /* The current blob file, or nullptr */
+  std::unique_ptr<FileWriter> writer_;
+  BlobFileInfo current_;
+  std::vector<BlobFileInfo> files_;
+};
+
+}  // namespace lsm
+
+}  // namespace wing
@@ -1,102 +1,247 @@
 #include "storage/lsm/block.hpp"
 
-#include <iostream>
-using namespace std;
+#include <cstring>
+
+#include "common/logging.hpp"
+#include "common/murmurhash.hpp"
 
 namespace wing {
 
 namespace lsm {
 
-bool BlockBuilder::Append(ParsedKey key, Slice value) {
-  
-  size_t kvp_size = key.size() + value.size() + sizeof(u_int32_t) * 2;
-  size_t check_size = key.size() + value.size() + sizeof(u_int32_t) * 3;
-  if (check_size + current_size_ > block_size_){
-      
-    return false;
+static constexpr size_t kEntryHeaderSize = 3 * sizeof(uint32_t);
 
-  }
+/* The restart count is stored in the low 23 bits of the last word. */
+static constexpr uint32_t kRestartCountMask = (1u << 23) - 1;
+static constexpr uint32_t kHashIndexFlag = 1u << 23;
 
-  else{
+static constexpr uint8_t kBucketEmpty = 255;
+static constexpr uint8_t kBucketCollision = 254;
+/* The restart points stored in buckets must be smaller than
+ * kBucketCollision. */
+static constexpr size_t kMaxHashRestarts = kBucketCollision;
+static constexpr size_t kMaxHashBuckets = 65535;
+static constexpr size_t kBlockHashSeed = 0x20240513;
 
-    file_->AppendValue<uint32_t>(key.size());
-    file_->AppendString(key.user_key_);
-    file_->AppendValue(key.seq_);
-    file_->AppendValue(key.type_);
-    file_->AppendValue<uint32_t>(value.size());
-    file_->AppendString(value);
-    current_size_ += check_size;
-    offsets_.push_back(offset_);
-    offset_ += kvp_size;
+static uint32_t DecodeU32(const char* ptr) {
+  uint32_t ret;
+  memcpy(&ret, ptr, sizeof(uint32_t));
+  return ret;
+}
 
-    return true;
-      
-  }
-  
+static size_t NumHashBuckets(size_t num_keys) {
+  size_t ret = static_cast<size_t>(num_keys / kBlockHashUtilRatio) | 1;
+  return std::min(ret, kMaxHashBuckets);
 }
 
-void BlockBuilder::Finish() { 
-  
-  for(int i = 0; i < (int)count(); i += 1){
+static uint32_t BlockHash(Slice user_key) {
+  return utils::Hash(user_key, kBlockHashSeed);
+}
 
-    file_->AppendValue<uint32_t>(offsets_[i]);
+bool BlockBuilder::HasHashIndex(size_t num_restarts) const {
+  return hash_index_ && num_restarts <= kMaxHashRestarts;
+}
 
+size_t BlockBuilder::TrailerSize(size_t num_restarts, size_t num_keys) const {
+  size_t ret = (num_restarts + 1) * sizeof(uint32_t);
+  if (HasHashIndex(num_restarts)) {
+    ret += NumHashBuckets(num_keys) + sizeof(uint16_t);
   }
+  return ret;
+}
 
-  //current_size_ += offsets_.size() * sizeof(u_int32_t);
-
-} 
-
-void BlockIterator::Seek(Slice user_key, seq_t seq) {
-  
-  SeekToFirst();
-
-  ParsedKey sk = ParsedKey (user_key, seq, RecordType::Value);
-
-  while (Valid() && (ParsedKey(key()) < sk)) {
-    Next();
+bool BlockBuilder::Append(ParsedKey key, Slice value) {
+  key_buf_.assign(key.user_key_);
+  key_buf_.append(reinterpret_cast<const char*>(&key.seq_), sizeof(seq_t));
+  key_buf_.append(reinterpret_cast<const char*>(&key.type_), sizeof(key.type_));
+
+  bool restart = count_ % restart_interval_ == 0;
+  bool new_user_key =
+      count_ == 0 || ParsedKey(Slice(last_key_)).user_key_ != key.user_key_;
+  size_t shared = 0;
+  if (!restart) {
+    size_t limit = std::min(last_key_.size(), key_buf_.size());
+    while (shared < limit && last_key_[shared] == key_buf_[shared]) {
+      shared++;
+    }
+  }
+  size_t unshared = key_buf_.size() - shared;
+  size_t entry_size = kEntryHeaderSize + unshared + value.size();
+  size_t new_size =
+      offset_ + entry_size +
+      TrailerSize(restarts_.size() + restart, keys_ + new_user_key);
+  if (count_ > 0 && new_size > block_size_) {
+    return false;
+  }
 
+  if (restart) {
+    restarts_.push_back(offset_);
+  }
+  if (new_user_key) {
+    keys_ += 1;
+    if (HasHashIndex(restarts_.size())) {
+      hashes_.emplace_back(BlockHash(key.user_key_), restarts_.size() - 1);
+    }
   }
+  file_->AppendValue<uint32_t>(shared)
+      .AppendValue<uint32_t>(unshared)
+      .AppendValue<uint32_t>(value.size())
+      .AppendString(Slice(key_buf_).substr(shared))
+      .AppendString(value);
+  offset_ += entry_size;
+  count_ += 1;
+  last_key_.swap(key_buf_);
+  return true;
+}
 
+void BlockBuilder::Finish() {
+  if (count_ == 0) {
+    return;
+  }
+  for (auto offset : restarts_) {
+    file_->AppendValue<uint32_t>(offset);
+  }
+  if (restarts_.size() > kRestartCountMask) {
+    DB_ERR("Too many restart points in a block: {}", restarts_.size());
+  }
+  uint32_t trailer =
+      kBlockFormatVersion << 24 | static_cast<uint32_t>(restarts_.size());
+  if (HasHashIndex(restarts_.size())) {
+    std::string buckets(NumHashBuckets(keys_), kBucketEmpty);
+    for (auto [hash, restart] : hashes_) {
+      auto& bucket = reinterpret_cast<uint8_t&>(buckets[hash % buckets.size()]);
+      if (bucket == kBucketEmpty) {
+        bucket = restart;
+      } else if (bucket != restart) {
+        bucket = kBucketCollision;
+      }
+    }
+    file_->AppendString(buckets).AppendValue<uint16_t>(buckets.size());
+    trailer |= kHashIndexFlag;
+  }
+  file_->AppendValue<uint32_t>(trailer);
 }
 
-void BlockIterator::SeekToFirst() { 
+BlockIterator::BlockIterator(const char* data, BlockHandle handle)
+  : data_(data) {
+  uint32_t trailer = DecodeU32(data + handle.size_ - sizeof(uint32_t));
+  if ((trailer >> 24) == kBlockFormatVersion) {
+    prefix_compressed_ = true;
+    num_restarts_ = trailer & kRestartCountMask;
+    const char* end = data + handle.size_ - sizeof(uint32_t);
+    if (trailer & kHashIndexFlag) {
+      uint16_t num_buckets;
+      memcpy(&num_buckets, end - sizeof(uint16_t), sizeof(uint16_t));
+      num_buckets_ = num_buckets;
+      end -= sizeof(uint16_t) + num_buckets_;
+      buckets_ = reinterpret_cast<const uint8_t*>(end);
+    }
+    restarts_ = end - num_restarts_ * sizeof(uint32_t);
+  } else {
+    /* The old format. Every entry is a restart point. */
+    num_restarts_ = handle.count_;
+    restarts_ = data + handle.size_ - num_restarts_ * sizeof(uint32_t);
+  }
+  SeekToFirst();
+}
 
-  curr_ = data_;
+uint32_t BlockIterator::RestartOffset(size_t i) const {
+  return DecodeU32(restarts_ + i * sizeof(uint32_t));
+}
 
+Slice BlockIterator::RestartKey(size_t i) const {
+  const char* ptr = data_ + RestartOffset(i);
+  if (prefix_compressed_) {
+    /* shared is 0 at restart points. */
+    return Slice(ptr + kEntryHeaderSize, DecodeU32(ptr + sizeof(uint32_t)));
+  }
+  return Slice(ptr + sizeof(uint32_t), DecodeU32(ptr));
 }
 
-Slice BlockIterator::key() const{
+void BlockIterator::ParseEntry() {
+  if (curr_ >= restarts_) {
+    return;
+  }
+  if (prefix_compressed_) {
+    uint32_t shared = DecodeU32(curr_);
+    uint32_t unshared = DecodeU32(curr_ + sizeof(uint32_t));
+    uint32_t vlen = DecodeU32(curr_ + 2 * sizeof(uint32_t));
+    const char* ptr = curr_ + kEntryHeaderSize;
+    key_.resize(shared);
+    key_.append(ptr, unshared);
+    value_ = Slice(ptr + unshared, vlen);
+    next_ = ptr + unshared + vlen;
+  } else {
+    uint32_t klen = DecodeU32(curr_);
+    const char* ptr = curr_ + sizeof(uint32_t);
+    key_.assign(ptr, klen);
+    uint32_t vlen = DecodeU32(ptr + klen);
+    value_ = Slice(ptr + klen + sizeof(uint32_t), vlen);
+    next_ = value_.data() + vlen;
+  }
+}
 
-  //auto klen = *(const uint32_t*)(curr_);
-  return Slice((curr_ + sizeof(uint32_t)), *(const uint32_t*)(curr_));
+void BlockIterator::SeekInRestartInterval(size_t i, ParsedKey target) {
+  curr_ = data_ + RestartOffset(i);
+  key_.clear();
+  ParseEntry();
+  while (Valid() && ParsedKey(key()) < target) {
+    Next();
+  }
+}
 
+void BlockIterator::Seek(Slice user_key, seq_t seq) {
+  if (num_restarts_ == 0) {
+    curr_ = restarts_;
+    return;
+  }
+  ParsedKey target(user_key, seq, RecordType::Value);
+  /* Find the last restart point whose key is smaller than the target. */
+  size_t l = 0, r = num_restarts_;
+  while (l + 1 < r) {
+    size_t m = (l + r) / 2;
+    if (ParsedKey(RestartKey(m)) < target) {
+      l = m;
+    } else {
+      r = m;
+    }
+  }
+  SeekInRestartInterval(l, target);
 }
 
-Slice BlockIterator::value() const{ 
+void BlockIterator::SeekForGet(Slice user_key, seq_t seq) {
+  if (buckets_ == nullptr) {
+    Seek(user_key, seq);
+    return;
+  }
+  uint8_t bucket = buckets_[BlockHash(user_key) % num_buckets_];
+  if (bucket == kBucketEmpty) {
+    /* The user key is not in the block. */
+    curr_ = restarts_;
+  } else if (bucket == kBucketCollision || bucket >= num_restarts_) {
+    Seek(user_key, seq);
+  } else {
+    SeekInRestartInterval(
+        bucket, ParsedKey(user_key, seq, RecordType::Value));
+  }
+}
 
-  auto klen = *(const uint32_t*)(curr_);
-  //auto vlen = *(const uint32_t*)(klen + curr_ + sizeof(uint32_t));
-  return Slice(curr_ + 2 * sizeof(uint32_t) + klen, *(const uint32_t*)(curr_ + klen + sizeof(uint32_t)));
-  
+void BlockIterator::SeekToFirst() {
+  curr_ = data_;
+  key_.clear();
+  ParseEntry();
 }
 
-void BlockIterator::Next() { 
+Slice BlockIterator::key() const { return key_; }
 
-  auto klen = *(const uint32_t*)(curr_);
-  curr_ += sizeof(uint32_t);
-  curr_ += klen;
-  auto vlen = *(const uint32_t*)(curr_);
-  curr_ += sizeof(uint32_t);
-  curr_ += vlen;
+Slice BlockIterator::value() const { return value_; }
 
+void BlockIterator::Next() {
+  curr_ = next_;
+  ParseEntry();
 }
 
-bool BlockIterator::Valid() { 
-
-  return (curr_ >= data_) && (curr_ < (data_ + handle_.size_ - handle_.count_ * sizeof(u_int32_t))); 
-  
-}
+bool BlockIterator::Valid() { return curr_ != nullptr && curr_ < restarts_; }
 
 }  // namespace lsm
 
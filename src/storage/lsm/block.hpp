@@ -1,5 +1,9 @@
 #pragma once
 
+#include <algorithm>
+#include <string>
+#include <vector>
+
 #include "storage/lsm/format.hpp"
 #include "storage/lsm/iterator.hpp"
 #include "storage/lsm/options.hpp"
@@ -10,51 +14,118 @@ namespace wing {
 
 namespace lsm {
 
+/* The number of entries between two restart points, by default. */
+constexpr size_t kDefaultBlockRestartInterval = 16;
+
+/* The version stored in the trailer of prefix-compressed blocks. */
+constexpr uint32_t kBlockFormatVersion = 1;
+
+/* The number of user keys per bucket of the hash index. */
+constexpr double kBlockHashUtilRatio = 0.75;
+
+/**
+ * The format of a data block is:
+ * | entry 0 | entry 1 | ... | restart offset 0 (uint32_t) | ... |
+ * | hash index (optional) |
+ * | version << 24 | has hash index << 23 | number of restart points |
+ *
+ * The format of an entry is:
+ * | shared (uint32_t) | unshared (uint32_t) | value size (uint32_t) |
+ * | the last unshared bytes of the internal key | value |
+ *
+ * The internal key shares its first shared bytes with the previous key. Every
+ * restart_interval entries there is a restart point, where shared is 0 and
+ * the full key is stored, and the restart offsets are used to binary search
+ * the block.
+ *
+ * The optional hash index is used by point lookups:
+ * | bucket 0 (uint8_t) | bucket 1 | ... | number of buckets (uint16_t) |
+ * A bucket stores the restart point before the first entry of the user keys
+ * hashed to it, kBucketEmpty if there is no such user key, or
+ * kBucketCollision if the user keys hashed to it are in different restart
+ * intervals. It is not built if there are more than kMaxHashRestarts restart
+ * points.
+ *
+ * Blocks written before the prefix compression end with the offsets of all
+ * the entries, and store the entries as:
+ * | key size (uint32_t) | internal key | value size (uint32_t) | value |
+ * Their last word is the offset of the last entry, whose high byte is 0, so
+ * they are read as blocks in which every entry is a restart point.
+ */
 class BlockBuilder {
  public:
-  BlockBuilder(size_t block_size, FileWriter* file)
-    : block_size_(block_size), file_(file) {}
+  BlockBuilder(size_t block_size, FileWriter* file,
+      size_t restart_interval = kDefaultBlockRestartInterval,
+      bool hash_index = false)
+    : block_size_(block_size),
+      restart_interval_(std::max<size_t>(restart_interval, 1)),
+      hash_index_(hash_index),
+      file_(file) {}
 
   /**
    * It appends key and value to the end of the block
    *
    * If it appends successfully, return true.
    * Otherwise, return false, and you need to append it to a new block.
+   * The first record is always appended.
    */
   bool Append(ParsedKey key, Slice value);
 
   /**
-   * It writes all the offsets to the end of the block
+   * It writes the restart offsets to the end of the block
    *
    * It is called when the block is full,
    * or there is no more key value pairs.
-   * It writes all the offsets to the end of the block.
    * */
   void Finish();
 
-  /* The size of the block (including key, value and the offsets)*/
-  size_t size() const { return current_size_; }
+  /* The size of the block (including the entries and the trailer) */
+  size_t size() const {
+    return count_ == 0 ? 0 : offset_ + TrailerSize(restarts_.size(), keys_);
+  }
 
   /* The number of key-value pairs. */
-  size_t count() const { return offsets_.size(); }
+  size_t count() const { return count_; }
 
   void Clear() {
-    current_size_ = offset_ = 0;
-    offsets_.clear();
+    offset_ = 0;
+    count_ = 0;
+    keys_ = 0;
+    restarts_.clear();
+    last_key_.clear();
+    hashes_.clear();
   }
 
  private:
+  /* The size of the restart offsets, the hash index and the last word. */
+  size_t TrailerSize(size_t num_restarts, size_t num_keys) const;
+
+  /* Whether the hash index is built for a block of num_restarts. */
+  bool HasHashIndex(size_t num_restarts) const;
+
   /* The maximum size of a block */
   size_t block_size_{0};
-  /* The current used size of the block. */
-  size_t current_size_{0};
-  /* The current offset of the key value region */
+  /* The number of entries between two restart points. */
+  size_t restart_interval_{0};
+  /* Build the hash index or not. */
+  bool hash_index_{false};
+  /* The size of the entries */
   offset_t offset_{0};
+  /* The number of entries. */
+  size_t count_{0};
+  /* The number of distinct user keys. */
+  size_t keys_{0};
   /* The writer. */
   FileWriter* file_{nullptr};
 
-  /* The offsets of the records in the block. */
-  std::vector<offset_t> offsets_;
+  /* The offsets of the restart points in the block. */
+  std::vector<offset_t> restarts_;
+  /* The internal key of the last entry. */
+  std::string last_key_;
+  /* The buffer of the internal key being appended. */
+  std::string key_buf_;
+  /* The hashes of the distinct user keys and their restart points. */
+  std::vector<std::pair<uint32_t, uint8_t>> hashes_;
 };
 
 class BlockIterator final : public Iterator {
@@ -62,10 +133,7 @@ class BlockIterator final : public Iterator {
   BlockIterator() = default;
 
   /* data is a pointer to the beginning of the block. */
-  BlockIterator(const char* data, BlockHandle handle) : data_(data) {
-    handle_ = handle;
-    curr_ = data;
-  }
+  BlockIterator(const char* data, BlockHandle handle);
 
   /* Move the the beginning */
   void SeekToFirst();
@@ -73,6 +141,13 @@ class BlockIterator final : public Iterator {
   /* Find the first record >= (user_key, seq) */
   void Seek(Slice user_key, seq_t seq);
 
+  /**
+   * Find the first record >= (user_key, seq), if its user key is user_key.
+   * Otherwise the iterator is positioned at a record with another user key,
+   * or is invalid. It uses the hash index if the block has one.
+   */
+  void SeekForGet(Slice user_key, seq_t seq);
+
   Slice key() const override;
 
   Slice value() const override;
@@ -82,9 +157,33 @@ class BlockIterator final : public Iterator {
   bool Valid() override;
 
  private:
+  /* Decode the entry at curr_. The previous key must be in key_. */
+  void ParseEntry();
+
+  /* The full key of the restart point i. */
+  Slice RestartKey(size_t i) const;
+
+  /* The offset of the restart point i. */
+  uint32_t RestartOffset(size_t i) const;
+
+  /* Move to restart point i and scan to the first record >= target. */
+  void SeekInRestartInterval(size_t i, ParsedKey target);
+
   const char* data_{nullptr};
+  /* The end of the entries, which is the beginning of the restart array. */
+  const char* restarts_{nullptr};
+  size_t num_restarts_{0};
+  /* Whether the block is prefix-compressed. */
+  bool prefix_compressed_{false};
+  /* The buckets of the hash index, or nullptr. */
+  const uint8_t* buckets_{nullptr};
+  size_t num_buckets_{0};
+  /* The current entry and the next entry. */
   const char* curr_{nullptr};
-  BlockHandle handle_;
+  const char* next_{nullptr};
+  /* The internal key of the current entry. */
+  std::string key_;
+  Slice value_;
 };
 
 }  // namespace lsm
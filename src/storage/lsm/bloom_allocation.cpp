@@ -0,0 +1,137 @@
+#include "storage/lsm/bloom_allocation.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+#include "common/bloomfilter.hpp"
+
+namespace wing {
+
+namespace lsm {
+
+/* The number of bits in a line of the blocked bloom filters. */
+static constexpr double kLineBits = utils::BloomFilter::kLineSize * 8;
+
+double BloomFalsePositiveRate(double bits_per_key) {
+  if (bits_per_key <= 0) {
+    return 1;
+  }
+  /**
+   * The number of keys in a line follows a Poisson distribution with mean
+   * kLineBits / bits_per_key. A line with i keys is a standard bloom filter
+   * of kLineBits bits, whose false positive rate is
+   * (1 - (1 - 1 / kLineBits)^(probes * i))^probes. Overloaded lines make it
+   * higher than exp(-bits_per_key * ln2^2), and the probes are capped.
+   */
+  double probes = utils::BloomFilter::BlockedProbes(bits_per_key);
+  double mean = kLineBits / bits_per_key;
+  double log_miss = std::log1p(-1 / kLineBits) * probes;
+  size_t max_keys = mean + 12 * std::sqrt(mean) + 30;
+  double ret = 0;
+  for (size_t i = 0; i <= max_keys; i++) {
+    double log_p = -mean + i * std::log(mean) - std::lgamma(i + 1.0);
+    ret += std::exp(log_p) *
+           std::pow(-std::expm1(log_miss * i), probes);
+  }
+  return std::min(ret, 1.0);
+}
+
+/* AllocateBloomBits searches the bits per key in steps of kBitsStep up to
+ * kMaxBits. */
+static constexpr size_t kBitsSteps = 16;
+static constexpr double kBitsStep = 1.0 / kBitsSteps;
+static constexpr size_t kMaxBits = 64;
+
+/* The false positive rates of the bits per key i * kBitsStep. */
+static const std::vector<double>& FalsePositiveRateTable() {
+  static const std::vector<double> table = []() {
+    std::vector<double> ret;
+    for (size_t i = 0; i <= kMaxBits * kBitsSteps; i++) {
+      ret.push_back(BloomFalsePositiveRate(i * kBitsStep));
+    }
+    return ret;
+  }();
+  return table;
+}
+
+std::vector<double> AllocateBloomBits(
+    const std::vector<size_t>& run_sizes, double bits_per_key) {
+  std::vector<double> ret(run_sizes.size(), 0);
+  double total = 0;
+  size_t min_size = 0, max_size = 0;
+  for (auto size : run_sizes) {
+    if (size == 0) {
+      continue;
+    }
+    total += size;
+    min_size = min_size == 0 ? size : std::min(min_size, size);
+    max_size = std::max(max_size, size);
+  }
+  if (total == 0 || bits_per_key <= 0) {
+    return ret;
+  }
+  /**
+   * By Lagrange multipliers, run i gets the bits per key b minimizing
+   * fpr(b) + lambda * run_sizes[i] * b. The total bits decrease with lambda,
+   * so find log(lambda) by bisection. fpr drops by less than 1 per bit, so
+   * all the runs get no bits if lambda * min_size > kBitsSteps. All the
+   * runs get kMaxBits if log(lambda) is lo below.
+   */
+  auto& table = FalsePositiveRateTable();
+  auto steps_of = [&](double log_lambda, size_t size) {
+    double cost = std::exp(log_lambda + std::log(size)) * kBitsStep;
+    size_t ret = 0;
+    for (size_t i = 1; i < table.size(); i++) {
+      if (table[i] + cost * i < table[ret] + cost * ret) {
+        ret = i;
+      }
+    }
+    return ret;
+  };
+  auto total_bits = [&](double log_lambda, std::vector<size_t>* steps) {
+    double bits = 0;
+    for (size_t i = 0; i < run_sizes.size(); i++) {
+      (*steps)[i] = run_sizes[i] > 0 ? steps_of(log_lambda, run_sizes[i]) : 0;
+      bits += run_sizes[i] * (*steps)[i] * kBitsStep;
+    }
+    return bits;
+  };
+  double lo = -std::log(max_size) - 60;
+  double hi = -std::log(min_size) + std::log(kBitsSteps) + 1;
+  double budget = bits_per_key * total;
+  std::vector<size_t> lo_steps(run_sizes.size()), hi_steps(run_sizes.size());
+  double lo_bits = total_bits(lo, &lo_steps);
+  double hi_bits = total_bits(hi, &hi_steps);
+  if (lo_bits <= budget) {
+    /* Every run gets kMaxBits. */
+    for (size_t i = 0; i < run_sizes.size(); i++) {
+      ret[i] = lo_steps[i] * kBitsStep;
+    }
+    return ret;
+  }
+  std::vector<size_t> mid_steps(run_sizes.size());
+  for (int iter = 0; iter < 60; iter++) {
+    double mid = (lo + hi) / 2;
+    double bits = total_bits(mid, &mid_steps);
+    if (bits > budget) {
+      lo = mid;
+      lo_bits = bits;
+      lo_steps.swap(mid_steps);
+    } else {
+      hi = mid;
+      hi_bits = bits;
+      hi_steps.swap(mid_steps);
+    }
+  }
+  /* The steps of the runs differ between lo and hi, so interpolate between
+   * the two allocations to use up the budget. */
+  double t = (budget - hi_bits) / (lo_bits - hi_bits);
+  for (size_t i = 0; i < run_sizes.size(); i++) {
+    ret[i] = (hi_steps[i] + t * (lo_steps[i] - hi_steps[i])) * kBitsStep;
+  }
+  return ret;
+}
+
+}  // namespace lsm
+
+}  // namespace wing
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace wing {
+
+namespace lsm {
+
+/**
+ * The expected false positive rate of a blocked bloom filter (see
+ * utils::BloomFilter) with bits_per_key bits per key. It is higher than
+ * exp(-bits_per_key * ln2^2) of a standard bloom filter, because some lines
+ * get more keys than the average, and the number of probes is capped.
+ */
+double BloomFalsePositiveRate(double bits_per_key);
+
+/**
+ * Allocate the bits of the bloom filters to the sorted runs (Monkey). A point
+ * lookup probes the filter of every sorted run, so the expected number of
+ * false positive I/Os is the sum of their false positive rates. Given the
+ * sizes of the sorted runs and the average number of bits per key, it returns
+ * the bits per key of each sorted run minimizing that sum, under the same
+ * total memory of filters, i.e. sum(run_sizes[i] * ret[i]) is
+ * bits_per_key * sum(run_sizes).
+ *
+ * The marginal false positive rate of a bit of a sorted run is proportional
+ * to its size, so the small runs in upper levels get more bits per key than
+ * the large runs in the last level, which may get no bits at all. The bits
+ * per key are at most 64.
+ */
+std::vector<double> AllocateBloomBits(
+    const std::vector<size_t>& run_sizes, double bits_per_key);
+
+/* The bloom filters of a level and their false positives observed so far. */
+struct BloomFilterStats {
+  int level;
+  /* The number of keys in the SSTables. */
+  uint64_t keys{0};
+  /* The number of bits in the bit arrays of the filters. */
+  uint64_t filter_bits{0};
+  /* The number of lookups which probe the filters. */
+  uint64_t lookups{0};
+  /* The number of lookups which pass the filters but find no record. */
+  uint64_t false_positives{0};
+  /* The sum of the expected false positive rates weighted by keys. */
+  double weighted_fpr{0};
+
+  double BitsPerKey() const {
+    return keys == 0 ? 0 : static_cast<double>(filter_bits) / keys;
+  }
+
+  /* The expected false positive rate of a filter in the level. */
+  double ExpectedFPR() const { return keys == 0 ? 0 : weighted_fpr / keys; }
+
+  /* The false positive rate observed so far. */
+  double ObservedFPR() const {
+    return lookups == 0 ? 0 : static_cast<double>(false_positives) / lookups;
+  }
+};
+
+}  // namespace lsm
+
+}  // namespace wing
@@ -1,9 +1,5 @@
 #include "storage/lsm/cache.hpp"
 
-#include <fcntl.h>
-#include <sys/stat.h>
-#include <unistd.h>
-
 #include <tuple>
 #include <utility>
 
@@ -11,69 +7,152 @@ namespace wing {
 
 namespace lsm {
 
-void Cache::unref_block(CacheKey cache_key) {
-  std::unique_lock<std::mutex> lock(mu_);
-  auto it = cache_.find(cache_key);
-  wing_assert(it != cache_.end());
-  size_t ori = it->second.refcount.fetch_sub(1, std::memory_order_relaxed);
-  if (ori == 1) {
-    auto lru_it = lru_list_.insert(lru_list_.end(), cache_key);
-    auto ret = lru_map_.insert(std::make_pair(cache_key, lru_it));
-    wing_assert(ret.second == true);
+void Cache::Queue::push_back(Entry *e) {
+  e->prev = head.prev;
+  e->next = &head;
+  head.prev->next = e;
+  head.prev = e;
+  size += e->block.size();
+}
+
+void Cache::Queue::remove(Entry *e) {
+  e->prev->next = e->next;
+  e->next->prev = e->prev;
+  e->prev = e->next = nullptr;
+  size -= e->block.size();
+}
+
+Cache::Cache(const CacheOptions &options)
+  : num_shards_(size_t(1) << options.num_shard_bits),
+    shift_(options.num_shard_bits == 0 ? 0 : 64 - options.num_shard_bits),
+    shards_(std::make_unique<Shard[]>(num_shards_)) {
+  for (size_t i = 0; i < num_shards_; i++) {
+    shards_[i].capacity = options.capacity / num_shards_;
+    shards_[i].probation_capacity =
+        shards_[i].capacity * options.probation_ratio;
+  }
+}
+
+void Cache::Shard::ref(Entry *e) {
+  e->refcount.fetch_add(1, std::memory_order_relaxed);
+  if (e->in_protected) {
+    e->referenced = true;
+  } else {
+    /* It is accessed again after it is inserted. */
+    probation.remove(e);
+    e->in_protected = true;
+    protected_.push_back(e);
+  }
+}
+
+void Cache::Shard::erase(Entry *e) {
+  (e->in_protected ? protected_ : probation).remove(e);
+  /* The key is copied because erasing destroys the entry. */
+  CacheKey key = e->key;
+  wing_assert(entries.erase(key) == 1);
+}
+
+bool Cache::Shard::evict_probation() {
+  /* Skip the pinned blocks. */
+  for (Entry *e = probation.front(); e != &probation.head; e = e->next) {
+    if (e->refcount.load(std::memory_order_acquire) == 0) {
+      erase(e);
+      return true;
+    }
+  }
+  return false;
+}
+
+bool Cache::Shard::evict_protected() {
+  /* Every block is moved to the back at most twice: once to clear the
+   * reference bit, and once if it is pinned. */
+  size_t steps = 0;
+  for (Entry *e = protected_.front(); e != &protected_.head;
+       e = protected_.front()) {
+    if (e->refcount.load(std::memory_order_acquire) == 0 && !e->referenced) {
+      erase(e);
+      return true;
+    }
+    if (++steps > 2 * entries.size()) {
+      break;
+    }
+    /* Give it a second chance. */
+    e->referenced = false;
+    protected_.remove(e);
+    protected_.push_back(e);
   }
+  return false;
 }
 
-void Cache::evict() {
-  wing_assert(size_ >= capacity_);
-  do {
-    wing_assert(lru_list_.empty(), "Cache capacity too small!");
-    auto it = lru_list_.begin();
-    const CacheKey &cache_key = *it;
-    wing_assert(lru_map_.erase(cache_key) == 1);
-    auto it2 = cache_.find(cache_key);
-    wing_assert(it2 != cache_.end());
-    size_t refcount = it2->second.refcount.load(std::memory_order_relaxed);
-    wing_assert_eq(refcount, (size_t)0);
-    size_ -= it2->second.block.size();
-    cache_.erase(it2);
-    lru_list_.erase(it);
-  } while (size_ >= capacity_);
+void Cache::Shard::evict() {
+  while (probation.size + protected_.size > capacity) {
+    if (probation.size > probation_capacity || protected_.empty()) {
+      if (!evict_probation() && !evict_protected()) {
+        /* All the blocks are pinned. */
+        return;
+      }
+    } else if (!evict_protected() && !evict_probation()) {
+      return;
+    }
+  }
 }
 
 std::optional<Cache::Handle> Cache::get(
     uint64_t sstable_id, BlockHandle block) {
   CacheKey cache_key(sstable_id, block.offset_);
-  std::unique_lock<std::mutex> lock(mu_);
-  auto it = cache_.find(cache_key);
-  if (it == cache_.end()) {
+  auto &s = shard(cache_key);
+  std::unique_lock<std::mutex> lock(s.mu);
+  auto it = s.entries.find(cache_key);
+  if (it == s.entries.end()) {
+    s.misses.fetch_add(1, std::memory_order_relaxed);
     return std::nullopt;
   }
-  size_t ori_refcount =
-      it->second.refcount.fetch_add(1, std::memory_order_relaxed);
-  if (ori_refcount == 0) {
-    auto map_it = lru_map_.find(cache_key);
-    wing_assert(map_it != lru_map_.end());
-    lru_list_.erase(map_it->second);
-    lru_map_.erase(map_it);
-  }
-  return Handle(*this, cache_key, it->second.block);
+  s.hits.fetch_add(1, std::memory_order_relaxed);
+  s.ref(&it->second);
+  return Handle(&it->second);
 }
 
 Cache::Handle Cache::insert(
     uint64_t sstable_id, BlockHandle block, std::string &&content) {
   CacheKey cache_key(sstable_id, block.offset_);
-  size_t size = content.size();
-  std::unique_lock<std::mutex> lock(mu_);
-  auto ret =
-      cache_.emplace(std::piecewise_construct, std::forward_as_tuple(cache_key),
-          std::forward_as_tuple(std::move(content), 1));
+  auto &s = shard(cache_key);
+  std::unique_lock<std::mutex> lock(s.mu);
+  auto ret = s.entries.emplace(std::piecewise_construct,
+      std::forward_as_tuple(cache_key),
+      std::forward_as_tuple(cache_key, std::move(content)));
+  Entry *e = &ret.first->second;
   if (ret.second) {
-    size_ += size;
-    if (size_ > capacity_) {
-      evict();
-    }
+    e->refcount.store(1, std::memory_order_relaxed);
+    s.probation.push_back(e);
+    s.evict();
+  } else {
+    /* Another thread has inserted the block. */
+    s.ref(e);
+  }
+  return Handle(e);
+}
+
+bool Cache::contains(uint64_t sstable_id, BlockHandle block) {
+  CacheKey cache_key(sstable_id, block.offset_);
+  auto &s = shard(cache_key);
+  std::unique_lock<std::mutex> lock(s.mu);
+  return s.entries.count(cache_key) > 0;
+}
+
+uint64_t Cache::hits() const {
+  uint64_t ret = 0;
+  for (size_t i = 0; i < num_shards_; i++) {
+    ret += shards_[i].hits.load(std::memory_order_relaxed);
+  }
+  return ret;
+}
+
+uint64_t Cache::misses() const {
+  uint64_t ret = 0;
+  for (size_t i = 0; i < num_shards_; i++) {
+    ret += shards_[i].misses.load(std::memory_order_relaxed);
   }
-  return Handle(*this, std::move(cache_key), ret.first->second.block);
+  return ret;
 }
 
 }  // namespace lsm
@@ -1,8 +1,7 @@
 #pragma once
 
 #include <atomic>
-#include <functional>
-#include <list>
+#include <memory>
 #include <mutex>
 #include <optional>
 #include <unordered_map>
@@ -15,6 +14,10 @@ namespace lsm {
 
 struct CacheOptions {
   size_t capacity = 8 * 1024 * 1024;  // 8MiB
+  /* The cache is divided into 2^num_shard_bits shards. */
+  size_t num_shard_bits = 4;
+  /* The fraction of the capacity for the blocks which are accessed once. */
+  double probation_ratio = 0.25;
 };
 
 class CacheKey {
@@ -28,7 +31,14 @@ class CacheKey {
 
   struct Hash {
     size_t operator()(const CacheKey &x) const {
-      return (x.sst_id_ << 32) | x.offset_;
+      /* The finalizer of MurmurHash3. The high bits select the shard. */
+      uint64_t h = x.sst_id_ * 0x9e3779b97f4a7c15ull ^ x.offset_;
+      h ^= h >> 33;
+      h *= 0xff51afd7ed558ccdull;
+      h ^= h >> 33;
+      h *= 0xc4ceb9fe1a85ec53ull;
+      h ^= h >> 33;
+      return h;
     }
   };
 
@@ -37,69 +47,131 @@ class CacheKey {
   offset_t offset_;
 };
 
+/**
+ * The block cache. It is divided into shards by the hash of CacheKey, and
+ * each shard has its own mutex, so readers of different blocks rarely
+ * contend.
+ *
+ * Each shard uses a 2Q-like policy. A new block enters the probation queue,
+ * which is a FIFO holding at most probation_ratio of the capacity. If it is
+ * accessed again, it is moved to the protected queue, which is managed by
+ * CLOCK (second chance). A scan inserts many blocks which are accessed only
+ * once, so it only evicts the blocks in the probation queue and does not
+ * flush the working set of point lookups.
+ *
+ * A block is pinned as long as there is a Handle to it, and pinned blocks are
+ * never evicted. The cache may exceed its capacity if too many blocks are
+ * pinned.
+ */
 class Cache {
+  struct Entry;
+
  public:
   class Handle {
    public:
     Handle(const Handle &) = delete;
     Handle &operator=(const Handle &) = delete;
-    Handle(Handle &&rhs)
-      : cache_(rhs.cache_), block_id_(rhs.block_id_), block_(rhs.block_) {
-      rhs.block_ = std::string_view();
-    }
+    Handle(Handle &&rhs) : entry_(rhs.entry_) { rhs.entry_ = nullptr; }
     Handle &operator=(Handle &&rhs) {
       this->~Handle();
-      cache_ = rhs.cache_;
-      block_id_ = rhs.block_id_;
-      block_ = rhs.block_;
-      rhs.block_ = std::string_view();
+      entry_ = rhs.entry_;
+      rhs.entry_ = nullptr;
       return *this;
     }
     ~Handle() {
-      if (block_.data() != nullptr)
-        cache_.get().unref_block(block_id_);
+      if (entry_ != nullptr)
+        Cache::unref(entry_);
     }
 
-    std::string_view block() const { return block_; }
+    std::string_view block() const { return entry_->block; }
 
    private:
-    Handle(Cache &cache, CacheKey block_id, std::string_view block)
-      : cache_(cache), block_id_(block_id), block_(block) {}
+    Handle(Entry *entry) : entry_(entry) {}
 
-    std::reference_wrapper<Cache> cache_;
-    CacheKey block_id_;
-    std::string_view block_;
+    Entry *entry_;
 
     friend class Cache;
   };
 
-  Cache(const CacheOptions &options) : capacity_(options.capacity), size_(0) {}
+  Cache(const CacheOptions &options);
 
   std::optional<Cache::Handle> get(uint64_t sstable_id, BlockHandle block);
   Handle insert(uint64_t sstable_id, BlockHandle block, std::string &&content);
 
+  /* Whether the block is in the cache. It does not count as an access. */
+  bool contains(uint64_t sstable_id, BlockHandle block);
+
+  /* The number of get() calls which found the block. */
+  uint64_t hits() const;
+  /* The number of get() calls which did not find the block. */
+  uint64_t misses() const;
+
  private:
-  struct BlockInfo {
+  struct Entry {
+    CacheKey key;
     std::string block;
+    /* The number of handles. It is increased only with the shard mutex held,
+     * and decreased without the mutex. */
     std::atomic<size_t> refcount;
+    /* The reference bit of CLOCK. */
+    bool referenced{false};
+    bool in_protected{false};
+    /* The links of the intrusive queue. */
+    Entry *prev{nullptr};
+    Entry *next{nullptr};
+
+    Entry(CacheKey k, std::string &&b) : key(k), block(std::move(b)) {
+      refcount.store(0, std::memory_order_relaxed);
+    }
+  };
+
+  /* A circular doubly linked list with a sentinel. */
+  struct Queue {
+    Entry head{CacheKey(0, 0), std::string()};
+    size_t size{0};
 
-    BlockInfo(std::string &&b, size_t rc) : block(std::move(b)), refcount(rc) {}
+    Queue() { head.prev = head.next = &head; }
+    bool empty() const { return head.next == &head; }
+    Entry *front() { return head.next; }
+    void push_back(Entry *e);
+    void remove(Entry *e);
   };
 
-  void unref_block(CacheKey block_id);
-  // REQUIRES: this->mu_ held
-  void evict();
+  struct alignas(64) Shard {
+    std::mutex mu;
+    std::unordered_map<CacheKey, Entry, CacheKey::Hash> entries;
+    /* The blocks accessed once. */
+    Queue probation;
+    /* The blocks accessed more than once. */
+    Queue protected_;
+    size_t capacity{0};
+    size_t probation_capacity{0};
+    std::atomic<uint64_t> hits{0};
+    std::atomic<uint64_t> misses{0};
+
+    // REQUIRES: this->mu held
+    void ref(Entry *e);
+    // REQUIRES: this->mu held
+    void evict();
+    // REQUIRES: this->mu held
+    bool evict_probation();
+    // REQUIRES: this->mu held
+    bool evict_protected();
+    // REQUIRES: this->mu held
+    void erase(Entry *e);
+  };
 
-  const size_t capacity_;
+  static void unref(Entry *e) {
+    e->refcount.fetch_sub(1, std::memory_order_release);
+  }
 
-  std::mutex mu_;
-  std::unordered_map<CacheKey, BlockInfo, CacheKey::Hash> cache_;
-  size_t size_;
-  std::unordered_map<CacheKey, std::list<CacheKey>::iterator, CacheKey::Hash>
-      lru_map_;
-  std::list<CacheKey> lru_list_;
+  Shard &shard(const CacheKey &key) {
+    return shards_[CacheKey::Hash()(key) >> shift_ & (num_shards_ - 1)];
+  }
 
-  friend class Block;
+  size_t num_shards_;
+  size_t shift_;
+  std::unique_ptr<Shard[]> shards_;
 };
 
 }  // namespace lsm
@@ -10,6 +10,8 @@ enum class GetResult : uint8_t {
   kFound = 0,
   kNotFound,
   kDelete,
+  /* The record is found and its value is a BlobIndex. */
+  kBlobIndex,
 };
 
 using offset_t = uint32_t;
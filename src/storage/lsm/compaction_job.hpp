@@ -1,5 +1,11 @@
   #pragma once
 
+  #include <deque>
+  #include <limits>
+  #include <optional>
+
+  #include "storage/lsm/blob.hpp"
+  #include "storage/lsm/range_tombstone.hpp"
   #include "storage/lsm/sst.hpp"
 
   namespace wing {
@@ -9,83 +15,206 @@
   class CompactionJob {
    public:
     CompactionJob(FileNameGenerator* gen, size_t block_size, size_t sst_size,
-        size_t write_buffer_size, size_t bloom_bits_per_key, bool use_direct_io)
+        size_t write_buffer_size, size_t bloom_bits_per_key, bool use_direct_io,
+        seq_t oldest_snapshot = std::numeric_limits<seq_t>::max(),
+        size_t restart_interval = kDefaultBlockRestartInterval,
+        bool block_hash_index = false,
+        const PrefixExtractor* prefix_extractor = nullptr,
+        const BlobJobOptions* blob_options = nullptr)
       : file_gen_(gen),
         block_size_(block_size),
         sst_size_(sst_size),
         write_buffer_size_(write_buffer_size),
         bloom_bits_per_key_(bloom_bits_per_key),
-        use_direct_io_(use_direct_io) {}
+        use_direct_io_(use_direct_io),
+        oldest_snapshot_(oldest_snapshot),
+        restart_interval_(restart_interval),
+        block_hash_index_(block_hash_index),
+        prefix_extractor_(prefix_extractor),
+        blob_options_(blob_options) {}
 
     /**
      * It receives an iterator and returns a list of SSTable
+     *
+     * Records are streamed from the iterator into an SSTableBuilder, and a
+     * new SSTable is started once the current one reaches sst_size_. Files
+     * are only cut between different user keys. For each user key, the
+     * versions newer than oldest_snapshot_ are kept, as well as the newest
+     * version visible to oldest_snapshot_. Older versions are dropped.
+     *
+     * If end_user_key is given, it stops at the first record whose user key
+     * is >= end_user_key. It is used by subcompactions, each of which merges
+     * a range of user keys.
+     *
+     * range_tombstones are the range tombstones of the inputs, which must be
+     * within the range of user keys. The records deleted by a tombstone
+     * visible to oldest_snapshot_ are dropped. The tombstones are written to
+     * the outputs, and the ones spanning two outputs are cut, so that the
+     * key ranges of the outputs do not overlap. The RecordType::RangeDeletion
+     * records of the inputs are skipped, since they are written again with
+     * the tombstones.
+     *
+     * If blob_options_ is given, the values of at least min_blob_size bytes
+     * are written to blob files, and the values in the blob files older than
+     * gc_before_file_id are copied to new blob files. The BlobIndex records
+     * dropped or relocated are counted as garbage. See GetBlobChanges.
      */
     template <typename IterT>
-    std::vector<SSTInfo> Run(IterT&& it) {
+    std::vector<SSTInfo> Run(IterT&& it,
+        std::optional<Slice> end_user_key = std::nullopt,
+        std::vector<RangeTombstone> range_tombstones = {}) {
       std::vector<SSTInfo> sst_infos;
-      std::vector<std::pair<std::string, std::string>> temp;
+      std::unique_ptr<SSTableBuilder> builder;
+      std::pair<std::string, size_t> file;
       size_t curr_size = 0;
-      std::string a;
-      std::string b;
-      bool add = true;
-
-      while (it.Valid()) {
-        size_t record_size = ParsedKey(it.key()).size() + it.value().size() + 3*sizeof(uint32_t); 
-
-        if (!temp.empty() && ParsedKey(temp.back().first).user_key_ == ParsedKey(it.key()).user_key_) {
-          if (ParsedKey(temp.back().first).seq_ <= ParsedKey(it.key()).seq_) {
-            int rec_size = ParsedKey(temp.back().first).size() + temp.back().second.size() + 3*sizeof(uint32_t);
-            temp.pop_back();
-            curr_size -= rec_size;
-          } else {
-            add = false;
-          }
+      /* The iterator may reuse its buffer, so the user key is copied. */
+      std::string last_user_key;
+      bool has_last_key = false;
+      /* Whether a version of the user key visible to the oldest snapshot has
+       * been seen. All the older versions can be dropped. */
+      bool visible_seen = false;
+      SortRangeTombstones(&range_tombstones);
+      RangeTombstoneFragments covering(range_tombstones, oldest_snapshot_);
+      /* The tombstones not written yet, in the order of their begin keys. */
+      std::deque<RangeTombstone> pending(
+          range_tombstones.begin(), range_tombstones.end());
+      auto new_builder = [&]() {
+        file = file_gen_->Generate();
+        builder = std::make_unique<SSTableBuilder>(
+            std::make_unique<FileWriter>(
+                std::make_unique<SeqWriteFile>(file.first, use_direct_io_),
+                write_buffer_size_),
+            block_size_, bloom_bits_per_key_, restart_interval_,
+            block_hash_index_, prefix_extractor_);
+      };
+      auto add_tombstone = [&](const RangeTombstone& tombstone) {
+        if (!builder) {
+          new_builder();
         }
+        builder->AddRangeTombstone(tombstone);
+        curr_size += tombstone.begin_.size() + sizeof(seq_t) +
+                     sizeof(RecordType) + 3 * sizeof(uint32_t);
+      };
+      /* Write the tombstones ordered before the record. */
+      auto add_tombstones_before = [&](ParsedKey key) {
+        while (!pending.empty() &&
+               ParsedKey(pending.front().begin_, pending.front().seq_,
+                   RecordType::RangeDeletion) < key) {
+          add_tombstone(pending.front());
+          pending.pop_front();
+        }
+      };
 
-        if (curr_size + record_size > sst_size_) {
-          std::vector<std::pair<std::string, std::string>>* t = &temp;
-          std::pair<std::string, size_t> pair = file_gen_->Generate();
-          SSTableBuilder builder(std::make_unique<FileWriter>(std::make_unique<SeqWriteFile>(pair.first, use_direct_io_), write_buffer_size_), block_size_, bloom_bits_per_key_);
-
-          for (auto& kv_pair : *t) {
-            builder.Append(ParsedKey(kv_pair.first), kv_pair.second);
+      for (; it.Valid(); it.Next()) {
+        ParsedKey key(it.key());
+        if (key.type_ == RecordType::RangeDeletion) {
+          continue;
+        }
+        bool new_user_key = !has_last_key || key.user_key_ != last_user_key;
+        if (new_user_key && end_user_key && key.user_key_ >= *end_user_key) {
+          break;
+        }
+        if (new_user_key) {
+          last_user_key = key.user_key_;
+          has_last_key = true;
+          visible_seen = false;
+        }
+        if (visible_seen || (!covering.empty() &&
+                                key.seq_ < covering.MaxCoveringSeq(
+                                               key.user_key_))) {
+          if (key.type_ == RecordType::BlobIndex) {
+            blob_changes_.AddGarbage(BlobIndex::Decode(it.value()));
           }
-          builder.Finish();
-          SSTInfo ssti = SSTInfo{builder.size(), builder.count(), pair.second, builder.GetIndexOffset(), builder.GetBloomFilterOffset(), pair.first};
-          sst_infos.push_back(ssti);
-          temp.clear();
+          continue;
+        }
+        visible_seen = key.seq_ <= oldest_snapshot_;
+        Slice value = SeparateValue(&key, it.value());
+        size_t record_size = key.size() + value.size() + 3 * sizeof(uint32_t);
+        add_tombstones_before(key);
+        if (builder && new_user_key && curr_size + record_size > sst_size_) {
+          /* The next SSTable starts at this user key, so the tombstones are
+           * cut here. */
+          auto rest = builder->CutRangeTombstones(key.user_key_);
+          SortRangeTombstones(&rest);
+          pending.insert(pending.begin(), rest.begin(), rest.end());
+          sst_infos.push_back(FinishSSTable(builder.get(), file));
+          builder.reset();
           curr_size = 0;
+          add_tombstones_before(key);
         }
-        
-        if (add) {
-          a = it.key();
-          b = it.value();
-          auto pair = std::make_pair(a, b);
-          temp.push_back(pair);
-          curr_size += record_size;
+        if (!builder) {
+          new_builder();
         }
-        it.Next();
-        add = true;
+        builder->Append(key, value);
+        curr_size += record_size;
+      }
+      for (auto& tombstone : pending) {
+        add_tombstone(tombstone);
+      }
+
+      if (builder) {
+        sst_infos.push_back(FinishSSTable(builder.get(), file));
       }
+      if (blob_builder_) {
+        blob_changes_.new_files_ = blob_builder_->Finish();
+      }
+      return sst_infos;
+    }
 
-      if (!temp.empty()) {
-        
-        std::vector<std::pair<std::string, std::string>>* t = &temp;
-        std::pair<std::string, size_t> pair = file_gen_->Generate();
-        SSTableBuilder builder(std::make_unique<FileWriter>(std::make_unique<SeqWriteFile>(pair.first, use_direct_io_), write_buffer_size_), block_size_, bloom_bits_per_key_);
+    /* The blob files written by Run and the garbage found. */
+    const BlobChanges& GetBlobChanges() const { return blob_changes_; }
 
-        for (auto& kv_pair : *t) {
-          builder.Append(ParsedKey(kv_pair.first), kv_pair.second);
+   private:
+    /**
+     * Return the value stored in the SSTable. If it is moved to a blob file,
+     * the type of key becomes RecordType::BlobIndex, and the encoded
+     * BlobIndex is returned.
+     */
+    Slice SeparateValue(ParsedKey* key, Slice value) {
+      if (blob_options_ == nullptr) {
+        return value;
+      }
+      if (key->type_ == RecordType::Value) {
+        if (blob_options_->min_blob_size == 0 ||
+            value.size() < blob_options_->min_blob_size) {
+          return value;
         }
-        builder.Finish();
-        SSTInfo ssti = SSTInfo{builder.size(), builder.count(), pair.second, builder.GetIndexOffset(), builder.GetBloomFilterOffset(), pair.first};
-        sst_infos.push_back(ssti);
+        blob_index_buf_ = BlobBuilder()->Add(value).Encode();
+      } else if (key->type_ == RecordType::BlobIndex) {
+        auto index = BlobIndex::Decode(value);
+        if (index.file_id_ >= blob_options_->gc_before_file_id) {
+          return value;
+        }
+        auto it = blob_options_->files->find(index.file_id_);
+        if (it == blob_options_->files->end()) {
+          DB_ERR("Blob file {} does not exist", index.file_id_);
+        }
+        it->second->Get(index, &blob_buf_);
+        blob_changes_.AddGarbage(index);
+        blob_index_buf_ = BlobBuilder()->Add(blob_buf_).Encode();
+      } else {
+        return value;
+      }
+      key->type_ = RecordType::BlobIndex;
+      return blob_index_buf_;
+    }
+
+    BlobFileBuilder* BlobBuilder() {
+      if (!blob_builder_) {
+        blob_builder_ = std::make_unique<BlobFileBuilder>(file_gen_,
+            blob_options_->blob_file_size, write_buffer_size_, use_direct_io_);
       }
+      return blob_builder_.get();
+    }
 
-      return sst_infos;
+    SSTInfo FinishSSTable(SSTableBuilder* builder,
+        const std::pair<std::string, size_t>& file) {
+      builder->Finish();
+      return SSTInfo{builder->size(), builder->count(), file.second,
+          builder->GetIndexOffset(), builder->GetBloomFilterOffset(),
+          file.first};
     }
 
-   private:
     /* Generate new SSTable file name */
     FileNameGenerator* file_gen_;
     /* The target block size */
@@ -98,6 +227,25 @@
     size_t bloom_bits_per_key_;
     /* Use O_DIRECT or not */
     bool use_direct_io_;
+    /**
+     * The sequence number of the oldest snapshot that may read the output.
+     * Readers of older snapshots hold the input files through their
+     * SuperVersion, so it is the newest sequence number by default.
+     */
+    seq_t oldest_snapshot_;
+    /* The number of entries between two restart points in data blocks */
+    size_t restart_interval_;
+    /* Build the hash index of data blocks or not */
+    bool block_hash_index_;
+    /* The prefix extractor of the prefix bloom filters, or nullptr */
+    const PrefixExtractor* prefix_extractor_;
+    /* The options of key-value separation, or nullptr */
+    const BlobJobOptions* blob_options_;
+    std::unique_ptr<BlobFileBuilder> blob_builder_;
+    BlobChanges blob_changes_;
+    /* The buffers of SeparateValue */
+    std::string blob_index_buf_;
+    std::string blob_buf_;
   };
 
   }  // namespace lsm
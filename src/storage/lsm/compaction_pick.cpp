@@ -6,10 +6,22 @@ namespace lsm {
 
 bool overlaps(
     std::shared_ptr<SSTable> table1, std::shared_ptr<SSTable> table2) {
-  return ((table1->GetLargestKey() <= table2->GetLargestKey()) &&
-             (table1->GetLargestKey() >= table2->GetSmallestKey())) ||
-         ((table1->GetSmallestKey() <= table2->GetLargestKey()) &&
-             (table1->GetSmallestKey() >= table2->GetSmallestKey()));
+  /* It also covers the case where table1 contains table2. */
+  return !(table1->GetLargestKey() < table2->GetSmallestKey() ||
+           table2->GetLargestKey() < table1->GetSmallestKey());
+}
+
+/* Whether some sorted runs of the level are being compacted. */
+static bool LevelInCompaction(const Version* version, size_t level) {
+  if (level >= version->GetLevels().size()) {
+    return false;
+  }
+  for (auto& run : version->GetLevels()[level].GetRuns()) {
+    if (run->GetCompactionInProcess()) {
+      return true;
+    }
+  }
+  return false;
 }
 
 std::unique_ptr<Compaction> LeveledCompactionPicker::Get(Version* version) {
@@ -20,14 +32,27 @@ std::unique_ptr<Compaction> LeveledCompactionPicker::Get(Version* version) {
     levels = version->GetLevels().size();
   }
 
-  if (levels > 0 && version->GetLevels()[0].GetRuns().size() > level0_compaction_trigger_) {
+  /* Levels that are being compacted are skipped, so that concurrent
+   * compactions never overlap. */
+  auto is_free = [&](int level) {
+    return !LevelInCompaction(version, level) &&
+           !LevelInCompaction(version, level + 1);
+  };
+
+  /* Level 0 is compacted once it has level0_compaction_trigger sorted runs,
+   * which is the same trigger as the other pickers.
+   */
+  if (levels > 0 &&
+      version->GetLevels()[0].GetRuns().size() >= level0_compaction_trigger_ &&
+      is_free(0)) {
     src_level = 0;
     target_level = 1;
   }
 
   for (size_t level = 1; level < levels; ++level) {
     size_t level_size = version->GetLevels()[level].size();
-    if (level_size >= base_level_size_ * std::pow(ratio_, level)) {
+    if (level_size >= base_level_size_ * std::pow(ratio_, level) &&
+        is_free(level)) {
       src_level = level;
       target_level = level + 1;
       break;
@@ -38,12 +63,15 @@ std::unique_ptr<Compaction> LeveledCompactionPicker::Get(Version* version) {
 
   if (src_level != -1) {
     std::shared_ptr<SortedRun> target_run = nullptr;
-    if (target_level < levels) {
+    if (target_level < levels &&
+        !version->GetLevels()[target_level].GetRuns().empty()) {
       if (src_level != 0) {
         auto curr = version->GetLevels()[src_level].GetRuns()[0];
         ParsedKey target_l = version->GetLevels()[target_level].GetRuns()[0]->GetSmallestKey();
         ParsedKey target_r = version->GetLevels()[target_level].GetRuns()[0]->GetLargestKey();
-        int rsf = -1;
+        /* Pick the SSTable with the minimum ratio of overlapping bytes in
+         * the target level to its own size. */
+        double rsf = -1;
 
         for (auto& curr_table : curr->GetSSTs()) {
           ParsedKey l = curr_table->GetSmallestKey();
@@ -53,14 +81,16 @@ std::unique_ptr<Compaction> LeveledCompactionPicker::Get(Version* version) {
             table = curr_table;
             break;
           } else {
-            int curr = 0;
+            size_t curr = 0;
             for (auto& t_table : version->GetLevels()[target_level].GetRuns()[0]->GetSSTs()) {
               if (overlaps(curr_table, t_table)) {
                 curr += t_table->GetSSTInfo().size_;
               }
             }
-            if (rsf == -1 || curr < rsf) {
-              rsf = curr;
+            double ratio = curr / (double)std::max<size_t>(
+                                      curr_table->GetSSTInfo().size_, 1);
+            if (rsf < 0 || ratio < rsf) {
+              rsf = ratio;
               table = curr_table;
             }
           }
@@ -72,10 +102,6 @@ std::unique_ptr<Compaction> LeveledCompactionPicker::Get(Version* version) {
           true;  
 
         table = version->GetLevels()[src_level].GetRuns()[0]->GetSSTs()[0];
-      if (target_level < levels) {
-        
-        target_run = version->GetLevels()[target_level].GetRuns()[0];
-      }
     }
 
     if (src_level == 0) {
@@ -102,11 +128,19 @@ std::unique_ptr<Compaction> TieredCompactionPicker::Get(Version* version) {
     return nullptr;
   }
 
-  for (int i = num_levels - 1; i >= 0; i--) {
+  for (size_t i = num_levels; i-- > 0;) {
     Level level = version->GetLevels()[i];
     std::shared_ptr<wing::lsm::SortedRun> target_run = nullptr;
+    if (LevelInCompaction(version, i) ||
+        (num_levels > 2 && i == num_levels - 2 &&
+            LevelInCompaction(version, num_levels - 1))) {
+      continue;
+    }
 
+    /* Level 0 is also compacted once it has enough sorted runs, otherwise
+     * the flushes may stall forever. */
     if (level.GetRuns().size() >= ratio_ ||
+        (i == 0 && level.GetRuns().size() >= level0_compaction_trigger_) ||
         level.size() >= (std::pow(ratio_, i) * base_level_size_)) {
       
       if (i == num_levels - 1) {
@@ -118,8 +152,9 @@ std::unique_ptr<Compaction> TieredCompactionPicker::Get(Version* version) {
         return compaction;
       }
 
-      if (num_levels > 2 &&
-          i == num_levels - 2) {  
+      if (leveled_last_level_ && num_levels > 2 &&
+          i == num_levels - 2 &&
+          !version->GetLevels()[num_levels - 1].GetRuns().empty()) {
    
         std::shared_ptr<SortedRun> target_run =
             version->GetLevels()[num_levels - 1].GetRuns()[0];
@@ -174,8 +209,11 @@ std::unique_ptr<Compaction> LazyLevelingCompactionPicker::Get(
   Options options;
   auto level_size_limit = level0_compaction_trigger_ * options.sst_file_size;
 
+  bool last_level_free = !LevelInCompaction(version, levels.size() - 1);
+
   if (levels.size() == 1) {
-    if (last_level.GetRuns().size() >= level0_compaction_trigger_) {
+    if (last_level.GetRuns().size() >= level0_compaction_trigger_ &&
+        last_level_free) {
       std::unique_ptr<Compaction> compaction = std::make_unique<Compaction>(
           std::vector<std::shared_ptr<SSTable>>{}, last_level.GetRuns(),
           last_level.GetID(), last_level.GetID() + 1, target_run, true);
@@ -185,7 +223,8 @@ std::unique_ptr<Compaction> LazyLevelingCompactionPicker::Get(
   }
 
   if (last_level.size() >=
-      std::pow(ratio_, levels.size() - 1) * base_level_size_) {
+          std::pow(ratio_, levels.size() - 1) * base_level_size_ &&
+      last_level_free) {
     std::unique_ptr<Compaction> compaction = std::make_unique<Compaction>(
         std::vector<std::shared_ptr<SSTable>>{}, last_level.GetRuns(),
         last_level.GetID(), last_level.GetID() + 1, target_run, true);
@@ -194,7 +233,7 @@ std::unique_ptr<Compaction> LazyLevelingCompactionPicker::Get(
   }
 
   TieredCompactionPicker tiered_compact_pick(
-      ratio_, base_level_size_, level0_compaction_trigger_);
+      ratio_, base_level_size_, level0_compaction_trigger_, true);
   std::unique_ptr<Compaction> compaction = tiered_compact_pick.Get(version);
   if (compaction) {
     compaction->SetLazyLeveling(true);
@@ -30,17 +30,18 @@ class LeveledCompactionPicker final : public CompactionPicker {
   size_t ratio_{10};
   /* The base size levels */
   size_t base_level_size_{0};
-  /* The maximum amount of sorted runs in Level 0 */
+  /* Level 0 is compacted once it has this number of sorted runs. */
   size_t level0_compaction_trigger_{0};
 };
 
 class TieredCompactionPicker final : public CompactionPicker {
  public:
-  TieredCompactionPicker(
-      size_t ratio, size_t base_level_size, size_t level0_compaction_trigger)
+  TieredCompactionPicker(size_t ratio, size_t base_level_size,
+      size_t level0_compaction_trigger, bool leveled_last_level = false)
     : ratio_(ratio),
       base_level_size_(base_level_size),
-      level0_compaction_trigger_(level0_compaction_trigger) {}
+      level0_compaction_trigger_(level0_compaction_trigger),
+      leveled_last_level_(leveled_last_level) {}
 
   std::unique_ptr<Compaction> Get(Version* version) override;
 
@@ -51,6 +52,12 @@ class TieredCompactionPicker final : public CompactionPicker {
   size_t base_level_size_{0};
   /* The maximum amount of sorted runs in Level 0 */
   size_t level0_compaction_trigger_{0};
+  /**
+   * If it is true, the last level has only one sorted run, into which the
+   * sorted runs of the second last level are merged (lazy leveling).
+   * Otherwise sorted runs are only merged into new sorted runs.
+   */
+  bool leveled_last_level_{false};
 };
 
 class LazyLevelingCompactionPicker final : public CompactionPicker {
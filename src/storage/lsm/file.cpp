@@ -1,7 +1,14 @@
 #include "storage/lsm/file.hpp"
 
 #include <fcntl.h>
+#include <sys/stat.h>
 #include <unistd.h>
+#if defined(__linux__)
+#include <sys/mman.h>
+#endif
+
+#include <algorithm>
+#include <cstring>
 
 #include "storage/lsm/stats.hpp"
 
@@ -9,7 +16,8 @@ namespace wing {
 
 namespace lsm {
 
-ReadFile::ReadFile(const std::string& filename, bool use_direct_io)
+ReadFile::ReadFile(
+    const std::string& filename, bool use_direct_io, bool use_mmap)
   : filename_(filename), use_direct_io_(use_direct_io) {
   auto flag = O_RDONLY;
 #if defined(__linux__)
@@ -23,11 +31,41 @@ ReadFile::ReadFile(const std::string& filename, bool use_direct_io)
   if (fd_ < 0) {
     DB_ERR("::open file {} error! Error: {}", filename, errno);
   }
+#if defined(__linux__)
+  if (use_mmap && !use_direct_io) {
+    struct stat st;
+    if (::fstat(fd_, &st) < 0) {
+      DB_ERR("::fstat file {} error! Error: {}", filename, errno);
+    }
+    mmap_size_ = st.st_size;
+    if (mmap_size_ > 0) {
+      void* ptr = ::mmap(nullptr, mmap_size_, PROT_READ, MAP_SHARED, fd_, 0);
+      if (ptr == MAP_FAILED) {
+        DB_ERR("::mmap file {} error! Error: {}", filename, errno);
+      }
+      mmap_data_ = static_cast<char*>(ptr);
+    }
+  }
+#endif
 }
 
-ReadFile::~ReadFile() { ::close(fd_); }
+ReadFile::~ReadFile() {
+#if defined(__linux__)
+  if (mmap_data_ != nullptr) {
+    ::munmap(mmap_data_, mmap_size_);
+  }
+#endif
+  ::close(fd_);
+}
 
 ssize_t ReadFile::Read(char* data, size_t n, offset_t offset) {
+  if (mmap_data_ != nullptr) {
+    n = offset < mmap_size_ ? std::min<size_t>(n, mmap_size_ - offset) : 0;
+    memcpy(data, mmap_data_ + offset, n);
+    GetStatsContext()->total_read_bytes.fetch_add(
+        n, std::memory_order_relaxed);
+    return n;
+  }
 #if defined(__linux__)
   ssize_t ret = ::pread(fd_, data, n, offset);
 #elif defined(__MINGW64__)
@@ -41,6 +79,32 @@ ssize_t ReadFile::Read(char* data, size_t n, offset_t offset) {
   return ret;
 }
 
+void ReadFile::PrepareAsync(
+    char* data, size_t n, offset_t offset, AsyncReadRequest* req) const {
+  req->fd = fd_;
+  req->data = data;
+  req->n = n;
+  req->offset = offset;
+  req->done.store(false, std::memory_order_relaxed);
+  GetStatsContext()->total_read_bytes.fetch_add(n, std::memory_order_relaxed);
+}
+
+void ReadFile::Advise(offset_t offset, size_t n, AccessPattern pattern) {
+#if defined(__linux__)
+  if (mmap_data_ == nullptr || offset >= mmap_size_) {
+    return;
+  }
+  /* madvise requires a page-aligned address. */
+  static const size_t page_size = ::sysconf(_SC_PAGESIZE);
+  size_t begin = offset / page_size * page_size;
+  size_t end = std::min<size_t>(offset + n, mmap_size_);
+  int advice =
+      pattern == AccessPattern::kRandom ? MADV_RANDOM : MADV_WILLNEED;
+  /* It is only a hint, so the errors are ignored. */
+  ::madvise(mmap_data_ + begin, end - begin, advice);
+#endif
+}
+
 SeqWriteFile::SeqWriteFile(const std::string& filename, bool use_direct_io)
   : filename_(filename), use_direct_io_(use_direct_io) {
   auto flag = O_WRONLY | O_CREAT | O_TRUNC;
@@ -92,6 +156,19 @@ FileWriter::~FileWriter() {
   }
 }
 
+void SyncFileByName(const std::string& filename) {
+  int fd = ::open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    DB_ERR("::open file {} error! Error: {}", filename, errno);
+  }
+#if defined(__linux__)
+  ::fdatasync(fd);
+#elif defined(__MINGW64__)
+  ::_commit(fd);
+#endif
+  ::close(fd);
+}
+
 void FileReader::Read(char* data, size_t n) {
   file_->Read(data, n, offset_);
   offset_ += n;
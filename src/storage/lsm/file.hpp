@@ -4,6 +4,7 @@
 
 #include "common/logging.hpp"
 #include "common/util.hpp"
+#include "storage/lsm/async_io.hpp"
 #include "storage/lsm/buffer.hpp"
 #include "storage/lsm/common.hpp"
 
@@ -11,9 +12,21 @@ namespace wing {
 
 namespace lsm {
 
+/**
+ * The hints of how a range of a memory-mapped file will be accessed.
+ * kRandom disables the readahead of the OS (MADV_RANDOM). kSequential means
+ * the range will be read soon, so the OS reads it ahead (MADV_WILLNEED).
+ */
+enum class AccessPattern { kRandom, kSequential };
+
 class ReadFile {
  public:
-  ReadFile(const std::string& filename, bool use_direct_io);
+  /**
+   * If use_mmap is true and use_direct_io is false, the whole file is mapped
+   * into memory, and it can be accessed through mmap_data() without copies.
+   */
+  ReadFile(const std::string& filename, bool use_direct_io,
+      bool use_mmap = false);
 
   ReadFile(const ReadFile&) = delete;
   ReadFile(ReadFile&&) = delete;
@@ -25,10 +38,26 @@ class ReadFile {
   ssize_t Read(char* data, size_t n, offset_t offset);
   bool use_direct_io() const { return use_direct_io_; }
 
+  /**
+   * Set up req to read n bytes at offset into data, without submitting it.
+   * Several requests are then submitted together by
+   * AsyncReader::Get().Submit. Call req->Wait() before accessing data.
+   */
+  void PrepareAsync(
+      char* data, size_t n, offset_t offset, AsyncReadRequest* req) const;
+
+  /* The mapped file, or nullptr if the file is not mapped. */
+  const char* mmap_data() const { return mmap_data_; }
+
+  /* Advise the OS how [offset, offset + n) of the mapped file is accessed. */
+  void Advise(offset_t offset, size_t n, AccessPattern pattern);
+
  private:
   int fd_;
   std::string filename_;
   bool use_direct_io_;
+  char* mmap_data_{nullptr};
+  size_t mmap_size_{0};
 };
 
 class SeqWriteFile {
@@ -121,6 +150,9 @@ class FileReader {
   AlignedBuffer buffer_;
 };
 
+/* Flush the data of the file to disk. */
+void SyncFileByName(const std::string& filename);
+
 class FileNameGenerator {
  public:
   FileNameGenerator(std::string_view prefix, size_t id_begin)
@@ -131,6 +163,18 @@ class FileNameGenerator {
     return {fmt::format("{}{}.sst", prefix_, id), id};
   }
 
+  /* Generate the file name of a write-ahead log */
+  std::pair<std::string, size_t> GenerateWAL() {
+    auto id = id_.fetch_add(1);
+    return {fmt::format("{}{}.wal", prefix_, id), id};
+  }
+
+  /* Generate the file name of a blob file */
+  std::pair<std::string, size_t> GenerateBlob() {
+    auto id = id_.fetch_add(1);
+    return {fmt::format("{}{}.blob", prefix_, id), id};
+  }
+
   size_t GetID() const { return id_.load(std::memory_order_relaxed); }
 
  private:
@@ -16,6 +16,14 @@ using PinnableSlice = std::string;
 enum class RecordType : uint8_t {
   Deletion = 0,
   Value,
+  /* The value is a BlobIndex pointing to a blob file. */
+  BlobIndex,
+  /**
+   * The begin key of a range tombstone, whose end key is in the range
+   * tombstones of the SSTable. It deletes the user key like a Deletion. In a
+   * WriteBatch, the value is the end key.
+   */
+  RangeDeletion,
 };
 
 class ParsedKey;
@@ -117,6 +125,17 @@ struct IndexValue {
   BlockHandle block_;
 };
 
+/* A key of a batched lookup (MultiGet) and its result. */
+struct LookupKey {
+  Slice user_key_;
+  /* The value is copied here if it is found. */
+  std::string* value_{nullptr};
+  /* It is kNotFound until a record of the key is found. */
+  GetResult result_{GetResult::kNotFound};
+  /* The sequence number of the record found. */
+  seq_t seq_{0};
+};
+
 struct SSTInfo {
   /* The size of the SSTable */
   size_t size_;
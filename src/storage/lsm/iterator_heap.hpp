@@ -1,109 +1,123 @@
 #pragma once
 
-#include <queue>
+#include <vector>
 
 #include "storage/lsm/format.hpp"
 #include "storage/lsm/iterator.hpp"
-#include <iostream>
-#include <string>
 
 namespace wing {
 
 namespace lsm {
 
+/**
+ * It merges the iterators by internal key with a tree of losers (tournament
+ * tree). Each internal node keeps the loser of the match played there, and
+ * the overall winner is the current record. Next() advances the winner and
+ * replays its matches on the path from its leaf to the root, which takes
+ * log(n) comparisons instead of the two sifts of a binary heap. The keys of
+ * the iterators are cached, so the matches do not call key() through the
+ * virtual interface or parse the internal keys again.
+ *
+ * The iterators are added by Push, and Build must be called before the
+ * first use. The iterators with the same key are ordered by the order of
+ * Push.
+ */
 template <typename T>
 class IteratorHeap final : public Iterator {
  public:
-    IteratorHeap() = default;
+  IteratorHeap() = default;
 
-    void Push(T* it) { 
-
-     it_.push(it);
+  void Push(T* it) { leaves_.push_back(Leaf{it}); }
 
+  /* Play all the matches. */
+  void Build() {
+    size_t n = leaves_.size();
+    for (size_t i = 0; i < n; i++) {
+      Load(i);
     }
-
-    void Pop(){
-
-        it_.pop();
-
+    tree_.assign(n, 0);
+    if (n <= 1) {
+      return;
     }
-
-    void Build() { 
-
+    /* winners[i] is the winner of the subtree i, whose leaves are n..2n-1. */
+    std::vector<size_t> winners(2 * n);
+    for (size_t i = 0; i < n; i++) {
+      winners[n + i] = i;
     }
-
-    bool Valid() override { 
-
-        return !(it_.empty()) && it_.top()->Valid();
-
+    for (size_t i = n - 1; i > 0; i--) {
+      size_t a = winners[2 * i], b = winners[2 * i + 1];
+      if (Less(a, b)) {
+        winners[i] = a;
+        tree_[i] = b;
+      } else {
+        winners[i] = b;
+        tree_[i] = a;
+      }
     }
+    tree_[0] = winners[1];
+  }
 
-    Slice key() const override { 
-
-        if (!(it_.empty()) && it_.top()->Valid()) {
-            return it_.top()->key();
-        } 
-        else {
-            return Slice();
-        }
-
-    }
-
-    Slice value() const override { 
-
-        if (!(it_.empty()) && it_.top()->Valid()) {
-
-            return it_.top()->value();
+  bool Valid() override { return !tree_.empty() && leaves_[tree_[0]].valid_; }
 
-        } 
-        else {
-            return Slice();
-        }
+  Slice key() const override { return leaves_[tree_[0]].key_; }
 
-    }
-
-    void Next() override { 
-
-        if (!(it_.empty()) && it_.top()->Valid()) {
-            T* top_it = it_.top();
-            top_it->Next(); 
-            if (!top_it->Valid()) {
-                it_.pop(); 
-            } 
-            else {
-                it_.pop();
-                it_.push(top_it);
-            }
-        }
+  Slice value() const override { return leaves_[tree_[0]].it_->value(); }
 
+  void Next() override {
+    size_t winner = tree_[0];
+    leaves_[winner].it_->Next();
+    Load(winner);
+    /* Replay the matches from the leaf of the winner to the root. */
+    for (size_t i = (winner + leaves_.size()) / 2; i > 0; i /= 2) {
+      if (Less(tree_[i], winner)) {
+        std::swap(tree_[i], winner);
+      }
     }
-
-    T* Top() {
-
-        return it_.top();
-
+    tree_[0] = winner;
+  }
+
+  /* The iterator of the current record. */
+  T* Top() { return leaves_[tree_[0]].it_; }
+
+  void Clear() {
+    leaves_.clear();
+    tree_.clear();
+  }
+
+ private:
+  struct Leaf {
+    T* it_;
+    /* The cached internal key and its parsed form, if valid_ is true */
+    Slice key_;
+    ParsedKey parsed_key_;
+    bool valid_{false};
+  };
+
+  void Load(size_t i) {
+    auto& leaf = leaves_[i];
+    leaf.valid_ = leaf.it_->Valid();
+    if (leaf.valid_) {
+      leaf.key_ = leaf.it_->key();
+      leaf.parsed_key_ = ParsedKey(leaf.key_);
     }
+  }
 
-    void Clear() {
-
-        std::priority_queue<T*, std::vector<T*>, Comparator> empty_it;
-        std::swap(it_, empty_it);
-
+  /* Whether leaf a wins over leaf b. Exhausted iterators lose to all. */
+  bool Less(size_t a, size_t b) const {
+    if (!leaves_[a].valid_ || !leaves_[b].valid_) {
+      return leaves_[a].valid_ || (!leaves_[b].valid_ && a < b);
     }
-
-    private:
-
-        struct Comparator{
-
-            bool operator()(T* a, T* b) const {
-
-                return ParsedKey(a->key()) > ParsedKey(b->key());
-
-            }
-        };
-
-        std::priority_queue<T*, std::vector<T*>, Comparator> it_;
-
+    auto cmp = leaves_[a].parsed_key_ <=> leaves_[b].parsed_key_;
+    return cmp < 0 || (cmp == 0 && a < b);
+  }
+
+  std::vector<Leaf> leaves_;
+  /**
+   * tree_[0] is the leaf of the winner, and tree_[i] (i > 0) is the loser of
+   * the match at internal node i, whose children are 2i and 2i + 1. Leaf j
+   * is node n + j.
+   */
+  std::vector<size_t> tree_;
 };
 
 }  // namespace lsm
@@ -1,96 +1,165 @@
 #include "storage/lsm/level.hpp"
 
+#include <algorithm>
+
 namespace wing {
 
 namespace lsm {
 
-GetResult SortedRun::Get(Slice key, uint64_t seq, std::string* value) {
-  
-  int l = 0;
-  int r = ssts_.size() - 1;
-  int i = -1;
-  
-  while (l <= r){
-    int m = l + (r-l)/2;
-
-    if (key >= ssts_[m]->GetSmallestKey().user_key_ && key <= ssts_[m]->GetLargestKey().user_key_){
-
-      i = m;
-      break;
+/* The first 8 bytes of key as a big-endian integer, padded with zeros. */
+static uint64_t KeyPrefix(Slice key) {
+  uint64_t ret = 0;
+  size_t n = std::min(key.size(), sizeof(uint64_t));
+  for (size_t i = 0; i < n; i++) {
+    ret |= static_cast<uint64_t>(static_cast<uint8_t>(key[i]))
+           << (56 - 8 * i);
+  }
+  return ret;
+}
 
-    }
+void SortedRun::BuildFences() {
+  fences_.clear();
+  fences_.reserve(ssts_.size());
+  fence_keys_.clear();
+  fence_key_offsets_.clear();
+  fence_key_offsets_.reserve(ssts_.size() + 1);
+  fence_key_offsets_.push_back(0);
+  for (size_t i = 0; i < ssts_.size(); i++) {
+    Slice largest = ssts_[i]->GetLargestKey().user_key_;
+    fences_.push_back(Fence{KeyPrefix(largest), static_cast<uint32_t>(i)});
+    fence_keys_.append(largest);
+    fence_key_offsets_.push_back(fence_keys_.size());
+  }
+}
 
-    else if (key < ssts_[m]->GetSmallestKey().user_key_){
+void SortedRun::CollectRangeTombstones() {
+  range_tombstones_.clear();
+  for (auto& sst : ssts_) {
+    auto& tombstones = sst->GetRangeTombstones();
+    range_tombstones_.insert(
+        range_tombstones_.end(), tombstones.begin(), tombstones.end());
+  }
+  range_fragments_ = RangeTombstoneFragments(range_tombstones_);
+}
 
-      r = m - 1;
+size_t SortedRun::FindSST(Slice key, size_t begin) const {
+  uint64_t prefix = KeyPrefix(key);
+  auto it = std::lower_bound(fences_.begin() + begin, fences_.end(), key,
+      [&](const Fence& fence, Slice key) {
+        if (fence.prefix != prefix) {
+          return fence.prefix < prefix;
+        }
+        /* The prefixes are equal, so the full keys decide. */
+        size_t begin = fence_key_offsets_[fence.sst_id];
+        return Slice(fence_keys_.data() + begin,
+                   fence_key_offsets_[fence.sst_id + 1] - begin) < key;
+      });
+  return it == fences_.end() ? ssts_.size() : it->sst_id;
+}
 
+GetResult SortedRun::Get(Slice key, uint64_t seq, std::string* value) {
+  for (size_t i = FindSST(key); i < ssts_.size(); i++) {
+    if (key < ssts_[i]->GetSmallestKey().user_key_) {
+      break;
     }
-    
-    else{
-
-      l = m + 1;
-
+    auto res = ssts_[i]->Get(key, seq, value);
+    if (res != GetResult::kNotFound) {
+      return res;
+    }
+    /* The records of the key may continue in the next SSTable, if it is the
+     * largest user key of this one. */
+    if (key != ssts_[i]->GetLargestKey().user_key_) {
+      break;
     }
   }
-
-  if (i == -1) {
-    
-    return GetResult::kNotFound;
-
-  }
-
-  return ssts_[i]->Get(key, seq, value);
-
+  return GetResult::kNotFound;
 }
 
-SortedRunIterator SortedRun::Seek(Slice key, uint64_t seq) {
-  
-  int l = 0;
-  int r = ssts_.size() - 1;
-  int i = -1;
-  
-  while (l <= r){
-    int m = l + (r-l)/2;
-
-    if (key >= ssts_[m]->GetSmallestKey().user_key_ && key <= ssts_[m]->GetLargestKey().user_key_){
-
-      i = m;
+void SortedRun::MultiGet(std::span<LookupKey*> keys, uint64_t seq) {
+  /* Both the keys and the SSTables are sorted, so each SSTable gets the
+   * consecutive keys in its key range. */
+  size_t begin = 0;
+  for (size_t i = 0; begin < keys.size(); i++) {
+    i = FindSST(keys[begin]->user_key_, i);
+    if (i >= ssts_.size()) {
       break;
-
     }
-
-    else if (key < ssts_[m]->GetSmallestKey().user_key_){
-
-      r = m - 1;
-
+    Slice smallest = ssts_[i]->GetSmallestKey().user_key_;
+    Slice largest = ssts_[i]->GetLargestKey().user_key_;
+    while (begin < keys.size() && keys[begin]->user_key_ < smallest) {
+      begin++;
     }
-    
-    else{
-
-      l = m + 1;
-
+    size_t end = begin;
+    while (end < keys.size() && keys[end]->user_key_ <= largest) {
+      end++;
+    }
+    if (begin < end) {
+      ssts_[i]->MultiGet(keys.subspan(begin, end - begin), seq);
+    }
+    /* The largest user key may also be the smallest one of the next
+     * SSTable, whose records are older. */
+    while (begin < end && (keys[begin]->user_key_ < largest ||
+                              keys[begin]->result_ != GetResult::kNotFound)) {
+      begin++;
     }
   }
+}
 
-  if (i == -1) {
-  
+SortedRunIterator SortedRun::Seek(Slice key, uint64_t seq, bool fill_cache) {
+  /* The first record >= (key, seq) is in the first SSTable whose largest
+   * user key >= key, or in the next one if all the records of key in it are
+   * newer than seq. */
+  size_t i = std::min(FindSST(key), ssts_.size() - 1);
+  SSTableIterator sst_iterator = ssts_[i]->Begin(fill_cache);
+  sst_iterator.Seek(key, seq);
+  /* All the records of the key in this SSTable are newer than seq. */
+  if (!sst_iterator.Valid() && i + 1 < ssts_.size()) {
     i++;
-
+    sst_iterator = ssts_[i]->Begin(fill_cache);
   }
 
-  SSTableIterator sst_iterator = ssts_[i]->Begin();
-  sst_iterator.Seek(key, seq);
-
-  return SortedRunIterator(this, std::move(sst_iterator), ssts_[i]->GetSSTInfo().sst_id_);
+  return SortedRunIterator(this, std::move(sst_iterator), i, fill_cache);
 
 }
 
-SortedRunIterator SortedRun::Begin() { 
+SortedRunIterator SortedRun::Begin(bool fill_cache) { 
 
-  return SortedRunIterator(this, ssts_[0]->Begin(), ssts_[0]->GetSSTInfo().sst_id_);
+  return SortedRunIterator(this, ssts_[0]->Begin(fill_cache), 0, fill_cache);
 
 }
 
+bool SortedRun::MayContain(Slice key, std::optional<Slice> upper_bound,
+    const PrefixExtractor* prefix_extractor) const {
+  Slice prefix;
+  if (prefix_extractor != nullptr) {
+    prefix = prefix_extractor->Transform(key);
+  }
+  for (size_t i = FindSST(key); i < ssts_.size(); i++) {
+    Slice smallest = ssts_[i]->GetSmallestKey().user_key_;
+    if (upper_bound && smallest >= *upper_bound) {
+      return false;
+    }
+    if (prefix_extractor == nullptr) {
+      return true;
+    }
+    /* The keys with the prefix are contiguous, and the largest key of the
+     * SSTable is >= key. So if the SSTable has no key with the prefix, neither
+     * do the following SSTables. */
+    if (smallest > key && !smallest.starts_with(prefix)) {
+      return false;
+    }
+    if (ssts_[i]->MayContainPrefix(prefix, *prefix_extractor)) {
+      return true;
+    }
+    /* Unless the largest key is the end key of a range tombstone, which is
+     * not a record, and is the first key of the next SSTable. */
+    if (ssts_[i]->GetLargestKey().type_ != RecordType::RangeDeletion) {
+      return false;
+    }
+  }
+  return false;
+}
+
 SortedRun::~SortedRun() {
   if (remove_tag_) {
     for (auto sst : ssts_) {
@@ -102,13 +171,13 @@ SortedRun::~SortedRun() {
 void SortedRunIterator::SeekToFirst() {
 
   sst_id_ = 0;
-  sst_it_ = run_->ssts_[sst_id_]->Begin();
+  sst_it_ = run_->ssts_[sst_id_]->Begin(fill_cache_);
 
 }
 
 void SortedRunIterator::Seek(Slice key, seq_t seq) {
 
-  *this = run_->Seek(key, seq);
+  *this = run_->Seek(key, seq, fill_cache_);
 
 }
 
@@ -136,6 +205,14 @@ void SortedRunIterator::Next() {
 
   if (sst_it_.Valid()){
 
+    /* Keep the next SSTable in flight once the readahead reaches the end of
+     * the current one. */
+    if (!next_prefetch_started_ && sst_it_.ReadaheadReachedEnd() &&
+        sst_id_ + 1 < run_->ssts_.size()) {
+      run_->ssts_[sst_id_ + 1]->Prefetch(
+          0, sst_it_.readahead_blocks(), &next_prefetched_);
+      next_prefetch_started_ = true;
+    }
     return;
 
   }
@@ -144,7 +221,14 @@ void SortedRunIterator::Next() {
 
   if (sst_id_ < run_->ssts_.size()){
 
-    sst_it_ = run_->ssts_[sst_id_]->Begin();
+    if (next_prefetch_started_) {
+      sst_it_ = SSTableIterator(run_->ssts_[sst_id_].get(), fill_cache_,
+          std::move(next_prefetched_), sst_it_.readahead_blocks());
+      next_prefetched_.clear();
+      next_prefetch_started_ = false;
+    } else {
+      sst_it_ = run_->ssts_[sst_id_]->Begin(fill_cache_);
+    }
   
   }
   
@@ -160,6 +244,21 @@ GetResult Level::Get(Slice key, uint64_t seq, std::string* value) {
   return GetResult::kNotFound;
 }
 
+void Level::MultiGet(std::span<LookupKey*> keys, uint64_t seq) {
+  std::vector<LookupKey*> pending;
+  for (auto key : keys) {
+    if (key->result_ == GetResult::kNotFound) {
+      pending.push_back(key);
+    }
+  }
+  for (int i = runs_.size() - 1; i >= 0 && !pending.empty(); --i) {
+    runs_[i]->MultiGet(pending, seq);
+    /* The keys found in newer sorted runs are not looked up again. */
+    std::erase_if(pending,
+        [](auto key) { return key->result_ != GetResult::kNotFound; });
+  }
+}
+
 void Level::Append(std::vector<std::shared_ptr<SortedRun>> runs) {
   for (auto& run : runs) {
     size_ += run->size();
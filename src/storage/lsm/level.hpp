@@ -10,15 +10,23 @@ class SortedRunIterator;
 
 class SortedRun {
  public:
-  SortedRun(
-      const std::vector<SSTInfo>& ssts, size_t block_size, bool use_direct_io)
+  /**
+   * The SSTables read data blocks through cache if it is not nullptr, or
+   * from the mapped files if use_mmap is true. Iterators read ahead at most
+   * max_readahead_blocks data blocks.
+   */
+  SortedRun(const std::vector<SSTInfo>& ssts, size_t block_size,
+      bool use_direct_io, Cache* cache = nullptr, bool use_mmap = false,
+      size_t max_readahead_blocks = 0)
     : block_size_(block_size), use_direct_io_(use_direct_io) {
     size_ = 0;
     for (auto& sst : ssts) {
-      ssts_.push_back(
-          std::make_shared<SSTable>(sst, block_size_, use_direct_io_));
+      ssts_.push_back(std::make_shared<SSTable>(sst, block_size_,
+          use_direct_io_, cache, use_mmap, max_readahead_blocks));
       size_ += sst.size_;
     }
+    BuildFences();
+    CollectRangeTombstones();
   }
 
   SortedRun(const std::vector<std::shared_ptr<SSTable>>& ssts,
@@ -29,6 +37,8 @@ class SortedRun {
     for (auto& sst : ssts_) {
       size_ += sst->GetSSTInfo().size_;
     }
+    BuildFences();
+    CollectRangeTombstones();
   }
 
   ~SortedRun();
@@ -40,20 +50,56 @@ class SortedRun {
    * If the record has type RecordType::Deletion, then it does nothing to the
    * value, and returns GetResult::kDelete If there is no such record, it
    * returns GetResult::kNotFound.
+   * If the record has type RecordType::BlobIndex, then it copies the encoded
+   * BlobIndex, and returns GetResult::kBlobIndex.
    * */
   GetResult Get(Slice key, uint64_t seq, std::string* value);
 
-  /* Return an iterator positioned at the first record >= (key, seq). */
-  SortedRunIterator Seek(Slice key, uint64_t seq);
+  /**
+   * Look up a batch of keys sorted by user key, whose results are all
+   * kNotFound. The results of the keys found are set.
+   */
+  void MultiGet(std::span<LookupKey*> keys, uint64_t seq);
+
+  /**
+   * Return an iterator positioned at the first record >= (key, seq). If
+   * fill_cache is false, the iterator does not insert data blocks into the
+   * block cache.
+   */
+  SortedRunIterator Seek(Slice key, uint64_t seq, bool fill_cache = true);
 
   /* Return an iterator positioned at the beginning of the SSTable */
-  SortedRunIterator Begin();
+  SortedRunIterator Begin(bool fill_cache = true);
+
+  /**
+   * Whether the sorted run may have user keys >= key which are smaller than
+   * upper_bound (if it is set), and have the same prefix as key (if
+   * prefix_extractor is not nullptr). Only the SSTable where Seek(key)
+   * starts is checked: its key range, and its prefix bloom filter. If its
+   * largest key is the end key of a range tombstone, the next SSTable is
+   * checked as well.
+   */
+  bool MayContain(Slice key, std::optional<Slice> upper_bound,
+      const PrefixExtractor* prefix_extractor) const;
 
   /* Get the number of SSTables. */
   size_t SSTCount() const { return ssts_.size(); }
 
   const std::vector<std::shared_ptr<SSTable>>& GetSSTs() const { return ssts_; }
 
+  /* The range tombstones of all the SSTables, sorted by begin key. */
+  const std::vector<RangeTombstone>& GetRangeTombstones() const {
+    return range_tombstones_;
+  }
+
+  /**
+   * The fragments of the range tombstones, which are built once in
+   * construction since the sorted run is immutable.
+   */
+  const RangeTombstoneFragments& GetRangeTombstoneFragments() const {
+    return range_fragments_;
+  }
+
   void SetCompactionInProcess(bool compaction_in_process) {
     compaction_in_process_ = compaction_in_process;
   }
@@ -76,8 +122,41 @@ class SortedRun {
   bool GetRemoveTag() const { return remove_tag_; }
 
  private:
+  /**
+   * A fence pointer of an SSTable. The fences are stored contiguously in the
+   * order of SSTables, so the candidate SSTable of a key is found without
+   * touching the SSTable objects. If the prefixes are equal, the full largest
+   * key is compared, which is stored in fence_keys_.
+   */
+  struct Fence {
+    /* The first 8 bytes of the largest user key, in big-endian order so that
+     * comparing the integers is the same as comparing the bytes. */
+    uint64_t prefix;
+    uint32_t sst_id;
+  };
+
+  void BuildFences();
+
+  void CollectRangeTombstones();
+
+  /**
+   * The first SSTable in [begin, SSTCount()) whose largest user key is >=
+   * key, or SSTCount() if there is no such SSTable.
+   */
+  size_t FindSST(Slice key, size_t begin = 0) const;
+
   /* The SSTables. */
   std::vector<std::shared_ptr<SSTable>> ssts_;
+  /* The fence pointers of ssts_. */
+  std::vector<Fence> fences_;
+  /**
+   * The largest user keys of ssts_, concatenated. The i-th key is
+   * [fence_key_offsets_[i], fence_key_offsets_[i + 1]).
+   */
+  std::string fence_keys_;
+  std::vector<uint32_t> fence_key_offsets_;
+  std::vector<RangeTombstone> range_tombstones_;
+  RangeTombstoneFragments range_fragments_;
   /* The total size of the sorted run. */
   size_t size_;
   /* The size of a data block. */
@@ -96,8 +175,12 @@ class SortedRunIterator final : public Iterator {
  public:
   SortedRunIterator() = default;
 
-  SortedRunIterator(SortedRun* run, SSTableIterator sst_it, int sst_id)
-    : run_(run), sst_it_(std::move(sst_it)), sst_id_(sst_id) {}
+  SortedRunIterator(
+      SortedRun* run, SSTableIterator sst_it, int sst_id, bool fill_cache)
+    : run_(run),
+      sst_it_(std::move(sst_it)),
+      sst_id_(sst_id),
+      fill_cache_(fill_cache) {}
 
   void SeekToFirst();
 
@@ -118,6 +201,12 @@ class SortedRunIterator final : public Iterator {
   SSTableIterator sst_it_;
   /* The index of the current SSTable */
   size_t sst_id_{0};
+  /* Whether the data blocks are inserted into the block cache. */
+  bool fill_cache_{true};
+  /* The first data blocks of the next SSTable being read ahead. */
+  PrefetchBuffer next_prefetched_;
+  /* Whether the readahead of the next SSTable has started. */
+  bool next_prefetch_started_{false};
 };
 
 class Level {
@@ -138,6 +227,12 @@ class Level {
 
   GetResult Get(Slice key, uint64_t seq, std::string* value);
 
+  /**
+   * Look up a batch of keys sorted by user key. The keys whose results are
+   * not kNotFound are skipped, since they are found in upper levels.
+   */
+  void MultiGet(std::span<LookupKey*> keys, uint64_t seq);
+
   /* Get the level id */
   int GetID() const { return level_id_; }
 
@@ -1,7 +1,12 @@
 #include "storage/lsm/lsm.hpp"
 
+#include <algorithm>
+#include <cmath>
 #include <fstream>
+#include <future>
+#include <sstream>
 
+#include "common/serializer.hpp"
 #include "common/stopwatch.hpp"
 #include "storage/lsm/compaction_job.hpp"
 #include "storage/lsm/stats.hpp"
@@ -10,17 +15,53 @@ namespace wing {
 
 namespace lsm {
 
+static std::atomic<uint64_t> next_db_id{1};
+
+/* The value of a LocalSV while its thread is reading. */
+static char sv_in_use_tag;
+static void* const kSVInUse = &sv_in_use_tag;
+
+/* The bit of the number of levels in the metadata which means that the
+ * blob files follow the levels. */
+static constexpr uint64_t kMetadataHasBlobs = uint64_t(1) << 63;
+/* The bit of the number of levels in the metadata which means that the
+ * number of the metadata log follows it. */
+static constexpr uint64_t kMetadataHasLog = uint64_t(1) << 62;
+/* The metadata log is folded into the metadata once it is larger than both
+ * this and the metadata. */
+static constexpr size_t kMinMetadataLogSize = 64 << 10;
+
 DBImpl::DBImpl(const Options& options)
-  : options_(options), cache_(options_.cache) {
+  : options_(options), cache_(options_.cache), id_(next_db_id.fetch_add(1)) {
+  if (options_.memtable_rep_name == "skiplist") {
+    memtable_rep_ = MemTableRep::kSkipList;
+  } else if (options_.memtable_rep_name == "map") {
+    memtable_rep_ = MemTableRep::kMap;
+  } else {
+    DB_ERR("Unknown MemTable representation: {}", options_.memtable_rep_name);
+  }
+  if (options_.wal_sync_mode == "sync") {
+    wal_sync_mode_ = WALSyncMode::kSync;
+  } else if (options_.wal_sync_mode == "interval") {
+    wal_sync_mode_ = WALSyncMode::kInterval;
+  } else if (options_.wal_sync_mode == "none") {
+    wal_sync_mode_ = WALSyncMode::kNone;
+  } else {
+    DB_ERR("Unknown WAL sync mode: {}", options_.wal_sync_mode);
+  }
   if (options_.create_new) {
     seq_ = 0;
-    sv_ = std::make_shared<SuperVersion>(std::make_shared<MemTable>(),
-        std::make_shared<std::vector<std::shared_ptr<MemTable>>>(),
-        std::make_shared<Version>());
+    visible_seq_ = 0;
     filename_gen_ =
         std::make_unique<FileNameGenerator>(options_.db_path.string() + "/", 0);
+    sv_ = std::make_shared<SuperVersion>(NewMemTableAndWAL(),
+        std::make_shared<std::vector<std::shared_ptr<MemTable>>>(),
+        std::make_shared<Version>());
+    /* The metadata must exist before any WAL can be recovered. */
+    SaveMetadata();
   } else {
     LoadMetadata();
+    RecoverWAL();
   }
   if (options_.compaction_strategy_name == "leveled") {
     compaction_picker_ = std::make_unique<LeveledCompactionPicker>(
@@ -44,35 +85,182 @@ DBImpl::DBImpl(const Options& options)
         options_.level0_compaction_trigger);
   }
 
+  /* The flush thread and each compaction thread run one of their tasks
+   * themselves, and the others in the workers. */
+  size_t compaction_threads = std::max<size_t>(options_.compaction_threads, 1);
+  size_t workers =
+      std::max<size_t>(options_.flush_threads, 1) - 1 +
+      compaction_threads *
+          (std::max<size_t>(options_.max_subcompactions, 1) - 1);
+  if (workers > 0) {
+    workers_ = std::make_unique<ThreadPool>(workers);
+  }
   threads_.emplace_back([&]() { FlushThread(); });
-  threads_.emplace_back([&]() { CompactionThread(); });
+  for (size_t i = 0; i < compaction_threads; i++) {
+    threads_.emplace_back([&]() { CompactionThread(); });
+  }
 }
 
 DBImpl::~DBImpl() {
   FlushAll();
-  stop_signal_ = true;
+  {
+    std::unique_lock lck(db_mutex_);
+    stop_signal_ = true;
+  }
   flush_cv_.notify_all();
   compact_cv_.notify_all();
+  sv_cv_.notify_all();
   for (auto& thread : threads_) {
     thread.join();
   }
+  /* The slots may outlive the DBImpl. */
+  ScrapeLocalSVs(true);
   Save();
+  /* All the records are flushed, so the logs of the empty MemTable are not
+   * needed anymore. */
+  auto mt = sv_->GetMt();
+  wal_.reset();
+  if (mt->size() == 0) {
+    RemoveLogFiles(mt.get());
+  }
+}
+
+std::shared_ptr<MemTable> DBImpl::NewMemTableAndWAL() {
+  auto mt = NewMemTable();
+  if (options_.enable_wal) {
+    wal_ = std::make_unique<WALWriter>(filename_gen_->GenerateWAL().first,
+        wal_sync_mode_, options_.wal_sync_interval_ms);
+    mt->AddLogFile(wal_->GetFilename());
+  }
+  return mt;
+}
+
+void DBImpl::RemoveLogFiles(MemTable* mt) {
+  for (auto& filename : mt->GetLogFiles()) {
+    std::filesystem::remove(filename);
+  }
+}
+
+void DBImpl::RecoverWAL() {
+  std::vector<std::pair<size_t, std::string>> logs;
+  for (auto& entry : std::filesystem::directory_iterator(options_.db_path)) {
+    auto& path = entry.path();
+    if (entry.is_regular_file() && path.extension() == ".wal") {
+      logs.emplace_back(std::stoull(path.stem().string()), path.string());
+    }
+  }
+  std::sort(logs.begin(), logs.end());
+  /* Replay the logs of all the MemTables which were not flushed into a fresh
+   * MemTable. The logs are removed after the MemTable is flushed. */
+  auto mt = sv_->GetMt();
+  seq_t max_seq = seq_;
+  size_t count = 0;
+  for (auto& [id, filename] : logs) {
+    WALReader reader(filename);
+    seq_t seq;
+    Slice contents;
+    while (reader.ReadRecord(&seq, &contents)) {
+      WriteBatch batch(contents);
+      mt->Apply(batch, seq);
+      max_seq = std::max<seq_t>(max_seq, seq + batch.Count() - 1);
+      count += batch.Count();
+    }
+    mt->AddLogFile(filename);
+  }
+  if (!logs.empty()) {
+    /* Don't reuse the IDs of the recovered logs. */
+    filename_gen_ = std::make_unique<FileNameGenerator>(
+        options_.db_path.string() + "/",
+        std::max(filename_gen_->GetID(), logs.back().first + 1));
+    DB_INFO("Recovered {} records from {} WAL files", count, logs.size());
+  }
+  seq_ = max_seq;
+  visible_seq_ = max_seq;
+  if (options_.enable_wal) {
+    wal_ = std::make_unique<WALWriter>(filename_gen_->GenerateWAL().first,
+        wal_sync_mode_, options_.wal_sync_interval_ms);
+    mt->AddLogFile(wal_->GetFilename());
+  }
 }
 
-void DBImpl::StopWrite() {
-  db_mutex_.unlock();
-  std::this_thread::sleep_for(std::chrono::milliseconds(100));
-  db_mutex_.lock();
+/* The pressure of a signal: 0 below slowdown, and 1 at stop or above. */
+static double WritePressure(size_t value, size_t slowdown, size_t stop) {
+  slowdown = std::min(slowdown, stop);
+  if (value < slowdown) {
+    return 0;
+  }
+  return std::min(1.0, (value - slowdown + 1) / (double)(stop - slowdown + 1));
+}
+
+size_t DBImpl::EstimatePendingCompactionBytes(const Version& version) const {
+  size_t ret = 0;
+  size_t limit = options_.level0_compaction_trigger * options_.sst_file_size;
+  for (auto& level : version.GetLevels()) {
+    if (level.GetID() == 0) {
+      if (level.GetRuns().size() >= options_.level0_compaction_trigger) {
+        ret += level.size();
+      }
+    } else if (level.size() > limit) {
+      ret += level.size() - limit;
+    }
+    limit *= options_.compaction_size_ratio;
+  }
+  return ret;
+}
+
+void DBImpl::UpdateWriteStall(const SuperVersion& sv) {
+  auto& levels = sv.GetVersion()->GetLevels();
+  size_t l0_runs = levels.empty() ? 0 : levels[0].GetRuns().size();
+  size_t max_imms = std::max<size_t>(options_.max_immutable_count, 1);
+  double pressure = std::max(
+      {WritePressure(l0_runs, options_.level0_slowdown_writes_trigger,
+           options_.level0_stop_writes_trigger),
+          WritePressure(sv.GetImms()->size(),
+              std::max<size_t>(max_imms - 1, 1), max_imms),
+          WritePressure(EstimatePendingCompactionBytes(*sv.GetVersion()),
+              options_.soft_pending_compaction_bytes_limit,
+              options_.hard_pending_compaction_bytes_limit)});
+  uint64_t rate = 0;
+  if (pressure > 0) {
+    /* The rate decreases linearly to 1/16 of delayed_write_rate. */
+    rate = std::max<uint64_t>(options_.delayed_write_rate * (1 - pressure),
+        std::max<uint64_t>(options_.delayed_write_rate / 16, 1));
+  }
+  write_controller_.SetDelayedWriteRate(rate);
+}
+
+void DBImpl::DelayWrite(size_t bytes) {
+  auto delay = write_controller_.GetDelay(bytes);
+  if (delay == 0) {
+    return;
+  }
+  std::this_thread::sleep_for(std::chrono::microseconds(delay));
+  GetStatsContext()->total_delay_micros.fetch_add(
+      delay, std::memory_order_relaxed);
+  GetStatsContext()->num_delayed_writes.fetch_add(
+      1, std::memory_order_relaxed);
 }
 
 void DBImpl::SwitchMemtable(bool force) {
   std::unique_lock db_lck(db_mutex_);
   auto old_sv = GetSV();
-  while (old_sv->GetImms()->size() >= options_.max_immutable_count) {
-    old_sv.reset();
-    StopWrite();
-    old_sv = GetSV();
+  if (old_sv->GetImms()->size() >= options_.max_immutable_count) {
+    /* Stop until a flush installs a new SuperVersion. */
+    auto start = std::chrono::steady_clock::now();
+    while (!stop_signal_ &&
+           old_sv->GetImms()->size() >= options_.max_immutable_count) {
+      old_sv.reset();
+      sv_cv_.wait(db_lck);
+      old_sv = GetSV();
+    }
+    GetStatsContext()->total_stall_micros.fetch_add(
+        std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start)
+            .count(),
+        std::memory_order_relaxed);
   }
+  /* Wait for the in-flight writes to the current MemTable. */
+  std::unique_lock switch_lck(switch_mutex_);
   if ((force && old_sv->GetMt()->size() > 0) ||
       old_sv->GetMt()->size() > options_.sst_file_size) {
     auto mt = old_sv->GetMt();
@@ -81,7 +269,7 @@ void DBImpl::SwitchMemtable(bool force) {
     new_imm->push_back(mt);
     new_imm->insert(
         new_imm->end(), old_sv->GetImms()->begin(), old_sv->GetImms()->end());
-    auto new_mt = std::make_shared<MemTable>();
+    auto new_mt = NewMemTableAndWAL();
     auto new_sv = std::make_shared<SuperVersion>(new_mt, new_imm, version);
     InstallSV(new_sv);
     DB_INFO("{}", new_sv->ToString());
@@ -89,22 +277,53 @@ void DBImpl::SwitchMemtable(bool force) {
   }
 }
 
-void DBImpl::Put(Slice key, Slice value) {
-  std::unique_lock lck(write_mutex_);
-  auto seq = ++seq_;
-  auto sv = GetSV();
-  sv->GetMt()->Put(key, seq, value);
-  if (sv->GetMt()->size() > options_.sst_file_size) {
-    SwitchMemtable();
+void DBImpl::PublishSeq(seq_t first_seq, seq_t last_seq) {
+  while (visible_seq_.load(std::memory_order_acquire) != first_seq - 1) {
+    std::this_thread::yield();
   }
+  visible_seq_.store(last_seq, std::memory_order_release);
+}
+
+void DBImpl::Put(Slice key, Slice value) {
+  WriteBatch batch;
+  batch.Put(key, value);
+  Write(batch);
 }
 
 void DBImpl::Del(Slice key) {
-  std::unique_lock lck(write_mutex_);
-  auto seq = ++seq_;
-  auto sv = GetSV();
-  sv->GetMt()->Del(key, seq);
-  if (sv->GetMt()->size() > options_.sst_file_size) {
+  WriteBatch batch;
+  batch.Del(key);
+  Write(batch);
+}
+
+void DBImpl::DeleteRange(Slice begin, Slice end) {
+  if (begin >= end) {
+    return;
+  }
+  WriteBatch batch;
+  batch.DeleteRange(begin, end);
+  Write(batch);
+}
+
+void DBImpl::Write(const WriteBatch& batch) {
+  auto count = batch.Count();
+  if (count == 0) {
+    return;
+  }
+  DelayWrite(batch.ByteSize());
+  bool need_switch;
+  {
+    std::shared_lock lck(switch_mutex_);
+    auto first_seq = seq_.fetch_add(count, std::memory_order_relaxed) + 1;
+    if (wal_) {
+      wal_->AddRecord(first_seq, batch);
+    }
+    auto mt = GetSV()->GetMt();
+    mt->Apply(batch, first_seq);
+    PublishSeq(first_seq, first_seq + count - 1);
+    need_switch = mt->size() > options_.sst_file_size;
+  }
+  if (need_switch) {
     SwitchMemtable();
   }
 }
@@ -112,8 +331,9 @@ void DBImpl::Del(Slice key) {
 void DBImpl::DropAll() {
   WaitForFlushAndCompaction();
   std::unique_lock db_lck(db_mutex_);
+  std::unique_lock switch_lck(switch_mutex_);
   auto sv = GetSV();
-  auto new_sv = std::make_shared<SuperVersion>(std::make_shared<MemTable>(),
+  auto new_sv = std::make_shared<SuperVersion>(NewMemTableAndWAL(),
       std::make_shared<std::vector<std::shared_ptr<MemTable>>>(),
       std::make_shared<Version>());
   auto version = sv->GetVersion();
@@ -122,111 +342,453 @@ void DBImpl::DropAll() {
       sr->SetRemoveTag(true);
     }
   }
+  for (auto& [id, blob_file] : version->GetBlobFiles()) {
+    blob_file->SetRemoveTag(true);
+  }
   InstallSV(new_sv);
+  SaveMetadata();
+  RemoveLogFiles(sv->GetMt().get());
+  for (auto& imm : *sv->GetImms()) {
+    RemoveLogFiles(imm.get());
+  }
 }
 
 bool DBImpl::Get(Slice key, std::string* value) {
-  auto sv = GetSV();
-  auto seq = seq_;
-  return sv->Get(key, seq, value);
+  /* Read the sequence number first, so that the SuperVersion contains all the
+   * records visible at seq. */
+  auto seq = CurrentSeq();
+  auto local = GetLocalSV();
+  auto cached = AcquireLocalSV(local);
+  bool ret = cached->sv->Get(key, seq, value);
+  ReturnLocalSV(local, cached);
+  return ret;
+}
+
+std::vector<std::optional<std::string>> DBImpl::MultiGet(
+    std::span<const Slice> keys) {
+  std::vector<std::string> values(keys.size());
+  std::vector<LookupKey> lookups(keys.size());
+  std::vector<LookupKey*> sorted(keys.size());
+  for (size_t i = 0; i < keys.size(); i++) {
+    lookups[i].user_key_ = keys[i];
+    lookups[i].value_ = &values[i];
+    sorted[i] = &lookups[i];
+  }
+  std::sort(sorted.begin(), sorted.end(),
+      [](auto a, auto b) { return a->user_key_ < b->user_key_; });
+  auto seq = CurrentSeq();
+  auto local = GetLocalSV();
+  auto cached = AcquireLocalSV(local);
+  cached->sv->MultiGet(sorted, seq);
+  ReturnLocalSV(local, cached);
+  std::vector<std::optional<std::string>> ret(keys.size());
+  for (size_t i = 0; i < keys.size(); i++) {
+    if (lookups[i].result_ == GetResult::kFound) {
+      ret[i] = std::move(values[i]);
+    }
+  }
+  return ret;
+}
+
+DBImpl::LocalSV::~LocalSV() {
+  auto p = ptr.exchange(nullptr);
+  if (p != nullptr && p != kSVInUse) {
+    delete static_cast<CachedSV*>(p);
+  }
+}
+
+DBImpl::LocalSV* DBImpl::GetLocalSV() {
+  /* The slots of the DBImpls used by this thread. They are released when the
+   * thread exits. */
+  thread_local std::unordered_map<uint64_t, std::shared_ptr<LocalSV>> slots;
+  thread_local uint64_t last_id = 0;
+  thread_local LocalSV* last_slot = nullptr;
+  if (last_id == id_) {
+    return last_slot;
+  }
+  auto& slot = slots[id_];
+  if (!slot) {
+    /* Drop the slots of the destroyed DBImpls. */
+    std::erase_if(slots, [](auto& kv) {
+      return kv.second && kv.second->obsolete.load();
+    });
+    slot = std::make_shared<LocalSV>();
+    std::unique_lock lck(local_sv_mutex_);
+    std::erase_if(local_svs_, [](auto& weak) { return weak.expired(); });
+    local_svs_.push_back(slot);
+  }
+  last_id = id_;
+  last_slot = slot.get();
+  return last_slot;
+}
+
+DBImpl::CachedSV* DBImpl::AcquireLocalSV(LocalSV* local) {
+  auto cached = static_cast<CachedSV*>(
+      local->ptr.exchange(kSVInUse, std::memory_order_acquire));
+  auto version = sv_version_.load(std::memory_order_acquire);
+  if (cached != nullptr && cached->version == version) {
+    return cached;
+  }
+  /* A new SuperVersion has been installed, or the slot has been scraped. */
+  delete cached;
+  return new CachedSV{GetSV(), version};
+}
+
+void DBImpl::ReturnLocalSV(LocalSV* local, CachedSV* cached) {
+  void* expected = kSVInUse;
+  if (!local->ptr.compare_exchange_strong(
+          expected, cached, std::memory_order_release)) {
+    /* The slot has been scraped while the thread was reading. */
+    delete cached;
+  }
+}
+
+void DBImpl::ScrapeLocalSVs(bool obsolete) {
+  std::unique_lock lck(local_sv_mutex_);
+  for (auto& weak : local_svs_) {
+    auto local = weak.lock();
+    if (!local) {
+      continue;
+    }
+    if (obsolete) {
+      local->obsolete.store(true);
+    }
+    /* If the slot is in use, its thread deletes the CachedSV after reading.
+     */
+    auto p = local->ptr.exchange(nullptr);
+    if (p != nullptr && p != kSVInUse) {
+      delete static_cast<CachedSV*>(p);
+    }
+  }
+}
+
+/* The name of the metadata log with number log_number. */
+static std::string MetadataLogName(
+    const std::filesystem::path& db_path, uint64_t log_number) {
+  return fmt::format("{}/metadata.log.{}", db_path.string(), log_number);
+}
+
+template <typename T>
+static void PutValue(std::string* out, T x) {
+  out->append(reinterpret_cast<const char*>(&x), sizeof(T));
+}
+
+static void PutSSTInfo(std::string* out, const SSTInfo& info) {
+  PutValue<uint64_t>(out, info.count_);
+  PutValue<uint64_t>(out, info.size_);
+  PutValue<uint64_t>(out, info.sst_id_);
+  PutValue<uint64_t>(out, info.index_offset_);
+  PutValue<uint64_t>(out, info.bloom_filter_offset_);
+  PutValue<uint64_t>(out, info.filename_.size());
+  out->append(info.filename_);
+}
+
+static SSTInfo GetSSTInfo(utils::Deserializer& d) {
+  SSTInfo info;
+  info.count_ = d.Read<uint64_t>();
+  info.size_ = d.Read<uint64_t>();
+  info.sst_id_ = d.Read<uint64_t>();
+  info.index_offset_ = d.Read<uint64_t>();
+  info.bloom_filter_offset_ = d.Read<uint64_t>();
+  info.filename_ = d.ReadString(d.Read<uint64_t>());
+  return info;
+}
+
+static void PutBlobFiles(std::string* out, const BlobFileSet& blob_files) {
+  PutValue<uint64_t>(out, blob_files.size());
+  for (auto& [id, blob_file] : blob_files) {
+    auto& info = blob_file->GetInfo();
+    auto garbage = blob_file->GetGarbage();
+    PutValue<uint64_t>(out, info.file_id_);
+    PutValue<uint64_t>(out, info.count_);
+    PutValue<uint64_t>(out, info.size_);
+    PutValue<uint64_t>(out, garbage.count_);
+    PutValue<uint64_t>(out, garbage.size_);
+    PutValue<uint64_t>(out, info.filename_.size());
+    out->append(info.filename_);
+  }
+}
+
+/* The blob files are opened after the metadata log is replayed, since the
+ * files in the earlier edits may be removed. */
+static std::vector<std::pair<BlobFileInfo, BlobGarbage>> GetBlobFiles(
+    utils::Deserializer& d) {
+  std::vector<std::pair<BlobFileInfo, BlobGarbage>> ret;
+  auto num_files = d.Read<uint64_t>();
+  for (uint64_t i = 0; i < num_files; i++) {
+    auto& [info, garbage] = ret.emplace_back();
+    info.file_id_ = d.Read<uint64_t>();
+    info.count_ = d.Read<uint64_t>();
+    info.size_ = d.Read<uint64_t>();
+    garbage.count_ = d.Read<uint64_t>();
+    garbage.size_ = d.Read<uint64_t>();
+    info.filename_ = d.ReadString(d.Read<uint64_t>());
+  }
+  return ret;
 }
 
 void DBImpl::SaveMetadata() {
+  std::unique_lock lck(metadata_mutex_);
+  auto version = GetSV()->GetVersion();
+  seq_t seq = seq_.load();
+  if (version == saved_version_ && seq == saved_seq_) {
+    return;
+  }
+  /* The log is folded into a new snapshot once it is larger than the
+   * snapshot, so it costs at most as much as rewriting the snapshot every
+   * time, and usually much less. */
+  if (metadata_log_ == nullptr ||
+      metadata_log_->GetWrittenSize() >
+          std::max(kMinMetadataLogSize, metadata_size_)) {
+    WriteMetadataSnapshot(*version);
+  } else {
+    metadata_log_->AddRecord(seq, EncodeMetadataEdit(*version));
+  }
+  saved_version_ = std::move(version);
+  saved_seq_ = seq;
+}
+
+void DBImpl::WriteMetadataSnapshot(const Version& version) {
   auto metadata_file = options_.db_path.string() + "/metadata";
-  FileWriter writer(
-      std::make_unique<SeqWriteFile>(metadata_file, options_.use_direct_io),
-      1 << 20);
-  auto sv = GetSV();
-  auto version = sv->GetVersion();
-  writer.AppendValue<uint64_t>(seq_)
-      .AppendValue<uint64_t>(filename_gen_->GetID())
-      .AppendValue<uint64_t>(version->GetLevels().size());
-  for (auto& level : version->GetLevels()) {
-    writer.AppendValue<uint64_t>(level.GetID())
-        .AppendValue<uint64_t>(level.GetRuns().size());
+  auto tmp_file = metadata_file + ".tmp";
+  uint64_t log_number = metadata_log_number_ + 1;
+  /* The blob files follow the levels if kMetadataHasBlobs is set, so that
+   * the metadata without blob files is unchanged. */
+  auto& blob_files = version.GetBlobFiles();
+  uint64_t num_levels = version.GetLevels().size() | kMetadataHasLog;
+  if (!blob_files.empty()) {
+    num_levels |= kMetadataHasBlobs;
+  }
+  std::string data;
+  PutValue<uint64_t>(&data, seq_.load());
+  PutValue<uint64_t>(&data, filename_gen_->GetID());
+  PutValue<uint64_t>(&data, num_levels);
+  PutValue<uint64_t>(&data, log_number);
+  logged_ssts_.clear();
+  for (auto& level : version.GetLevels()) {
+    PutValue<uint64_t>(&data, level.GetID());
+    PutValue<uint64_t>(&data, level.GetRuns().size());
     for (auto& run : level.GetRuns()) {
-      writer.AppendValue<uint64_t>(run->GetSSTs().size());
+      PutValue<uint64_t>(&data, run->GetSSTs().size());
+      for (auto& sst : run->GetSSTs()) {
+        PutSSTInfo(&data, sst->GetSSTInfo());
+        logged_ssts_.insert(sst->GetSSTInfo().sst_id_);
+      }
+    }
+  }
+  if (!blob_files.empty()) {
+    PutBlobFiles(&data, blob_files);
+  }
+  {
+    FileWriter writer(
+        std::make_unique<SeqWriteFile>(tmp_file, options_.use_direct_io),
+        1 << 20);
+    writer.AppendString(data);
+    writer.Flush();
+  }
+  /* Metadata must reach the disk before the WALs it covers are removed. */
+  bool sync = options_.enable_wal && wal_sync_mode_ != WALSyncMode::kNone;
+  if (sync) {
+    SyncFileByName(tmp_file);
+  }
+  /* The new log exists before the snapshot which refers to it. A log left
+   * by a crash before the rename is never referred to, so it is removed. */
+  auto log_file = MetadataLogName(options_.db_path, log_number);
+  std::filesystem::remove(log_file);
+  auto log = std::make_unique<WALWriter>(log_file,
+      sync ? WALSyncMode::kSync : WALSyncMode::kNone, 0,
+      &GetStatsContext()->total_write_bytes);
+  /* Replace the old metadata atomically. */
+  std::filesystem::rename(tmp_file, metadata_file);
+  metadata_log_.reset();
+  if (metadata_log_number_ > 0) {
+    std::filesystem::remove(
+        MetadataLogName(options_.db_path, metadata_log_number_));
+  }
+  metadata_log_ = std::move(log);
+  metadata_log_number_ = log_number;
+  metadata_size_ = data.size();
+}
+
+std::string DBImpl::EncodeMetadataEdit(const Version& version) {
+  auto& blob_files = version.GetBlobFiles();
+  uint64_t num_levels = version.GetLevels().size();
+  if (!blob_files.empty()) {
+    num_levels |= kMetadataHasBlobs;
+  }
+  std::string ret;
+  PutValue<uint64_t>(&ret, filename_gen_->GetID());
+  PutValue<uint64_t>(&ret, num_levels);
+  /* The layout refers to the SSTables by ID, and only the SSTables which are
+   * not in the snapshot or the previous edits are written in full. */
+  std::vector<const SSTInfo*> new_ssts;
+  for (auto& level : version.GetLevels()) {
+    PutValue<uint64_t>(&ret, level.GetID());
+    PutValue<uint64_t>(&ret, level.GetRuns().size());
+    for (auto& run : level.GetRuns()) {
+      PutValue<uint64_t>(&ret, run->GetSSTs().size());
       for (auto& sst : run->GetSSTs()) {
         auto& info = sst->GetSSTInfo();
-        writer.AppendValue<uint64_t>(info.count_)
-            .AppendValue<uint64_t>(info.size_)
-            .AppendValue<uint64_t>(info.sst_id_)
-            .AppendValue<uint64_t>(info.index_offset_)
-            .AppendValue<uint64_t>(info.bloom_filter_offset_)
-            .AppendValue<uint64_t>(info.filename_.size())
-            .AppendString(info.filename_);
+        PutValue<uint64_t>(&ret, info.sst_id_);
+        if (logged_ssts_.insert(info.sst_id_).second) {
+          new_ssts.push_back(&info);
+        }
       }
     }
   }
-  writer.Flush();
+  PutValue<uint64_t>(&ret, new_ssts.size());
+  for (auto info : new_ssts) {
+    PutSSTInfo(&ret, *info);
+  }
+  if (!blob_files.empty()) {
+    PutBlobFiles(&ret, blob_files);
+  }
+  return ret;
 }
 
 void DBImpl::LoadMetadata() {
   auto metadata_filename = options_.db_path.string() + "/metadata";
-  auto file =
-      std::make_unique<ReadFile>(metadata_filename, options_.use_direct_io);
-  FileReader reader(file.get(), 1 << 20, 0);
-  seq_ = reader.ReadValue<uint64_t>();
-  auto latest_file_id = reader.ReadValue<uint64_t>();
-  auto num_levels = reader.ReadValue<uint64_t>();
-  std::vector<Level> levels;
+  std::ifstream in(metadata_filename, std::ios::binary);
+  if (!in) {
+    DB_ERR("Cannot open metadata {}", metadata_filename);
+  }
+  std::stringstream ss;
+  ss << in.rdbuf();
+  std::string data = std::move(ss).str();
+  utils::Deserializer d(data.data());
+  seq_ = d.Read<uint64_t>();
+  auto latest_file_id = d.Read<uint64_t>();
+  auto num_levels = d.Read<uint64_t>();
+  bool has_blobs = num_levels & kMetadataHasBlobs;
+  bool has_log = num_levels & kMetadataHasLog;
+  num_levels &= ~(kMetadataHasBlobs | kMetadataHasLog);
+  if (has_log) {
+    metadata_log_number_ = d.Read<uint64_t>();
+  }
+  /* The SSTables of each sorted run of each level, by ID. */
+  std::vector<std::pair<uint64_t, std::vector<std::vector<size_t>>>> layout;
+  std::unordered_map<size_t, SSTInfo> infos;
   for (uint64_t i = 0; i < num_levels; i++) {
-    auto id = reader.ReadValue<uint64_t>();
-    auto num_run = reader.ReadValue<uint64_t>();
-    std::vector<std::shared_ptr<SortedRun>> runs;
-    for (uint64_t j = 0; j < num_run; j++) {
-      auto num_sst = reader.ReadValue<uint64_t>();
+    auto& [id, runs] = layout.emplace_back();
+    id = d.Read<uint64_t>();
+    runs.resize(d.Read<uint64_t>());
+    for (auto& run : runs) {
+      run.resize(d.Read<uint64_t>());
+      for (auto& sst_id : run) {
+        auto info = GetSSTInfo(d);
+        sst_id = info.sst_id_;
+        infos.emplace(sst_id, std::move(info));
+      }
+    }
+  }
+  std::vector<std::pair<BlobFileInfo, BlobGarbage>> blob_infos;
+  if (has_blobs) {
+    blob_infos = GetBlobFiles(d);
+  }
+  /* Replay the edits in the metadata log. Each edit has the whole layout. */
+  auto log_file = MetadataLogName(options_.db_path, metadata_log_number_);
+  if (has_log && std::filesystem::exists(log_file)) {
+    WALReader reader(log_file);
+    seq_t seq;
+    Slice contents;
+    size_t count = 0;
+    while (reader.ReadRecord(&seq, &contents)) {
+      utils::Deserializer e(contents.data());
+      seq_ = seq;
+      latest_file_id = e.Read<uint64_t>();
+      num_levels = e.Read<uint64_t>();
+      has_blobs = num_levels & kMetadataHasBlobs;
+      num_levels &= ~kMetadataHasBlobs;
+      layout.clear();
+      for (uint64_t i = 0; i < num_levels; i++) {
+        auto& [id, runs] = layout.emplace_back();
+        id = e.Read<uint64_t>();
+        runs.resize(e.Read<uint64_t>());
+        for (auto& run : runs) {
+          run.resize(e.Read<uint64_t>());
+          for (auto& sst_id : run) {
+            sst_id = e.Read<uint64_t>();
+          }
+        }
+      }
+      auto num_new = e.Read<uint64_t>();
+      for (uint64_t i = 0; i < num_new; i++) {
+        auto info = GetSSTInfo(e);
+        auto sst_id = info.sst_id_;
+        infos.insert_or_assign(sst_id, std::move(info));
+      }
+      blob_infos.clear();
+      if (has_blobs) {
+        blob_infos = GetBlobFiles(e);
+      }
+      count++;
+    }
+    DB_INFO("Replayed {} metadata edits", count);
+  }
+  visible_seq_ = seq_.load();
+  std::vector<Level> levels;
+  for (auto& [id, runs] : layout) {
+    std::vector<std::shared_ptr<SortedRun>> sorted_runs;
+    for (auto& run : runs) {
       std::vector<SSTInfo> ssts;
-      for (uint64_t k = 0; k < num_sst; k++) {
-        SSTInfo info;
-        info.count_ = reader.ReadValue<uint64_t>();
-        info.size_ = reader.ReadValue<uint64_t>();
-        info.sst_id_ = reader.ReadValue<uint64_t>();
-        info.index_offset_ = reader.ReadValue<uint64_t>();
-        info.bloom_filter_offset_ = reader.ReadValue<uint64_t>();
-        auto len = reader.ReadValue<uint64_t>();
-        info.filename_ = reader.ReadString(len);
-        ssts.push_back(info);
+      for (auto sst_id : run) {
+        auto it = infos.find(sst_id);
+        if (it == infos.end()) {
+          DB_ERR("SSTable {} is not in the metadata", sst_id);
+        }
+        ssts.push_back(it->second);
       }
-      runs.push_back(std::make_shared<SortedRun>(
-          ssts, options_.block_size, options_.use_direct_io));
+      sorted_runs.push_back(std::make_shared<SortedRun>(
+          ssts, options_.block_size, options_.use_direct_io, &cache_,
+          options_.use_mmap_reads, options_.max_readahead_blocks));
     }
-    levels.emplace_back(id, std::move(runs));
+    levels.emplace_back(id, std::move(sorted_runs));
   }
   auto version = std::make_shared<Version>(std::move(levels));
-  sv_ = std::make_shared<SuperVersion>(std::make_shared<MemTable>(),
+  BlobFileSet blob_files;
+  for (auto& [info, garbage] : blob_infos) {
+    auto id = info.file_id_;
+    blob_files.emplace(id, std::make_shared<BlobFile>(info, garbage));
+  }
+  version->SetBlobFiles(std::move(blob_files));
+  sv_ = std::make_shared<SuperVersion>(NewMemTable(),
       std::make_shared<std::vector<std::shared_ptr<MemTable>>>(),
       std::move(version));
   DB_INFO("SuperVersion: {}", sv_->ToString());
+  UpdateWriteStall(*sv_);
   filename_gen_ = std::make_unique<FileNameGenerator>(
       options_.db_path.string() + "/", latest_file_id);
+  /* The next SaveMetadata writes a snapshot and starts a new log, since the
+   * tail of this log may be torn. */
 }
 
 void DBImpl::Save() { SaveMetadata(); }
 
 void DBImpl::FlushAll() {
   SwitchMemtable(true);
-  while (true) {
-    {
-      auto sv = GetSV();
-      if (sv->GetMt()->size() == 0 && sv->GetImms()->size() == 0) {
-        break;
-      }
-    }
-    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  std::unique_lock lck(db_mutex_);
+  sv_cv_.wait(lck, [&]() {
+    auto sv = GetSV();
+    return sv->GetMt()->size() == 0 && sv->GetImms()->empty();
+  });
+  lck.unlock();
+  /* The flush thread saves the metadata after installing the SuperVersion,
+   * so it may not be saved yet. */
+  SaveMetadata();
+}
+
+bool DBImpl::IsIdle() {
+  if (flush_flag_ || compact_flag_ || !GetSV()->GetImms()->empty()) {
+    return false;
   }
+  /* A compaction may be picked but not started yet. */
+  return compaction_picker_ == nullptr ||
+         compaction_picker_->Get(GetSV()->GetVersion().get()) == nullptr;
 }
 
 void DBImpl::WaitForFlushAndCompaction() {
-  while (true) {
-    db_mutex_.lock();
-    if (!flush_flag_ && !compact_flag_) {
-      db_mutex_.unlock();
-      return;
-    }
-    db_mutex_.unlock();
-    std::this_thread::sleep_for(std::chrono::milliseconds(100));
-  }
+  std::unique_lock lck(db_mutex_);
+  sv_cv_.wait(lck, [&]() { return IsIdle(); });
 }
 
 void DBImpl::FlushThread() {
@@ -241,17 +803,19 @@ void DBImpl::FlushThread() {
     std::vector<std::shared_ptr<MemTable>> imms;
     {
       auto old_sv = GetSV();
-      while (old_sv->GetVersion()->GetLevels().size() > 0 &&
+      /* Wait until a compaction installs a new SuperVersion. */
+      while (!stop_signal_ && old_sv->GetVersion()->GetLevels().size() > 0 &&
              old_sv->GetVersion()->GetLevels()[0].GetRuns().size() >=
                  options_.level0_stop_writes_trigger) {
         old_sv.reset();
-        StopWrite();
+        sv_cv_.wait(lck);
         old_sv = GetSV();
       }
       imms = PickMemTables();
       if (imms.empty()) {
         old_sv.reset();
         flush_flag_ = false;
+        sv_cv_.notify_all();
         flush_cv_.wait(lck);
         continue;
       }
@@ -263,21 +827,13 @@ void DBImpl::FlushThread() {
     }
     /* Flush the memtables */
     std::vector<std::shared_ptr<SortedRun>> runs;
+    BlobChanges blob_changes;
     {
       db_mutex_.unlock();
-      for (auto& imm : imms) {
-        CompactionJob worker(filename_gen_.get(), options_.block_size,
-            options_.sst_file_size, options_.write_buffer_size,
-            options_.bloom_bits_per_key, options_.use_direct_io);
-        auto ssts = worker.Run(imm->Begin());
-        if (ssts.empty()) {
-          continue;
-        }
-        runs.push_back(std::make_shared<SortedRun>(
-            ssts, options_.block_size, options_.use_direct_io));
-        GetStatsContext()->total_input_bytes.fetch_add(
-            runs.back()->size(), std::memory_order_relaxed);
-      }
+      /* imms are ordered from the newest to the oldest, while the newest
+       * sorted run is the last one in a level. */
+      runs = FlushMemTables(
+          std::vector(imms.rbegin(), imms.rend()), &blob_changes);
       db_mutex_.lock();
     }
     /* Install the new SuperVersion */
@@ -297,18 +853,542 @@ void DBImpl::FlushThread() {
       }
       /* Append the sorted runs to the first level (L0) of the LSM tree. */
       new_version->Append(0, std::move(runs));
+      ApplyBlobChanges(new_version.get(), blob_changes);
       auto new_sv =
           std::make_shared<SuperVersion>(std::move(mt), new_imm, new_version);
       DB_INFO("{}", new_sv->ToString());
       InstallSV(std::move(new_sv));
       compact_cv_.notify_one();
     }
+    /* The flushed records are durable once the metadata references the new
+     * SSTables. Then their logs can be removed. The metadata is saved without
+     * db_mutex_, so that SwitchMemtable does not wait for the fsync. */
+    db_mutex_.unlock();
+    SaveMetadata();
+    for (auto& imm : imms) {
+      RemoveLogFiles(imm.get());
+    }
+    db_mutex_.lock();
+  }
+}
+
+std::vector<std::shared_ptr<SortedRun>> DBImpl::FlushMemTables(
+    const std::vector<std::shared_ptr<MemTable>>& imms,
+    BlobChanges* blob_changes) {
+  bool merge = options_.merge_immutables_on_flush && imms.size() > 1;
+  /* The new sorted runs are appended to Level 0. */
+  std::vector<size_t> run_sizes;
+  for (auto& level : GetSV()->GetVersion()->GetLevels()) {
+    for (auto& run : level.GetRuns()) {
+      run_sizes.push_back(run->size());
+    }
+  }
+  size_t imms_size = 0;
+  for (auto& imm : imms) {
+    imms_size += imm->size();
+    if (!merge) {
+      run_sizes.push_back(imm->size());
+    }
+  }
+  if (merge) {
+    run_sizes.push_back(imms_size);
+  }
+  auto bloom_bits = BloomBitsPerKey(run_sizes, merge ? 1 : imms.size());
+  /* MemTables have no BlobIndex records, so nothing is relocated. */
+  BlobJobOptions blob_options{
+      options_.min_blob_size, options_.blob_file_size, nullptr, 0};
+  std::mutex blob_mutex;
+  auto build = [&](auto&& it, size_t bloom_bits_per_key,
+                   std::vector<RangeTombstone> tombstones) {
+    CompactionJob worker(filename_gen_.get(), options_.block_size,
+        options_.sst_file_size, options_.write_buffer_size,
+        bloom_bits_per_key, options_.use_direct_io,
+        std::numeric_limits<seq_t>::max(), options_.block_restart_interval,
+        options_.enable_block_hash_index, options_.prefix_extractor.get(),
+        &blob_options);
+    auto ssts = worker.Run(it, std::nullopt, std::move(tombstones));
+    auto& changes = worker.GetBlobChanges();
+    if (options_.enable_wal && wal_sync_mode_ != WALSyncMode::kNone) {
+      for (auto& sst : ssts) {
+        SyncFileByName(sst.filename_);
+      }
+      for (auto& blob : changes.new_files_) {
+        SyncFileByName(blob.filename_);
+      }
+    }
+    std::unique_lock lck(blob_mutex);
+    blob_changes->Merge(changes);
+    return ssts;
+  };
+  std::vector<std::vector<SSTInfo>> results;
+  if (merge) {
+    std::vector<MemTableIterator> its;
+    its.reserve(imms.size());
+    IteratorHeap<MemTableIterator> heap;
+    std::vector<RangeTombstone> tombstones;
+    for (auto& imm : imms) {
+      its.push_back(imm->Begin());
+      if (its.back().Valid()) {
+        heap.Push(&its.back());
+      }
+      auto imm_tombstones = imm->GetRangeTombstones();
+      tombstones.insert(
+          tombstones.end(), imm_tombstones.begin(), imm_tombstones.end());
+    }
+    heap.Build();
+    results.push_back(build(heap, bloom_bits[0], std::move(tombstones)));
+  } else {
+    /* The threads take the MemTables one by one. */
+    results.resize(imms.size());
+    std::atomic<size_t> next{0};
+    auto work = [&]() {
+      for (size_t i; (i = next.fetch_add(1)) < imms.size();) {
+        results[i] = build(
+            imms[i]->Begin(), bloom_bits[i], imms[i]->GetRangeTombstones());
+      }
+    };
+    RunInWorkers(
+        std::min(std::max<size_t>(options_.flush_threads, 1), imms.size()),
+        [&](size_t) { work(); });
+  }
+  std::vector<std::shared_ptr<SortedRun>> runs;
+  for (auto& ssts : results) {
+    if (ssts.empty()) {
+      continue;
+    }
+    runs.push_back(std::make_shared<SortedRun>(
+        ssts, options_.block_size, options_.use_direct_io, &cache_,
+        options_.use_mmap_reads, options_.max_readahead_blocks));
+    GetStatsContext()->total_input_bytes.fetch_add(
+        runs.back()->size(), std::memory_order_relaxed);
   }
+  return runs;
 }
 
 void DBImpl::CompactionThread() {
-  // DB_ERR("Not Implemented!");
-  // TODO
+  std::unique_lock lck(db_mutex_);
+  while (!stop_signal_) {
+    std::unique_ptr<Compaction> compaction;
+    if (compaction_picker_) {
+      /* The pickers skip the levels which are being compacted, so the picked
+       * compaction does not overlap with running ones. */
+      compaction = compaction_picker_->Get(GetSV()->GetVersion().get());
+    }
+    if (!compaction) {
+      compact_cv_.wait(lck);
+      continue;
+    }
+    for (auto& run : compaction->input_runs()) {
+      run->SetCompactionInProcess(true);
+    }
+    if (compaction->target_sorted_run()) {
+      compaction->target_sorted_run()->SetCompactionInProcess(true);
+    }
+    running_compactions_ += 1;
+    compact_flag_ = true;
+    DoCompaction(*compaction, lck);
+    for (auto& run : compaction->input_runs()) {
+      run->SetCompactionInProcess(false);
+    }
+    if (compaction->target_sorted_run()) {
+      compaction->target_sorted_run()->SetCompactionInProcess(false);
+    }
+    running_compactions_ -= 1;
+    compact_flag_ = running_compactions_ > 0;
+    sv_cv_.notify_all();
+    /* Wake up the other workers, since the version has changed. */
+    compact_cv_.notify_all();
+  }
+}
+
+void DBImpl::DoCompaction(
+    const Compaction& compaction, std::unique_lock<std::mutex>& lck) {
+  auto user_key_less = [](const std::shared_ptr<SSTable>& a,
+                           const std::shared_ptr<SSTable>& b) {
+    return a->GetSmallestKey().user_key_ < b->GetSmallestKey().user_key_;
+  };
+  /**
+   * The inputs in the source level are either some SSTables of a sorted run
+   * (leveling), or whole sorted runs.
+   */
+  const auto& src_ssts = compaction.input_ssts();
+  std::vector<std::shared_ptr<SortedRun>> src_runs;
+  if (src_ssts.empty()) {
+    src_runs = compaction.input_runs();
+  }
+  std::vector<std::shared_ptr<SSTable>> src_all = src_ssts;
+  for (auto& run : src_runs) {
+    src_all.insert(src_all.end(), run->GetSSTs().begin(), run->GetSSTs().end());
+  }
+  if (src_all.empty()) {
+    return;
+  }
+  /* Only the SSTables of the target run which overlap with the inputs are
+   * merged. */
+  Slice smallest = src_all[0]->GetSmallestKey().user_key_;
+  Slice largest = src_all[0]->GetLargestKey().user_key_;
+  for (auto& sst : src_all) {
+    smallest = std::min(smallest, sst->GetSmallestKey().user_key_);
+    largest = std::max(largest, sst->GetLargestKey().user_key_);
+  }
+  /* The range tombstones of the inputs, which are newer than the records
+   * of the target run. */
+  std::vector<RangeTombstone> src_tombstones;
+  for (auto& sst : src_all) {
+    src_tombstones.insert(src_tombstones.end(),
+        sst->GetRangeTombstones().begin(), sst->GetRangeTombstones().end());
+  }
+  auto target = compaction.target_sorted_run();
+  std::vector<std::shared_ptr<SSTable>> target_ssts;
+  /* The SSTables of the target run which are entirely deleted by a range
+   * tombstone. They are dropped without being read. */
+  std::vector<std::shared_ptr<SSTable>> dropped_ssts;
+  if (target) {
+    for (auto& sst : target->GetSSTs()) {
+      if (sst->GetLargestKey().user_key_ < smallest ||
+          sst->GetSmallestKey().user_key_ > largest) {
+        continue;
+      }
+      target_ssts.push_back(sst);
+      if (std::any_of(src_tombstones.begin(), src_tombstones.end(),
+              [&](const RangeTombstone& tombstone) {
+                return tombstone.Contains(sst->GetSmallestKey().user_key_) &&
+                       tombstone.Contains(sst->GetLargestKey().user_key_);
+              })) {
+        dropped_ssts.push_back(sst);
+      }
+    }
+  }
+  auto contains = [](const std::vector<std::shared_ptr<SSTable>>& ssts,
+                      const std::shared_ptr<SSTable>& sst) {
+    return std::find(ssts.begin(), ssts.end(), sst) != ssts.end();
+  };
+  std::vector<std::shared_ptr<SSTable>> merged_target_ssts;
+  for (auto& sst : target_ssts) {
+    if (!contains(dropped_ssts, sst)) {
+      merged_target_ssts.push_back(sst);
+    }
+  }
+  BlobChanges blob_changes;
+  if (!dropped_ssts.empty()) {
+    /* The values of the dropped records become garbage. */
+    if (!GetSV()->GetVersion()->GetBlobFiles().empty()) {
+      lck.unlock();
+      for (auto& sst : dropped_ssts) {
+        for (auto it = sst->Begin(false); it.Valid(); it.Next()) {
+          if (ParsedKey(it.key()).type_ == RecordType::BlobIndex) {
+            blob_changes.AddGarbage(BlobIndex::Decode(it.value()));
+          }
+        }
+      }
+      lck.lock();
+    }
+    for (auto& sst : dropped_ssts) {
+      sst->SetRemoveTag(true);
+    }
+  }
+  /* If nothing else overlaps, the SSTables are moved without rewriting. */
+  bool trivial_move = merged_target_ssts.empty() &&
+                      (src_ssts.size() == 1 || src_runs.size() == 1);
+  std::vector<std::shared_ptr<SSTable>> outputs;
+  if (trivial_move) {
+    outputs = src_all;
+  } else {
+    std::vector<std::shared_ptr<SortedRun>> inputs = src_runs;
+    if (!src_ssts.empty()) {
+      inputs.push_back(std::make_shared<SortedRun>(
+          src_ssts, options_.block_size, options_.use_direct_io));
+    }
+    if (!merged_target_ssts.empty()) {
+      inputs.push_back(std::make_shared<SortedRun>(
+          merged_target_ssts, options_.block_size, options_.use_direct_io));
+    }
+    /* Split the compaction at the SSTable boundaries of the largest input,
+     * which is usually the target sorted run. */
+    auto split = *std::max_element(
+        inputs.begin(), inputs.end(), [](const auto& a, const auto& b) {
+          return a->SSTCount() < b->SSTCount();
+        });
+    size_t num_ranges = std::min(
+        std::max<size_t>(options_.max_subcompactions, 1), split->SSTCount());
+    std::vector<std::string> bounds;
+    for (size_t i = 1; i < num_ranges; i++) {
+      bounds.emplace_back(split->GetSSTs()[i * split->SSTCount() / num_ranges]
+                              ->GetSmallestKey()
+                              .user_key_);
+    }
+    /* The sizes of the sorted runs after the compaction. The inputs are
+     * moved to the target run, which is the last one. */
+    size_t input_size = 0;
+    for (auto& sst : src_all) {
+      input_size += sst->GetSSTInfo().size_;
+    }
+    std::vector<size_t> run_sizes;
+    for (auto& level : GetSV()->GetVersion()->GetLevels()) {
+      for (auto& run : level.GetRuns()) {
+        bool is_src =
+            std::find(src_runs.begin(), src_runs.end(), run) != src_runs.end();
+        if (run == target || is_src) {
+          continue;
+        }
+        size_t size = run->size();
+        for (auto& sst : run->GetSSTs()) {
+          if (contains(src_ssts, sst)) {
+            size -= sst->GetSSTInfo().size_;
+          }
+        }
+        run_sizes.push_back(size);
+      }
+    }
+    run_sizes.push_back((target ? target->size() : 0) + input_size);
+    size_t bloom_bits = BloomBitsPerKey(run_sizes, 1)[0];
+    /* The values in the oldest blob files are relocated. The blob files are
+     * copied, since the version may be replaced while merging. */
+    BlobFileSet blob_files = GetSV()->GetVersion()->GetBlobFiles();
+    BlobJobOptions blob_options{
+        options_.min_blob_size, options_.blob_file_size, &blob_files, 0};
+    size_t num_gc_files = std::min<size_t>(
+        blob_files.size() * options_.blob_gc_age_cutoff, blob_files.size());
+    if (num_gc_files == blob_files.size() && num_gc_files > 0) {
+      blob_options.gc_before_file_id = blob_files.rbegin()->first + 1;
+    } else if (num_gc_files > 0) {
+      blob_options.gc_before_file_id =
+          std::next(blob_files.begin(), num_gc_files)->first;
+    }
+    lck.unlock();
+    auto infos = MergeSortedRuns(
+        inputs, bounds, bloom_bits, blob_options, &blob_changes);
+    if (options_.enable_wal && wal_sync_mode_ != WALSyncMode::kNone) {
+      for (auto& info : infos) {
+        SyncFileByName(info.filename_);
+      }
+      for (auto& blob : blob_changes.new_files_) {
+        SyncFileByName(blob.filename_);
+      }
+    }
+    if (!infos.empty()) {
+      SortedRun run(
+          infos, options_.block_size, options_.use_direct_io, &cache_,
+          options_.use_mmap_reads, options_.max_readahead_blocks);
+      outputs = run.GetSSTs();
+    }
+    lck.lock();
+    /* The merged SSTables are removed once no SuperVersion uses them. */
+    for (auto& sst : src_all) {
+      sst->SetRemoveTag(true);
+    }
+    for (auto& sst : merged_target_ssts) {
+      sst->SetRemoveTag(true);
+    }
+  }
+  /* Build the new version from the current one, in which new sorted runs may
+   * have been flushed to Level 0. */
+  auto old_sv = GetSV();
+  std::vector<Level> levels;
+  for (auto& level : old_sv->GetVersion()->GetLevels()) {
+    std::vector<std::shared_ptr<SortedRun>> runs;
+    for (auto& run : level.GetRuns()) {
+      if (run == target) {
+        std::vector<std::shared_ptr<SSTable>> ssts = outputs;
+        for (auto& sst : run->GetSSTs()) {
+          if (!contains(target_ssts, sst)) {
+            ssts.push_back(sst);
+          }
+        }
+        std::sort(ssts.begin(), ssts.end(), user_key_less);
+        runs.push_back(std::make_shared<SortedRun>(
+            ssts, options_.block_size, options_.use_direct_io));
+      } else if (std::find(src_runs.begin(), src_runs.end(), run) !=
+                 src_runs.end()) {
+        /* The whole sorted run is compacted. */
+      } else if (!src_ssts.empty() &&
+                 std::any_of(run->GetSSTs().begin(), run->GetSSTs().end(),
+                     [&](auto& sst) { return contains(src_ssts, sst); })) {
+        std::vector<std::shared_ptr<SSTable>> ssts;
+        for (auto& sst : run->GetSSTs()) {
+          if (!contains(src_ssts, sst)) {
+            ssts.push_back(sst);
+          }
+        }
+        if (!ssts.empty()) {
+          runs.push_back(std::make_shared<SortedRun>(
+              ssts, options_.block_size, options_.use_direct_io));
+        }
+      } else {
+        runs.push_back(run);
+      }
+    }
+    levels.emplace_back(level.GetID(), std::move(runs));
+  }
+  auto new_version = std::make_shared<Version>(std::move(levels));
+  new_version->SetBlobFiles(old_sv->GetVersion()->GetBlobFiles());
+  ApplyBlobChanges(new_version.get(), blob_changes);
+  if (!target && !outputs.empty()) {
+    new_version->Append(compaction.target_level(),
+        std::make_shared<SortedRun>(
+            outputs, options_.block_size, options_.use_direct_io));
+  }
+  new_version->TrimEmptyLevels();
+  auto new_sv = std::make_shared<SuperVersion>(
+      old_sv->GetMt(), old_sv->GetImms(), std::move(new_version));
+  DB_INFO("{}", new_sv->ToString());
+  InstallSV(std::move(new_sv));
+  /* The metadata must not reference the removed SSTables. old_sv keeps them
+   * alive until the new metadata is written. SaveMetadata always writes the
+   * latest Version, and it is serialized by metadata_mutex_, so db_mutex_ is
+   * not needed. */
+  lck.unlock();
+  SaveMetadata();
+  lck.lock();
+}
+
+void DBImpl::RunInWorkers(size_t n, const std::function<void(size_t)>& func) {
+  if (n == 0) {
+    return;
+  }
+  std::vector<std::future<void>> futures;
+  for (size_t i = 1; i < n; i++) {
+    auto task =
+        std::make_shared<std::packaged_task<void()>>([&func, i]() { func(i); });
+    futures.push_back(task->get_future());
+    workers_->Push([task]() { (*task)(); });
+  }
+  /* func must outlive the tasks even if func(0) throws. */
+  std::packaged_task<void()> first([&func]() { func(0); });
+  futures.push_back(first.get_future());
+  first();
+  for (auto& future : futures) {
+    future.wait();
+  }
+  for (auto& future : futures) {
+    future.get();
+  }
+}
+
+std::vector<SSTInfo> DBImpl::MergeSortedRuns(
+    const std::vector<std::shared_ptr<SortedRun>>& inputs,
+    const std::vector<std::string>& bounds, size_t bloom_bits_per_key,
+    const BlobJobOptions& blob_options, BlobChanges* blob_changes) {
+  /* The range i is [bounds[i - 1], bounds[i]). The input blocks are not
+   * inserted into the block cache, since they are removed after the
+   * compaction. */
+  std::vector<BlobChanges> changes(bounds.size() + 1);
+  auto merge_range = [&](size_t i) {
+    std::vector<SortedRunIterator> its;
+    its.reserve(inputs.size());
+    IteratorHeap<SortedRunIterator> heap;
+    for (auto& run : inputs) {
+      if (i == 0) {
+        its.push_back(run->Begin(false));
+      } else {
+        /* The record with the largest sequence number is the first one of a
+         * user key. */
+        its.push_back(run->Seek(
+            bounds[i - 1], std::numeric_limits<seq_t>::max(), false));
+      }
+      if (its.back().Valid()) {
+        heap.Push(&its.back());
+      }
+    }
+    heap.Build();
+    /* The range tombstones are clipped to the range. */
+    std::optional<Slice> lower, upper;
+    if (i > 0) {
+      lower = bounds[i - 1];
+    }
+    if (i < bounds.size()) {
+      upper = bounds[i];
+    }
+    std::vector<RangeTombstone> tombstones;
+    for (auto& run : inputs) {
+      auto clipped =
+          ClipRangeTombstones(run->GetRangeTombstones(), lower, upper);
+      tombstones.insert(tombstones.end(), clipped.begin(), clipped.end());
+    }
+    CompactionJob worker(filename_gen_.get(), options_.block_size,
+        options_.sst_file_size, options_.write_buffer_size,
+        bloom_bits_per_key, options_.use_direct_io,
+        std::numeric_limits<seq_t>::max(), options_.block_restart_interval,
+        options_.enable_block_hash_index, options_.prefix_extractor.get(),
+        &blob_options);
+    auto ssts = worker.Run(heap, upper, std::move(tombstones));
+    changes[i] = worker.GetBlobChanges();
+    return ssts;
+  };
+  std::vector<std::vector<SSTInfo>> results(bounds.size() + 1);
+  RunInWorkers(
+      results.size(), [&](size_t i) { results[i] = merge_range(i); });
+  std::vector<SSTInfo> ret;
+  for (auto& result : results) {
+    ret.insert(ret.end(), result.begin(), result.end());
+  }
+  for (auto& change : changes) {
+    blob_changes->Merge(change);
+  }
+  return ret;
+}
+
+void DBImpl::ApplyBlobChanges(Version* version, const BlobChanges& changes) {
+  if (changes.new_files_.empty() && changes.garbage_.empty()) {
+    return;
+  }
+  BlobFileSet blob_files = version->GetBlobFiles();
+  for (auto& info : changes.new_files_) {
+    blob_files.emplace(info.file_id_, std::make_shared<BlobFile>(info));
+  }
+  for (auto& [file_id, garbage] : changes.garbage_) {
+    auto it = blob_files.find(file_id);
+    if (it == blob_files.end()) {
+      DB_ERR("Blob file {} does not exist", file_id);
+    }
+    it->second->AddGarbage(garbage);
+  }
+  for (auto it = blob_files.begin(); it != blob_files.end();) {
+    if (it->second->IsObsolete()) {
+      it->second->SetRemoveTag(true);
+      it = blob_files.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  version->SetBlobFiles(std::move(blob_files));
+}
+
+std::vector<size_t> DBImpl::BloomBitsPerKey(
+    const std::vector<size_t>& run_sizes, size_t new_runs) const {
+  if (!options_.enable_per_level_bloom_bits) {
+    return std::vector<size_t>(new_runs, options_.bloom_bits_per_key);
+  }
+  auto bits = AllocateBloomBits(run_sizes, options_.bloom_bits_per_key);
+  std::vector<size_t> ret;
+  for (size_t i = run_sizes.size() - new_runs; i < run_sizes.size(); i++) {
+    ret.push_back(std::llround(bits[i]));
+  }
+  return ret;
+}
+
+std::vector<BloomFilterStats> DBImpl::GetBloomFilterStats() {
+  std::vector<BloomFilterStats> ret;
+  for (auto& level : GetSV()->GetVersion()->GetLevels()) {
+    BloomFilterStats stats;
+    stats.level = level.GetID();
+    for (auto& run : level.GetRuns()) {
+      for (auto& sst : run->GetSSTs()) {
+        size_t keys = sst->GetSSTInfo().count_;
+        size_t bits = sst->BloomFilterBits();
+        stats.keys += keys;
+        stats.filter_bits += bits;
+        stats.lookups += sst->BloomLookups();
+        stats.false_positives += sst->BloomFalsePositives();
+        if (keys > 0) {
+          stats.weighted_fpr +=
+              keys * BloomFalsePositiveRate(static_cast<double>(bits) / keys);
+        }
+      }
+    }
+    ret.push_back(stats);
+  }
+  return ret;
 }
 
 std::vector<std::shared_ptr<MemTable>> DBImpl::PickMemTables() {
@@ -328,51 +1408,141 @@ std::shared_ptr<SuperVersion> DBImpl::GetSV() {
 }
 
 void DBImpl::InstallSV(std::shared_ptr<SuperVersion> sv) {
-  std::unique_lock lck(sv_mutex_);
-  sv_ = std::move(sv);
+  UpdateWriteStall(*sv);
+  {
+    std::unique_lock lck(sv_mutex_);
+    sv_ = std::move(sv);
+    sv_version_.fetch_add(1, std::memory_order_release);
+  }
+  /* The cached SuperVersions are refreshed by the next reads anyway. They are
+   * released here so that they do not keep the obsolete SSTables alive. */
+  ScrapeLocalSVs();
+  sv_cv_.notify_all();
 }
 
-DBIterator DBImpl::Begin() {
-  DBIterator it(GetSV(), seq_);
+DBIterator DBImpl::Begin(const ReadOptions& read_options) {
+  auto seq = CurrentSeq();
+  auto local = GetLocalSV();
+  auto cached = AcquireLocalSV(local);
+  /* The iterator pins the SuperVersion. */
+  DBIterator it(cached->sv, seq, read_options, options_.prefix_extractor);
+  ReturnLocalSV(local, cached);
   it.SeekToFirst();
   return it;
 }
 
-DBIterator DBImpl::Seek(Slice key) {
-  DBIterator it(GetSV(), seq_);
+DBIterator DBImpl::Seek(Slice key, const ReadOptions& read_options) {
+  auto seq = CurrentSeq();
+  auto local = GetLocalSV();
+  auto cached = AcquireLocalSV(local);
+  DBIterator it(cached->sv, seq, read_options, options_.prefix_extractor);
+  ReturnLocalSV(local, cached);
   it.Seek(key);
   return it;
 }
 
-void DBIterator::SeekToFirst() {
-  it_.SeekToFirst();
-  if (it_.Valid()) {
-    current_key_ = ParsedKey(it_.key());
-    if (current_key_.record_type() == RecordType::Deletion ||
-        current_key_.seq() > seq_) {
-      Next();
+DBIterator::DBIterator(std::shared_ptr<SuperVersion> sv, seq_t seq,
+    ReadOptions read_options,
+    std::shared_ptr<const PrefixExtractor> prefix_extractor)
+  : sv_(std::move(sv)),
+    it_(sv_.get()),
+    seq_(seq),
+    read_options_(std::move(read_options)),
+    prefix_extractor_(std::move(prefix_extractor)) {
+  if (auto list = sv_->GetMt()->GetRangeTombstoneList()) {
+    mem_tombstones_.push_back(std::move(list));
+  }
+  for (auto& imm : *sv_->GetImms()) {
+    if (auto list = imm->GetRangeTombstoneList()) {
+      mem_tombstones_.push_back(std::move(list));
+    }
+  }
+  for (auto& level : sv_->GetVersion()->GetLevels()) {
+    for (auto& run : level.GetRuns()) {
+      if (!run->GetRangeTombstoneFragments().empty()) {
+        run_tombstones_.push_back(&run->GetRangeTombstoneFragments());
+      }
     }
   }
 }
 
+void DBIterator::SeekToFirst() {
+  prefix_.reset();
+  blob_value_.reset();
+  it_.SeekToFirst(read_options_.iterate_upper_bound);
+  FindVisible();
+}
+
 void DBIterator::Seek(Slice key) {
-  it_.Seek(key, seq_);
+  prefix_.reset();
+  blob_value_.reset();
+  if (read_options_.prefix_same_as_start && prefix_extractor_ != nullptr &&
+      prefix_extractor_->InDomain(key)) {
+    prefix_ = std::string(prefix_extractor_->Transform(key));
+  }
+  it_.Seek(key, seq_, read_options_.iterate_upper_bound,
+      prefix_ ? prefix_extractor_.get() : nullptr);
+  FindVisible();
+}
+
+void DBIterator::FindVisible() {
+  out_of_bounds_ = false;
   if (it_.Valid()) {
     current_key_ = ParsedKey(it_.key());
-    if (current_key_.record_type() == RecordType::Deletion ||
-        current_key_.seq() > seq_) {
+    if (!InBounds(current_key_.user_key())) {
+      out_of_bounds_ = true;
+      return;
+    }
+    if (current_key_.seq() > seq_ || IsDeleted()) {
       Next();
     }
   }
 }
 
-bool DBIterator::Valid() { return it_.Valid(); }
+bool DBIterator::InBounds(Slice user_key) const {
+  if (read_options_.iterate_upper_bound &&
+      user_key >= *read_options_.iterate_upper_bound) {
+    return false;
+  }
+  return !prefix_ || user_key.starts_with(*prefix_);
+}
+
+bool DBIterator::IsDeleted() const {
+  if (current_key_.record_type() == RecordType::Deletion ||
+      current_key_.record_type() == RecordType::RangeDeletion) {
+    return true;
+  }
+  Slice user_key = current_key_.user_key();
+  for (auto& list : mem_tombstones_) {
+    if (current_key_.seq() < list->fragments_.MaxCoveringSeq(user_key, seq_)) {
+      return true;
+    }
+  }
+  for (auto fragments : run_tombstones_) {
+    if (current_key_.seq() < fragments->MaxCoveringSeq(user_key, seq_)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool DBIterator::Valid() { return !out_of_bounds_ && it_.Valid(); }
 
 Slice DBIterator::key() const { return current_key_.user_key(); }
 
-Slice DBIterator::value() const { return it_.value(); }
+Slice DBIterator::value() const {
+  if (current_key_.record_type() != RecordType::BlobIndex) {
+    return it_.value();
+  }
+  if (!blob_value_) {
+    blob_value_.emplace(it_.value());
+    sv_->GetVersion()->ResolveBlobIndex(&*blob_value_);
+  }
+  return *blob_value_;
+}
 
 void DBIterator::Next() {
+  blob_value_.reset();
   it_.Next();
   while (true) {
     while (it_.Valid() && (seq_ < ParsedKey(it_.key()).seq_ ||
@@ -383,7 +1553,11 @@ void DBIterator::Next() {
     }
     if (it_.Valid()) {
       current_key_ = ParsedKey(it_.key());
-      if (current_key_.record_type() == RecordType::Deletion) {
+      if (!InBounds(current_key_.user_key())) {
+        out_of_bounds_ = true;
+        break;
+      }
+      if (IsDeleted()) {
         it_.Next();
         continue;
       }
@@ -1,22 +1,35 @@
 #pragma once
 
+#include <atomic>
 #include <cassert>
 #include <condition_variable>
 #include <deque>
+#include <functional>
 #include <limits>
 #include <map>
+#include <memory>
 #include <mutex>
+#include <optional>
 #include <set>
 #include <shared_mutex>
+#include <span>
 #include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include <utility>
 #include <variant>
+#include <vector>
 
+#include "common/threadpool.hpp"
+#include "storage/lsm/bloom_allocation.hpp"
 #include "storage/lsm/cache.hpp"
 #include "storage/lsm/compaction_pick.hpp"
 #include "storage/lsm/memtable.hpp"
 #include "storage/lsm/options.hpp"
 #include "storage/lsm/version.hpp"
+#include "storage/lsm/wal.hpp"
+#include "storage/lsm/write_batch.hpp"
+#include "storage/lsm/write_controller.hpp"
 
 namespace wing {
 
@@ -35,55 +48,271 @@ class DBImpl {
 
   void Put(Slice key, Slice value);
   void Del(Slice key);
+  /**
+   * Delete the user keys in [begin, end) with one range tombstone, instead of
+   * a deletion per key. The deleted records are dropped by compactions, and
+   * the SSTables entirely in the range are dropped without being read.
+   */
+  void DeleteRange(Slice begin, Slice end);
+  /**
+   * Apply all the operations in the batch atomically. They get a contiguous
+   * range of sequence numbers, are written to the WAL as one record, and
+   * become visible to readers at the same time.
+   */
+  void Write(const WriteBatch& batch);
   // Return true if kFound, false if not
   bool Get(Slice key, std::string *value);
+  /**
+   * Look up a batch of keys in one snapshot. The i-th result is the value of
+   * keys[i], or std::nullopt if it is not found. The keys are sorted, so the
+   * keys in the same data block share one block read, and the bloom filters
+   * and data blocks of an SSTable are probed for the whole batch at once.
+   */
+  std::vector<std::optional<std::string>> MultiGet(std::span<const Slice> keys);
   void Save();
+  /* Flush the MemTable and wait until all the MemTables are flushed. */
   void FlushAll();
+  /* Wait until there are no pending flushes or compactions. */
   void WaitForFlushAndCompaction();
-  size_t CurrentSeq() const { return seq_; }
+  size_t CurrentSeq() const {
+    return visible_seq_.load(std::memory_order_acquire);
+  }
   /* Delete all things */
   void DropAll();
 
-  DBIterator Begin();
-  DBIterator Seek(Slice key);
+  DBIterator Begin(const ReadOptions &read_options = {});
+  /**
+   * Return an iterator positioned at the first user key >= key. With
+   * read_options, the iterator stops at an upper bound or at the end of the
+   * prefix of key, and the sorted runs out of the range are not read.
+   */
+  DBIterator Seek(Slice key, const ReadOptions &read_options = {});
   std::shared_ptr<SuperVersion> GetSV();
   const Options &GetOptions() const { return options_; }
+  /**
+   * The bloom filters of each level: their sizes, and their expected and
+   * observed false positive rates.
+   */
+  std::vector<BloomFilterStats> GetBloomFilterStats();
+  const Cache &GetCache() const { return cache_; }
 
  private:
+  /* A SuperVersion cached by a thread, and the version number of it. */
+  struct CachedSV {
+    std::shared_ptr<SuperVersion> sv;
+    uint64_t version;
+  };
+
+  /**
+   * The slot of a thread for the cached SuperVersion of a DBImpl. It holds
+   * nullptr, a CachedSV* owned by the slot, or kSVInUse while the thread is
+   * reading with the CachedSV. Only the owner thread and ScrapeLocalSVs
+   * access it, so it is not contended.
+   */
+  struct LocalSV {
+    std::atomic<void*> ptr{nullptr};
+    /* It is set when the DBImpl is destroyed. */
+    std::atomic<bool> obsolete{false};
+
+    ~LocalSV();
+  };
+
+  /* Return the slot of the current thread, and register it if it is new. */
+  LocalSV* GetLocalSV();
+  /**
+   * Take the cached SuperVersion of the current thread, and refresh it if a
+   * new SuperVersion has been installed. It must be returned by
+   * ReturnLocalSV.
+   */
+  CachedSV* AcquireLocalSV(LocalSV* local);
+  void ReturnLocalSV(LocalSV* local, CachedSV* cached);
+  /**
+   * Release the SuperVersions cached by all the threads. If obsolete is true,
+   * the slots are also marked obsolete, so that the threads can drop them.
+   */
+  void ScrapeLocalSVs(bool obsolete = false);
+
+  std::shared_ptr<MemTable> NewMemTable() const {
+    return std::make_shared<MemTable>(memtable_rep_);
+  }
+  /**
+   * Make the records with sequence numbers in [first_seq, last_seq] visible to
+   * readers. It waits until all the records with smaller sequence numbers are
+   * visible, so that readers never observe gaps in the sequence.
+   */
+  void PublishSeq(seq_t first_seq, seq_t last_seq);
+  /**
+   * Create a new MemTable and a new WAL for it.
+   * Require: no concurrent writers (switch_mutex_ held exclusively)
+   */
+  std::shared_ptr<MemTable> NewMemTableAndWAL();
+  /* Replay the remaining WALs into the MemTable after LoadMetadata. */
+  void RecoverWAL();
+  /* Remove the WALs of a flushed or dropped MemTable. */
+  void RemoveLogFiles(MemTable* mt);
   void SwitchMemtable(bool force = false);
   void FlushThread();
   void CompactionThread();
+  /**
+   * Run a compaction whose inputs are marked by SetCompactionInProcess, and
+   * install the result as a new SuperVersion. db_mutex_ is released while
+   * the records are merged and while the metadata is saved.
+   * Require: db_mutex_ held by lck
+   */
+  void DoCompaction(const Compaction& compaction,
+      std::unique_lock<std::mutex>& lck);
+  /* Whether there are no pending flushes or compactions. Require: DB Mutex */
+  bool IsIdle();
+
+  /**
+   * Merge the sorted runs into SSTables. The user key space is split at
+   * bounds, and the ranges are merged in parallel. The outputs are ordered
+   * by user key.
+   */
+  std::vector<SSTInfo> MergeSortedRuns(
+      const std::vector<std::shared_ptr<SortedRun>>& inputs,
+      const std::vector<std::string>& bounds, size_t bloom_bits_per_key,
+      const BlobJobOptions& blob_options, BlobChanges* blob_changes);
+  /**
+   * The bits per key of the bloom filters of the last new_runs sorted runs in
+   * run_sizes, which are the sizes of all the sorted runs once the new runs
+   * are installed. They are allocated by AllocateBloomBits if
+   * Options::enable_per_level_bloom_bits is true.
+   */
+  std::vector<size_t> BloomBitsPerKey(
+      const std::vector<size_t>& run_sizes, size_t new_runs) const;
+  /**
+   * Flush the MemTables, which are ordered from the oldest to the newest, and
+   * return the sorted runs in the same order. The MemTables are flushed by up
+   * to Options::flush_threads threads, or merged into one sorted run if
+   * Options::merge_immutables_on_flush is true.
+   */
+  std::vector<std::shared_ptr<SortedRun>> FlushMemTables(
+      const std::vector<std::shared_ptr<MemTable>>& imms,
+      BlobChanges* blob_changes);
+  /**
+   * Run func(0), ..., func(n - 1) in parallel and wait for them. func(0) runs
+   * in the caller, and the others in workers_, so that no threads are created
+   * for each flush or compaction.
+   */
+  void RunInWorkers(size_t n, const std::function<void(size_t)>& func);
+  /**
+   * Add the new blob files and the garbage to the blob files of version. The
+   * blob files whose values are all garbage are removed from version, and
+   * deleted once no Version references them.
+   * Require: DB Mutex held
+   */
+  void ApplyBlobChanges(Version* version, const BlobChanges& changes);
   std::vector<std::shared_ptr<MemTable>> PickMemTables();
+  /**
+   * Install a new SuperVersion, update the write stall state and wake up the
+   * stalled threads.
+   * Require: DB Mutex held
+   */
   void InstallSV(std::shared_ptr<SuperVersion> sv);
+  /**
+   * Persist the current Version. An edit is appended to the metadata log,
+   * or a new snapshot of the metadata is written if the log is too large.
+   * It does nothing if neither the Version nor the sequence number changed.
+   */
   void SaveMetadata();
+  /**
+   * Write a snapshot of version to the metadata, and start a new metadata
+   * log. Require: metadata_mutex_ held
+   */
+  void WriteMetadataSnapshot(const Version& version);
+  /**
+   * Encode version as an edit of the metadata log.
+   * Require: metadata_mutex_ held
+   */
+  std::string EncodeMetadataEdit(const Version& version);
+  /* Load the metadata snapshot, and replay the metadata log. */
   void LoadMetadata();
 
-  // Require: DB Mutex held
-  void StopWrite();
+  /**
+   * Set the delayed write rate of write_controller_ from the number of sorted
+   * runs in Level 0, the number of immutable MemTables and the estimated
+   * pending compaction bytes.
+   */
+  void UpdateWriteStall(const SuperVersion& sv);
+  /**
+   * The bytes that still have to be compacted to bring the levels within
+   * their size limits.
+   */
+  size_t EstimatePendingCompactionBytes(const Version& version) const;
+  /* Sleep if writes are delayed by write_controller_. */
+  void DelayWrite(size_t bytes);
 
   Options options_;
   Cache cache_;
-  size_t seq_;
+  MemTableRep memtable_rep_{MemTableRep::kSkipList};
+  /* The last allocated sequence number */
+  std::atomic<seq_t> seq_{0};
+  /* The last sequence number visible to readers */
+  std::atomic<seq_t> visible_seq_{0};
 
   std::vector<std::thread> threads_;
+  /**
+   * The workers shared by the parallel flushes and the subcompactions. It is
+   * null if neither of them is enabled.
+   */
+  std::unique_ptr<ThreadPool> workers_;
   std::condition_variable flush_cv_;
   std::condition_variable compact_cv_;
+  /**
+   * Notified whenever a new SuperVersion is installed or a background job
+   * finishes. The stopped writers, the stalled flush thread, FlushAll and
+   * WaitForFlushAndCompaction wait on it with db_mutex_.
+   */
+  std::condition_variable sv_cv_;
+  WriteController write_controller_;
   bool stop_signal_{false};
   bool compact_flag_{false};
+  /* The number of compactions that are running */
+  size_t running_compactions_{0};
   bool flush_flag_{false};
 
-  std::mutex write_mutex_;
+  /**
+   * Writers hold it in shared mode while writing to the MemTable,
+   * and SwitchMemtable holds it in exclusive mode.
+   */
+  std::shared_mutex switch_mutex_;
+  /* The WAL of the current MemTable. It is null if WAL is disabled. */
+  std::unique_ptr<WALWriter> wal_;
+  WALSyncMode wal_sync_mode_{WALSyncMode::kNone};
+  std::mutex metadata_mutex_;
+  /**
+   * The log of metadata edits after the metadata snapshot. It is null until
+   * the first snapshot is written. The metadata fields are protected by
+   * metadata_mutex_.
+   */
+  std::unique_ptr<WALWriter> metadata_log_;
+  uint64_t metadata_log_number_{0};
+  /* The size of the metadata snapshot. */
+  size_t metadata_size_{0};
+  /* The SSTables whose SSTInfo is in the metadata snapshot or log. */
+  std::unordered_set<size_t> logged_ssts_;
+  /* The Version and sequence number which were saved last. */
+  std::shared_ptr<Version> saved_version_;
+  seq_t saved_seq_{0};
   std::mutex db_mutex_;
   std::shared_mutex sv_mutex_;
   std::shared_ptr<SuperVersion> sv_;
+  /* It is increased every time a new SuperVersion is installed. */
+  std::atomic<uint64_t> sv_version_{0};
+  /* The unique ID of the DBImpl, which identifies its thread-local slots. */
+  uint64_t id_;
+  std::mutex local_sv_mutex_;
+  std::vector<std::weak_ptr<LocalSV>> local_svs_;
   std::unique_ptr<FileNameGenerator> filename_gen_;
   std::unique_ptr<CompactionPicker> compaction_picker_;
 };
 
 class DBIterator final : public Iterator {
  public:
-  DBIterator(std::shared_ptr<SuperVersion> sv, seq_t seq)
-    : sv_(std::move(sv)), it_(sv_.get()), seq_(seq) {}
+  DBIterator(std::shared_ptr<SuperVersion> sv, seq_t seq,
+      ReadOptions read_options = {},
+      std::shared_ptr<const PrefixExtractor> prefix_extractor = nullptr);
 
   void SeekToFirst();
 
@@ -98,10 +327,41 @@ class DBIterator final : public Iterator {
   void Next() override;
 
  private:
+  /* Whether the user key is below the upper bound and has the prefix. */
+  bool InBounds(Slice user_key) const;
+
+  /**
+   * Move to the first visible record from the current position of it_, or
+   * stop if the key is out of bounds.
+   */
+  void FindVisible();
+
+  /**
+   * Whether the current record is a deletion, or is deleted by a newer range
+   * tombstone.
+   */
+  bool IsDeleted() const;
+
   std::shared_ptr<SuperVersion> sv_;
   SuperVersionIterator it_;
   seq_t seq_;
   InternalKey current_key_;
+  /* The value of a BlobIndex record, which is read by value() lazily. */
+  mutable std::optional<std::string> blob_value_;
+  ReadOptions read_options_;
+  std::shared_ptr<const PrefixExtractor> prefix_extractor_;
+  /**
+   * The range tombstones of the MemTables, and those of the sorted runs
+   * which have any. They are only referenced, since they are immutable and
+   * sv_ pins the sorted runs.
+   */
+  std::vector<std::shared_ptr<const MemTable::RangeTombstoneList>>
+      mem_tombstones_;
+  std::vector<const RangeTombstoneFragments*> run_tombstones_;
+  /* The prefix of the key of Seek if prefix_same_as_start is true. */
+  std::optional<std::string> prefix_;
+  /* Whether the iterator has reached the upper bound or the prefix end. */
+  bool out_of_bounds_{false};
 };
 
 }  // namespace lsm
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <unordered_set>
+
 #include "storage/lsm/lsm.hpp"
 #include "storage/storage.hpp"
 
@@ -86,6 +88,30 @@ class LSMStorage : public Storage {
       table_.lsm_->Put(key, new_value);
       return true;
     }
+    /* All the pairs are written in one WriteBatch. */
+    bool InsertBatch(const std::vector<std::pair<std::string_view,
+            std::string_view>>& kvs) override {
+      std::string v0;
+      std::unordered_set<std::string_view> keys;
+      lsm::WriteBatch batch;
+      for (auto& [key, value] : kvs) {
+        if (!keys.insert(key).second || table_.lsm_->Get(key, &v0)) {
+          return false;
+        }
+        batch.Put(key, value);
+      }
+      table_.lsm_->Write(batch);
+      table_.tick_ += kvs.size();
+      return true;
+    }
+    bool DeleteBatch(const std::vector<std::string_view>& keys) override {
+      lsm::WriteBatch batch;
+      for (auto& key : keys) {
+        batch.Del(key);
+      }
+      table_.lsm_->Write(batch);
+      return true;
+    }
 
    private:
     Table& table_;
@@ -102,23 +128,36 @@ class LSMStorage : public Storage {
       }
       return reinterpret_cast<const uint8_t*>(value_.data());
     }
+    std::vector<const uint8_t*> MultiSearch(
+        std::span<const std::string_view> keys) override {
+      batch_ = lsm_->MultiGet(keys);
+      std::vector<const uint8_t*> ret(keys.size(), nullptr);
+      for (size_t i = 0; i < keys.size(); i++) {
+        if (batch_[i].has_value()) {
+          ret[i] = reinterpret_cast<const uint8_t*>(batch_[i]->data());
+        }
+      }
+      return ret;
+    }
 
    private:
     lsm::DBImpl* lsm_;
     std::string value_;
+    /* The rows returned by the last MultiSearch. */
+    std::vector<std::optional<std::string>> batch_;
   };
 
   class LSMIterator : public wing::Iterator<const uint8_t*> {
    public:
     LSMIterator(lsm::DBImpl* lsm, std::tuple<std::string_view, bool, bool> L,
         std::tuple<std::string_view, bool, bool> R)
-      : it_(std::get<1>(L) ? lsm->Begin() : lsm->Seek(std::get<0>(L))) {
+      : it_(std::get<1>(L) ? lsm->Begin(UpperBound(R))
+                           : lsm->Seek(std::get<0>(L), UpperBound(R))) {
       if (!std::get<1>(L) && !std::get<2>(L) && it_.Valid() &&
           it_.key() == std::get<0>(L)) {
         it_.Next();
       }
       first_flag_ = true;
-      R_ = R;
     }
     void Init() override {}
     const uint8_t* Next() override {
@@ -128,19 +167,32 @@ class LSMStorage : public Storage {
         if (it_.Valid())
           it_.Next();
       }
-      if (!it_.Valid() ||
-          (!std::get<1>(R_) &&
-              (std::get<2>(R_) ? it_.key() > std::get<0>(R_)
-                               : it_.key() >= std::get<0>(R_)))) {
+      if (!it_.Valid()) {
         return nullptr;
       }
       return reinterpret_cast<const uint8_t*>(it_.value().data());
     }
 
    private:
+    /**
+     * The iterator stops at the right end of the range, and the sorted runs
+     * beyond it are not read. The smallest key greater than an inclusive
+     * bound k is k + '\0'.
+     */
+    static lsm::ReadOptions UpperBound(
+        std::tuple<std::string_view, bool, bool> R) {
+      lsm::ReadOptions ret;
+      if (!std::get<1>(R)) {
+        ret.iterate_upper_bound = std::string(std::get<0>(R));
+        if (std::get<2>(R)) {
+          ret.iterate_upper_bound->push_back('\0');
+        }
+      }
+      return ret;
+    }
+
     bool first_flag_{true};
     lsm::DBIterator it_;
-    std::tuple<std::string, bool, bool> R_;
   };
 
   void Create(const TableSchema& schema) override {
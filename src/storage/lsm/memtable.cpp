@@ -1,5 +1,7 @@
 #include "storage/lsm/memtable.hpp"
 
+#include <algorithm>
+
 #include "common/logging.hpp"
 #include "common/serializer.hpp"
 
@@ -7,48 +9,164 @@ namespace wing {
 
 namespace lsm {
 
-void MemTable::Add(ParsedKey key, Slice value) {
+std::pair<ParsedKey, Slice> MemTable::CopyRecord(ParsedKey key, Slice value) {
   auto ptr = (char *)alloc_.Allocate(key.size() + value.size());
   utils::Serializer(ptr)
       .WriteString(key.user_key_)
       .Write(key.seq_)
       .Write(key.type_)
       .WriteString(value);
-  size_ += key.size() + value.size() + sizeof(offset_t) * 2;
-  auto parsed_key =
-      ParsedKey(Slice(ptr, key.user_key_.size()), key.seq_, key.type_);
-  auto copied_value = Slice(ptr + key.size(), value.size());
-  table_.emplace(parsed_key, copied_value);
+  return {ParsedKey(Slice(ptr, key.user_key_.size()), key.seq_, key.type_),
+      Slice(ptr + key.size(), value.size())};
+}
+
+void MemTable::Add(ParsedKey key, Slice value) {
+  size_.fetch_add(key.size() + value.size() + sizeof(offset_t) * 2,
+      std::memory_order_relaxed);
+  auto [parsed_key, copied_value] = CopyRecord(key, value);
+  if (rep_ == MemTableRep::kSkipList) {
+    list_->Insert(parsed_key, copied_value);
+  } else {
+    std::unique_lock<std::shared_mutex> lck(mu_);
+    table_.emplace(parsed_key, copied_value);
+  }
 }
 
 void MemTable::Put(Slice user_key, seq_t seq, Slice value) {
-  std::unique_lock<std::shared_mutex> lck(mu_);
   Add(ParsedKey(user_key, seq, RecordType::Value), value);
 }
 
 void MemTable::Del(Slice user_key, seq_t seq) {
-  std::unique_lock<std::shared_mutex> lck(mu_);
   Add(ParsedKey(user_key, seq, RecordType::Deletion), Slice());
 }
 
+void MemTable::DeleteRange(Slice begin, Slice end, seq_t seq) {
+  size_.fetch_add(begin.size() + end.size() + sizeof(seq_t),
+      std::memory_order_relaxed);
+  RangeTombstone tombstone{std::string(begin), std::string(end), seq};
+  std::unique_lock lck(range_mutex_);
+  auto list = std::make_shared<RangeTombstoneList>();
+  if (auto old = range_tombstones_.load(std::memory_order_acquire)) {
+    list->tombstones_ = old->tombstones_;
+  }
+  /* Keep the order of SortRangeTombstones. */
+  auto pos = std::upper_bound(list->tombstones_.begin(),
+      list->tombstones_.end(), tombstone,
+      [](const RangeTombstone& a, const RangeTombstone& b) {
+        return a.begin_ != b.begin_ ? a.begin_ < b.begin_ : a.seq_ > b.seq_;
+      });
+  list->tombstones_.insert(pos, std::move(tombstone));
+  list->fragments_ = RangeTombstoneFragments(list->tombstones_);
+  range_tombstones_.store(std::move(list), std::memory_order_release);
+  has_range_tombstones_.store(true, std::memory_order_release);
+}
+
+std::shared_ptr<const MemTable::RangeTombstoneList>
+MemTable::GetRangeTombstoneList() const {
+  if (!has_range_tombstones_.load(std::memory_order_acquire)) {
+    return nullptr;
+  }
+  return range_tombstones_.load(std::memory_order_acquire);
+}
+
+std::vector<RangeTombstone> MemTable::GetRangeTombstones() const {
+  auto list = GetRangeTombstoneList();
+  return list ? list->tombstones_ : std::vector<RangeTombstone>();
+}
+
+seq_t MemTable::MaxCoveringSeq(Slice user_key, seq_t seq) const {
+  auto list = GetRangeTombstoneList();
+  return list ? list->fragments_.MaxCoveringSeq(user_key, seq) : 0;
+}
+
+void MemTable::Apply(const WriteBatch& batch, seq_t first_seq) {
+  if (rep_ == MemTableRep::kSkipList) {
+    seq_t seq = first_seq;
+    for (auto it = batch.Begin(); it.Valid(); it.Next()) {
+      if (it.type() == RecordType::RangeDeletion) {
+        DeleteRange(it.key(), it.value(), seq++);
+        continue;
+      }
+      Add(ParsedKey(it.key(), seq++, it.type()), it.value());
+    }
+    return;
+  }
+  /* Copy the records before taking the lock, then insert all of them under a
+   * single lock acquisition. */
+  std::vector<std::pair<ParsedKey, Slice>> records;
+  records.reserve(batch.Count());
+  size_t size = 0;
+  seq_t seq = first_seq;
+  for (auto it = batch.Begin(); it.Valid(); it.Next()) {
+    if (it.type() == RecordType::RangeDeletion) {
+      DeleteRange(it.key(), it.value(), seq++);
+      continue;
+    }
+    auto key = ParsedKey(it.key(), seq++, it.type());
+    size += key.size() + it.value().size() + sizeof(offset_t) * 2;
+    records.push_back(CopyRecord(key, it.value()));
+  }
+  size_.fetch_add(size, std::memory_order_relaxed);
+  std::unique_lock<std::shared_mutex> lck(mu_);
+  for (auto& [key, value] : records) {
+    table_.emplace(key, value);
+  }
+}
+
 void MemTable::Clear() {
   std::unique_lock<std::shared_mutex> lck(mu_);
   table_.clear();
+  range_tombstones_.store(nullptr, std::memory_order_relaxed);
+  has_range_tombstones_.store(false, std::memory_order_relaxed);
+  /* The nodes of the old skiplist stay in the arena until destruction. */
+  list_ = std::make_unique<SkipList>(&alloc_);
+  size_.store(0, std::memory_order_relaxed);
 }
 
 GetResult MemTable::Get(Slice user_key, seq_t seq, std::string *value) {
-  std::shared_lock<std::shared_mutex> lock(mu_);
-  auto it = table_.lower_bound(ParsedKey(user_key, seq, RecordType::Value));
-  if (it == table_.end() || it->first.user_key_ != user_key) {
-    return GetResult::kNotFound;
+  auto lookup_key = ParsedKey(user_key, seq, RecordType::Value);
+  /* A range tombstone deletes the older records of the key, in this MemTable
+   * and in the older ones. */
+  seq_t tombstone_seq = MaxCoveringSeq(user_key, seq);
+  auto not_found =
+      tombstone_seq > 0 ? GetResult::kDelete : GetResult::kNotFound;
+  const ParsedKey *key;
+  Slice found_value;
+  if (rep_ == MemTableRep::kSkipList) {
+    auto node = list_->FindGreaterOrEqual(lookup_key);
+    if (node == nullptr) {
+      return not_found;
+    }
+    key = &node->key_;
+    found_value = node->value_;
   } else {
-    switch (it->first.type_) {
-      case RecordType::Deletion:
-        return GetResult::kDelete;
-      case RecordType::Value:
-        *value = it->second;
-        return GetResult::kFound;
+    std::shared_lock<std::shared_mutex> lock(mu_);
+    auto it = table_.lower_bound(lookup_key);
+    if (it == table_.end()) {
+      return not_found;
     }
+    /* Elements of std::map are never moved, and we never erase them. */
+    key = &it->first;
+    found_value = it->second;
+  }
+  if (key->user_key_ != user_key) {
+    return not_found;
+  }
+  if (key->seq_ < tombstone_seq) {
+    return GetResult::kDelete;
+  }
+  switch (key->type_) {
+    case RecordType::Deletion:
+      return GetResult::kDelete;
+    case RecordType::Value:
+      *value = found_value;
+      return GetResult::kFound;
+    /* The values are only moved to blob files by flushes and compactions. */
+    case RecordType::BlobIndex:
+      break;
+    /* The range tombstones are kept aside from the records. */
+    case RecordType::RangeDeletion:
+      break;
   }
   DB_ERR("Incorrect key value!");
 }
@@ -67,4 +185,4 @@ MemTableIterator MemTable::Begin() {
 
 }  // namespace lsm
 
-}  // namespace wing
\ No newline at end of file
+}  // namespace wing
@@ -1,6 +1,9 @@
 #pragma once
 
+#include <atomic>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <shared_mutex>
 #include <string>
 
@@ -9,6 +12,9 @@
 #include "storage/lsm/format.hpp"
 #include "storage/lsm/iterator.hpp"
 #include "storage/lsm/options.hpp"
+#include "storage/lsm/range_tombstone.hpp"
+#include "storage/lsm/skiplist.hpp"
+#include "storage/lsm/write_batch.hpp"
 
 namespace wing {
 
@@ -16,18 +22,62 @@ namespace lsm {
 
 class MemTableIterator;
 
+/* The data structure that stores the records of a MemTable. */
+enum class MemTableRep : uint8_t {
+  /* Lock-free skiplist. Writers and readers never block each other. */
+  kSkipList = 0,
+  /* std::map protected by a shared_mutex. */
+  kMap,
+};
+
 class MemTable {
  public:
-  MemTable() : size_(0) {}
+  MemTable(MemTableRep rep = MemTableRep::kSkipList)
+    : rep_(rep), size_(0), list_(std::make_unique<SkipList>(&alloc_)) {}
 
+  /* Put and Del are thread-safe. */
   void Put(Slice user_key, seq_t seq, Slice value);
 
   void Del(Slice user_key, seq_t seq);
 
-  /* Find a record with the same key and the largest sequence number <= seq */
+  /**
+   * Delete the user keys in [begin, end). The range tombstone is kept aside
+   * from the records, and written to the SSTables by the flush. It is
+   * thread-safe.
+   */
+  void DeleteRange(Slice begin, Slice end, seq_t seq);
+
+  /**
+   * Insert all the operations in the batch. The i-th operation gets sequence
+   * number first_seq + i. It is thread-safe.
+   */
+  void Apply(const WriteBatch& batch, seq_t first_seq);
+
+  /**
+   * Find a record with the same key and the largest sequence number <= seq.
+   * It returns kDelete if a range tombstone <= seq deletes the record.
+   */
   GetResult Get(Slice user_key, seq_t seq, std::string* value);
 
-  size_t size() const { return size_; }
+  /* The range tombstones, sorted by begin key. */
+  std::vector<RangeTombstone> GetRangeTombstones() const;
+
+  /**
+   * An immutable snapshot of the range tombstones. DeleteRange publishes a
+   * new one instead of modifying it, so readers never take a lock.
+   */
+  struct RangeTombstoneList {
+    /* Sorted by begin key. */
+    std::vector<RangeTombstone> tombstones_;
+    RangeTombstoneFragments fragments_;
+  };
+
+  /* The current snapshot, or nullptr if there are no range tombstones. */
+  std::shared_ptr<const RangeTombstoneList> GetRangeTombstoneList() const;
+
+  size_t size() const { return size_.load(std::memory_order_relaxed); }
+
+  MemTableRep rep() const { return rep_; }
 
   std::map<ParsedKey, Slice>& GetTable() { return table_; }
 
@@ -43,46 +93,97 @@ class MemTable {
 
   bool GetFlushComplete() const { return flush_complete_; }
 
+  /* Require: there are no concurrent readers or writers. */
   void Clear();
 
+  /* The write-ahead logs which contain the records of the MemTable. */
+  const std::vector<std::string>& GetLogFiles() const { return log_files_; }
+
+  void AddLogFile(std::string filename) {
+    log_files_.push_back(std::move(filename));
+  }
+
  private:
+  /* Copy the record into the arena and return the copied key and value. */
+  std::pair<ParsedKey, Slice> CopyRecord(ParsedKey key, Slice value);
+
   void Add(ParsedKey key, Slice value);
 
+  /* The largest sequence number <= seq of the range tombstones of key. */
+  seq_t MaxCoveringSeq(Slice user_key, seq_t seq) const;
+
+  MemTableRep rep_;
   std::shared_mutex mu_;
+  /* Only used if rep_ is MemTableRep::kMap. */
   std::map<ParsedKey, Slice> table_;
-  uint64_t size_;
-  ArenaAllocator alloc_;
+  std::atomic<uint64_t> size_;
+  ConcurrentArenaAllocator alloc_;
+  /* Only used if rep_ is MemTableRep::kSkipList. */
+  std::unique_ptr<SkipList> list_;
   bool flush_in_progress_{false};
   bool flush_complete_{false};
+  std::vector<std::string> log_files_;
+  /* It serializes the writers of range_tombstones_. */
+  std::mutex range_mutex_;
+  std::atomic<std::shared_ptr<const RangeTombstoneList>> range_tombstones_;
+  /* Lookups do not load range_tombstones_ if there are no tombstones. */
+  std::atomic<bool> has_range_tombstones_{false};
 
   friend class MemTableIterator;
 };
 
 class MemTableIterator final : public Iterator {
  public:
-  MemTableIterator(MemTable* table) : table_(table) {}
+  MemTableIterator(MemTable* table)
+    : table_(table),
+      is_list_(table->rep_ == MemTableRep::kSkipList),
+      list_it_(table->list_.get()) {}
 
   void Seek(Slice key, seq_t seq) {
-    it_ = table_->table_.lower_bound(ParsedKey(key, seq, RecordType::Value));
+    if (is_list_) {
+      list_it_.Seek(ParsedKey(key, seq, RecordType::Value));
+    } else {
+      it_ = table_->table_.lower_bound(ParsedKey(key, seq, RecordType::Value));
+    }
   }
 
-  void SeekToFirst() { it_ = table_->table_.begin(); }
+  void SeekToFirst() {
+    if (is_list_) {
+      list_it_.SeekToFirst();
+    } else {
+      it_ = table_->table_.begin();
+    }
+  }
 
-  bool Valid() override { return it_ != table_->table_.end(); }
+  bool Valid() override {
+    return is_list_ ? list_it_.Valid() : it_ != table_->table_.end();
+  }
 
+  /* The key is stored contiguously as (user_key, seq, type) in the arena. */
   Slice key() const override {
-    return Slice(it_->first.user_key_.data(), it_->first.size());
+    const ParsedKey& key = is_list_ ? list_it_.key() : it_->first;
+    return Slice(key.user_key_.data(), key.size());
   }
 
-  Slice value() const override { return it_->second; }
+  Slice value() const override {
+    return is_list_ ? list_it_.value() : it_->second;
+  }
 
-  void Next() override { it_++; }
+  void Next() override {
+    if (is_list_) {
+      list_it_.Next();
+    } else {
+      it_++;
+    }
+  }
 
  private:
   MemTable* table_;
+  bool is_list_;
+  SkipList::Iterator list_it_;
   std::map<ParsedKey, Slice>::iterator it_;
 };
 
 }  // namespace lsm
 
-}  // namespace wing
\ No newline at end of file
+}  // namespace wing
@@ -1,8 +1,12 @@
 #pragma once
 
 #include <filesystem>
+#include <memory>
+#include <optional>
+#include <string>
 
 #include "storage/lsm/cache.hpp"
+#include "storage/lsm/prefix_extractor.hpp"
 
 namespace wing {
 
@@ -15,16 +19,77 @@ struct Options {
   uint64_t sst_file_size = 64 * 1024 * 1024;
   /* The target size of data block in SSTable */
   size_t block_size = 4 * 1024;
+  /**
+   * The number of entries between two restart points in a data block. Keys
+   * between restart points are prefix-compressed against the previous key,
+   * and lookups binary search the restart points. A larger interval makes
+   * blocks smaller but scans more entries per lookup.
+   */
+  size_t block_restart_interval = 16;
+  /**
+   * Append a hash index to each data block, which maps user keys to restart
+   * points, so that point lookups skip the binary search in the block.
+   */
+  bool enable_block_hash_index = false;
+  /**
+   * The data structure of MemTables. Options are 'skiplist' (lock-free, the
+   * default) and 'map' (std::map protected by a shared_mutex).
+   */
+  std::string memtable_rep_name = "skiplist";
+  /* Write records to the write-ahead log before inserting them to MemTable */
+  bool enable_wal = true;
+  /**
+   * When the write-ahead log is synced to disk. Options are
+   * 'sync' (fdatasync every write group before returning),
+   * 'interval' (fdatasync every wal_sync_interval_ms in the background) and
+   * 'none' (only write to the OS page cache, survives process crashes).
+   */
+  std::string wal_sync_mode = "none";
+  /* The sync interval of the write-ahead log in 'interval' mode */
+  size_t wal_sync_interval_ms = 100;
   /* The size of write buffer */
   size_t write_buffer_size = 1024 * 1024;
   /* Use O_DIRECT or not */
   bool use_direct_io = false;
+  /**
+   * Map SSTable files into memory and read data blocks from the mapping
+   * without copies, instead of reading them into the block cache. It is
+   * useful if the data fits in the page cache. Iterators ask the OS to read
+   * ahead, and point lookups disable the readahead. It is ignored if
+   * use_direct_io is true.
+   */
+  bool use_mmap_reads = false;
+  /**
+   * The maximum number of data blocks that an iterator reads ahead
+   * asynchronously (through io_uring, or a thread pool if it is not
+   * available). The readahead starts when an iterator moves to the next data
+   * block, and its size doubles every block up to this limit. When it reaches
+   * the end of an SSTable, the next SSTable of the sorted run is read ahead.
+   * 0 disables the readahead.
+   */
+  size_t max_readahead_blocks = 8;
   /* Use bloom filter or not*/
   bool enable_bloom_filter = true;
   /* Whether we create a new database in the directory */
   bool create_new = true;
   /* The maximum number of immutable MemTables. */
   size_t max_immutable_count = 4;
+  /* The number of threads which flush immutable MemTables in parallel */
+  size_t flush_threads = 2;
+  /**
+   * If it is true, the immutable MemTables picked by one flush are merged
+   * into one sorted run, so that fewer sorted runs are added to Level 0.
+   */
+  bool merge_immutables_on_flush = false;
+  /* The number of background compaction threads */
+  size_t compaction_threads = 2;
+  /**
+   * The maximum number of threads which run one compaction. The key space of
+   * a compaction is split at the SSTable boundaries of its largest input
+   * (usually the target sorted run), and each range is merged by its own
+   * thread.
+   */
+  size_t max_subcompactions = 1;
   /* The name of compaction strategy. */
   std::string compaction_strategy_name = "leveled";
   /* The minimum number of sorted runs for triggering compaction in Level 0*/
@@ -34,10 +99,58 @@ struct Options {
    * It stops writes when the number of sorted runs reaches this limit.
    */
   size_t level0_stop_writes_trigger = 20;
+  /**
+   * The number of sorted runs in Level 0 at which writes start to be delayed.
+   * The delay grows until the number reaches level0_stop_writes_trigger.
+   */
+  size_t level0_slowdown_writes_trigger = 16;
+  /**
+   * Writes are delayed if the estimated bytes to be compacted exceed the soft
+   * limit. The delay grows until the hard limit.
+   */
+  size_t soft_pending_compaction_bytes_limit = 64ull << 30;
+  size_t hard_pending_compaction_bytes_limit = 256ull << 30;
+  /* The maximum rate of delayed writes in bytes per second */
+  uint64_t delayed_write_rate = 64 << 20;
   /* The default size ratio used in tiering/leveling compaction strategy. */
   size_t compaction_size_ratio = 10;
   /* The number of bits per key in bloom filter, by default */
   size_t bloom_bits_per_key = 10;
+  /**
+   * Choose the bits per key of the bloom filters of each new sorted run from
+   * the shape of the LSM tree (Monkey), instead of using bloom_bits_per_key
+   * everywhere. bloom_bits_per_key is then the average over all the keys, i.e.
+   * it sets the total memory of filters, and the bits are moved from the large
+   * runs in lower levels to the small runs in upper levels, which minimizes
+   * the expected number of false positive I/Os of a point lookup. SSTables
+   * moved to the next level without rewriting keep their filters, so the
+   * memory may differ from the budget. See DBImpl::GetBloomFilterStats for
+   * the resulting false positive rates.
+   */
+  bool enable_per_level_bloom_bits = false;
+  /**
+   * The prefix extractor of user keys, e.g. NewFixedPrefixExtractor(8) if the
+   * keys start with an 8-byte tenant id. If it is set, SSTables have a prefix
+   * bloom filter, and iterators with ReadOptions::prefix_same_as_start skip
+   * the sorted runs without the prefix of the seek key.
+   */
+  std::shared_ptr<const PrefixExtractor> prefix_extractor;
+  /**
+   * Key-value separation. The values of at least min_blob_size bytes are
+   * written to blob files by flushes, and the SSTables only store their
+   * BlobIndex (file, offset, size), so that compactions do not rewrite the
+   * large values. Reads resolve the indexes lazily. 0 disables it.
+   */
+  size_t min_blob_size = 0;
+  /* The target size of blob files */
+  size_t blob_file_size = 256 * 1024 * 1024;
+  /**
+   * The garbage collection of blob files. Compactions copy the live values
+   * in the oldest blob_gc_age_cutoff of the blob files to new blob files, so
+   * that the old files become obsolete and are removed. A blob file is also
+   * removed once all its values are overwritten or deleted.
+   */
+  double blob_gc_age_cutoff = 0.25;
   /* The target scan length in part3 */
   double target_scan_length_part3 = 0;
   /* The target alpha in part3 */
@@ -45,6 +158,22 @@ struct Options {
   CacheOptions cache{};
 };
 
+/* The options of an iterator, see DBImpl::Seek. */
+struct ReadOptions {
+  /**
+   * Only iterate the user keys with the same prefix as the key of Seek,
+   * extracted by Options::prefix_extractor. The sorted runs whose prefix
+   * bloom filters exclude the prefix are not read. It is ignored if the key
+   * has no prefix, or the iterator starts with SeekToFirst.
+   */
+  bool prefix_same_as_start = false;
+  /**
+   * If it is set, the iterator becomes invalid at the first user key >= it,
+   * and the sorted runs whose keys are all >= it are not read.
+   */
+  std::optional<std::string> iterate_upper_bound;
+};
+
 }  // namespace lsm
 
 }  // namespace wing
\ No newline at end of file
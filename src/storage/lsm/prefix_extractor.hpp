@@ -0,0 +1,58 @@
+#pragma once
+
+#include <fmt/format.h>
+
+#include <memory>
+#include <string>
+
+#include "storage/lsm/format.hpp"
+
+namespace wing {
+
+namespace lsm {
+
+/**
+ * It extracts the prefix of a user key, e.g. the tenant id of a composite
+ * key. The keys with the same prefix must be contiguous in the key order,
+ * i.e. if a <= b <= c and a and c have the same prefix, so does b.
+ *
+ * SSTables store the prefixes of their keys in a prefix bloom filter, tagged
+ * with Name(). The filter is only used if the name matches the extractor of
+ * the reader, so the name must change if the extracted prefixes change.
+ */
+class PrefixExtractor {
+ public:
+  virtual ~PrefixExtractor() = default;
+
+  virtual std::string Name() const = 0;
+
+  /* Whether the key has a prefix. */
+  virtual bool InDomain(Slice key) const = 0;
+
+  /* The prefix of the key. Require: InDomain(key) */
+  virtual Slice Transform(Slice key) const = 0;
+};
+
+/* The first len bytes of the keys which are not shorter than len. */
+class FixedPrefixExtractor final : public PrefixExtractor {
+ public:
+  FixedPrefixExtractor(size_t len) : len_(len) {}
+
+  std::string Name() const override { return fmt::format("fixed:{}", len_); }
+
+  bool InDomain(Slice key) const override { return key.size() >= len_; }
+
+  Slice Transform(Slice key) const override { return key.substr(0, len_); }
+
+ private:
+  size_t len_;
+};
+
+inline std::shared_ptr<const PrefixExtractor> NewFixedPrefixExtractor(
+    size_t len) {
+  return std::make_shared<FixedPrefixExtractor>(len);
+}
+
+}  // namespace lsm
+
+}  // namespace wing
@@ -0,0 +1,103 @@
+#include "storage/lsm/range_tombstone.hpp"
+
+#include <algorithm>
+#include <functional>
+#include <set>
+
+namespace wing {
+
+namespace lsm {
+
+void SortRangeTombstones(std::vector<RangeTombstone>* tombstones) {
+  std::sort(tombstones->begin(), tombstones->end(),
+      [](const RangeTombstone& a, const RangeTombstone& b) {
+        return a.begin_ != b.begin_ ? a.begin_ < b.begin_ : a.seq_ > b.seq_;
+      });
+}
+
+seq_t MaxCoveringSeq(
+    std::span<const RangeTombstone> tombstones, Slice key, seq_t seq) {
+  seq_t ret = 0;
+  for (auto& tombstone : tombstones) {
+    if (tombstone.begin_ > key) {
+      break;
+    }
+    if (key < tombstone.end_ && tombstone.seq_ <= seq) {
+      ret = std::max(ret, tombstone.seq_);
+    }
+  }
+  return ret;
+}
+
+std::vector<RangeTombstone> ClipRangeTombstones(
+    std::span<const RangeTombstone> tombstones, std::optional<Slice> lower,
+    std::optional<Slice> upper) {
+  std::vector<RangeTombstone> ret;
+  for (auto& tombstone : tombstones) {
+    RangeTombstone clipped = tombstone;
+    if (lower && clipped.begin_ < *lower) {
+      clipped.begin_ = *lower;
+    }
+    if (upper && clipped.end_ > *upper) {
+      clipped.end_ = *upper;
+    }
+    if (clipped.begin_ < clipped.end_) {
+      ret.push_back(std::move(clipped));
+    }
+  }
+  return ret;
+}
+
+RangeTombstoneFragments::RangeTombstoneFragments(
+    std::span<const RangeTombstone> tombstones, seq_t seq) {
+  /* Sweep the begin and end keys in order, keeping the sequence numbers of
+   * the tombstones containing the current fragment. */
+  std::vector<std::pair<Slice, const RangeTombstone*>> events;
+  for (auto& tombstone : tombstones) {
+    if (tombstone.seq_ <= seq && tombstone.begin_ < tombstone.end_) {
+      events.emplace_back(tombstone.begin_, &tombstone);
+      events.emplace_back(tombstone.end_, &tombstone);
+    }
+  }
+  std::sort(events.begin(), events.end(),
+      [](auto& a, auto& b) { return a.first < b.first; });
+  std::multiset<seq_t, std::greater<>> active;
+  offsets_.push_back(0);
+  for (size_t i = 0; i < events.size();) {
+    Slice key = events[i].first;
+    for (; i < events.size() && events[i].first == key; i++) {
+      auto tombstone = events[i].second;
+      if (key == tombstone->begin_) {
+        active.insert(tombstone->seq_);
+      } else {
+        active.erase(active.find(tombstone->seq_));
+      }
+    }
+    /* Merge the adjacent fragments with the same sequence numbers. */
+    if (!bounds_.empty() &&
+        std::equal(seqs_.begin() + offsets_[offsets_.size() - 2],
+            seqs_.end(), active.begin(), active.end())) {
+      continue;
+    }
+    bounds_.emplace_back(key);
+    seqs_.insert(seqs_.end(), active.begin(), active.end());
+    offsets_.push_back(seqs_.size());
+  }
+}
+
+seq_t RangeTombstoneFragments::MaxCoveringSeq(Slice key, seq_t seq) const {
+  auto it = std::upper_bound(bounds_.begin(), bounds_.end(), key,
+      [](Slice key, const std::string& bound) { return key < bound; });
+  if (it == bounds_.begin()) {
+    return 0;
+  }
+  size_t i = it - bounds_.begin() - 1;
+  auto end = seqs_.begin() + offsets_[i + 1];
+  auto found =
+      std::lower_bound(seqs_.begin() + offsets_[i], end, seq, std::greater<>());
+  return found == end ? 0 : *found;
+}
+
+}  // namespace lsm
+
+}  // namespace wing
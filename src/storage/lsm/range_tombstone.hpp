@@ -0,0 +1,79 @@
+#pragma once
+
+#include <limits>
+#include <optional>
+#include <span>
+#include <string>
+#include <vector>
+
+#include "storage/lsm/format.hpp"
+
+namespace wing {
+
+namespace lsm {
+
+/**
+ * A range tombstone written by DBImpl::DeleteRange. It deletes the records of
+ * the user keys in [begin_, end_) whose sequence numbers are smaller than
+ * seq_.
+ */
+struct RangeTombstone {
+  std::string begin_;
+  std::string end_;
+  seq_t seq_;
+
+  bool Contains(Slice key) const { return begin_ <= key && key < end_; }
+};
+
+/* Sort the range tombstones by begin key, as MaxCoveringSeq requires. */
+void SortRangeTombstones(std::vector<RangeTombstone>* tombstones);
+
+/**
+ * The largest sequence number <= seq of the range tombstones containing key,
+ * or 0 if there is none. The tombstones must be sorted by begin key.
+ */
+seq_t MaxCoveringSeq(
+    std::span<const RangeTombstone> tombstones, Slice key, seq_t seq);
+
+/* The parts of the range tombstones in [lower, upper). */
+std::vector<RangeTombstone> ClipRangeTombstones(
+    std::span<const RangeTombstone> tombstones, std::optional<Slice> lower,
+    std::optional<Slice> upper);
+
+/**
+ * The range tombstones visible to a snapshot, split at their begin and end
+ * keys into disjoint fragments, each of which keeps the sequence numbers of
+ * the tombstones covering it. It is built once per iterator, compaction,
+ * sorted run or MemTable snapshot, and then each key is checked by a binary
+ * search instead of a scan of all the tombstones.
+ */
+class RangeTombstoneFragments {
+ public:
+  RangeTombstoneFragments() = default;
+
+  /* Only the tombstones whose sequence numbers are <= seq are used. */
+  RangeTombstoneFragments(std::span<const RangeTombstone> tombstones,
+      seq_t seq = std::numeric_limits<seq_t>::max());
+
+  /**
+   * The largest sequence number <= seq of the tombstones containing key, or
+   * 0 if there is none.
+   */
+  seq_t MaxCoveringSeq(
+      Slice key, seq_t seq = std::numeric_limits<seq_t>::max()) const;
+
+  bool empty() const { return bounds_.empty(); }
+
+ private:
+  /**
+   * Fragment i is [bounds_[i], bounds_[i + 1]), which is covered by the
+   * sequence numbers seqs_[offsets_[i], offsets_[i + 1]) in descending order.
+   */
+  std::vector<std::string> bounds_;
+  std::vector<size_t> offsets_;
+  std::vector<seq_t> seqs_;
+};
+
+}  // namespace lsm
+
+}  // namespace wing
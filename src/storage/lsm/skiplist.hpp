@@ -0,0 +1,186 @@
+#pragma once
+
+#include <atomic>
+#include <random>
+
+#include "common/allocator.hpp"
+#include "storage/lsm/format.hpp"
+
+namespace wing {
+
+namespace lsm {
+
+/**
+ * A lock-free skiplist which supports multiple concurrent writers and readers.
+ *
+ * Nodes are allocated in a ConcurrentArenaAllocator and are never removed,
+ * so readers can traverse the list without any locks. A writer links a new
+ * node level by level from the bottom up using compare-and-swap, and retries
+ * the splice of a level if another writer changes it concurrently. A node is
+ * visible to readers once it is linked in level 0.
+ *
+ * The keys are ParsedKeys, whose user_key_ and the value must point to memory
+ * that outlives the skiplist (usually the same arena).
+ */
+class SkipList {
+ public:
+  static constexpr int kMaxHeight = 12;
+  /* The probability of increasing the height is 1 / kBranching. */
+  static constexpr uint32_t kBranching = 4;
+
+  struct Node {
+    ParsedKey key_;
+    Slice value_;
+
+    Node* Next(int level) const {
+      return next_[level].load(std::memory_order_acquire);
+    }
+
+    void SetNextRelaxed(int level, Node* x) {
+      next_[level].store(x, std::memory_order_relaxed);
+    }
+
+    bool CASNext(int level, Node* expected, Node* x) {
+      return next_[level].compare_exchange_strong(
+          expected, x, std::memory_order_release, std::memory_order_relaxed);
+    }
+
+    /* The array has the length of the height of the node. It must be the
+     * last member. */
+    std::atomic<Node*> next_[1];
+  };
+
+  class Iterator {
+   public:
+    Iterator() = default;
+
+    Iterator(const SkipList* list) : list_(list) {}
+
+    bool Valid() const { return node_ != nullptr; }
+
+    const ParsedKey& key() const { return node_->key_; }
+
+    Slice value() const { return node_->value_; }
+
+    void Next() { node_ = node_->Next(0); }
+
+    void SeekToFirst() { node_ = list_->head_->Next(0); }
+
+    /* Find the first node >= key */
+    void Seek(const ParsedKey& key) {
+      node_ = list_->FindGreaterOrEqual(key);
+    }
+
+   private:
+    const SkipList* list_{nullptr};
+    Node* node_{nullptr};
+  };
+
+  SkipList(ConcurrentArenaAllocator* arena) : arena_(arena) {
+    head_ = NewNode(ParsedKey(), Slice(), kMaxHeight);
+    for (int i = 0; i < kMaxHeight; i++) {
+      head_->SetNextRelaxed(i, nullptr);
+    }
+  }
+
+  SkipList(const SkipList&) = delete;
+  SkipList& operator=(const SkipList&) = delete;
+
+  /* Insert a key. It is thread-safe. */
+  void Insert(const ParsedKey& key, Slice value) {
+    int height = RandomHeight();
+    Node* x = NewNode(key, value, height);
+    int max_height = max_height_.load(std::memory_order_relaxed);
+    while (height > max_height) {
+      if (max_height_.compare_exchange_weak(max_height, height)) {
+        break;
+      }
+    }
+    Node* prev[kMaxHeight];
+    Node* next[kMaxHeight];
+    /* Compute the splice at each level from the top. Levels above the old max
+     * height only contain head_. */
+    Node* before = head_;
+    for (int i = kMaxHeight - 1; i >= 0; i--) {
+      FindSpliceForLevel(key, before, i, &prev[i], &next[i]);
+      before = prev[i];
+    }
+    for (int i = 0; i < height; i++) {
+      while (true) {
+        x->SetNextRelaxed(i, next[i]);
+        if (prev[i]->CASNext(i, next[i], x)) {
+          break;
+        }
+        /* Someone inserted into this level. prev[i] is still before key, so
+         * search again from it. */
+        FindSpliceForLevel(key, prev[i], i, &prev[i], &next[i]);
+      }
+    }
+  }
+
+  /* Return the first node >= key, or nullptr. */
+  Node* FindGreaterOrEqual(const ParsedKey& key) const {
+    Node* x = head_;
+    int level = max_height_.load(std::memory_order_relaxed) - 1;
+    while (true) {
+      Node* next = x->Next(level);
+      if (next != nullptr && next->key_ < key) {
+        x = next;
+      } else if (level == 0) {
+        return next;
+      } else {
+        level--;
+      }
+    }
+  }
+
+  Iterator Begin() const {
+    Iterator it(this);
+    it.SeekToFirst();
+    return it;
+  }
+
+ private:
+  Node* NewNode(const ParsedKey& key, Slice value, int height) {
+    size_t size = sizeof(Node) + sizeof(std::atomic<Node*>) * (height - 1);
+    auto x = new (arena_->Allocate(size)) Node;
+    x->key_ = key;
+    x->value_ = value;
+    /* Construct the remaining std::atomic<Node*>s. */
+    for (int i = 1; i < height; i++) {
+      new (&x->next_[i]) std::atomic<Node*>(nullptr);
+    }
+    return x;
+  }
+
+  /* Find prev and next such that prev < key <= next at the level. */
+  void FindSpliceForLevel(const ParsedKey& key, Node* before, int level,
+      Node** out_prev, Node** out_next) const {
+    while (true) {
+      Node* next = before->Next(level);
+      if (next == nullptr || !(next->key_ < key)) {
+        *out_prev = before;
+        *out_next = next;
+        return;
+      }
+      before = next;
+    }
+  }
+
+  static int RandomHeight() {
+    thread_local std::minstd_rand rgen(std::random_device{}());
+    int height = 1;
+    while (height < kMaxHeight && rgen() % kBranching == 0) {
+      height++;
+    }
+    return height;
+  }
+
+  ConcurrentArenaAllocator* arena_;
+  Node* head_;
+  std::atomic<int> max_height_{1};
+};
+
+}  // namespace lsm
+
+}  // namespace wing
@@ -5,50 +5,94 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <cstring>
 #include <fstream>
+#include <limits>
 
 #include "common/bloomfilter.hpp"
+#include "storage/lsm/stats.hpp"
 
 namespace wing {
 
 namespace lsm {
 
-SSTable::SSTable(SSTInfo sst_info, size_t block_size, bool use_direct_io)
-  : sst_info_(std::move(sst_info)), block_size_(block_size) {
-  file_ = std::make_unique<ReadFile>(sst_info_.filename_, use_direct_io);
-  FileReader reader(file_.get(), sst_info_.size_ - sst_info_.index_offset_, sst_info_.index_offset_);
-
-  uint32_t reader_offset = sst_info_.index_offset_;
-
-  while (reader_offset < sst_info_.bloom_filter_offset_){
-
-      // read size
-      uint32_t ksize = reader.ReadValue<uint32_t>();
-      std::string user_key = reader.ReadString(ksize);
-      seq_t seq_ = reader.ReadValue<seq_t>();
-      RecordType type_ = reader.ReadValue<RecordType>();
-      InternalKey key(user_key, seq_, type_);
-
-      offset_t bh_offset = reader.ReadValue<offset_t>();
-      offset_t bh_size = reader.ReadValue<offset_t>();
-      offset_t bh_count = reader.ReadValue<offset_t>();
+/* The size of the data that iterators read ahead in the mapped file. */
+static constexpr size_t kMmapReadaheadSize = 256 * 1024;
+/* An index entry is | key size u32 | internal key | offset | size | count |. */
+static constexpr size_t kIndexHandleSize = 3 * sizeof(offset_t);
+/* The maximum number of data blocks that MultiGet reads at the same time. */
+static constexpr size_t kMultiGetMaxAsyncReads = 64;
+
+/**
+ * Find the newest version of key visible to seq in the data block, and set
+ * *found_seq to its sequence number. It returns kNotFound if the block does
+ * not contain the key.
+ */
+static GetResult GetInBlock(BlockIterator* it, Slice key, uint64_t seq,
+    std::string* value, seq_t* found_seq) {
+  /* The first record >= (key, seq) is in this block. It is the newest
+   * version visible to seq if its user key is key. */
+  it->SeekForGet(key, seq);
+  if (!it->Valid()) {
+    return GetResult::kNotFound;
+  }
+  ParsedKey pk(it->key());
+  if (pk.user_key_ != key) {
+    return GetResult::kNotFound;
+  }
+  *found_seq = pk.seq_;
+  if (pk.type_ == RecordType::Deletion ||
+      pk.type_ == RecordType::RangeDeletion) {
+    return GetResult::kDelete;
+  }
+  *value = it->value();
+  return pk.type_ == RecordType::BlobIndex ? GetResult::kBlobIndex
+                                           : GetResult::kFound;
+}
 
-      
-      BlockHandle handle;
-      handle.offset_ = bh_offset;
-      handle.size_ = bh_size;
-      handle.count_ = bh_count;
-      IndexValue iv;
-      iv.key_ = key;
-      iv.block_ = handle;
+/**
+ * Read a bloom filter of size bytes into *buf. The bit array is aligned to a
+ * cache line, so that a probe of a blocked bloom filter touches one cache
+ * line. Return the filter in *buf.
+ */
+static Slice ReadBloomFilter(
+    FileReader* reader, size_t size, std::string* buf) {
+  constexpr size_t kLineSize = utils::BloomFilter::kLineSize;
+  buf->resize(size + kLineSize);
+  auto array = reinterpret_cast<uintptr_t>(buf->data()) +
+               utils::BloomFilter::kHeaderSize;
+  size_t shift = (kLineSize - array % kLineSize) % kLineSize;
+  reader->Read(buf->data() + shift, size);
+  return Slice(buf->data() + shift, size);
+}
 
-      index_.push_back(iv);
-      reader_offset += 3 * sizeof(offset_t) + sizeof(uint32_t) + key.size();
+SSTable::SSTable(SSTInfo sst_info, size_t block_size, bool use_direct_io,
+    Cache* cache, bool use_mmap, size_t max_readahead_blocks)
+  : sst_info_(std::move(sst_info)),
+    block_size_(block_size),
+    cache_(cache),
+    max_readahead_blocks_(max_readahead_blocks) {
+  file_ = std::make_unique<ReadFile>(
+      sst_info_.filename_, use_direct_io, use_mmap);
+  /* Point lookups read single blocks, so the readahead of the OS is wasted.
+   * Iterators ask for readahead explicitly. */
+  file_->Advise(0, sst_info_.size_, AccessPattern::kRandom);
+  FileReader reader(file_.get(), sst_info_.size_ - sst_info_.index_offset_, sst_info_.index_offset_);
 
+  /* The index is kept as it is in the file, and only the offsets of the
+   * entries are decoded, instead of allocating a key for every entry. */
+  index_data_ = reader.ReadString(
+      sst_info_.bloom_filter_offset_ - sst_info_.index_offset_);
+  for (size_t offset = 0; offset < index_data_.size();) {
+    index_offsets_.push_back(offset);
+    uint32_t ksize;
+    memcpy(&ksize, index_data_.data() + offset, sizeof(uint32_t));
+    offset += sizeof(uint32_t) + ksize + sizeof(seq_t) + sizeof(RecordType) +
+              kIndexHandleSize;
   }
 
   offset_t bloom_filter_size = reader.ReadValue<uint32_t>();
-  bloom_filter_ = reader.ReadString(bloom_filter_size);
+  bloom_filter_ = ReadBloomFilter(&reader, bloom_filter_size, &bloom_buf_);
 
   uint32_t sksize = reader.ReadValue<uint32_t>();
   std::string skuser_key = reader.ReadString(sksize);
@@ -62,6 +106,30 @@ SSTable::SSTable(SSTInfo sst_info, size_t block_size, bool use_direct_io)
   RecordType lktype_ = reader.ReadValue<RecordType>();
   largest_key_ = InternalKey(lkuser_key, lkseq_, lktype_);
 
+  /* The prefix bloom filter follows the footer. Older SSTables end here. */
+  size_t key_fields = sizeof(uint32_t) + sizeof(seq_t) + sizeof(RecordType);
+  size_t footer_end = sst_info_.bloom_filter_offset_ + sizeof(uint32_t) +
+                      bloom_filter_size + 2 * key_fields + sksize + lksize;
+  if (footer_end < sst_info_.size_) {
+    uint32_t name_size = reader.ReadValue<uint32_t>();
+    prefix_extractor_name_ = reader.ReadString(name_size);
+    uint32_t prefix_filter_size = reader.ReadValue<uint32_t>();
+    prefix_filter_ =
+        ReadBloomFilter(&reader, prefix_filter_size, &prefix_filter_buf_);
+    /* The range tombstones follow the prefix bloom filter. */
+    size_t prefix_end = footer_end + 2 * sizeof(uint32_t) + name_size +
+                        prefix_filter_size;
+    if (prefix_end < sst_info_.size_) {
+      uint32_t num_tombstones = reader.ReadValue<uint32_t>();
+      for (uint32_t i = 0; i < num_tombstones; i++) {
+        RangeTombstone tombstone;
+        tombstone.begin_ = reader.ReadString(reader.ReadValue<uint32_t>());
+        tombstone.end_ = reader.ReadString(reader.ReadValue<uint32_t>());
+        tombstone.seq_ = reader.ReadValue<seq_t>();
+        range_tombstones_.push_back(std::move(tombstone));
+      }
+    }
+  }
 }
 
 SSTable::~SSTable() {
@@ -80,178 +148,341 @@ SSTable::~SSTable() {
    * returns GetResult::kNotFound.
    * */
 GetResult SSTable::Get(Slice key, uint64_t seq, std::string* value) {
-
-  if (!(utils::BloomFilter::Find(key, bloom_filter_))){
-
-    return GetResult::kNotFound;
-
+  /* A range tombstone deletes the older records of the key, in this SSTable
+   * and in the older ones. */
+  seq_t tombstone_seq = MaxCoveringSeq(range_tombstones_, key, seq);
+  auto not_found =
+      tombstone_seq > 0 ? GetResult::kDelete : GetResult::kNotFound;
+  bloom_lookups_.fetch_add(1, std::memory_order_relaxed);
+  if (!(utils::BloomFilter::Find(key, bloom_filter_))) {
+    return not_found;
   }
 
-  int l = 0;
-  int r = index_.size() - 1;
-  int i = -1;
-  
-  while (l <= r){
-    int m = l + (r-l)/2;
-
-    if (ParsedKey(index_[m].key_) < ParsedKey(key, seq, RecordType::Value)){
-
-      i = m;
-      l = m + 1;
+  GetResult ret = GetResult::kNotFound;
+  seq_t found_seq = 0;
+  size_t i = FindBlock(key, seq);
+  if (i < BlockCount()) {
+    BlockHandle bh = IndexBlock(i);
+    std::optional<Cache::Handle> handle;
+    std::string block;
+    BlockIterator it(ReadBlock(bh, true, &handle, &block), bh);
+    ret = GetInBlock(&it, key, seq, value, &found_seq);
+  }
+  if (ret == GetResult::kNotFound) {
+    bloom_false_positives_.fetch_add(1, std::memory_order_relaxed);
+    return not_found;
+  }
+  return found_seq < tombstone_seq ? GetResult::kDelete : ret;
+}
 
+void SSTable::MultiGet(std::span<LookupKey*> keys, uint64_t seq) {
+  /* The keys are sorted, so the keys in the same data block are adjacent.
+   * Group them by block, skipping the keys filtered by the bloom filter. */
+  struct BlockLookup {
+    size_t block_id;
+    std::vector<LookupKey*> keys;
+    std::optional<Cache::Handle> handle;
+    std::unique_ptr<PrefetchedBlock> prefetched;
+  };
+  std::vector<size_t> hashes;
+  hashes.reserve(keys.size());
+  for (auto key : keys) {
+    hashes.push_back(utils::BloomFilter::BloomHash(key->user_key_));
+  }
+  BitVector may_exist(keys.size());
+  utils::BloomFilter::Find(hashes, bloom_filter_, may_exist);
+  std::vector<BlockLookup> lookups;
+  for (size_t j = 0; j < keys.size(); j++) {
+    if (!may_exist[j]) {
+      continue;
     }
-
-    else{
-
-      r = m - 1;
-
+    auto key = keys[j];
+    size_t i = FindBlock(key->user_key_, seq);
+    if (i >= BlockCount()) {
+      continue;
     }
-  }
-
-  if (i == -1){
-
-    if (ParsedKey(key, seq, RecordType::Value) > ParsedKey(index_[0].key_)){
-
-      return GetResult::kNotFound;
-
+    if (lookups.empty() || lookups.back().block_id != i) {
+      lookups.push_back(BlockLookup{i, {}, std::nullopt, nullptr});
     }
-
-  }
-
-  i++;
-
-  if (i >= index_.size()) {
-    
-    return GetResult::kNotFound;
-
+    lookups.back().keys.push_back(key);
   }
-
-  BlockHandle bh = index_[i].block_;
-  FileReader reader(file_.get(), bh.size_, bh.offset_);
-  std::string block = reader.ReadString(bh.size_);
-  BlockIterator it(block.c_str(), bh);
-  
-  GetResult getResult = GetResult::kNotFound;
-
-  for (it; it.Valid(); it.Next()){
-
-    ParsedKey pk(it.key());
-
-    if (pk.user_key_ == key && pk.seq_ <= seq){
-      if (pk.type_ == RecordType::Deletion){
-        if(getResult == GetResult::kNotFound){
-          getResult = GetResult::kDelete;
+  /* Submit the reads of all the missing blocks of a wave in one batch before
+   * waiting for any of them, so that they are served by the device in
+   * parallel. */
+  bool async = CanReadAsync();
+  std::vector<AsyncReadRequest*> reqs;
+  for (size_t begin = 0; begin < lookups.size();
+       begin += kMultiGetMaxAsyncReads) {
+    size_t end = std::min(begin + kMultiGetMaxAsyncReads, lookups.size());
+    reqs.clear();
+    for (size_t j = begin; async && j < end; j++) {
+      auto& lookup = lookups[j];
+      BlockHandle bh = IndexBlock(lookup.block_id);
+      if (cache_ != nullptr) {
+        lookup.handle = cache_->get(sst_info_.sst_id_, bh);
+        if (lookup.handle) {
+          continue;
         }
       }
-
-      else{
-
-        *value = it.value();
-        return GetResult::kFound;
-
+      lookup.prefetched =
+          std::make_unique<PrefetchedBlock>(lookup.block_id, bh.size_);
+      file_->PrepareAsync(lookup.prefetched->data.data(), bh.size_,
+          bh.offset_, &lookup.prefetched->req);
+      reqs.push_back(&lookup.prefetched->req);
+    }
+    if (!reqs.empty()) {
+      AsyncReader::Get().Submit(reqs);
+    }
+    for (size_t j = begin; j < end; j++) {
+      auto& lookup = lookups[j];
+      BlockHandle bh = IndexBlock(lookup.block_id);
+      std::string block;
+      const char* data;
+      if (lookup.prefetched != nullptr) {
+        data = TakePrefetchedBlock(
+            bh, true, lookup.prefetched.get(), &lookup.handle, &block);
+      } else if (lookup.handle) {
+        data = lookup.handle->block().data();
+      } else {
+        data = ReadBlock(bh, true, &lookup.handle, &block);
+      }
+      BlockIterator it(data, bh);
+      for (auto key : lookup.keys) {
+        key->result_ =
+            GetInBlock(&it, key->user_key_, seq, key->value_, &key->seq_);
       }
+      /* Unpin the block. */
+      lookup.handle.reset();
+      lookup.prefetched.reset();
     }
   }
+  size_t false_positives = 0;
+  for (size_t j = 0; j < keys.size(); j++) {
+    false_positives += may_exist[j] && keys[j]->result_ == GetResult::kNotFound;
+  }
+  bloom_lookups_.fetch_add(keys.size(), std::memory_order_relaxed);
+  bloom_false_positives_.fetch_add(false_positives, std::memory_order_relaxed);
+  if (range_tombstones_.empty()) {
+    return;
+  }
+  for (auto key : keys) {
+    seq_t tombstone_seq =
+        MaxCoveringSeq(range_tombstones_, key->user_key_, seq);
+    if (tombstone_seq > 0 && (key->result_ == GetResult::kNotFound ||
+                                 key->seq_ < tombstone_seq)) {
+      key->result_ = GetResult::kDelete;
+    }
+  }
+}
 
-  i--;
-
-  if (0 <= i && index_[i].key_.user_key() == key){
-    BlockHandle bh = index_[i].block_;
-    FileReader reader(file_.get(), bh.size_, bh.offset_);
-    std::string block = reader.ReadString(bh.size_);
-    BlockIterator it(block.c_str(), bh);
+size_t SSTable::BloomFilterBits() const {
+  return (bloom_filter_.size() - utils::BloomFilter::kHeaderSize) * 8;
+}
 
-    for (it; it.Valid(); it.Next()){
+bool SSTable::MayContainPrefix(
+    Slice prefix, const PrefixExtractor& prefix_extractor) const {
+  if (prefix_filter_.empty() ||
+      prefix_extractor_name_ != prefix_extractor.Name()) {
+    return true;
+  }
+  return utils::BloomFilter::Find(prefix, prefix_filter_);
+}
 
-      ParsedKey pk(it.key());
+Slice SSTable::IndexKey(size_t i) const {
+  const char* entry = index_data_.data() + index_offsets_[i];
+  uint32_t ksize;
+  memcpy(&ksize, entry, sizeof(uint32_t));
+  return Slice(entry + sizeof(uint32_t),
+      ksize + sizeof(seq_t) + sizeof(RecordType));
+}
 
-      if (pk.user_key_ == key && pk.seq_ <= seq){
-        if (pk.type_ == RecordType::Deletion){
-          if(getResult == GetResult::kNotFound){
-             getResult = GetResult::kDelete;
-          }
-        }
+BlockHandle SSTable::IndexBlock(size_t i) const {
+  Slice key = IndexKey(i);
+  const char* ptr = key.data() + key.size();
+  BlockHandle ret;
+  memcpy(&ret.offset_, ptr, sizeof(offset_t));
+  memcpy(&ret.size_, ptr + sizeof(offset_t), sizeof(offset_t));
+  memcpy(&ret.count_, ptr + 2 * sizeof(offset_t), sizeof(offset_t));
+  return ret;
+}
 
-        else{
+size_t SSTable::FindBlock(Slice key, uint64_t seq) const {
+  /* The index key is the largest key of a block, so the first record >=
+   * (key, seq) is in the first block whose index key >= (key, seq). */
+  ParsedKey target(key, seq, RecordType::Value);
+  size_t l = 0, r = BlockCount();
+  while (l < r) {
+    size_t m = (l + r) / 2;
+    if (ParsedKey(IndexKey(m)) < target) {
+      l = m + 1;
+    } else {
+      r = m;
+    }
+  }
+  return l;
+}
 
-          *value = it.value();
-          getResult = GetResult::kFound;
+bool SSTable::CanReadAsync() const {
+  return file_->mmap_data() == nullptr && !file_->use_direct_io();
+}
 
-        }
-      }
+const char* SSTable::ReadBlock(BlockHandle bh, bool fill_cache,
+    std::optional<Cache::Handle>* handle, std::string* buf) {
+  if (file_->mmap_data() != nullptr) {
+    handle->reset();
+    GetStatsContext()->total_read_bytes.fetch_add(
+        bh.size_, std::memory_order_relaxed);
+    return file_->mmap_data() + bh.offset_;
+  }
+  std::optional<Cache::Handle> cached;
+  if (cache_ != nullptr) {
+    cached = cache_->get(sst_info_.sst_id_, bh);
+  }
+  if (!cached) {
+    FileReader reader(file_.get(), bh.size_, bh.offset_);
+    if (cache_ == nullptr || !fill_cache) {
+      *buf = reader.ReadString(bh.size_);
+      handle->reset();
+      return buf->data();
     }
+    cached = cache_->insert(sst_info_.sst_id_, bh, reader.ReadString(bh.size_));
   }
+  /* The previous block is unpinned here. */
+  *handle = std::move(cached);
+  return (*handle)->block().data();
+}
 
-  return getResult;
+const char* SSTable::TakePrefetchedBlock(BlockHandle bh, bool fill_cache,
+    PrefetchedBlock* block, std::optional<Cache::Handle>* handle,
+    std::string* buf) {
+  block->req.Wait();
+  if (block->req.result != static_cast<ssize_t>(bh.size_)) {
+    DB_ERR("Read block error! Result: {}", block->req.result);
+  }
+  GetStatsContext()->num_prefetch_hits.fetch_add(
+      1, std::memory_order_relaxed);
+  if (cache_ == nullptr || !fill_cache) {
+    *buf = std::move(block->data);
+    handle->reset();
+    return buf->data();
+  }
+  *handle = cache_->insert(sst_info_.sst_id_, bh, std::move(block->data));
+  return (*handle)->block().data();
+}
 
+void SSTable::Prefetch(size_t begin, size_t end, PrefetchBuffer* buf) {
+  if (max_readahead_blocks_ == 0 || !CanReadAsync()) {
+    return;
+  }
+  /* The readahead window is submitted as one batch. */
+  std::vector<AsyncReadRequest*> reqs;
+  for (size_t i = begin; i < std::min(end, BlockCount()); i++) {
+    BlockHandle bh = IndexBlock(i);
+    if (cache_ != nullptr && cache_->contains(sst_info_.sst_id_, bh)) {
+      continue;
+    }
+    auto block = std::make_unique<PrefetchedBlock>(i, bh.size_);
+    file_->PrepareAsync(
+        block->data.data(), bh.size_, bh.offset_, &block->req);
+    reqs.push_back(&block->req);
+    buf->push_back(std::move(block));
+  }
+  if (!reqs.empty()) {
+    GetStatsContext()->num_prefetched_blocks.fetch_add(
+        reqs.size(), std::memory_order_relaxed);
+    AsyncReader::Get().Submit(reqs);
+  }
 }
 
-SSTableIterator SSTable::Seek(Slice key, uint64_t seq) {
+SSTableIterator SSTable::Seek(Slice key, uint64_t seq, bool fill_cache) {
   
-  SSTableIterator ssti = Begin();
+  SSTableIterator ssti = Begin(fill_cache);
   ssti.Seek(key, seq);
   return ssti;
 
 }
 
-SSTableIterator SSTable::Begin() { 
+SSTableIterator SSTable::Begin(bool fill_cache) { 
 
-  return SSTableIterator(this);
+  return SSTableIterator(this, fill_cache);
 
 }
 
 void SSTableIterator::Seek(Slice key, uint64_t seq) {
 
-  auto is = sst_->index_;
-  int l = 0;
-  int r = is.size() - 1;
-  int i = -1;
-  
-  while (l <= r){
-    int m = l + (r-l)/2;
+  block_id_ = sst_->FindBlock(key, seq);
+  ResetReadahead();
+  if (block_id_ >= sst_->BlockCount()) {
+    block_it_ = BlockIterator();
+    block_handle_.reset();
+    return;
+  }
+  LoadBlock();
+  block_it_.Seek(key, seq);
+}
 
-    if (ParsedKey(is[m].key_) < ParsedKey(key, seq, RecordType::Value)){
+void SSTableIterator::SeekToFirst() { 
 
-      i = m;
-      l = m + 1;
+  block_id_ = 0;
+  ResetReadahead();
+  LoadBlock();
 
-    }
+}
 
-    else{
+SSTableIterator::SSTableIterator(SSTable* sst, bool fill_cache,
+    PrefetchBuffer prefetched, size_t readahead_blocks)
+  : sst_(sst),
+    fill_cache_(fill_cache),
+    prefetched_(std::move(prefetched)),
+    readahead_blocks_(readahead_blocks),
+    prefetch_end_(readahead_blocks) {
+  block_id_ = 0;
+  LoadBlock();
+}
 
-      r = m - 1;
+void SSTableIterator::ResetReadahead() {
+  prefetched_.clear();
+  readahead_blocks_ = 0;
+  prefetch_end_ = 0;
+}
 
-    }
+void SSTableIterator::Readahead() {
+  size_t max_blocks = sst_->max_readahead_blocks_;
+  if (max_blocks == 0) {
+    return;
   }
-
-  block_id_ = i;
-  BlockHandle bh = sst_->index_[block_id_].block_;
-  FileReader reader(sst_->file_.get(), bh.size_, bh.offset_);
-  block_buf = reader.ReadString(bh.size_);
-  block_it_ = BlockIterator(block_buf.c_str(), bh);
-  block_it_.Seek(key, seq);
-
-  if (!(block_it_.Valid())){
-
-    block_id_++;
-    if (block_id_ < is.size()){
-      BlockHandle bh = sst_->index_[block_id_].block_;
-      FileReader reader(sst_->file_.get(), bh.size_, bh.offset_);
-      block_buf = reader.ReadString(bh.size_);
-      block_it_ = BlockIterator(block_buf.c_str(), bh);
-      block_it_.Seek(key, seq);
-    }
+  readahead_blocks_ =
+      std::min(std::max<size_t>(readahead_blocks_ * 2, 1), max_blocks);
+  size_t begin = std::max(prefetch_end_, block_id_ + 1);
+  size_t end = std::min(block_id_ + 1 + readahead_blocks_, sst_->BlockCount());
+  if (begin < end) {
+    sst_->Prefetch(begin, end, &prefetched_);
+    prefetch_end_ = end;
   }
 }
 
-void SSTableIterator::SeekToFirst() { 
-
-  block_id_ = 0;
-  BlockHandle bh = sst_->index_[block_id_].block_;
-  FileReader reader(sst_->file_.get(), bh.size_, bh.offset_);
-  block_buf = reader.ReadString(bh.size_);
-  block_it_ = BlockIterator(block_buf.c_str(), bh);
-
+void SSTableIterator::LoadBlock() {
+  BlockHandle bh = sst_->IndexBlock(block_id_);
+  if (sst_->file_->mmap_data() != nullptr &&
+      bh.offset_ + bh.size_ > readahead_end_) {
+    readahead_end_ = std::min<offset_t>(
+        bh.offset_ + kMmapReadaheadSize, sst_->sst_info_.index_offset_);
+    sst_->file_->Advise(
+        bh.offset_, readahead_end_ - bh.offset_, AccessPattern::kSequential);
+  }
+  while (!prefetched_.empty() && prefetched_.front()->block_id < block_id_) {
+    prefetched_.pop_front();
+  }
+  if (!prefetched_.empty() && prefetched_.front()->block_id == block_id_) {
+    auto block = std::move(prefetched_.front());
+    prefetched_.pop_front();
+    block_it_ = BlockIterator(sst_->TakePrefetchedBlock(bh, fill_cache_,
+                                  block.get(), &block_handle_, &block_buf),
+        bh);
+    return;
+  }
+  block_it_ = BlockIterator(
+      sst_->ReadBlock(bh, fill_cache_, &block_handle_, &block_buf), bh);
 }
 
 bool SSTableIterator::Valid() { 
@@ -282,17 +513,34 @@ void SSTableIterator::Next() {
   }
   block_id_++;
 
-  if (block_id_ < sst_->index_.size()){
+  if (block_id_ < sst_->BlockCount()){
+
+    Readahead();
+    LoadBlock();
+
+  } else {
+
+    /* Unpin the last block. */
+    block_handle_.reset();
 
-    BlockHandle bh = sst_->index_[block_id_].block_;
-    FileReader reader(sst_->file_.get(), bh.size_, bh.offset_);
-    block_buf = reader.ReadString(bh.size_);
-    block_it_ = BlockIterator(block_buf.c_str(), bh);
-  
   }
 
 }
   
+void SSTableBuilder::AddToFilters(Slice user_key) {
+  key_hashes_.push_back(utils::BloomFilter::BloomHash(user_key));
+  if (prefix_extractor_ == nullptr || !prefix_extractor_->InDomain(user_key)) {
+    return;
+  }
+  /* The keys are sorted, so the same prefixes are adjacent. */
+  Slice prefix = prefix_extractor_->Transform(user_key);
+  if (!has_last_prefix_ || prefix != last_prefix_) {
+    prefix_hashes_.push_back(utils::BloomFilter::BloomHash(prefix));
+    last_prefix_ = prefix;
+    has_last_prefix_ = true;
+  }
+}
+
 void SSTableBuilder::Append(ParsedKey key, Slice value) {
 
   if (block_builder_.Append(key, value)){
@@ -312,7 +560,7 @@ void SSTableBuilder::Append(ParsedKey key, Slice value) {
     
     count_ ++;
     
-    key_hashes_.push_back(utils::BloomFilter::BloomHash(key.user_key_));
+    AddToFilters(key.user_key_);
 
   }
 
@@ -332,7 +580,7 @@ void SSTableBuilder::Append(ParsedKey key, Slice value) {
     block_builder_.Finish();
     block_builder_.Clear();
     block_builder_.Append(key, value);
-    key_hashes_.push_back(utils::BloomFilter::BloomHash(key.user_key_));
+    AddToFilters(key.user_key_);
     
     if (count_ == 0){
 
@@ -352,6 +600,25 @@ void SSTableBuilder::Append(ParsedKey key, Slice value) {
   }
 }
 
+void SSTableBuilder::AddRangeTombstone(const RangeTombstone& tombstone) {
+  Append(
+      ParsedKey(tombstone.begin_, tombstone.seq_, RecordType::RangeDeletion),
+      Slice());
+  range_tombstones_.push_back(tombstone);
+}
+
+std::vector<RangeTombstone> SSTableBuilder::CutRangeTombstones(Slice key) {
+  std::vector<RangeTombstone> ret;
+  for (auto& tombstone : range_tombstones_) {
+    if (tombstone.end_ > key) {
+      ret.push_back(RangeTombstone{std::string(key), tombstone.end_,
+          tombstone.seq_});
+      tombstone.end_ = key;
+    }
+  }
+  return ret;
+}
+
 void SSTableBuilder::Finish() { 
   
   IndexValue iv;
@@ -398,10 +665,48 @@ void SSTableBuilder::Finish() {
   writer_->AppendString((smallest_key_).user_key());
   writer_->AppendValue<seq_t>((smallest_key_).seq());
   writer_->AppendValue<RecordType>((smallest_key_).record_type());
-  writer_->AppendValue<u_int32_t>((largest_key_).user_key().size());
-  writer_->AppendString((largest_key_).user_key());
-  writer_->AppendValue<seq_t>((largest_key_).seq());
-  writer_->AppendValue<RecordType>((largest_key_).record_type());
+  /* The key range covers the range tombstones. An end key is exclusive, so
+   * it gets the largest sequence number, which is ordered before all the
+   * records of the user key. */
+  InternalKey largest_key = largest_key_;
+  for (auto& tombstone : range_tombstones_) {
+    if (tombstone.end_ > largest_key.user_key()) {
+      largest_key = InternalKey(tombstone.end_,
+          std::numeric_limits<seq_t>::max(), RecordType::RangeDeletion);
+    }
+  }
+  writer_->AppendValue<u_int32_t>((largest_key).user_key().size());
+  writer_->AppendString((largest_key).user_key());
+  writer_->AppendValue<seq_t>((largest_key).seq());
+  writer_->AppendValue<RecordType>((largest_key).record_type());
+  largest_key_ = largest_key;
+
+  if (prefix_extractor_ != nullptr) {
+    std::string prefix_filter;
+    utils::BloomFilter::Create(
+        prefix_hashes_.size(), bloom_bits_per_key_, prefix_filter);
+    for (auto h : prefix_hashes_) {
+      utils::BloomFilter::Add(h, prefix_filter);
+    }
+    auto name = prefix_extractor_->Name();
+    writer_->AppendValue<uint32_t>(name.size());
+    writer_->AppendString(name);
+    writer_->AppendValue<uint32_t>(prefix_filter.size());
+    writer_->AppendString(prefix_filter);
+  } else if (!range_tombstones_.empty()) {
+    /* An empty prefix section, so that the range tombstones follow it. */
+    writer_->AppendValue<uint32_t>(0).AppendValue<uint32_t>(0);
+  }
+  if (!range_tombstones_.empty()) {
+    writer_->AppendValue<uint32_t>(range_tombstones_.size());
+    for (auto& tombstone : range_tombstones_) {
+      writer_->AppendValue<uint32_t>(tombstone.begin_.size())
+          .AppendString(tombstone.begin_)
+          .AppendValue<uint32_t>(tombstone.end_.size())
+          .AppendString(tombstone.end_)
+          .AppendValue<seq_t>(tombstone.seq_);
+    }
+  }
   writer_->Flush();
 
 }  // namespace lsm
@@ -1,5 +1,9 @@
 #pragma once
 
+#include <atomic>
+#include <deque>
+#include <optional>
+#include <span>
 #include <string>
 #include <vector>
 
@@ -10,6 +14,8 @@
 #include "storage/lsm/format.hpp"
 #include "storage/lsm/iterator.hpp"
 #include "storage/lsm/options.hpp"
+#include "storage/lsm/prefix_extractor.hpp"
+#include "storage/lsm/range_tombstone.hpp"
 
 namespace wing {
 
@@ -17,6 +23,21 @@ namespace lsm {
 
 class SSTableIterator;
 
+/* A data block which is read ahead asynchronously. */
+struct PrefetchedBlock {
+  PrefetchedBlock(size_t block_id, size_t size)
+    : block_id(block_id), data(size, 0) {}
+
+  /* The read may still be writing to data. */
+  ~PrefetchedBlock() { req.Wait(); }
+
+  size_t block_id;
+  std::string data;
+  AsyncReadRequest req;
+};
+
+using PrefetchBuffer = std::deque<std::unique_ptr<PrefetchedBlock>>;
+
 class SSTable {
  public:
   /**
@@ -25,8 +46,16 @@ class SSTable {
    * Below are global options (see lsm/options.hpp):
    * block_size: The size of data block in the SSTable
    * use_direct_io: Enable O_DIRECT or not.
+   * cache: The block cache. If it is nullptr, data blocks are read from the
+   * file every time.
+   * use_mmap: Map the file into memory and read data blocks from the mapping
+   * without copies. The block cache is not used in this case.
+   * max_readahead_blocks: The maximum number of data blocks that an iterator
+   * reads ahead asynchronously. 0 disables the readahead.
    */
-  SSTable(SSTInfo sst_info, size_t block_size, bool use_direct_io);
+  SSTable(SSTInfo sst_info, size_t block_size, bool use_direct_io,
+      Cache* cache = nullptr, bool use_mmap = false,
+      size_t max_readahead_blocks = 0);
 
   ~SSTable();
 
@@ -37,15 +66,37 @@ class SSTable {
    * If the record has type RecordType::Deletion, then it does nothing to the
    * value, and returns GetResult::kDelete If there is no such record, it
    * returns GetResult::kNotFound.
+   * If the record has type RecordType::BlobIndex, then it copies the encoded
+   * BlobIndex, and returns GetResult::kBlobIndex.
+   * If a range tombstone of the SSTable with sequence number <= seq contains
+   * key and is newer than the record, it returns GetResult::kDelete.
    * */
   GetResult Get(Slice key, uint64_t seq, std::string* value);
 
-  /* Return an iterator positioned at the first record that is not smaller than
-   * (key, seq). */
-  SSTableIterator Seek(Slice key, uint64_t seq);
+  /**
+   * Look up a batch of keys sorted by user key, whose results are all
+   * kNotFound. The keys in the same data block share one block read, and the
+   * data blocks which are not in the block cache are read in parallel.
+   */
+  void MultiGet(std::span<LookupKey*> keys, uint64_t seq);
+
+  /**
+   * The range tombstones sorted by begin key. They are within the key range
+   * of the SSTable, whose largest user key may be the end key of one.
+   */
+  const std::vector<RangeTombstone>& GetRangeTombstones() const {
+    return range_tombstones_;
+  }
+
+  /**
+   * Return an iterator positioned at the first record that is not smaller than
+   * (key, seq). If fill_cache is false, the data blocks read by the iterator
+   * are not inserted into the block cache, e.g. in compactions.
+   */
+  SSTableIterator Seek(Slice key, uint64_t seq, bool fill_cache = true);
 
   /* Return an iterator positioned at the beginning of the SSTable */
-  SSTableIterator Begin();
+  SSTableIterator Begin(bool fill_cache = true);
 
   /* The largest key of the SSTable. */
   ParsedKey GetLargestKey() const { return largest_key_; }
@@ -65,13 +116,85 @@ class SSTable {
 
   const SSTInfo& GetSSTInfo() const { return sst_info_; }
 
+  Cache* GetCache() const { return cache_; }
+
+  /* The number of data blocks. */
+  size_t BlockCount() const { return index_offsets_.size(); }
+
+  /* The number of bits in the bit array of the bloom filter. */
+  size_t BloomFilterBits() const;
+
+  /**
+   * Whether the SSTable may have user keys with the prefix, which is
+   * extracted by prefix_extractor. It is always true if the SSTable has no
+   * prefix bloom filter built by an extractor of the same name.
+   */
+  bool MayContainPrefix(
+      Slice prefix, const PrefixExtractor& prefix_extractor) const;
+
+  /* The number of lookups which have probed the bloom filter. */
+  uint64_t BloomLookups() const {
+    return bloom_lookups_.load(std::memory_order_relaxed);
+  }
+
+  /**
+   * The number of lookups which have passed the bloom filter but found no
+   * record of the key.
+   */
+  uint64_t BloomFalsePositives() const {
+    return bloom_false_positives_.load(std::memory_order_relaxed);
+  }
+
+  /**
+   * Read the data blocks [begin, end) asynchronously and append them to
+   * *buf, except those in the block cache. It does nothing if the readahead
+   * is disabled, or the file is mapped or opened with O_DIRECT.
+   */
+  void Prefetch(size_t begin, size_t end, PrefetchBuffer* buf);
+
  private:
+  /**
+   * Read the data block bh. If the file is mapped, return the mapped data.
+   * If it is in the block cache, or it is inserted into the block cache
+   * because fill_cache is true, it is pinned by *handle. Otherwise it is read
+   * into *buf. Return the block data.
+   */
+  const char* ReadBlock(BlockHandle bh, bool fill_cache,
+      std::optional<Cache::Handle>* handle, std::string* buf);
+
+  /* The largest internal key of the data block i. */
+  Slice IndexKey(size_t i) const;
+
+  /* The handle of the data block i. */
+  BlockHandle IndexBlock(size_t i) const;
+
+  /**
+   * The id of the data block which may contain the first record >= (key,
+   * seq), or BlockCount() if there is no such block.
+   */
+  size_t FindBlock(Slice key, uint64_t seq) const;
+
+  /* Whether data blocks can be read by ReadFile::PrepareAsync. */
+  bool CanReadAsync() const;
+
+  /**
+   * Wait for the prefetched data block bh, and move it into the block cache
+   * or *buf like ReadBlock. Return the block data.
+   */
+  const char* TakePrefetchedBlock(BlockHandle bh, bool fill_cache,
+      PrefetchedBlock* block, std::optional<Cache::Handle>* handle,
+      std::string* buf);
+
   /* The information of SSTable. */
   SSTInfo sst_info_;
   /* The file manager. */
   std::unique_ptr<ReadFile> file_;
-  /* The index data, which is initialized in construction. */
-  std::vector<IndexValue> index_;
+  /**
+   * The index block, which is read in construction and searched in place.
+   * The i-th entry starts at index_offsets_[i].
+   */
+  std::string index_data_;
+  std::vector<uint32_t> index_offsets_;
   /* The block size of the data block. */
   size_t block_size_;
   /* The key range of the SSTable, which is initialized in construction. */
@@ -80,8 +203,23 @@ class SSTable {
   bool compaction_in_process_{false};
   /* If it is true, then the SSTable file will be removed in deconstrution. */
   bool remove_tag_{false};
-  /* The bloom filter buffer */
-  std::string bloom_filter_;
+  /* The bloom filter, whose bit array is aligned to a cache line in
+   * bloom_buf_. */
+  Slice bloom_filter_;
+  std::string bloom_buf_;
+  /* The prefix bloom filter and the name of its prefix extractor. */
+  Slice prefix_filter_;
+  std::string prefix_filter_buf_;
+  std::string prefix_extractor_name_;
+  /* The range tombstones, which follow the prefix bloom filter. */
+  std::vector<RangeTombstone> range_tombstones_;
+  /* The statistics of the bloom filter. */
+  std::atomic<uint64_t> bloom_lookups_{0};
+  std::atomic<uint64_t> bloom_false_positives_{0};
+  /* The block cache shared by the SSTables of a database. */
+  Cache* cache_{nullptr};
+  /* The maximum number of data blocks read ahead by an iterator. */
+  size_t max_readahead_blocks_{0};
 
   friend class SSTableIterator;
 };
@@ -90,12 +228,19 @@ class SSTableIterator final : public Iterator {
  public:
   SSTableIterator() = default;
 
-  SSTableIterator(SSTable* sst) : sst_(sst) {
-
+  SSTableIterator(SSTable* sst, bool fill_cache = true)
+    : sst_(sst), fill_cache_(fill_cache) {
     SeekToFirst();
-
   }
 
+  /**
+   * Positioned at the beginning of the SSTable, whose first
+   * readahead_blocks data blocks have been prefetched into prefetched. It is
+   * used to continue the readahead of the previous SSTable in a sorted run.
+   */
+  SSTableIterator(SSTable* sst, bool fill_cache, PrefetchBuffer prefetched,
+      size_t readahead_blocks);
+
   /* Move the the beginning */
   void SeekToFirst();
 
@@ -110,25 +255,66 @@ class SSTableIterator final : public Iterator {
 
   void Next() override;
 
+  /* The number of data blocks read ahead. */
+  size_t readahead_blocks() const { return readahead_blocks_; }
+
+  /* Whether the readahead has reached the end of the SSTable. */
+  bool ReadaheadReachedEnd() const {
+    return readahead_blocks_ > 0 && prefetch_end_ >= sst_->BlockCount();
+  }
+
  private:
+  /* Read the data block block_id_ and move block_it_ to its beginning. */
+  void LoadBlock();
+
+  /**
+   * It is called when the iterator moves to the next data block. The number
+   * of blocks read ahead is doubled, up to max_readahead_blocks, so short
+   * scans do not waste reads.
+   */
+  void Readahead();
+
+  /* Drop the blocks read ahead after the iterator jumps. */
+  void ResetReadahead();
+
+  /* The current data block if the SSTable has no block cache. */
   std::string block_buf;
+  /* It pins the current data block in the block cache. */
+  std::optional<Cache::Handle> block_handle_;
   /* The reference to the SSTable */
   SSTable* sst_{nullptr};
+  /* Whether the data blocks are inserted into the block cache. */
+  bool fill_cache_{true};
   /* Current data block id */
   size_t block_id_{0};
   /* The block iterator of the current data block. */
   BlockIterator block_it_;
-  /* The buffer */
-  // AlignedBuffer buf_;
+  /* The end of the range of the mapped file which has been read ahead. */
+  offset_t readahead_end_{0};
+  /* The data blocks being read ahead, in the order of block ids. */
+  PrefetchBuffer prefetched_;
+  /* The number of data blocks read ahead. */
+  size_t readahead_blocks_{0};
+  /* The blocks before it have been read ahead. */
+  size_t prefetch_end_{0};
 };
 
 class SSTableBuilder {
  public:
+  /**
+   * If prefix_extractor is not nullptr, the prefixes of the user keys are
+   * added to a prefix bloom filter, which is stored after the footer.
+   */
   SSTableBuilder(std::unique_ptr<FileWriter> writer, size_t block_size,
-      size_t bloom_bits_per_key)
+      size_t bloom_bits_per_key,
+      size_t restart_interval = kDefaultBlockRestartInterval,
+      bool block_hash_index = false,
+      const PrefixExtractor* prefix_extractor = nullptr)
     : writer_(std::move(writer)),
-      block_builder_(block_size, writer_.get()),
-      bloom_bits_per_key_(bloom_bits_per_key) 
+      block_builder_(
+          block_size, writer_.get(), restart_interval, block_hash_index),
+      bloom_bits_per_key_(bloom_bits_per_key),
+      prefix_extractor_(prefix_extractor)
       {
         max_block_size_ = block_size;
       }
@@ -137,6 +323,19 @@ class SSTableBuilder {
 
   void Append(ParsedKey key, Slice value);
 
+  /**
+   * Add a range tombstone. Its begin key is appended as a
+   * RecordType::RangeDeletion record, so it must be added in the order of
+   * the records. The largest key of the SSTable covers its end key.
+   */
+  void AddRangeTombstone(const RangeTombstone& tombstone);
+
+  /**
+   * Cut the range tombstones at key, and return their parts >= key, which
+   * belong to the next SSTable.
+   */
+  std::vector<RangeTombstone> CutRangeTombstones(Slice key);
+
   void Finish();
 
   std::vector<IndexValue> GetIndexData() const { return index_data_; }
@@ -154,6 +353,9 @@ class SSTableBuilder {
    size_t GetBloomFilterOffset() const { return bloom_filter_offset_; }
 
  private:
+  /* Add the user key and its prefix to the bloom filters. */
+  void AddToFilters(Slice user_key);
+
   /* The file writer */
   std::unique_ptr<FileWriter> writer_;
   /* The builder for the data block */
@@ -176,6 +378,14 @@ class SSTableBuilder {
   size_t bloom_bits_per_key_{0};
   /* The maximum size of a block */
   size_t max_block_size_{0};
+  /* The prefix extractor of the prefix bloom filter */
+  const PrefixExtractor* prefix_extractor_{nullptr};
+  /* The hashes of the distinct prefixes, and the last prefix */
+  std::vector<size_t> prefix_hashes_;
+  std::string last_prefix_;
+  bool has_last_prefix_{false};
+  /* The range tombstones added */
+  std::vector<RangeTombstone> range_tombstones_;
 };
 
 }  // namespace lsm
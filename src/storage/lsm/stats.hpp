@@ -13,11 +13,30 @@ struct StatsContext {
   std::atomic<uint64_t> total_write_bytes{0};
   /* Total bytes of flushed MemTable */
   std::atomic<uint64_t> total_input_bytes{0};
+  /* Total bytes written to write-ahead logs. Not counted in total_write_bytes
+   */
+  std::atomic<uint64_t> total_wal_bytes{0};
+  /* Total time in microseconds that writers were stopped */
+  std::atomic<uint64_t> total_stall_micros{0};
+  /* Total time in microseconds that writers were delayed */
+  std::atomic<uint64_t> total_delay_micros{0};
+  /* The number of delayed writes */
+  std::atomic<uint64_t> num_delayed_writes{0};
+  /* The number of data blocks submitted by the readahead of iterators */
+  std::atomic<uint64_t> num_prefetched_blocks{0};
+  /* The number of data blocks that iterators took from the readahead */
+  std::atomic<uint64_t> num_prefetch_hits{0};
 
   void Reset() {
     total_read_bytes = 0;
     total_write_bytes = 0;
     total_input_bytes = 0;
+    total_wal_bytes = 0;
+    total_stall_micros = 0;
+    total_delay_micros = 0;
+    num_delayed_writes = 0;
+    num_prefetched_blocks = 0;
+    num_prefetch_hits = 0;
   }
 };
 
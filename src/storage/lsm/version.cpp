@@ -8,9 +8,15 @@ bool Version::Get(std::string_view user_key, seq_t seq, std::string* value) {
   
   for (int i = 0; i < levels_.size(); i++){
 
-    if (levels_[i].Get(user_key, seq, value) == GetResult::kFound){
+    auto res = levels_[i].Get(user_key, seq, value);
+    /* A deletion hides the records in the lower levels. */
+    if (res != GetResult::kNotFound) {
+      if (res == GetResult::kBlobIndex) {
+        ResolveBlobIndex(value);
+        return true;
+      }
 
-      return true;
+      return res == GetResult::kFound;
 
     }
   }
@@ -19,6 +25,29 @@ bool Version::Get(std::string_view user_key, seq_t seq, std::string* value) {
 
 }
 
+void Version::MultiGet(std::span<LookupKey*> keys, seq_t seq) {
+  for (auto& level : levels_) {
+    /* A deletion hides the records in the lower levels, so the keys found
+     * are skipped by the lower levels. */
+    level.MultiGet(keys, seq);
+  }
+  for (auto key : keys) {
+    if (key->result_ == GetResult::kBlobIndex) {
+      ResolveBlobIndex(key->value_);
+      key->result_ = GetResult::kFound;
+    }
+  }
+}
+
+void Version::ResolveBlobIndex(std::string* value) const {
+  auto index = BlobIndex::Decode(*value);
+  auto it = blob_files_.find(index.file_id_);
+  if (it == blob_files_.end()) {
+    DB_ERR("Blob file {} does not exist", index.file_id_);
+  }
+  it->second->Get(index, value);
+}
+
 void Version::Append(
     uint32_t level_id, std::vector<std::shared_ptr<SortedRun>> sorted_runs) {
   while (levels_.size() <= level_id) {
@@ -36,16 +65,18 @@ void Version::Append(uint32_t level_id, std::shared_ptr<SortedRun> sorted_run) {
 bool SuperVersion::Get(
     std::string_view user_key, seq_t seq, std::string* value) {
 
-    if (mt_->Get(user_key, seq, value) == GetResult::kFound){
+    auto res = mt_->Get(user_key, seq, value);
+    if (res != GetResult::kNotFound){
 
-      return true;
+      return res == GetResult::kFound;
 
     }
 
     for (std::shared_ptr<MemTable> mt : *imms_) {
-      if (mt->Get(user_key, seq, value) == GetResult::kFound) {
+      res = mt->Get(user_key, seq, value);
+      if (res != GetResult::kNotFound) {
        
-        return true;
+        return res == GetResult::kFound;
 
       }
     }
@@ -60,6 +91,23 @@ bool SuperVersion::Get(
 
 }
 
+void SuperVersion::MultiGet(std::span<LookupKey*> keys, seq_t seq) {
+  std::vector<LookupKey*> pending;
+  for (auto key : keys) {
+    key->result_ = mt_->Get(key->user_key_, seq, key->value_);
+    for (auto it = imms_->begin();
+         key->result_ == GetResult::kNotFound && it != imms_->end(); ++it) {
+      key->result_ = (*it)->Get(key->user_key_, seq, key->value_);
+    }
+    if (key->result_ == GetResult::kNotFound) {
+      pending.push_back(key);
+    }
+  }
+  if (!pending.empty()) {
+    version_->MultiGet(pending, seq);
+  }
+}
+
 std::string SuperVersion::ToString() const {
   std::string ret;
   ret += fmt::format("Memtable: size {}, ", mt_->size());
@@ -76,50 +124,48 @@ std::string SuperVersion::ToString() const {
   return ret;
 }
 
-void SuperVersionIterator::SeekToFirst() { 
-
+void SuperVersionIterator::SeekToFirst(std::optional<Slice> upper_bound) {
   it_.Clear();
+  /* Exhausted iterators are not pushed, since they have no key. */
   for (MemTableIterator& mt_it : mt_its_) {
     mt_it.SeekToFirst();
-    it_.Push(&mt_it);
+    if (mt_it.Valid()) {
+      it_.Push(&mt_it);
+    }
   }
-
-  for (SortedRunIterator& sr_it : sst_its_) {
-    sr_it.SeekToFirst();
-    it_.Push(&sr_it);
+  for (size_t i = 0; i < runs_.size(); i++) {
+    if (upper_bound &&
+        runs_[i]->GetSmallestKey().user_key_ >= *upper_bound) {
+      continue;
+    }
+    sst_its_[i].SeekToFirst();
+    if (sst_its_[i].Valid()) {
+      it_.Push(&sst_its_[i]);
+    }
   }
+  it_.Build();
+}
 
- }
-
-void SuperVersionIterator::Seek(Slice key, seq_t seq) {
-
-  SeekToFirst();
-  std::vector<Iterator*> itv;
-  while (Valid()) {
-
-    if (typeid(*it_.Top()) == typeid(MemTableIterator)) {
-
-      MemTableIterator* mit = dynamic_cast<MemTableIterator*>(it_.Top());
-      mit->Seek(key, seq);
-
-    } else {
-
-      SortedRunIterator* sst = dynamic_cast<SortedRunIterator*>(it_.Top());
-      sst->Seek(key, seq);
-
+void SuperVersionIterator::Seek(Slice key, seq_t seq,
+    std::optional<Slice> upper_bound,
+    const PrefixExtractor* prefix_extractor) {
+  it_.Clear();
+  for (MemTableIterator& mt_it : mt_its_) {
+    mt_it.Seek(key, seq);
+    if (mt_it.Valid()) {
+      it_.Push(&mt_it);
     }
-
-      itv.push_back(it_.Top());
-      it_.Pop();
-
   }
-
-  for (int i = 0; i < itv.size(); i++) {
-    
-    it_.Push(itv[i]);
-  
+  for (size_t i = 0; i < runs_.size(); i++) {
+    if (!runs_[i]->MayContain(key, upper_bound, prefix_extractor)) {
+      continue;
+    }
+    sst_its_[i].Seek(key, seq);
+    if (sst_its_[i].Valid()) {
+      it_.Push(&sst_its_[i]);
+    }
   }
-
+  it_.Build();
 }
 
 bool SuperVersionIterator::Valid() { 
@@ -1,5 +1,6 @@
 #pragma once
 
+#include "storage/lsm/blob.hpp"
 #include "storage/lsm/common.hpp"
 #include "storage/lsm/iterator_heap.hpp"
 #include "storage/lsm/level.hpp"
@@ -20,8 +21,23 @@ class Version {
   // Otherwise return false
   bool Get(Slice user_key, seq_t seq, std::string* value);
 
+  /**
+   * Look up a batch of keys sorted by user key. The keys whose results are
+   * not kNotFound are skipped.
+   */
+  void MultiGet(std::span<LookupKey*> keys, seq_t seq);
+
   const std::vector<Level>& GetLevels() const { return levels_; }
 
+  const BlobFileSet& GetBlobFiles() const { return blob_files_; }
+
+  void SetBlobFiles(BlobFileSet blob_files) {
+    blob_files_ = std::move(blob_files);
+  }
+
+  /* Replace the encoded BlobIndex in *value with the value it points to. */
+  void ResolveBlobIndex(std::string* value) const;
+
   /**
    * Append sorted runs to the Level level_id
    * It will create new levels if level_id >= levels_.size()
@@ -35,8 +51,17 @@ class Version {
    * */
   void Append(uint32_t level_id, std::shared_ptr<SortedRun> sorted_run);
 
+  /* Remove the empty levels at the bottom of the LSM tree. */
+  void TrimEmptyLevels() {
+    while (!levels_.empty() && levels_.back().GetRuns().empty()) {
+      levels_.pop_back();
+    }
+  }
+
  private:
   std::vector<Level> levels_;
+  /* The blob files referenced by the SSTables. */
+  BlobFileSet blob_files_;
 };
 
 class SuperVersionIterator;
@@ -60,6 +85,9 @@ class SuperVersion {
   // Otherwise return false
   bool Get(Slice user_key, seq_t seq, std::string* value);
 
+  /* Look up a batch of keys sorted by user key. */
+  void MultiGet(std::span<LookupKey*> keys, seq_t seq);
+
   std::string ToString() const;
 
  private:
@@ -72,36 +100,37 @@ class SuperVersion {
 
 class SuperVersionIterator final : public Iterator {
  public:
+  /* It must be positioned by SeekToFirst or Seek before use. */
   SuperVersionIterator(SuperVersion* sv) : sv_(sv) {
-
     mt_its_.push_back(sv_->GetMt()->Begin());
-    std::shared_ptr<std::vector<std::shared_ptr<MemTable>>> imts = sv_->GetImms();
-    for (auto& imt : *imts) {
-      auto imt_iterator = imt->Begin();
-      mt_its_.push_back(imt_iterator);
+    for (auto& imt : *sv_->GetImms()) {
+      mt_its_.push_back(imt->Begin());
     }
-
+    /* The sorted runs are not read until the iterator is positioned, since
+     * some of them may be skipped. */
     for (auto& level : sv->GetVersion()->GetLevels()) {
       for (auto& sr : level.GetRuns()) {
-        sst_its_.push_back(SortedRunIterator(sr->Begin()));
+        runs_.push_back(sr.get());
+        sst_its_.push_back(
+            SortedRunIterator(sr.get(), SSTableIterator(), 0, true));
       }
     }
-
-    for (auto& mt_it : mt_its_) {
-      it_.Push(&mt_it);
-    }
-
-    for (auto& sr_it : sst_its_) {
-      it_.Push(&sr_it);
-    }
-
   }
 
-  /* Move the the beginning */
-  void SeekToFirst();
+  /**
+   * Move the the beginning. The sorted runs whose keys are all >= upper_bound
+   * are skipped.
+   */
+  void SeekToFirst(std::optional<Slice> upper_bound = std::nullopt);
 
-  /* Find the first record >= (user_key, seq) */
-  void Seek(Slice key, seq_t seq);
+  /**
+   * Find the first record >= (user_key, seq). The sorted runs are skipped if
+   * SortedRun::MayContain(key, upper_bound, prefix_extractor) is false, so
+   * the caller must stop at upper_bound and at the end of the prefix.
+   */
+  void Seek(Slice key, seq_t seq,
+      std::optional<Slice> upper_bound = std::nullopt,
+      const PrefixExtractor* prefix_extractor = nullptr);
 
   bool Valid() override;
 
@@ -118,7 +147,8 @@ class SuperVersionIterator final : public Iterator {
   IteratorHeap<Iterator> it_;
   /* The memtable iterators */
   std::vector<MemTableIterator> mt_its_;
-  /* The sorted run iterators */
+  /* The sorted runs and their iterators */
+  std::vector<SortedRun*> runs_;
   std::vector<SortedRunIterator> sst_its_;
 };
 
@@ -0,0 +1,211 @@
+#include "storage/lsm/wal.hpp"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <sstream>
+
+#include "common/logging.hpp"
+#include "common/murmurhash.hpp"
+#include "storage/lsm/stats.hpp"
+
+namespace wing {
+
+namespace lsm {
+
+/* The maximum size of a write group. The leader always writes its own record.
+ */
+static constexpr size_t kMaxGroupSize = 1 << 20;
+
+static constexpr size_t kRecordHeaderSize = sizeof(uint32_t) * 2;
+
+static void SyncFile(int fd) {
+#if defined(__linux__)
+  ::fdatasync(fd);
+#elif defined(__MINGW64__)
+  ::_commit(fd);
+#endif
+}
+
+uint32_t WALChecksum(Slice payload) {
+  return static_cast<uint32_t>(
+      utils::Hash(payload.data(), payload.size(), 0x20241016));
+}
+
+WALWriter::WALWriter(const std::string& filename, WALSyncMode mode,
+    size_t sync_interval_ms, std::atomic<uint64_t>* bytes_counter)
+  : filename_(filename),
+    mode_(mode),
+    sync_interval_(sync_interval_ms),
+    bytes_counter_(bytes_counter != nullptr
+                       ? bytes_counter
+                       : &GetStatsContext()->total_wal_bytes) {
+  auto flag = O_WRONLY | O_CREAT | O_APPEND;
+#if defined(__MINGW64__)
+  flag |= O_BINARY;
+#endif
+  fd_ = ::open(filename.c_str(), flag, 0644);
+  if (fd_ < 0) {
+    DB_ERR("::open file {} error! Error: {}", filename, errno);
+  }
+  /* A background thread syncs the log, so that the records written by the
+   * last write group are not left unsynced until the next one. */
+  if (mode_ == WALSyncMode::kInterval) {
+    sync_thread_ = std::thread([this]() { SyncLoop(); });
+  }
+}
+
+WALWriter::~WALWriter() {
+  if (sync_thread_.joinable()) {
+    {
+      std::unique_lock lck(sync_mu_);
+      stop_ = true;
+    }
+    sync_cv_.notify_all();
+    sync_thread_.join();
+  }
+  if (mode_ != WALSyncMode::kNone) {
+    Sync();
+  }
+  ::close(fd_);
+}
+
+void WALWriter::EncodeRecord(const Writer& w, std::string* buf) {
+  uint32_t payload_size = sizeof(seq_t) + w.contents.size();
+  size_t begin = buf->size();
+  buf->resize(begin + kRecordHeaderSize + payload_size);
+  char* ptr = buf->data() + begin;
+  char* payload = ptr + kRecordHeaderSize;
+  memcpy(payload, &w.seq, sizeof(seq_t));
+  memcpy(payload + sizeof(seq_t), w.contents.data(), w.contents.size());
+  uint32_t checksum = WALChecksum(Slice(payload, payload_size));
+  memcpy(ptr, &payload_size, sizeof(uint32_t));
+  memcpy(ptr + sizeof(uint32_t), &checksum, sizeof(uint32_t));
+}
+
+void WALWriter::WriteAll(const char* data, size_t n) {
+  while (n > 0) {
+    ssize_t ret = ::write(fd_, data, n);
+    if (ret < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      DB_ERR("::write WAL {} Error! Error: {}", filename_, errno);
+    }
+    data += ret;
+    n -= ret;
+  }
+}
+
+void WALWriter::AddRecord(seq_t seq, const WriteBatch& batch) {
+  AddRecord(seq, batch.Contents());
+}
+
+void WALWriter::AddRecord(seq_t seq, Slice contents) {
+  Writer w;
+  w.seq = seq;
+  w.contents = contents;
+  std::unique_lock lck(mu_);
+  writers_.push_back(&w);
+  while (!w.done && &w != writers_.front()) {
+    w.cv.wait(lck);
+  }
+  if (w.done) {
+    return;
+  }
+  /* This writer is the leader. Collect the records of the group. */
+  buf_.clear();
+  Writer* last_writer = &w;
+  for (auto writer : writers_) {
+    if (writer != &w && buf_.size() >= kMaxGroupSize) {
+      break;
+    }
+    EncodeRecord(*writer, &buf_);
+    last_writer = writer;
+  }
+  /* New writers can queue up while we are doing I/O. They will wait because
+   * the leader is still at the front. */
+  lck.unlock();
+  WriteAll(buf_.data(), buf_.size());
+  bytes_counter_->fetch_add(buf_.size(), std::memory_order_relaxed);
+  written_.fetch_add(buf_.size(), std::memory_order_release);
+  if (mode_ == WALSyncMode::kSync) {
+    Sync();
+  }
+  lck.lock();
+  while (true) {
+    Writer* ready = writers_.front();
+    writers_.pop_front();
+    if (ready != &w) {
+      ready->done = true;
+      ready->cv.notify_one();
+    }
+    if (ready == last_writer) {
+      break;
+    }
+  }
+  /* Wake up the next leader. */
+  if (!writers_.empty()) {
+    writers_.front()->cv.notify_one();
+  }
+}
+
+void WALWriter::Sync() {
+  std::unique_lock lck(sync_mu_);
+  /* The records written before this point are synced. */
+  uint64_t written = written_.load(std::memory_order_acquire);
+  if (written == synced_.load(std::memory_order_relaxed)) {
+    return;
+  }
+  SyncFile(fd_);
+  synced_.store(written, std::memory_order_release);
+}
+
+void WALWriter::SyncLoop() {
+  std::unique_lock lck(sync_mu_);
+  while (!sync_cv_.wait_for(lck, sync_interval_, [&]() { return stop_; })) {
+    lck.unlock();
+    Sync();
+    lck.lock();
+  }
+}
+
+WALReader::WALReader(const std::string& filename) {
+  std::ifstream in(filename, std::ios::binary);
+  if (!in) {
+    DB_ERR("Cannot open WAL {}", filename);
+  }
+  std::stringstream ss;
+  ss << in.rdbuf();
+  data_ = std::move(ss).str();
+}
+
+bool WALReader::ReadRecord(seq_t* seq, Slice* contents) {
+  if (offset_ + kRecordHeaderSize > data_.size()) {
+    return false;
+  }
+  const char* ptr = data_.data() + offset_;
+  uint32_t payload_size, checksum;
+  memcpy(&payload_size, ptr, sizeof(uint32_t));
+  memcpy(&checksum, ptr + sizeof(uint32_t), sizeof(uint32_t));
+  if (offset_ + kRecordHeaderSize + payload_size > data_.size()) {
+    DB_INFO("Truncated WAL record at offset {}", offset_);
+    return false;
+  }
+  const char* payload = ptr + kRecordHeaderSize;
+  if (payload_size < sizeof(seq_t) + sizeof(uint32_t) ||
+      WALChecksum(Slice(payload, payload_size)) != checksum) {
+    DB_INFO("Corrupted WAL record at offset {}", offset_);
+    return false;
+  }
+  memcpy(seq, payload, sizeof(seq_t));
+  *contents =
+      Slice(payload + sizeof(seq_t), payload_size - sizeof(seq_t));
+  offset_ += kRecordHeaderSize + payload_size;
+  return true;
+}
+
+}  // namespace lsm
+
+}  // namespace wing
@@ -0,0 +1,139 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "storage/lsm/common.hpp"
+#include "storage/lsm/format.hpp"
+#include "storage/lsm/write_batch.hpp"
+
+namespace wing {
+
+namespace lsm {
+
+enum class WALSyncMode : uint8_t {
+  /* fdatasync after every write group. */
+  kSync = 0,
+  /* fdatasync the written records every sync interval in the background. */
+  kInterval,
+  /* Only write to the OS page cache. */
+  kNone,
+};
+
+/**
+ * The write-ahead log of a MemTable.
+ *
+ * The format of a log record is:
+ * | payload size (uint32_t) | checksum of payload (uint32_t) | payload |
+ *
+ * The format of a payload is:
+ * | sequence number of the first operation (seq_t) | WriteBatch contents |
+ *
+ * AddRecord is thread-safe. Concurrent writers are coalesced using
+ * leader/follower group commit: the writer at the front of the queue becomes
+ * the leader, writes the records of all the queued writers with a single
+ * write() (and at most one fdatasync()), and then wakes up the followers.
+ */
+class WALWriter {
+ public:
+  /**
+   * The written bytes are added to bytes_counter, or to
+   * StatsContext::total_wal_bytes if it is nullptr.
+   */
+  WALWriter(const std::string& filename, WALSyncMode mode,
+      size_t sync_interval_ms, std::atomic<uint64_t>* bytes_counter = nullptr);
+
+  WALWriter(const WALWriter&) = delete;
+  WALWriter& operator=(const WALWriter&) = delete;
+
+  /* Syncs the log if the sync mode is not kNone. */
+  ~WALWriter();
+
+  /**
+   * Append a WriteBatch whose first operation has sequence number seq, and
+   * return after it is written (and synced).
+   */
+  void AddRecord(seq_t seq, const WriteBatch& batch);
+
+  /* Append a record with arbitrary contents, e.g. a metadata edit. */
+  void AddRecord(seq_t seq, Slice contents);
+
+  /* Force the written records to disk. */
+  void Sync();
+
+  /* The number of bytes written to the log, and the number of them synced. */
+  uint64_t GetWrittenSize() const {
+    return written_.load(std::memory_order_acquire);
+  }
+
+  uint64_t GetSyncedSize() const {
+    return synced_.load(std::memory_order_acquire);
+  }
+
+  const std::string& GetFilename() const { return filename_; }
+
+ private:
+  struct Writer {
+    seq_t seq;
+    Slice contents;
+    bool done{false};
+    std::condition_variable cv;
+  };
+
+  static void EncodeRecord(const Writer& w, std::string* buf);
+
+  void WriteAll(const char* data, size_t n);
+
+  /* Sync the log every sync_interval_ until stop_ is set. */
+  void SyncLoop();
+
+  std::string filename_;
+  int fd_;
+  WALSyncMode mode_;
+  std::chrono::milliseconds sync_interval_;
+  std::atomic<uint64_t>* bytes_counter_;
+  std::atomic<uint64_t> written_{0};
+  std::atomic<uint64_t> synced_{0};
+
+  std::mutex mu_;
+  /* The queue of pending writers. The front is the current leader. */
+  std::deque<Writer*> writers_;
+  /* The buffer of a write group. It is only used by the leader. */
+  std::string buf_;
+
+  /* It serializes the syncs, and protects stop_. */
+  std::mutex sync_mu_;
+  std::condition_variable sync_cv_;
+  bool stop_{false};
+  /* Only used in kInterval mode. */
+  std::thread sync_thread_;
+};
+
+/* Read the records in a write-ahead log. */
+class WALReader {
+ public:
+  WALReader(const std::string& filename);
+
+  /**
+   * Read the next record. It returns false at the end of the log.
+   * A truncated or corrupted record at the tail of the log (e.g. a torn write
+   * during a crash) is treated as the end of the log.
+   */
+  bool ReadRecord(seq_t* seq, Slice* contents);
+
+ private:
+  std::string data_;
+  size_t offset_{0};
+};
+
+/* The checksum of a log record payload. */
+uint32_t WALChecksum(Slice payload);
+
+}  // namespace lsm
+
+}  // namespace wing
@@ -0,0 +1,138 @@
+#pragma once
+
+#include <cstring>
+#include <string>
+
+#include "storage/lsm/common.hpp"
+#include "storage/lsm/format.hpp"
+
+namespace wing {
+
+namespace lsm {
+
+/**
+ * A WriteBatch holds a sequence of Put, Del and DeleteRange operations which
+ * are applied to the DB atomically. The operations get consecutive sequence
+ * numbers in the order they are added, and become visible to readers at the
+ * same time.
+ *
+ * The format of the contents is:
+ * | count (uint32_t) | record 0 | record 1 | ... |
+ *
+ * The format of a record is:
+ * | type (RecordType) | key size (uint32_t) | key |
+ * | value size (uint32_t) | value | (only if type is RecordType::Value or
+ * RecordType::RangeDeletion, whose value is the end key)
+ *
+ * The contents are also the payload of a WAL record, so a WriteBatch is
+ * written to the WAL as a whole.
+ */
+class WriteBatch {
+ public:
+  class Iterator {
+   public:
+    Iterator(Slice contents)
+      : ptr_(contents.data() + sizeof(uint32_t)),
+        end_(contents.data() + contents.size()) {
+      if (ptr_ <= end_) {
+        Parse();
+      }
+    }
+
+    bool Valid() const { return valid_; }
+
+    RecordType type() const { return type_; }
+
+    Slice key() const { return key_; }
+
+    Slice value() const { return value_; }
+
+    void Next() { Parse(); }
+
+   private:
+    void Parse() {
+      valid_ = ptr_ < end_;
+      if (!valid_) {
+        return;
+      }
+      uint32_t len;
+      memcpy(&type_, ptr_, sizeof(RecordType));
+      ptr_ += sizeof(RecordType);
+      memcpy(&len, ptr_, sizeof(uint32_t));
+      ptr_ += sizeof(uint32_t);
+      key_ = Slice(ptr_, len);
+      ptr_ += len;
+      value_ = Slice();
+      if (type_ == RecordType::Value || type_ == RecordType::RangeDeletion) {
+        memcpy(&len, ptr_, sizeof(uint32_t));
+        ptr_ += sizeof(uint32_t);
+        value_ = Slice(ptr_, len);
+        ptr_ += len;
+      }
+    }
+
+    const char* ptr_;
+    const char* end_;
+    bool valid_{false};
+    RecordType type_{RecordType::Value};
+    Slice key_;
+    Slice value_;
+  };
+
+  WriteBatch() { Clear(); }
+
+  /* Create a WriteBatch from the contents of another one, e.g. from WAL. */
+  explicit WriteBatch(Slice contents) : rep_(contents) {}
+
+  void Put(Slice key, Slice value) {
+    Append(RecordType::Value, key);
+    AppendSlice(value);
+  }
+
+  void Del(Slice key) { Append(RecordType::Deletion, key); }
+
+  /* Delete the user keys in [begin, end). */
+  void DeleteRange(Slice begin, Slice end) {
+    Append(RecordType::RangeDeletion, begin);
+    AppendSlice(end);
+  }
+
+  void Clear() {
+    rep_.clear();
+    rep_.resize(sizeof(uint32_t), 0);
+  }
+
+  /* The number of operations in the batch */
+  uint32_t Count() const {
+    uint32_t count;
+    memcpy(&count, rep_.data(), sizeof(uint32_t));
+    return count;
+  }
+
+  /* The size of the encoded contents */
+  size_t ByteSize() const { return rep_.size(); }
+
+  Slice Contents() const { return rep_; }
+
+  Iterator Begin() const { return Iterator(rep_); }
+
+ private:
+  void Append(RecordType type, Slice key) {
+    uint32_t count = Count() + 1;
+    memcpy(rep_.data(), &count, sizeof(uint32_t));
+    rep_.append(reinterpret_cast<const char*>(&type), sizeof(RecordType));
+    AppendSlice(key);
+  }
+
+  void AppendSlice(Slice data) {
+    uint32_t len = data.size();
+    rep_.append(reinterpret_cast<const char*>(&len), sizeof(uint32_t));
+    rep_.append(data);
+  }
+
+  std::string rep_;
+};
+
+}  // namespace lsm
+
+}  // namespace wing
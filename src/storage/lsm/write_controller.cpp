@@ -0,0 +1,43 @@
+#include "storage/lsm/write_controller.hpp"
+
+#include <algorithm>
+
+namespace wing {
+
+namespace lsm {
+
+void WriteController::SetDelayedWriteRate(uint64_t rate) {
+  std::unique_lock lck(mu_);
+  if (rate_.load(std::memory_order_relaxed) == 0 && rate > 0) {
+    /* Start with an empty bucket. */
+    tokens_ = 0;
+    last_refill_ = std::chrono::steady_clock::now();
+  }
+  rate_.store(rate, std::memory_order_relaxed);
+}
+
+uint64_t WriteController::GetDelay(uint64_t bytes) {
+  if (!IsDelayed()) {
+    return 0;
+  }
+  std::unique_lock lck(mu_);
+  double rate = rate_.load(std::memory_order_relaxed);
+  if (rate == 0) {
+    return 0;
+  }
+  auto now = std::chrono::steady_clock::now();
+  std::chrono::duration<double> elapsed = now - last_refill_;
+  std::chrono::duration<double> max_burst = kMaxBurst;
+  last_refill_ = now;
+  tokens_ = std::min(
+      tokens_ + elapsed.count() * rate, max_burst.count() * rate);
+  tokens_ -= bytes;
+  if (tokens_ >= 0) {
+    return 0;
+  }
+  return static_cast<uint64_t>(-tokens_ / rate * 1e6);
+}
+
+}  // namespace lsm
+
+}  // namespace wing
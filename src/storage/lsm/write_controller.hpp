@@ -0,0 +1,49 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+
+namespace wing {
+
+namespace lsm {
+
+/**
+ * WriteController slows down writers when flushes and compactions fall
+ * behind, instead of stopping them.
+ *
+ * In the delayed state, writers take tokens (bytes) from a token bucket which
+ * is refilled at the delayed write rate. A writer which finds the bucket empty
+ * goes into debt and sleeps until its tokens are refilled, so the following
+ * writers wait behind it and the writes are spread out smoothly. The bucket
+ * holds at most kMaxBurst worth of tokens.
+ *
+ * It is thread-safe.
+ */
+class WriteController {
+ public:
+  static constexpr std::chrono::microseconds kMaxBurst{1000};
+
+  /* Set the rate in bytes per second. 0 means writes are not delayed. */
+  void SetDelayedWriteRate(uint64_t rate);
+
+  uint64_t GetDelayedWriteRate() const {
+    return rate_.load(std::memory_order_relaxed);
+  }
+
+  bool IsDelayed() const { return GetDelayedWriteRate() > 0; }
+
+  /* Take the tokens of a write and return the microseconds to sleep. */
+  uint64_t GetDelay(uint64_t bytes);
+
+ private:
+  std::atomic<uint64_t> rate_{0};
+  std::mutex mu_;
+  /* The available tokens. It is negative if the writers are in debt. */
+  double tokens_{0};
+  std::chrono::steady_clock::time_point last_refill_;
+};
+
+}  // namespace lsm
+
+}  // namespace wing
@@ -72,6 +72,15 @@ class MemoryTable {
     const uint8_t* Search(std::string_view key) override {
       return table_.Search(key);
     }
+    std::vector<const uint8_t*> MultiSearch(
+        std::span<const std::string_view> keys) override {
+      std::vector<const uint8_t*> ret;
+      ret.reserve(keys.size());
+      for (auto key : keys) {
+        ret.push_back(table_.Search(key));
+      }
+      return ret;
+    }
 
    private:
     MemoryTable& table_;
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <memory>
+#include <span>
 #include <vector>
 
 #include "catalog/schema.hpp"
@@ -34,6 +35,30 @@ class ModifyHandle {
   virtual bool Delete(std::string_view key) = 0;
   virtual bool Insert(std::string_view key, std::string_view value) = 0;
   virtual bool Update(std::string_view key, std::string_view new_value) = 0;
+  /**
+   * Insert multiple (key, value) pairs. Return false if any key is duplicate.
+   * By default the pairs are inserted one at a time. Storages that support
+   * atomic batches should override it, and then nothing is inserted on
+   * failure.
+   */
+  virtual bool InsertBatch(
+      const std::vector<std::pair<std::string_view, std::string_view>>& kvs) {
+    for (auto& [key, value] : kvs) {
+      if (!Insert(key, value)) {
+        return false;
+      }
+    }
+    return true;
+  }
+  /* Delete multiple keys. By default the keys are deleted one at a time. */
+  virtual bool DeleteBatch(const std::vector<std::string_view>& keys) {
+    for (auto& key : keys) {
+      if (!Delete(key)) {
+        return false;
+      }
+    }
+    return true;
+  }
 };
 
 /**
@@ -41,7 +66,7 @@ class ModifyHandle {
  * SearchHandle is read only.
  * Used in index scan.
  * Ensure that return value (e.g. const uint8_t*) is valid until the next
- * Search() is called.
+ * Search() or MultiSearch() is called.
  *
  * You can store additional information to speed up query. For example, you can
  * cache 1 page so that you don't need to fetch pages if the next query hits the
@@ -53,6 +78,13 @@ class SearchHandle {
   virtual ~SearchHandle() = default;
   virtual void Init() = 0;
   virtual const uint8_t* Search(std::string_view key) = 0;
+  /**
+   * Search a batch of keys. The i-th result is the row of keys[i], or nullptr
+   * if it does not exist. The storage may serve the batch more efficiently
+   * than searching the keys one by one.
+   */
+  virtual std::vector<const uint8_t*> MultiSearch(
+      std::span<const std::string_view> keys) = 0;
 };
 
 class Storage {
@@ -674,3 +674,37 @@ TEST(UtilsTest, BloomFilter) {
   DB_INFO("{}", fp / (double)N);
   ASSERT_TRUE(fp / (double)N <= 0.01);
 }
+
+TEST(UtilsTest, BloomFilterFormatsAndBatch) {
+  using wing::utils::BloomFilter;
+  size_t N = 1e4;
+  auto kv = wing::wing_testing::GenKVData(0x202410191500, 2 * N, 10, 9);
+  std::vector<size_t> hashes;
+  for (auto& k : kv) {
+    hashes.push_back(BloomFilter::BloomHash(k.key()));
+  }
+  for (auto format : {BloomFilter::Format::kLegacy,
+           BloomFilter::Format::kBlocked}) {
+    for (size_t bits_per_key : {1, 5, 10, 20}) {
+      std::string bf;
+      BloomFilter::Create(N, bits_per_key, bf, format);
+      for (uint32_t i = 0; i < N; i++) {
+        BloomFilter::Add(hashes[i], bf);
+      }
+      wing::BitVector result(2 * N);
+      BloomFilter::Find(hashes, bf, result);
+      for (uint32_t i = 0; i < 2 * N; i++) {
+        ASSERT_EQ(result[i], BloomFilter::Find(kv[i].key(), bf));
+        if (i < N) {
+          ASSERT_TRUE(result[i]);
+        }
+      }
+      /* The scalar probes give the same results as the AVX2 probes, which
+       * Find uses if the CPU supports AVX2. */
+      for (uint32_t i = 0; i < 2 * N; i++) {
+        ASSERT_EQ(
+            wing::utils::bloom_internal::FindScalar(hashes[i], bf), result[i]);
+      }
+    }
+  }
+}
@@ -1,5 +1,10 @@
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "common/bloomfilter.hpp"
 #include "common/stopwatch.hpp"
 #include "gtest/gtest.h"
+#include "storage/lsm/async_io.hpp"
 #include "storage/lsm/block.hpp"
 #include "storage/lsm/compaction_job.hpp"
 #include "storage/lsm/file.hpp"
@@ -10,6 +15,8 @@
 #include "storage/lsm/sst.hpp"
 #include "storage/lsm/stats.hpp"
 #include "storage/lsm/version.hpp"
+#include "storage/lsm/write_batch.hpp"
+#include "storage/lsm/write_controller.hpp"
 #include "test.hpp"
 
 using namespace wing::lsm;
@@ -80,6 +87,96 @@ TEST(LSMTest, MemTableSmallTest) {
     f.get();
 }
 
+TEST(LSMTest, MemTableConcurrentWriteTest) {
+  for (auto rep : {MemTableRep::kSkipList, MemTableRep::kMap}) {
+    MemTable t(rep);
+    size_t n = 20000, TH = 8;
+    std::atomic<size_t> seq{0};
+    std::vector<std::vector<CompressedKVPair>> kvs(TH);
+    std::vector<std::future<void>> pool;
+    for (uint32_t i = 0; i < TH; i++) {
+      kvs[i] = GenKVData(0x202410161419 + i, n, 13, 29);
+      pool.push_back(std::async([&, id = i]() {
+        for (auto& kv : kvs[id]) {
+          t.Put(kv.key(), ++seq, kv.value());
+        }
+      }));
+    }
+    for (auto& f : pool)
+      f.get();
+    auto kv = std::vector<CompressedKVPair>();
+    for (auto& v : kvs) {
+      kv.insert(kv.end(), v.begin(), v.end());
+    }
+    for (auto& k : kv) {
+      std::string value;
+      ASSERT_EQ(t.Get(k.key(), seq, &value), GetResult::kFound);
+      ASSERT_EQ(value, k.value());
+    }
+    std::sort(kv.begin(), kv.end());
+    auto it = t.Begin();
+    for (uint32_t i = 0; i < kv.size(); i++) {
+      ASSERT_TRUE(it.Valid());
+      ASSERT_EQ(ParsedKey(it.key()).user_key_, kv[i].key());
+      ASSERT_EQ(it.value(), kv[i].value());
+      it.Next();
+    }
+    ASSERT_FALSE(it.Valid());
+  }
+}
+
+TEST(LSMTest, MemTableRangeTombstoneTest) {
+  MemTable t;
+  size_t n = 1000, num_tombstones = 200;
+  auto key_of = [](size_t i) { return fmt::format("key{:04}", i); };
+  seq_t seq = 0;
+  for (size_t i = 0; i < n; i++) {
+    t.Put(key_of(i), ++seq, "value");
+  }
+  /* Readers run while DeleteRange publishes new snapshots. Each snapshot is
+   * checked against the reference scan of its own tombstones. */
+  std::atomic<bool> done{false};
+  std::vector<std::future<void>> readers;
+  for (size_t th = 0; th < 4; th++) {
+    readers.push_back(std::async([&, th]() {
+      std::mt19937_64 rgen(0x202610171741 + th);
+      while (!done.load()) {
+        auto list = t.GetRangeTombstoneList();
+        if (list == nullptr) {
+          continue;
+        }
+        auto key = key_of(rgen() % n);
+        seq_t read_seq = rgen() % (n + num_tombstones + 1);
+        ASSERT_EQ(list->fragments_.MaxCoveringSeq(key, read_seq),
+            MaxCoveringSeq(list->tombstones_, key, read_seq));
+      }
+    }));
+  }
+  std::mt19937_64 rgen(0x202610171740);
+  std::vector<RangeTombstone> tombstones;
+  for (size_t i = 0; i < num_tombstones; i++) {
+    size_t begin = rgen() % n, len = rgen() % 50 + 1;
+    t.DeleteRange(key_of(begin), key_of(begin + len), ++seq);
+    tombstones.push_back(
+        RangeTombstone{key_of(begin), key_of(begin + len), seq});
+  }
+  done = true;
+  for (auto& f : readers) {
+    f.get();
+  }
+  SortRangeTombstones(&tombstones);
+  ASSERT_EQ(t.GetRangeTombstones().size(), tombstones.size());
+  for (size_t i = 0; i < n; i++) {
+    for (seq_t read_seq : {seq_t(n), seq_t(n + num_tombstones / 2), seq}) {
+      std::string value;
+      auto expected = MaxCoveringSeq(tombstones, key_of(i), read_seq) > i + 1
+                          ? GetResult::kDelete
+                          : GetResult::kFound;
+      ASSERT_EQ(t.Get(key_of(i), read_seq, &value), expected);
+    }
+  }
+}
+
 TEST(LSMTest, FileWriterTest) {
   FileWriter writer(
       std::make_unique<SeqWriteFile>("__tmpLSMFileWriterTest", false), 4096);
@@ -117,6 +214,62 @@ TEST(LSMTest, FileWriterTest) {
   std::remove("__tmpLSMFileWriterTest");
 }
 
+TEST(LSMTest, AsyncReaderTest) {
+  size_t file_size = 1 << 20;
+  std::string content(file_size, 0);
+  std::mt19937_64 rgen(0x202410181130);
+  for (auto& ch : content) {
+    ch = rgen() % 256;
+  }
+  {
+    FileWriter writer(
+        std::make_unique<SeqWriteFile>("__tmpLSMAsyncReaderTest", false),
+        4096);
+    writer.AppendString(content);
+    writer.Flush();
+  }
+  int fd = ::open("__tmpLSMAsyncReaderTest", O_RDONLY);
+  ASSERT_GE(fd, 0);
+  /* Requests are submitted one by one, and in batches larger than the
+   * io_uring submission queue. */
+  for (auto [use_io_uring, batch] : {std::pair<bool, size_t>{true, 1},
+           {true, 300}, {false, 1}, {false, 300}}) {
+    auto reader = AsyncReader::Create(use_io_uring);
+    DB_INFO("Backend: {}, batch: {}", reader->name(), batch);
+    /* More requests than the io_uring queue, so some of them are executed
+     * synchronously. */
+    size_t M = 1000;
+    std::vector<std::unique_ptr<AsyncReadRequest>> reqs;
+    std::vector<std::string> bufs(M);
+    for (size_t i = 0; i < M; i++) {
+      auto req = std::make_unique<AsyncReadRequest>();
+      bufs[i].resize(4096);
+      req->fd = fd;
+      req->data = bufs[i].data();
+      req->n = 4096;
+      /* The last one is a short read at the end of the file. */
+      req->offset = i + 1 < M ? rgen() % (file_size - 4096) : file_size - 100;
+      reqs.push_back(std::move(req));
+    }
+    for (size_t i = 0; i < M; i += batch) {
+      std::vector<AsyncReadRequest*> submit;
+      for (size_t j = i; j < std::min(i + batch, M); j++) {
+        submit.push_back(reqs[j].get());
+      }
+      reader->Submit(submit);
+    }
+    for (size_t i = 0; i < M; i++) {
+      reqs[i]->Wait();
+      size_t n = i + 1 < M ? 4096 : 100;
+      ASSERT_EQ(reqs[i]->result, n);
+      ASSERT_EQ(Slice(bufs[i].data(), n),
+          Slice(content).substr(reqs[i]->offset, n));
+    }
+  }
+  ::close(fd);
+  std::remove("__tmpLSMAsyncReaderTest");
+}
+
 TEST(LSMTest, BlockTest) {
   FileWriter writer(
       std::make_unique<SeqWriteFile>("__tmpLSMBlockTest", false), 4096);
@@ -153,6 +306,188 @@ TEST(LSMTest, BlockTest) {
   std::remove("__tmpLSMBlockTest");
 }
 
+TEST(LSMTest, BlockPrefixCompressionTest) {
+  /* Keys with a long common prefix, and 3 versions of each key. */
+  uint32_t N = 300;
+  std::vector<std::string> keys;
+  for (uint32_t i = 0; i < N; i++) {
+    keys.push_back(fmt::format("user_table_index_{:08}", i * 2));
+  }
+  std::vector<std::pair<ParsedKey, std::string>> records;
+  for (auto& key : keys) {
+    for (seq_t seq = 3; seq >= 1; seq--) {
+      records.emplace_back(ParsedKey(key, seq, RecordType::Value),
+          fmt::format("value{}{}", key, seq));
+    }
+  }
+  auto read_block = [](const char* name, size_t size) {
+    std::string buf(size, 0);
+    ReadFile(name, false).Read(buf.data(), size, 0);
+    return buf;
+  };
+  size_t uncompressed_size = 0;
+  for (size_t interval : {1, 4, 16, 1000}) {
+    std::string name = fmt::format("__tmpLSMBlockPrefixTest{}", interval);
+    FileWriter writer(std::make_unique<SeqWriteFile>(name, false), 4096);
+    BlockBuilder builder(1 << 20, &writer, interval);
+    for (auto& [key, value] : records) {
+      ASSERT_TRUE(builder.Append(key, value));
+    }
+    builder.Finish();
+    writer.Flush();
+    ASSERT_EQ(builder.size(), writer.size());
+    if (interval == 1) {
+      uncompressed_size = builder.size();
+    } else {
+      ASSERT_LT(builder.size(), uncompressed_size * 3 / 4);
+    }
+    auto buf = read_block(name.c_str(), writer.size());
+    BlockHandle handle;
+    handle.offset_ = 0;
+    handle.size_ = builder.size();
+    handle.count_ = builder.count();
+    /* Full iteration */
+    BlockIterator it(buf.data(), handle);
+    for (auto& [key, value] : records) {
+      ASSERT_TRUE(it.Valid());
+      ASSERT_EQ(it.key(), InternalKey(key).GetSlice());
+      ASSERT_EQ(it.value(), value);
+      it.Next();
+    }
+    ASSERT_FALSE(it.Valid());
+    for (uint32_t i = 0; i < N; i++) {
+      /* Seek to an existing version, and between two versions. */
+      it.Seek(keys[i], 2);
+      ASSERT_TRUE(it.Valid());
+      ASSERT_EQ(it.key(), InternalKey(records[i * 3 + 1].first).GetSlice());
+      it.Seek(keys[i], 5);
+      ASSERT_TRUE(it.Valid());
+      ASSERT_EQ(it.key(), InternalKey(records[i * 3].first).GetSlice());
+      /* Seek to a missing key between two keys. */
+      it.Seek(fmt::format("user_table_index_{:08}", i * 2 + 1), 3);
+      if (i + 1 < N) {
+        ASSERT_TRUE(it.Valid());
+        ASSERT_EQ(it.key(), InternalKey(records[i * 3 + 3].first).GetSlice());
+        ASSERT_EQ(it.value(), records[i * 3 + 3].second);
+      } else {
+        ASSERT_FALSE(it.Valid());
+      }
+    }
+    it.Seek("a", 1);
+    ASSERT_TRUE(it.Valid());
+    ASSERT_EQ(it.key(), InternalKey(records[0].first).GetSlice());
+    std::remove(name.c_str());
+  }
+  /* Blocks written in the old format are still readable. */
+  {
+    std::string block;
+    std::vector<uint32_t> offsets;
+    for (auto& [key, value] : records) {
+      offsets.push_back(block.size());
+      InternalKey ikey(key);
+      uint32_t klen = ikey.size(), vlen = value.size();
+      block.append(reinterpret_cast<const char*>(&klen), sizeof(uint32_t));
+      block.append(ikey.GetSlice());
+      block.append(reinterpret_cast<const char*>(&vlen), sizeof(uint32_t));
+      block.append(value);
+    }
+    for (auto offset : offsets) {
+      block.append(reinterpret_cast<const char*>(&offset), sizeof(uint32_t));
+    }
+    BlockHandle handle;
+    handle.offset_ = 0;
+    handle.size_ = block.size();
+    handle.count_ = records.size();
+    BlockIterator it(block.data(), handle);
+    for (auto& [key, value] : records) {
+      ASSERT_TRUE(it.Valid());
+      ASSERT_EQ(it.key(), InternalKey(key).GetSlice());
+      ASSERT_EQ(it.value(), value);
+      it.Next();
+    }
+    ASSERT_FALSE(it.Valid());
+    it.Seek(keys[N / 2], 2);
+    ASSERT_TRUE(it.Valid());
+    ASSERT_EQ(it.key(), InternalKey(records[N / 2 * 3 + 1].first).GetSlice());
+  }
+}
+
+TEST(LSMTest, BlockHashIndexTest) {
+  uint32_t N = 200;
+  std::vector<std::string> keys;
+  for (uint32_t i = 0; i < N; i++) {
+    keys.push_back(fmt::format("key{:06}", i * 2));
+  }
+  /* Each user key has 1 to 4 versions, so some of them span restart
+   * intervals. */
+  std::vector<std::pair<ParsedKey, std::string>> records;
+  for (uint32_t i = 0; i < N; i++) {
+    for (seq_t seq = i % 4 + 1; seq >= 1; seq--) {
+      records.emplace_back(
+          ParsedKey(keys[i], seq * 2, seq % 3 == 0 ? RecordType::Deletion
+                                                   : RecordType::Value),
+          fmt::format("value{}{}", keys[i], seq));
+    }
+  }
+  size_t size_without_index = 0;
+  for (auto [interval, hash_index] : std::vector<std::pair<size_t, bool>>{
+           {4, false}, {4, true}, {1, true}, {16, true}}) {
+    std::string name = fmt::format("__tmpLSMBlockHashIndexTest{}", interval);
+    FileWriter writer(std::make_unique<SeqWriteFile>(name, false), 4096);
+    BlockBuilder builder(1 << 20, &writer, interval, hash_index);
+    for (auto& [key, value] : records) {
+      ASSERT_TRUE(builder.Append(key, value));
+    }
+    builder.Finish();
+    writer.Flush();
+    ASSERT_EQ(builder.size(), writer.size());
+    if (!hash_index) {
+      size_without_index = builder.size();
+    } else if (interval == 4) {
+      /* The hash index takes about 1.33 bytes per user key. */
+      ASSERT_GT(builder.size(), size_without_index);
+      ASSERT_LT(builder.size(), size_without_index + N * 2);
+    }
+    std::string buf(writer.size(), 0);
+    ReadFile(name.c_str(), false).Read(buf.data(), writer.size(), 0);
+    BlockHandle handle;
+    handle.offset_ = 0;
+    handle.size_ = builder.size();
+    handle.count_ = builder.count();
+    BlockIterator it(buf.data(), handle);
+    for (auto& [key, value] : records) {
+      ASSERT_TRUE(it.Valid());
+      ASSERT_EQ(it.key(), InternalKey(key).GetSlice());
+      it.Next();
+    }
+    ASSERT_FALSE(it.Valid());
+    for (size_t i = 0, j = 0; i < N; i++) {
+      size_t versions = i % 4 + 1;
+      /* Every version, and the sequence numbers between versions. */
+      for (seq_t seq = versions * 2 + 1; seq >= 1; seq--) {
+        it.SeekForGet(keys[i], seq);
+        if (seq < 2) {
+          /* No version is visible. */
+          ASSERT_TRUE(
+              !it.Valid() || ParsedKey(it.key()).user_key_ != keys[i]);
+          continue;
+        }
+        size_t newest = versions - std::min<size_t>(seq / 2, versions);
+        auto& [key, value] = records[j + newest];
+        ASSERT_TRUE(it.Valid());
+        ASSERT_EQ(it.key(), InternalKey(key).GetSlice());
+        ASSERT_EQ(it.value(), value);
+      }
+      /* A user key which is not in the block. */
+      auto missing = fmt::format("key{:06}", i * 2 + 1);
+      it.SeekForGet(missing, 10);
+      ASSERT_TRUE(!it.Valid() || ParsedKey(it.key()).user_key_ != missing);
+      j += versions;
+    }
+    std::remove(name.c_str());
+  }
+}
+
 TEST(LSMTest, SSTableTest) {
   SSTableBuilder builder(
       std::make_unique<FileWriter>(
@@ -354,6 +689,51 @@ TEST(LSMTest, IteratorHeapTest) {
   }
 }
 
+TEST(LSMTest, IteratorHeapLoserTreeTest) {
+  /* The tree of losers with an odd number of iterators, some of which are
+   * empty or run out early. */
+  for (size_t num_its : {1, 2, 3, 7, 33}) {
+    std::vector<MemTable> mts(num_its);
+    std::vector<std::tuple<std::string, seq_t, std::string>> expected;
+    seq_t seq = 0;
+    for (size_t i = 0; i < num_its; i++) {
+      if (i % 4 == 3) {
+        continue;
+      }
+      for (size_t j = 0; j < (i + 1) * 13 % 50; j++) {
+        auto key = fmt::format("key{:04}", (j * 7 + i * 3) % 97);
+        auto value = fmt::format("value{}_{}", i, j);
+        mts[i].Put(key, ++seq, value);
+        expected.emplace_back(key, seq, value);
+      }
+    }
+    std::sort(expected.begin(), expected.end(), [](auto& a, auto& b) {
+      return ParsedKey(std::get<0>(a), std::get<1>(a), RecordType::Value) <
+             ParsedKey(std::get<0>(b), std::get<1>(b), RecordType::Value);
+    });
+    std::vector<MemTableIterator> its;
+    for (auto& mt : mts) {
+      its.push_back(mt.Begin());
+    }
+    IteratorHeap<MemTableIterator> heap;
+    for (auto& it : its) {
+      heap.Push(&it);
+    }
+    heap.Build();
+    for (auto& [key, key_seq, value] : expected) {
+      ASSERT_TRUE(heap.Valid());
+      ASSERT_EQ(ParsedKey(heap.key()).user_key_, key);
+      ASSERT_EQ(ParsedKey(heap.key()).seq_, key_seq);
+      ASSERT_EQ(heap.value(), value);
+      heap.Next();
+    }
+    ASSERT_FALSE(heap.Valid());
+    heap.Clear();
+    heap.Build();
+    ASSERT_FALSE(heap.Valid());
+  }
+}
+
 TEST(LSMTest, SuperVersionTest) {
   auto mt = std::make_shared<MemTable>();
   auto imms = std::make_shared<std::vector<std::shared_ptr<MemTable>>>();
@@ -670,6 +1050,82 @@ TEST(LSMTest, CompactionBasicTest) {
   }
 }
 
+TEST(LSMTest, CompactionSnapshotTest) {
+  std::vector<std::pair<InternalKey, std::string>> records;
+  uint32_t N = 1000;
+  for (uint32_t i = 0; i < N; i++) {
+    auto key = fmt::format("key{:06}", i);
+    for (seq_t seq = 3; seq >= 1; seq--) {
+      records.emplace_back(
+          InternalKey(key, seq, RecordType::Value), std::to_string(seq));
+    }
+  }
+  class Iterator {
+   public:
+    Iterator(std::vector<std::pair<InternalKey, std::string>>& records)
+      : records_(records) {}
+    Slice key() { return records_[id_].first.GetSlice(); }
+    Slice value() { return records_[id_].second; }
+    void Next() { id_ += 1; }
+    bool Valid() { return id_ < records_.size(); }
+
+   private:
+    std::vector<std::pair<InternalKey, std::string>>& records_;
+    size_t id_{0};
+  };
+  auto filegen =
+      std::make_unique<FileNameGenerator>("__tmpCompactionSnapshotTest", 0);
+  /* Versions 3 and 2 are visible to the snapshot 2, version 1 is dropped. */
+  CompactionJob worker(filegen.get(), 4096, 4096, 16384, 10, false, 2);
+  auto ssts = worker.Run(Iterator(records));
+  ASSERT_GT(ssts.size(), 1);
+  SortedRun level(ssts, 4096, false);
+  auto it = level.Begin();
+  for (uint32_t i = 0; i < N; i++) {
+    for (seq_t seq = 3; seq >= 2; seq--) {
+      ASSERT_TRUE(it.Valid());
+      ASSERT_EQ(ParsedKey(it.key()).user_key_, fmt::format("key{:06}", i));
+      ASSERT_EQ(ParsedKey(it.key()).seq_, seq);
+      ASSERT_EQ(it.value(), std::to_string(seq));
+      it.Next();
+    }
+  }
+  ASSERT_FALSE(it.Valid());
+  for (auto& sst : ssts) {
+    std::remove(sst.filename_.c_str());
+  }
+}
+
+TEST(LSMTest, LeveledCompactionTriggerTest) {
+  auto filegen = std::make_unique<FileNameGenerator>(
+      "__tmpLeveledCompactionTriggerTest", 0);
+  CompactionJob worker(filegen.get(), 4096, 1 << 20, 16384, 10, false);
+  size_t trigger = 4;
+  LeveledCompactionPicker picker(10, 1 << 30, trigger);
+  /* Level 0 is compacted as soon as it has trigger sorted runs, not after it
+   * has more than trigger. */
+  std::vector<std::shared_ptr<SortedRun>> runs;
+  for (size_t i = 0; i < trigger; i++) {
+    MemTable mt;
+    mt.Put(fmt::format("key{}", i), 1, "value");
+    auto run =
+        std::make_shared<SortedRun>(worker.Run(mt.Begin()), 4096, false);
+    run->SetRemoveTag(true);
+    runs.push_back(run);
+    Version version;
+    version.Append(0, runs);
+    auto compaction = picker.Get(&version);
+    if (i + 1 < trigger) {
+      ASSERT_EQ(compaction, nullptr);
+      continue;
+    }
+    ASSERT_NE(compaction, nullptr);
+    ASSERT_EQ(compaction->src_level(), 0);
+    ASSERT_EQ(compaction->target_level(), 1);
+    ASSERT_EQ(compaction->input_runs().size(), trigger);
+  }
+}
+
 //////////////// LSM Tests
 
 TEST(LSMTest, LSMBasicTest) {
@@ -987,6 +1443,1417 @@ TEST(LSMTest, LSMSaveTest) {
   std::filesystem::remove_all(options.db_path);
 }
 
+TEST(LSMTest, LSMMetadataLogTest) {
+  Options options;
+  options.compaction_strategy_name = "leveled";
+  options.sst_file_size = 1 << 16;
+  options.write_buffer_size = 1 << 18;
+  options.db_path = "__tmpLSMMetadataLogTest/";
+  std::filesystem::remove_all(options.db_path);
+  std::filesystem::create_directories(options.db_path);
+  auto metadata_logs = [&]() {
+    std::vector<std::filesystem::path> ret;
+    for (auto& entry : std::filesystem::directory_iterator(options.db_path)) {
+      if (entry.path().filename().string().starts_with("metadata.log.")) {
+        ret.push_back(entry.path());
+      }
+    }
+    return ret;
+  };
+  uint32_t klen = 10, vlen = 64, N = 2e5;
+  auto kv =
+      GenKVDataWithRandomLen(0x202610171700, N, {klen - 1, klen}, {1, vlen});
+  {
+    auto lsm = DBImpl::Create(options);
+    for (uint32_t i = 0; i < N / 2; i++) {
+      lsm->Put(kv[i].key(), kv[i].value());
+    }
+    lsm->FlushAll();
+    lsm->WaitForFlushAndCompaction();
+  }
+  /* The flushes and compactions append edits to the log, which is folded
+   * into a new snapshot once it is large, and the old logs are removed. */
+  auto logs = metadata_logs();
+  ASSERT_EQ(logs.size(), 1);
+  ASSERT_GT(std::stoull(logs[0].extension().string().substr(1)), 1);
+  /* A torn record at the tail of the log is ignored. */
+  {
+    std::ofstream out(logs[0], std::ios::binary | std::ios::app);
+    out << std::string(10, 'x');
+  }
+  options.create_new = false;
+  {
+    auto lsm = DBImpl::Create(options);
+    for (uint32_t i = N / 2; i < N; i++) {
+      lsm->Put(kv[i].key(), kv[i].value());
+    }
+    lsm->FlushAll();
+    lsm->WaitForFlushAndCompaction();
+  }
+  ASSERT_EQ(metadata_logs().size(), 1);
+  {
+    auto lsm = DBImpl::Create(options);
+    auto it = lsm->Begin();
+    std::sort(kv.begin(), kv.end());
+    for (uint32_t i = 0; i < N; i++) {
+      ASSERT_TRUE(it.Valid());
+      ASSERT_EQ(it.key(), kv[i].key());
+      ASSERT_EQ(it.value(), kv[i].value());
+      it.Next();
+    }
+    ASSERT_FALSE(it.Valid());
+    ASSERT_TRUE(SanityCheck(lsm.get()));
+  }
+  std::filesystem::remove_all(options.db_path);
+}
+
+TEST(LSMTest, LSMWALRecoveryTest) {
+  Options options;
+  options.db_path = "__tmpLSMWALRecoveryTest/";
+  options.wal_sync_mode = "sync";
+  std::string crash_path = "__tmpLSMWALRecoveryTestCrash/";
+  std::filesystem::remove_all(options.db_path);
+  std::filesystem::remove_all(crash_path);
+  std::filesystem::create_directories(options.db_path);
+  uint32_t klen = 10, vlen = 100, N = 8000, T = 4;
+  auto kv =
+      GenKVDataWithRandomLen(0x202410161530, N, {klen - 1, klen}, {1, vlen});
+  std::sort(kv.begin(), kv.end());
+  kv.erase(std::unique(kv.begin(), kv.end(),
+               [](auto& x, auto& y) { return x.key() == y.key(); }),
+      kv.end());
+  N = kv.size();
+  {
+    auto lsm = DBImpl::Create(options);
+    /* Concurrent writers are grouped into the same WAL writes. */
+    std::vector<std::thread> threads;
+    for (uint32_t t = 0; t < T; t++) {
+      threads.emplace_back([&, t]() {
+        for (uint32_t i = t; i < N; i += T) {
+          lsm->Put(kv[i].key(), kv[i].value());
+        }
+      });
+    }
+    for (auto& thread : threads) {
+      thread.join();
+    }
+    for (uint32_t i = 0; i < N; i += 2) {
+      lsm->Del(kv[i].key());
+    }
+    /* Simulate a crash by copying the files before the MemTable is flushed. */
+    std::filesystem::copy(options.db_path, crash_path);
+  }
+  std::filesystem::remove_all(options.db_path);
+  options.db_path = crash_path;
+  options.create_new = false;
+  for (int round = 0; round < 2; round++) {
+    auto lsm = DBImpl::Create(options);
+    ASSERT_GE(lsm->CurrentSeq(), N + (N + 1) / 2);
+    for (uint32_t i = 0; i < N; i++) {
+      std::string value;
+      if (i % 2 == 0) {
+        ASSERT_FALSE(lsm->Get(kv[i].key(), &value));
+      } else {
+        ASSERT_TRUE(lsm->Get(kv[i].key(), &value));
+        ASSERT_EQ(value, kv[i].value());
+      }
+    }
+  }
+  std::filesystem::remove_all(options.db_path);
+}
+
+TEST(LSMTest, WALIntervalSyncTest) {
+  std::string path = "__tmpWALIntervalSyncTest/";
+  std::filesystem::remove_all(path);
+  std::filesystem::create_directories(path);
+  WriteBatch batch;
+  batch.Put("a", "1");
+  {
+    WALWriter wal(path + "sync.wal", WALSyncMode::kSync, 0);
+    wal.AddRecord(1, batch);
+    ASSERT_GT(wal.GetWrittenSize(), 0);
+    ASSERT_EQ(wal.GetSyncedSize(), wal.GetWrittenSize());
+  }
+  {
+    WALWriter wal(path + "none.wal", WALSyncMode::kNone, 0);
+    wal.AddRecord(1, batch);
+    ASSERT_EQ(wal.GetSyncedSize(), 0);
+  }
+  {
+    /* The tail is synced by the background thread without later writes. */
+    WALWriter wal(path + "interval.wal", WALSyncMode::kInterval, 10);
+    wal.AddRecord(1, batch);
+    wal.AddRecord(2, batch);
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(30);
+    while (wal.GetSyncedSize() < wal.GetWrittenSize() &&
+           std::chrono::steady_clock::now() < deadline) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    ASSERT_EQ(wal.GetSyncedSize(), wal.GetWrittenSize());
+  }
+  {
+    /* Nothing is synced before the interval, unless Sync is called. */
+    auto wal = std::make_unique<WALWriter>(
+        path + "close.wal", WALSyncMode::kInterval, 1000000);
+    wal->AddRecord(1, batch);
+    ASSERT_EQ(wal->GetSyncedSize(), 0);
+    wal->Sync();
+    ASSERT_EQ(wal->GetSyncedSize(), wal->GetWrittenSize());
+  }
+  std::filesystem::remove_all(path);
+}
+
+TEST(LSMTest, LSMWriteBatchTest) {
+  Options options;
+  options.db_path = "__tmpLSMWriteBatchTest/";
+  std::filesystem::remove_all(options.db_path);
+  std::filesystem::create_directories(options.db_path);
+  auto lsm = DBImpl::Create(options);
+  {
+    WriteBatch batch;
+    batch.Put("a", "1");
+    batch.Put("b", "2");
+    batch.Put("c", "3");
+    batch.Del("b");
+    ASSERT_EQ(batch.Count(), 4);
+    lsm->Write(batch);
+  }
+  ASSERT_EQ(lsm->CurrentSeq(), 4);
+  std::string value;
+  ASSERT_TRUE(lsm->Get("a", &value));
+  ASSERT_EQ(value, "1");
+  ASSERT_FALSE(lsm->Get("b", &value));
+  ASSERT_TRUE(lsm->Get("c", &value));
+  ASSERT_EQ(value, "3");
+  /* Readers observe either all or none of the operations in a batch. "a"
+   * and "c" are equal before the reader starts. */
+  {
+    WriteBatch batch;
+    batch.Put("a", "-1");
+    batch.Put("c", "-1");
+    lsm->Write(batch);
+  }
+  std::atomic<bool> stop{false};
+  std::thread reader([&]() {
+    while (!stop) {
+      std::vector<std::string> values;
+      for (auto it = lsm->Begin(); it.Valid(); it.Next()) {
+        values.emplace_back(it.value());
+      }
+      ASSERT_EQ(values.size(), 2);
+      ASSERT_EQ(values[0], values[1]);
+    }
+  });
+  for (int i = 0; i < 20000; i++) {
+    WriteBatch batch;
+    batch.Put("a", std::to_string(i));
+    batch.Del("b");
+    batch.Put("c", std::to_string(i));
+    lsm->Write(batch);
+  }
+  stop = true;
+  reader.join();
+  ASSERT_EQ(lsm->CurrentSeq(), 4 + 2 + 20000 * 3);
+  lsm.reset();
+  std::filesystem::remove_all(options.db_path);
+}
+
+TEST(LSMTest, LSMConcurrentCompactionTest) {
+  Options options;
+  options.compaction_strategy_name = "leveled";
+  options.sst_file_size = 1 << 16;
+  options.compaction_size_ratio = 4;
+  options.compaction_threads = 4;
+  options.db_path = "__tmpLSMConcurrentCompactionTest/";
+  std::filesystem::remove_all(options.db_path);
+  std::filesystem::create_directories(options.db_path);
+  auto lsm = DBImpl::Create(options);
+
+  uint32_t N = 2e5;
+  std::vector<std::string> keys;
+  for (uint32_t i = 0; i < N; i++) {
+    auto key = std::to_string(i);
+    keys.push_back(std::string(8 - key.size(), '0') + key);
+  }
+  std::mt19937_64 rgen(0x202410161542);
+  std::shuffle(keys.begin(), keys.end(), rgen);
+  for (auto& key : keys) {
+    lsm->Put(key, key + key + key + key);
+  }
+  /* Delete some keys, so that the deletions must hide older records in lower
+   * levels. */
+  for (uint32_t i = 0; i < N; i += 7) {
+    lsm->Del(keys[i]);
+  }
+  lsm->FlushAll();
+  lsm->WaitForFlushAndCompaction();
+
+  auto version = lsm->GetSV()->GetVersion();
+  ASSERT_TRUE(version->GetLevels().size() > 2);
+  for (auto& level : version->GetLevels()) {
+    if (level.GetID() != 0) {
+      ASSERT_EQ(level.GetRuns().size(), 1);
+    }
+  }
+  std::vector<std::string> expected;
+  for (uint32_t i = 0; i < N; i++) {
+    std::string value;
+    if (i % 7 == 0) {
+      ASSERT_FALSE(lsm->Get(keys[i], &value));
+    } else {
+      ASSERT_TRUE(lsm->Get(keys[i], &value));
+      ASSERT_EQ(value, keys[i] + keys[i] + keys[i] + keys[i]);
+      expected.push_back(keys[i]);
+    }
+  }
+  std::sort(expected.begin(), expected.end());
+  auto it = lsm->Begin();
+  for (auto& key : expected) {
+    ASSERT_TRUE(it.Valid());
+    ASSERT_EQ(it.key(), key);
+    it.Next();
+  }
+  ASSERT_FALSE(it.Valid());
+  lsm.reset();
+  std::filesystem::remove_all(options.db_path);
+}
+
+TEST(LSMTest, LSMSubcompactionTest) {
+  Options options;
+  options.compaction_strategy_name = "leveled";
+  options.sst_file_size = 1 << 16;
+  options.compaction_size_ratio = 4;
+  options.max_subcompactions = 4;
+  options.db_path = "__tmpLSMSubcompactionTest/";
+  std::filesystem::remove_all(options.db_path);
+  std::filesystem::create_directories(options.db_path);
+  auto lsm = DBImpl::Create(options);
+
+  uint32_t klen = 10, vlen = 128, N = 2e5;
+  auto kv =
+      GenKVDataWithRandomLen(0x202410171030, N, {klen - 1, klen}, {1, vlen});
+  std::mt19937_64 rgen(0x202410171031);
+  for (uint32_t i = 0; i < 2; i++) {
+    std::shuffle(kv.begin(), kv.end(), rgen);
+    for (auto& k : kv) {
+      lsm->Put(k.key(), k.value());
+    }
+  }
+  lsm->FlushAll();
+  lsm->WaitForFlushAndCompaction();
+  ASSERT_TRUE(lsm->GetSV()->GetVersion()->GetLevels().size() > 2);
+  ASSERT_TRUE(SanityCheck(lsm.get()));
+  std::sort(kv.begin(), kv.end());
+  auto it = lsm->Begin();
+  for (auto& k : kv) {
+    ASSERT_TRUE(it.Valid());
+    ASSERT_EQ(it.key(), k.key());
+    ASSERT_EQ(it.value(), k.value());
+    it.Next();
+  }
+  ASSERT_FALSE(it.Valid());
+  lsm.reset();
+  std::filesystem::remove_all(options.db_path);
+}
+
+TEST(LSMTest, WriteControllerTest) {
+  WriteController controller;
+  ASSERT_FALSE(controller.IsDelayed());
+  ASSERT_EQ(controller.GetDelay(1 << 20), 0);
+  controller.SetDelayedWriteRate(1 << 20);
+  ASSERT_TRUE(controller.IsDelayed());
+  /* The bucket is empty, so the writer sleeps until its tokens are refilled.
+   */
+  auto delay = controller.GetDelay(1 << 19);
+  ASSERT_TRUE(delay > 400000 && delay <= 500000);
+  /* The next writer waits behind the previous one. */
+  delay = controller.GetDelay(1 << 19);
+  ASSERT_TRUE(delay > 900000 && delay <= 1000000);
+  controller.SetDelayedWriteRate(0);
+  ASSERT_EQ(controller.GetDelay(1 << 20), 0);
+}
+
+TEST(LSMTest, LSMWriteStallTest) {
+  Options options;
+  options.compaction_strategy_name = "leveled";
+  options.sst_file_size = 1 << 16;
+  options.level0_slowdown_writes_trigger = 1;
+  options.delayed_write_rate = 16 << 20;
+  options.db_path = "__tmpLSMWriteStallTest/";
+  std::filesystem::remove_all(options.db_path);
+  std::filesystem::create_directories(options.db_path);
+  auto lsm = DBImpl::Create(options);
+  GetStatsContext()->Reset();
+
+  uint32_t klen = 10, vlen = 128, N = 5e4;
+  auto kv =
+      GenKVDataWithRandomLen(0x202410171611, N, {klen - 1, klen}, {1, vlen});
+  for (auto& k : kv) {
+    lsm->Put(k.key(), k.value());
+  }
+  lsm->FlushAll();
+  lsm->WaitForFlushAndCompaction();
+  /* Writes are delayed as soon as Level 0 is not empty. */
+  ASSERT_TRUE(GetStatsContext()->num_delayed_writes.load() > 0);
+  ASSERT_TRUE(GetStatsContext()->total_delay_micros.load() > 0);
+  std::string value;
+  for (auto& k : kv) {
+    ASSERT_TRUE(lsm->Get(k.key(), &value));
+  }
+  lsm.reset();
+  std::filesystem::remove_all(options.db_path);
+}
+
+TEST(LSMTest, LSMFlushAllLatencyTest) {
+  Options options;
+  options.db_path = "__tmpLSMFlushAllLatencyTest/";
+  std::filesystem::remove_all(options.db_path);
+  std::filesystem::create_directories(options.db_path);
+  auto lsm = DBImpl::Create(options);
+  /* FlushAll and WaitForFlushAndCompaction are woken up by the flushes and
+   * compactions instead of polling, and only return once their conditions
+   * hold. Flushing a single record or compacting a few tiny SSTables takes
+   * much less than the 100 ms polling interval, so each call is expected to
+   * return well within it. */
+  std::vector<double> flush_times, compact_times;
+  for (int i = 0; i < 20; i++) {
+    lsm->Put(std::to_string(i), std::to_string(i));
+    wing::StopWatch sw;
+    lsm->FlushAll();
+    flush_times.push_back(sw.GetTimeInSeconds());
+    auto sv = lsm->GetSV();
+    ASSERT_EQ(sv->GetMt()->size(), 0);
+    ASSERT_TRUE(sv->GetImms()->empty());
+    ASSERT_FALSE(sv->GetVersion()->GetLevels().empty());
+    /* The flush has triggered a compaction. */
+    bool compact = sv->GetVersion()->GetLevels()[0].GetRuns().size() >=
+                   options.level0_compaction_trigger;
+    sv.reset();
+    sw.Reset();
+    lsm->WaitForFlushAndCompaction();
+    if (compact) {
+      compact_times.push_back(sw.GetTimeInSeconds());
+    }
+    sv = lsm->GetSV();
+    ASSERT_LT(sv->GetVersion()->GetLevels()[0].GetRuns().size(),
+        options.level0_compaction_trigger);
+    for (auto& level : sv->GetVersion()->GetLevels()) {
+      for (auto& run : level.GetRuns()) {
+        ASSERT_FALSE(run->GetCompactionInProcess());
+      }
+    }
+  }
+  std::string value;
+  for (int i = 0; i < 20; i++) {
+    ASSERT_TRUE(lsm->Get(std::to_string(i), &value));
+    ASSERT_EQ(value, std::to_string(i));
+  }
+  /* The medians are compared, so that a single slow call on a busy machine
+   * does not fail the test. */
+  auto median = [](std::vector<double> times) {
+    std::sort(times.begin(), times.end());
+    return times[times.size() / 2];
+  };
+  DB_INFO("FlushAll: {} s", median(flush_times));
+  ASSERT_LT(median(flush_times), 0.05);
+  ASSERT_FALSE(compact_times.empty());
+  DB_INFO("WaitForFlushAndCompaction: {} s", median(compact_times));
+  ASSERT_LT(median(compact_times), 0.05);
+  lsm.reset();
+  std::filesystem::remove_all(options.db_path);
+}
+
+TEST(LSMTest, LSMParallelFlushTest) {
+  for (bool merge : {false, true}) {
+    Options options;
+    options.compaction_strategy_name = "leveled";
+    options.sst_file_size = 1 << 16;
+    options.max_immutable_count = 8;
+    options.flush_threads = 4;
+    options.merge_immutables_on_flush = merge;
+    options.db_path = "__tmpLSMParallelFlushTest/";
+    std::filesystem::remove_all(options.db_path);
+    std::filesystem::create_directories(options.db_path);
+    auto lsm = DBImpl::Create(options);
+
+    uint32_t klen = 10, vlen = 128, N = 1e5;
+    auto kv =
+        GenKVDataWithRandomLen(0x202410171802, N, {klen - 1, klen}, {1, vlen});
+    std::mt19937_64 rgen(0x202410171803);
+    for (uint32_t i = 0; i < 2; i++) {
+      std::shuffle(kv.begin(), kv.end(), rgen);
+      for (auto& k : kv) {
+        lsm->Put(k.key(), k.value());
+      }
+    }
+    lsm->FlushAll();
+    lsm->WaitForFlushAndCompaction();
+    ASSERT_TRUE(SanityCheck(lsm.get()));
+    std::sort(kv.begin(), kv.end());
+    auto it = lsm->Begin();
+    for (auto& k : kv) {
+      ASSERT_TRUE(it.Valid());
+      ASSERT_EQ(it.key(), k.key());
+      ASSERT_EQ(it.value(), k.value());
+      it.Next();
+    }
+    ASSERT_FALSE(it.Valid());
+    lsm.reset();
+    std::filesystem::remove_all(options.db_path);
+  }
+}
+
+TEST(LSMTest, LSMCachedSuperVersionTest) {
+  Options options;
+  options.compaction_strategy_name = "leveled";
+  options.sst_file_size = 1 << 16;
+  options.db_path = "__tmpLSMCachedSuperVersionTest/";
+  std::filesystem::remove_all(options.db_path);
+  std::filesystem::create_directories(options.db_path);
+  auto lsm = DBImpl::Create(options);
+
+  uint32_t klen = 10, vlen = 128, N = 1e5;
+  auto kv =
+      GenKVDataWithRandomLen(0x202410172011, N, {klen - 1, klen}, {1, vlen});
+  std::atomic<uint32_t> inserted{0};
+  std::atomic<bool> stop{false};
+  std::vector<std::thread> readers;
+  for (int t = 0; t < 4; t++) {
+    readers.emplace_back([&, t]() {
+      std::mt19937_64 rgen(t);
+      std::string value;
+      while (!stop.load()) {
+        uint32_t n = inserted.load();
+        if (n == 0) {
+          continue;
+        }
+        auto& k = kv[rgen() % n];
+        /* The record must be visible through the cached SuperVersion after
+         * it is inserted. */
+        ASSERT_TRUE(lsm->Get(k.key(), &value));
+        ASSERT_EQ(value, k.value());
+      }
+    });
+  }
+  for (uint32_t i = 0; i < N; i++) {
+    lsm->Put(kv[i].key(), kv[i].value());
+    inserted.store(i + 1);
+  }
+  lsm->FlushAll();
+  lsm->WaitForFlushAndCompaction();
+  stop = true;
+  for (auto& thread : readers) {
+    thread.join();
+  }
+  /* Pin a SuperVersion in the cache of this thread, and then replace it. The
+   * obsolete SSTables must not be kept by the cache. */
+  std::string value;
+  ASSERT_TRUE(lsm->Get(kv[0].key(), &value));
+  for (uint32_t i = 0; i < N; i++) {
+    lsm->Put(kv[i].key(), kv[i].value());
+  }
+  lsm->FlushAll();
+  lsm->WaitForFlushAndCompaction();
+  ASSERT_TRUE(SanityCheck(lsm.get()));
+  for (uint32_t i = 0; i < N; i += 97) {
+    ASSERT_TRUE(lsm->Get(kv[i].key(), &value));
+    ASSERT_EQ(value, kv[i].value());
+  }
+  lsm.reset();
+  std::filesystem::remove_all(options.db_path);
+}
+
+TEST(LSMTest, BlockCacheTest) {
+  CacheOptions options;
+  options.capacity = 10;
+  options.num_shard_bits = 0;
+  Cache cache(options);
+  BlockHandle b0{0, 4, 1}, b1{4, 4, 1}, b2{8, 4, 1};
+  ASSERT_FALSE(cache.get(1, b0).has_value());
+  {
+    auto h0 = cache.insert(1, b0, "aaaa");
+    auto h1 = cache.insert(1, b1, "bbbb");
+    /* Both blocks are pinned, so the cache exceeds its capacity. */
+    auto h2 = cache.insert(1, b2, "cccc");
+    ASSERT_EQ(h2.block(), "cccc");
+    auto h3 = cache.get(1, b0);
+    ASSERT_TRUE(h3.has_value());
+    ASSERT_EQ(h3->block(), "aaaa");
+    /* A concurrent insertion of the same block reuses the cached one. */
+    auto h4 = cache.insert(1, b1, "bbbb");
+    ASSERT_EQ(h4.block().data(), h1.block().data());
+  }
+  /* b0 and b1 have been accessed twice, so they are protected. The block
+   * accessed once is evicted first, and then the protected blocks are
+   * evicted by CLOCK. */
+  auto h5 = cache.insert(2, b0, "dddd");
+  ASSERT_FALSE(cache.get(1, b2).has_value());
+  ASSERT_FALSE(cache.get(1, b0).has_value());
+  ASSERT_TRUE(cache.get(1, b1).has_value());
+  ASSERT_EQ(cache.hits(), 2);
+  ASSERT_EQ(cache.misses(), 3);
+}
+
+TEST(LSMTest, BlockCacheScanResistanceTest) {
+  CacheOptions options;
+  options.capacity = 1000;
+  options.num_shard_bits = 0;
+  Cache cache(options);
+  std::string block(10, 'a');
+  auto handle = [](uint32_t i) { return BlockHandle{i * 10, 10, 1}; };
+  /* The working set of point lookups. */
+  for (uint32_t i = 0; i < 50; i++) {
+    cache.insert(1, handle(i), std::string(block));
+    ASSERT_TRUE(cache.get(1, handle(i)).has_value());
+  }
+  /* A scan reads each block once. */
+  for (uint32_t i = 0; i < 1000; i++) {
+    cache.insert(2, handle(i), std::string(block));
+  }
+  for (uint32_t i = 0; i < 50; i++) {
+    ASSERT_TRUE(cache.get(1, handle(i)).has_value());
+  }
+}
+
+TEST(LSMTest, BlockCacheConcurrentTest) {
+  CacheOptions options;
+  options.capacity = 1 << 16;
+  Cache cache(options);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; t++) {
+    threads.emplace_back([&, t]() {
+      std::mt19937_64 rgen(t);
+      for (int i = 0; i < 100000; i++) {
+        uint32_t id = rgen() % 1000;
+        BlockHandle bh{id * 100, 100, 1};
+        auto h = cache.get(id % 7, bh);
+        if (!h) {
+          h = cache.insert(id % 7, bh, std::string(100, 'a' + id % 26));
+        }
+        ASSERT_EQ(h->block(), std::string(100, 'a' + id % 26));
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  ASSERT_EQ(cache.hits() + cache.misses(), 400000);
+}
+
+TEST(LSMTest, LSMBlockCacheTest) {
+  Options options;
+  options.compaction_strategy_name = "leveled";
+  options.sst_file_size = 1 << 20;
+  options.cache.capacity = 64 << 20;
+  options.db_path = "__tmpLSMBlockCacheTest/";
+  std::filesystem::remove_all(options.db_path);
+  std::filesystem::create_directories(options.db_path);
+  auto lsm = DBImpl::Create(options);
+
+  uint32_t klen = 10, vlen = 128, N = 5e4;
+  auto kv =
+      GenKVDataWithRandomLen(0x202410172241, N, {klen - 1, klen}, {1, vlen});
+  for (auto& k : kv) {
+    lsm->Put(k.key(), k.value());
+  }
+  lsm->FlushAll();
+  lsm->WaitForFlushAndCompaction();
+  std::string value;
+  for (auto& k : kv) {
+    ASSERT_TRUE(lsm->Get(k.key(), &value));
+    ASSERT_EQ(value, k.value());
+  }
+  auto misses = lsm->GetCache().misses();
+  auto read_bytes = GetStatsContext()->total_read_bytes.load();
+  /* All the data blocks are in the cache now. */
+  for (auto& k : kv) {
+    ASSERT_TRUE(lsm->Get(k.key(), &value));
+    ASSERT_EQ(value, k.value());
+  }
+  std::sort(kv.begin(), kv.end());
+  auto it = lsm->Begin();
+  for (auto& k : kv) {
+    ASSERT_TRUE(it.Valid());
+    ASSERT_EQ(it.key(), k.key());
+    ASSERT_EQ(it.value(), k.value());
+    it.Next();
+  }
+  ASSERT_FALSE(it.Valid());
+  ASSERT_EQ(lsm->GetCache().misses(), misses);
+  ASSERT_EQ(GetStatsContext()->total_read_bytes.load(), read_bytes);
+  ASSERT_GE(lsm->GetCache().hits(), N);
+  lsm.reset();
+  std::filesystem::remove_all(options.db_path);
+}
+
+TEST(LSMTest, LSMBlockHashIndexTest) {
+  Options options;
+  options.sst_file_size = 1 << 20;
+  options.enable_block_hash_index = true;
+  options.db_path = "__tmpLSMBlockHashIndexTest/";
+  std::filesystem::remove_all(options.db_path);
+  std::filesystem::create_directories(options.db_path);
+  auto lsm = DBImpl::Create(options);
+
+  uint32_t klen = 10, vlen = 128, N = 5e4;
+  auto kv =
+      GenKVDataWithRandomLen(0x202410172350, N, {klen - 1, klen}, {1, vlen});
+  for (auto& k : kv) {
+    lsm->Put(k.key(), k.value());
+  }
+  /* Overwrite or delete some keys, so that a user key has several versions. */
+  for (uint32_t i = 0; i < N; i += 3) {
+    lsm->Put(kv[i].key(), kv[i].value() + "new");
+  }
+  for (uint32_t i = 1; i < N; i += 3) {
+    lsm->Del(kv[i].key());
+  }
+  lsm->FlushAll();
+  lsm->WaitForFlushAndCompaction();
+  std::string value;
+  for (uint32_t i = 0; i < N; i++) {
+    if (i % 3 == 1) {
+      ASSERT_FALSE(lsm->Get(kv[i].key(), &value));
+    } else {
+      ASSERT_TRUE(lsm->Get(kv[i].key(), &value));
+      ASSERT_EQ(value, kv[i].value() + (i % 3 == 0 ? "new" : ""));
+    }
+  }
+  ASSERT_FALSE(lsm->Get("missing key", &value));
+  lsm.reset();
+  std::filesystem::remove_all(options.db_path);
+}
+
+TEST(LSMTest, LSMMmapReadTest) {
+  Options options;
+  options.sst_file_size = 1 << 20;
+  options.use_mmap_reads = true;
+  options.db_path = "__tmpLSMMmapReadTest/";
+  std::filesystem::remove_all(options.db_path);
+  std::filesystem::create_directories(options.db_path);
+  auto lsm = DBImpl::Create(options);
+
+  uint32_t klen = 10, vlen = 128, N = 5e4;
+  auto kv =
+      GenKVDataWithRandomLen(0x202410180012, N, {klen - 1, klen}, {1, vlen});
+  for (auto& k : kv) {
+    lsm->Put(k.key(), k.value());
+  }
+  lsm->FlushAll();
+  lsm->WaitForFlushAndCompaction();
+  std::string value;
+  for (auto& k : kv) {
+    ASSERT_TRUE(lsm->Get(k.key(), &value));
+    ASSERT_EQ(value, k.value());
+  }
+  std::sort(kv.begin(), kv.end());
+  auto it = lsm->Begin();
+  for (auto& k : kv) {
+    ASSERT_TRUE(it.Valid());
+    ASSERT_EQ(it.key(), k.key());
+    ASSERT_EQ(it.value(), k.value());
+    it.Next();
+  }
+  ASSERT_FALSE(it.Valid());
+  /* Data blocks are read from the mapped files instead of the block cache. */
+  ASSERT_EQ(lsm->GetCache().hits() + lsm->GetCache().misses(), 0);
+  lsm.reset();
+  /* Reopen the database, and the SSTables are mapped again. */
+  options.create_new = false;
+  lsm = DBImpl::Create(options);
+  for (auto& k : kv) {
+    ASSERT_TRUE(lsm->Get(k.key(), &value));
+    ASSERT_EQ(value, k.value());
+  }
+  lsm.reset();
+  std::filesystem::remove_all(options.db_path);
+}
+
+TEST(LSMTest, LSMReadaheadTest) {
+  Options options;
+  /* Small SSTables, so that scans read ahead across SSTables. */
+  options.sst_file_size = 256 << 10;
+  options.cache.capacity = 256 << 10;
+  options.max_readahead_blocks = 4;
+  options.db_path = "__tmpLSMReadaheadTest/";
+  std::filesystem::remove_all(options.db_path);
+  std::filesystem::create_directories(options.db_path);
+  auto lsm = DBImpl::Create(options);
+
+  uint32_t klen = 10, vlen = 128, N = 5e4;
+  auto kv =
+      GenKVDataWithRandomLen(0x202410181140, N, {klen - 1, klen}, {1, vlen});
+  for (auto& k : kv) {
+    lsm->Put(k.key(), k.value());
+  }
+  lsm->FlushAll();
+  lsm->WaitForFlushAndCompaction();
+  std::sort(kv.begin(), kv.end());
+  auto stats = GetStatsContext();
+  stats->Reset();
+  for (int round = 0; round < 2; round++) {
+    auto it = lsm->Begin();
+    for (auto& k : kv) {
+      ASSERT_TRUE(it.Valid());
+      ASSERT_EQ(it.key(), k.key());
+      ASSERT_EQ(it.value(), k.value());
+      it.Next();
+    }
+    ASSERT_FALSE(it.Valid());
+  }
+  /* The blocks not in the cache are read ahead, and the scans take them from
+   * the readahead instead of reading them synchronously. */
+  DB_INFO("{} blocks prefetched, {} taken by the scans",
+      stats->num_prefetched_blocks.load(), stats->num_prefetch_hits.load());
+  ASSERT_GT(stats->num_prefetch_hits.load(), 0);
+  ASSERT_LE(stats->num_prefetch_hits.load(),
+      stats->num_prefetched_blocks.load());
+  /* Short scans from random keys. The readahead of the previous scans is
+   * dropped. */
+  std::mt19937_64 rgen(0x202410181150);
+  for (int i = 0; i < 200; i++) {
+    size_t start = rgen() % N;
+    auto it = lsm->Seek(kv[start].key());
+    for (size_t j = start; j < std::min<size_t>(start + 500, N); j++) {
+      ASSERT_TRUE(it.Valid());
+      ASSERT_EQ(it.key(), kv[j].key());
+      ASSERT_EQ(it.value(), kv[j].value());
+      it.Next();
+    }
+  }
+  lsm.reset();
+  std::filesystem::remove_all(options.db_path);
+}
+
+TEST(LSMTest, LSMMultiGetTest) {
+  Options options;
+  options.sst_file_size = 256 << 10;
+  options.cache.capacity = 256 << 10;
+  options.db_path = "__tmpLSMMultiGetTest/";
+  std::filesystem::remove_all(options.db_path);
+  std::filesystem::create_directories(options.db_path);
+  auto lsm = DBImpl::Create(options);
+
+  uint32_t klen = 10, vlen = 128, N = 5e4;
+  auto kv =
+      GenKVDataWithRandomLen(0x202410191030, N, {klen - 1, klen}, {1, vlen});
+  for (auto& k : kv) {
+    lsm->Put(k.key(), k.value());
+  }
+  lsm->FlushAll();
+  lsm->WaitForFlushAndCompaction();
+  /* Newer versions and deletions in SSTables and in the MemTable. */
+  std::mt19937_64 rgen(0x202410191031);
+  for (int round = 0; round < 2; round++) {
+    for (int i = 0; i < 5000; i++) {
+      auto& k = kv[rgen() % N];
+      if (rgen() % 2) {
+        lsm->Put(k.key(), fmt::format("{}-{}", k.value(), i));
+      } else {
+        lsm->Del(k.key());
+      }
+    }
+    if (round == 0) {
+      lsm->FlushAll();
+    }
+  }
+  std::vector<std::string> missing;
+  for (int i = 0; i < 100; i++) {
+    missing.push_back(fmt::format("missing{}", i));
+  }
+  for (size_t batch : {1, 7, 100, 3000}) {
+    std::vector<Slice> keys;
+    for (size_t i = 0; i < batch; i++) {
+      if (rgen() % 10 == 0) {
+        keys.push_back(missing[rgen() % missing.size()]);
+      } else {
+        keys.push_back(kv[rgen() % N].key());
+      }
+    }
+    /* Duplicate keys. */
+    keys.push_back(keys.front());
+    auto values = lsm->MultiGet(keys);
+    ASSERT_EQ(values.size(), keys.size());
+    for (size_t i = 0; i < keys.size(); i++) {
+      std::string value;
+      bool found = lsm->Get(keys[i], &value);
+      ASSERT_EQ(values[i].has_value(), found);
+      if (found) {
+        ASSERT_EQ(*values[i], value);
+      }
+    }
+  }
+  ASSERT_TRUE(lsm->MultiGet({}).empty());
+  lsm.reset();
+  std::filesystem::remove_all(options.db_path);
+}
+
+TEST(LSMTest, LSMFencePointerTest) {
+  Options options;
+  /* Many small SSTables whose keys share long prefixes, so the fence
+   * pointers often compare the full keys. */
+  options.sst_file_size = 64 << 10;
+  options.db_path = "__tmpLSMFencePointerTest/";
+  std::filesystem::remove_all(options.db_path);
+  std::filesystem::create_directories(options.db_path);
+  auto lsm = DBImpl::Create(options);
+
+  size_t N = 2e4;
+  auto key_of = [](size_t i) {
+    return fmt::format("common_prefix_{:08}", i * 2);
+  };
+  for (size_t i = 0; i < N; i++) {
+    lsm->Put(key_of(i), fmt::format("value{}", i));
+  }
+  lsm->FlushAll();
+  lsm->WaitForFlushAndCompaction();
+  std::string value;
+  for (size_t i = 0; i < N; i++) {
+    ASSERT_TRUE(lsm->Get(key_of(i), &value));
+    ASSERT_EQ(value, fmt::format("value{}", i));
+    /* Keys between two records, possibly between two SSTables. */
+    auto missing = fmt::format("common_prefix_{:08}", i * 2 + 1);
+    ASSERT_FALSE(lsm->Get(missing, &value));
+  }
+  ASSERT_FALSE(lsm->Get("common", &value));
+  ASSERT_FALSE(lsm->Get("common_prefix_~", &value));
+  ASSERT_FALSE(lsm->Get("", &value));
+  for (size_t i = 0; i < N; i += 97) {
+    auto it = lsm->Seek(fmt::format("common_prefix_{:08}", i * 2 + 1));
+    for (size_t j = i + 1; j < std::min(i + 200, N); j++) {
+      ASSERT_TRUE(it.Valid());
+      ASSERT_EQ(it.key(), key_of(j));
+      it.Next();
+    }
+  }
+  auto it = lsm->Seek("common");
+  ASSERT_TRUE(it.Valid());
+  ASSERT_EQ(it.key(), key_of(0));
+  ASSERT_FALSE(lsm->Seek("common_prefix_~").Valid());
+  lsm.reset();
+  std::filesystem::remove_all(options.db_path);
+}
+
+TEST(LSMTest, BloomBitsAllocationTest) {
+  std::vector<size_t> sizes = {1000, 10000, 100000, 1000000};
+  size_t total = 0;
+  for (auto size : sizes) {
+    total += size;
+  }
+  auto bits = AllocateBloomBits(sizes, 10);
+  ASSERT_EQ(bits.size(), sizes.size());
+  double total_bits = 0, fpr = 0;
+  for (size_t i = 0; i < sizes.size(); i++) {
+    total_bits += sizes[i] * bits[i];
+    fpr += BloomFalsePositiveRate(bits[i]);
+    /* The smaller runs get more bits per key. */
+    if (i > 0) {
+      ASSERT_GT(bits[i - 1], bits[i]);
+    }
+  }
+  ASSERT_NEAR(total_bits, 10.0 * total, 1e-3 * total);
+  ASSERT_LT(fpr, sizes.size() * BloomFalsePositiveRate(10));
+  /* The same bits if there is only one run. */
+  ASSERT_NEAR(AllocateBloomBits({100}, 10)[0], 10, 1e-6);
+  ASSERT_EQ(AllocateBloomBits({100, 0}, 10)[1], 0);
+  ASSERT_EQ(AllocateBloomBits({100, 1000}, 0)[0], 0);
+
+  /* The blocked filters have a higher false positive rate than the standard
+   * ones, and the model matches the real filters. */
+  double ln2 = std::log(2.0);
+  ASSERT_GT(BloomFalsePositiveRate(10), std::exp(-10 * ln2 * ln2));
+  ASSERT_EQ(BloomFalsePositiveRate(0), 1);
+  size_t N = 1e5, M = 1e6;
+  for (size_t bits_per_key : {5, 10, 16}) {
+    std::string filter;
+    wing::utils::BloomFilter::Create(N, bits_per_key, filter);
+    for (size_t i = 0; i < N; i++) {
+      wing::utils::BloomFilter::Add(fmt::format("key{}", i), filter);
+    }
+    size_t false_positives = 0;
+    for (size_t i = 0; i < M; i++) {
+      false_positives +=
+          wing::utils::BloomFilter::Find(fmt::format("absent{}", i), filter);
+    }
+    double observed = static_cast<double>(false_positives) / M;
+    double expected = BloomFalsePositiveRate(bits_per_key);
+    DB_INFO("{} bits per key: expected FPR {}, observed FPR {}", bits_per_key,
+        expected, observed);
+    ASSERT_NEAR(observed, expected, 0.15 * expected + 2e-5);
+  }
+}
+
+TEST(LSMTest, LSMPerLevelBloomBitsTest) {
+  Options options;
+  options.compaction_strategy_name = "leveled";
+  options.sst_file_size = 1 << 16;
+  options.compaction_size_ratio = 4;
+  options.enable_per_level_bloom_bits = true;
+  options.db_path = "__tmpLSMPerLevelBloomBitsTest/";
+  std::filesystem::remove_all(options.db_path);
+  std::filesystem::create_directories(options.db_path);
+  auto lsm = DBImpl::Create(options);
+
+  /* The keys are inserted in random order, so that the SSTables are
+   * rewritten by compactions instead of being moved to lower levels. */
+  size_t N = 2e5;
+  std::vector<size_t> ids(N);
+  std::iota(ids.begin(), ids.end(), 0);
+  std::shuffle(ids.begin(), ids.end(), std::mt19937_64(0x202610171530));
+  for (auto i : ids) {
+    lsm->Put(fmt::format("key{:08}", i * 2), fmt::format("value{:064}", i));
+  }
+  lsm->FlushAll();
+  lsm->WaitForFlushAndCompaction();
+  std::string value;
+  for (size_t i = 0; i < N; i += 7) {
+    ASSERT_TRUE(lsm->Get(fmt::format("key{:08}", i * 2), &value));
+    ASSERT_EQ(value, fmt::format("value{:064}", i));
+    ASSERT_FALSE(lsm->Get(fmt::format("key{:08}", i * 2 + 1), &value));
+  }
+  std::vector<BloomFilterStats> stats;
+  uint64_t keys = 0, bits = 0;
+  for (auto& s : lsm->GetBloomFilterStats()) {
+    DB_INFO("Level {}: {} keys, {} bits per key, expected FPR {}, observed "
+            "FPR {}",
+        s.level, s.keys, s.BitsPerKey(), s.ExpectedFPR(), s.ObservedFPR());
+    if (s.keys > 0) {
+      stats.push_back(s);
+      keys += s.keys;
+      bits += s.filter_bits;
+    }
+  }
+  ASSERT_TRUE(stats.size() > 2);
+  /* The upper levels get more bits per key, and the total is close to the
+   * budget. The filters are rounded up to cache lines. */
+  ASSERT_GT(stats.front().BitsPerKey(), stats.back().BitsPerKey() + 2);
+  ASSERT_LT(stats.back().BitsPerKey(), options.bloom_bits_per_key);
+  ASSERT_LT(static_cast<double>(bits) / keys, options.bloom_bits_per_key + 1);
+  for (auto& s : stats) {
+    ASSERT_GT(s.lookups, 0);
+    /* The lookups of the present keys are counted as well, so the observed
+     * rate is lower than the expected one. */
+    ASSERT_LT(s.ObservedFPR(), 1.5 * s.ExpectedFPR() + 1e-3);
+  }
+  lsm.reset();
+  std::filesystem::remove_all(options.db_path);
+}
+
+TEST(LSMTest, LSMPrefixSeekTest) {
+  Options options;
+  options.sst_file_size = 1 << 16;
+  options.level0_compaction_trigger = 100;
+  options.level0_slowdown_writes_trigger = 100;
+  options.level0_stop_writes_trigger = 100;
+  options.prefix_extractor = NewFixedPrefixExtractor(8);
+  options.db_path = "__tmpLSMPrefixSeekTest/";
+  std::filesystem::remove_all(options.db_path);
+  std::filesystem::create_directories(options.db_path);
+  auto lsm = DBImpl::Create(options);
+
+  /* The keys are tenant ids of 8 bytes followed by row ids. Each sorted run
+   * has every 8th tenant, so the key ranges of the runs overlap, and only the
+   * prefix bloom filters tell which runs have a tenant. */
+  size_t num_runs = 8, num_tenants = 256, num_rows = 50;
+  auto tenant_of = [](size_t t) { return fmt::format("t{:07}", t); };
+  auto key_of = [&](size_t t, size_t r) {
+    return fmt::format("{}{:06}", tenant_of(t), r);
+  };
+  for (size_t run = 0; run < num_runs; run++) {
+    for (size_t t = run; t < num_tenants; t += num_runs) {
+      for (size_t r = 0; r < num_rows; r++) {
+        lsm->Put(key_of(t, r), fmt::format("value{}_{}", t, r));
+      }
+    }
+    lsm->FlushAll();
+  }
+  lsm->WaitForFlushAndCompaction();
+
+  ReadOptions prefix_options;
+  prefix_options.prefix_same_as_start = true;
+  for (size_t t = 0; t < num_tenants; t++) {
+    auto it = lsm->Seek(tenant_of(t), prefix_options);
+    for (size_t r = 0; r < num_rows; r++) {
+      ASSERT_TRUE(it.Valid());
+      ASSERT_EQ(it.key(), key_of(t, r));
+      ASSERT_EQ(it.value(), fmt::format("value{}_{}", t, r));
+      it.Next();
+    }
+    ASSERT_FALSE(it.Valid());
+    /* Start in the middle of the tenant. */
+    it = lsm->Seek(key_of(t, num_rows / 2), prefix_options);
+    for (size_t r = num_rows / 2; r < num_rows; r++) {
+      ASSERT_TRUE(it.Valid());
+      ASSERT_EQ(it.key(), key_of(t, r));
+      it.Next();
+    }
+    ASSERT_FALSE(it.Valid());
+  }
+  ASSERT_FALSE(lsm->Seek(tenant_of(num_tenants), prefix_options).Valid());
+  ASSERT_FALSE(lsm->Seek("t0000000~", prefix_options).Valid());
+
+  /* Most of the sorted runs are skipped by the prefix bloom filters. */
+  auto version = lsm->GetSV()->GetVersion();
+  size_t runs = 0, candidates = 0;
+  for (size_t t = 0; t < num_tenants; t++) {
+    for (auto& level : version->GetLevels()) {
+      for (auto& run : level.GetRuns()) {
+        runs += 1;
+        candidates += run->MayContain(
+            tenant_of(t), std::nullopt, options.prefix_extractor.get());
+      }
+    }
+  }
+  ASSERT_GE(candidates, num_tenants);
+  ASSERT_LT(candidates, num_tenants + runs / 10);
+
+  /* The upper bound. */
+  {
+    ReadOptions bound_options;
+    bound_options.iterate_upper_bound = key_of(3, 10);
+    auto it = lsm->Begin(bound_options);
+    for (size_t t = 0; t <= 3; t++) {
+      for (size_t r = 0; r < (t < 3 ? num_rows : 10); r++) {
+        ASSERT_TRUE(it.Valid());
+        ASSERT_EQ(it.key(), key_of(t, r));
+        it.Next();
+      }
+    }
+    ASSERT_FALSE(it.Valid());
+    it = lsm->Seek(key_of(2, 49), bound_options);
+    ASSERT_TRUE(it.Valid());
+    ASSERT_EQ(it.key(), key_of(2, 49));
+    ASSERT_FALSE(lsm->Seek(key_of(3, 10), bound_options).Valid());
+  }
+
+  /* The filters are not used by an extractor of another name. */
+  lsm->Save();
+  lsm.reset();
+  options.create_new = false;
+  options.prefix_extractor = NewFixedPrefixExtractor(4);
+  lsm = DBImpl::Create(options);
+  {
+    auto it = lsm->Seek("t000", prefix_options);
+    for (size_t t = 0; t < num_tenants; t++) {
+      for (size_t r = 0; r < num_rows; r++) {
+        ASSERT_TRUE(it.Valid());
+        ASSERT_EQ(it.key(), key_of(t, r));
+        it.Next();
+      }
+    }
+    ASSERT_FALSE(it.Valid());
+  }
+  lsm.reset();
+  std::filesystem::remove_all(options.db_path);
+}
+
+TEST(LSMTest, LSMBlobTest) {
+  Options options;
+  options.sst_file_size = 1 << 20;
+  options.level0_compaction_trigger = 2;
+  options.min_blob_size = 256;
+  options.blob_file_size = 1 << 16;
+  options.blob_gc_age_cutoff = 0.5;
+  options.db_path = "__tmpLSMBlobTest/";
+  std::filesystem::remove_all(options.db_path);
+  std::filesystem::create_directories(options.db_path);
+  auto lsm = DBImpl::Create(options);
+
+  /* The hot keys are overwritten or deleted in every round, while the cold
+   * keys are only written in the first round. Half of the values are large
+   * enough to be stored in blob files. */
+  size_t num_hot = 1000, num_cold = 200, num_rounds = 4;
+  auto key_of = [](bool hot, size_t i) {
+    return fmt::format("{}{:06}", hot ? "hot" : "cold", i);
+  };
+  auto value_of = [](size_t i, size_t round) {
+    auto value = fmt::format("value{}_{}_", i, round);
+    if (i % 2 == 0) {
+      value.resize(256 + (i * 37 + round * 101) % 700, 'a' + i % 26);
+    }
+    return value;
+  };
+  std::map<std::string, std::string> expected;
+  auto check = [&]() {
+    std::vector<std::string> key_strs;
+    for (bool hot : {false, true}) {
+      for (size_t i = 0; i < (hot ? num_hot : num_cold); i++) {
+        key_strs.push_back(key_of(hot, i));
+      }
+    }
+    std::vector<Slice> keys(key_strs.begin(), key_strs.end());
+    auto values = lsm->MultiGet(keys);
+    for (size_t i = 0; i < keys.size(); i++) {
+      auto it = expected.find(std::string(keys[i]));
+      std::string value;
+      ASSERT_EQ(lsm->Get(keys[i], &value), it != expected.end());
+      ASSERT_EQ(values[i].has_value(), it != expected.end());
+      if (it != expected.end()) {
+        ASSERT_EQ(value, it->second);
+        ASSERT_EQ(*values[i], it->second);
+      }
+    }
+    auto it = lsm->Begin();
+    for (auto& [key, value] : expected) {
+      ASSERT_TRUE(it.Valid());
+      ASSERT_EQ(it.key(), key);
+      ASSERT_EQ(it.value(), value);
+      /* The value is read once and kept until the iterator moves. */
+      ASSERT_EQ(it.value(), value);
+      it.Next();
+    }
+    ASSERT_FALSE(it.Valid());
+  };
+
+  for (size_t i = 0; i < num_cold; i++) {
+    lsm->Put(key_of(false, i), value_of(i, 0));
+    expected[key_of(false, i)] = value_of(i, 0);
+  }
+  std::set<uint64_t> first_files;
+  std::vector<std::string> first_filenames;
+  for (size_t round = 0; round < num_rounds; round++) {
+    for (size_t i = 0; i < num_hot; i++) {
+      if ((i + round) % 5 == 0) {
+        lsm->Del(key_of(true, i));
+        expected.erase(key_of(true, i));
+      } else {
+        lsm->Put(key_of(true, i), value_of(i, round));
+        expected[key_of(true, i)] = value_of(i, round);
+      }
+    }
+    /* Read from the MemTable, whose values are not separated yet. */
+    if (round == 0) {
+      check();
+    }
+    lsm->FlushAll();
+    lsm->WaitForFlushAndCompaction();
+    check();
+    if (round == 0) {
+      auto version = lsm->GetSV()->GetVersion();
+      for (auto& [id, blob_file] : version->GetBlobFiles()) {
+        first_files.insert(id);
+        first_filenames.push_back(blob_file->GetInfo().filename_);
+      }
+      ASSERT_GT(first_files.size(), 1);
+    }
+  }
+  /* The values of the first round are overwritten, deleted or relocated by
+   * the garbage collection, so its blob files are obsolete. */
+  auto blob_files = lsm->GetSV()->GetVersion()->GetBlobFiles();
+  ASSERT_FALSE(blob_files.empty());
+  for (auto& [id, blob_file] : blob_files) {
+    ASSERT_FALSE(first_files.contains(id));
+    ASSERT_FALSE(blob_file->IsObsolete());
+  }
+  blob_files.clear();
+
+  /* The blob files are in the metadata. */
+  lsm.reset();
+  for (auto& filename : first_filenames) {
+    ASSERT_FALSE(std::filesystem::exists(filename));
+  }
+  options.create_new = false;
+  lsm = DBImpl::Create(options);
+  check();
+  lsm.reset();
+  std::filesystem::remove_all(options.db_path);
+}
+
+TEST(LSMTest, LSMDeleteRangeTest) {
+  Options options;
+  options.sst_file_size = 1 << 16;
+  options.level0_compaction_trigger = 2;
+  options.wal_sync_mode = "sync";
+  options.db_path = "__tmpLSMDeleteRangeTest/";
+  std::string crash_path = "__tmpLSMDeleteRangeTestCrash/";
+  std::filesystem::remove_all(options.db_path);
+  std::filesystem::remove_all(crash_path);
+  std::filesystem::create_directories(options.db_path);
+  auto lsm = DBImpl::Create(options);
+
+  size_t N = 20000;
+  auto key_of = [](size_t i) { return fmt::format("key{:06}", i); };
+  auto value_of = [](size_t i, size_t round) {
+    return fmt::format("value{}_{}_{}", i, round, std::string(80, 'a' + i % 26));
+  };
+  std::map<std::string, std::string> expected;
+  auto check = [&]() {
+    std::vector<std::string> key_strs;
+    for (size_t i = 0; i < N; i++) {
+      key_strs.push_back(key_of(i));
+    }
+    std::vector<Slice> keys(key_strs.begin(), key_strs.end());
+    auto values = lsm->MultiGet(keys);
+    for (size_t i = 0; i < keys.size(); i++) {
+      auto it = expected.find(key_strs[i]);
+      std::string value;
+      ASSERT_EQ(lsm->Get(keys[i], &value), it != expected.end());
+      ASSERT_EQ(values[i].has_value(), it != expected.end());
+      if (it != expected.end()) {
+        ASSERT_EQ(value, it->second);
+        ASSERT_EQ(*values[i], it->second);
+      }
+    }
+    auto it = lsm->Begin();
+    for (auto& [key, value] : expected) {
+      ASSERT_TRUE(it.Valid());
+      ASSERT_EQ(it.key(), key);
+      ASSERT_EQ(it.value(), value);
+      it.Next();
+    }
+    ASSERT_FALSE(it.Valid());
+    /* Seek into a deleted range. */
+    auto seek = lsm->Seek(key_of(N / 4));
+    auto next = expected.lower_bound(key_of(N / 4));
+    ASSERT_EQ(seek.Valid(), next != expected.end());
+    if (next != expected.end()) {
+      ASSERT_EQ(seek.key(), next->first);
+    }
+  };
+  auto delete_range = [&](size_t begin, size_t end) {
+    lsm->DeleteRange(key_of(begin), key_of(end));
+    expected.erase(
+        expected.lower_bound(key_of(begin)), expected.lower_bound(key_of(end)));
+  };
+  auto sst_count = [&]() {
+    size_t count = 0;
+    for (auto& level : lsm->GetSV()->GetVersion()->GetLevels()) {
+      for (auto& run : level.GetRuns()) {
+        count += run->SSTCount();
+      }
+    }
+    return count;
+  };
+
+  for (size_t i = 0; i < N; i++) {
+    lsm->Put(key_of(i), value_of(i, 0));
+    expected[key_of(i)] = value_of(i, 0);
+  }
+  lsm->FlushAll();
+  lsm->WaitForFlushAndCompaction();
+  size_t ssts_before = sst_count();
+  check();
+
+  /* The range tombstone is in the MemTable. Then some deleted keys are
+   * written again, which are newer than the tombstone. */
+  delete_range(N / 10, N * 6 / 10);
+  check();
+  for (size_t i = N / 10; i < N * 6 / 10; i += 97) {
+    lsm->Put(key_of(i), value_of(i, 1));
+    expected[key_of(i)] = value_of(i, 1);
+  }
+  check();
+  lsm->FlushAll();
+  /* A MemTable with only a range tombstone. */
+  delete_range(N * 7 / 10, N * 8 / 10);
+  delete_range(N * 7 / 10 - 3, N * 7 / 10 + 3);
+  lsm->FlushAll();
+  check();
+  lsm->WaitForFlushAndCompaction();
+  check();
+  /* The deleted records are dropped by the compactions, and most SSTables
+   * in the deleted range are dropped as a whole. */
+  for (size_t i = 0; i < 4; i++) {
+    for (size_t j = i; j < N; j += 40) {
+      if (!expected.contains(key_of(j))) {
+        continue;
+      }
+      lsm->Put(key_of(j), value_of(j, 2));
+      expected[key_of(j)] = value_of(j, 2);
+    }
+    lsm->FlushAll();
+    lsm->WaitForFlushAndCompaction();
+  }
+  check();
+  ASSERT_LT(sst_count(), ssts_before * 3 / 4);
+
+  /* The range tombstones are stored in the SSTables. */
+  delete_range(0, N / 20);
+  lsm.reset();
+  options.create_new = false;
+  lsm = DBImpl::Create(options);
+  check();
+  lsm.reset();
+  std::filesystem::remove_all(options.db_path);
+
+  /* The range tombstones are recovered from the WAL. The records stay in
+   * the MemTable, since SSTables can not be copied. */
+  options.create_new = true;
+  options.sst_file_size = 1 << 24;
+  std::filesystem::create_directories(options.db_path);
+  lsm = DBImpl::Create(options);
+  expected.clear();
+  for (size_t i = 0; i < N / 10; i++) {
+    lsm->Put(key_of(i), value_of(i, 0));
+    expected[key_of(i)] = value_of(i, 0);
+  }
+  delete_range(N / 50, N / 20);
+  lsm->Put(key_of(N / 40), value_of(N / 40, 1));
+  expected[key_of(N / 40)] = value_of(N / 40, 1);
+  std::filesystem::copy(options.db_path, crash_path);
+  lsm.reset();
+  std::filesystem::remove_all(options.db_path);
+  options.db_path = crash_path;
+  options.create_new = false;
+  lsm = DBImpl::Create(options);
+  check();
+  lsm.reset();
+  std::filesystem::remove_all(options.db_path);
+}
+
+TEST(LSMTest, LSMDeleteRangePrefixSeekTest) {
+  Options options;
+  options.sst_file_size = 1 << 16;
+  options.level0_compaction_trigger = 100;
+  options.level0_slowdown_writes_trigger = 100;
+  options.level0_stop_writes_trigger = 100;
+  options.prefix_extractor = NewFixedPrefixExtractor(1);
+  options.db_path = "__tmpLSMDeleteRangePrefixSeekTest/";
+  std::filesystem::remove_all(options.db_path);
+  std::filesystem::create_directories(options.db_path);
+  auto lsm = DBImpl::Create(options);
+
+  /* The records are newer than the range tombstone. The "b" records almost
+   * fill the first SSTable, so it is cut at "kz1", and the tombstone [a, l)
+   * is cut there too. The largest key of the first SSTable is then "kz1",
+   * whose prefix is not in its prefix bloom filter. */
+  lsm->DeleteRange("a", "l");
+  for (size_t i = 0; i < 120; i++) {
+    lsm->Put(fmt::format("b{:05}", i), std::string(500, 'b'));
+  }
+  lsm->Put("kz1", std::string(3000, 'k'));
+  lsm->FlushAll();
+  lsm->WaitForFlushAndCompaction();
+
+  auto version = lsm->GetSV()->GetVersion();
+  ASSERT_EQ(version->GetLevels().size(), 1u);
+  ASSERT_EQ(version->GetLevels()[0].GetRuns().size(), 1u);
+  auto run = version->GetLevels()[0].GetRuns()[0];
+  ASSERT_EQ(run->SSTCount(), 2u);
+  ASSERT_EQ(run->GetSSTs()[0]->GetLargestKey().user_key_, "kz1");
+  ASSERT_EQ(run->GetSSTs()[1]->GetSmallestKey().user_key_, "kz1");
+  ASSERT_TRUE(
+      run->MayContain("k", std::nullopt, options.prefix_extractor.get()));
+
+  ReadOptions prefix_options;
+  prefix_options.prefix_same_as_start = true;
+  auto it = lsm->Seek("k", prefix_options);
+  ASSERT_TRUE(it.Valid());
+  ASSERT_EQ(it.key(), "kz1");
+  it.Next();
+  ASSERT_FALSE(it.Valid());
+  it = lsm->Seek("b00100", prefix_options);
+  for (size_t i = 100; i < 120; i++) {
+    ASSERT_TRUE(it.Valid());
+    ASSERT_EQ(it.key(), fmt::format("b{:05}", i));
+    it.Next();
+  }
+  ASSERT_FALSE(it.Valid());
+  ASSERT_FALSE(lsm->Seek("c", prefix_options).Valid());
+  lsm.reset();
+  std::filesystem::remove_all(options.db_path);
+}
+
 TEST(LSMTest, LSMBigScanTest) {
   Options options;
   options.compaction_strategy_name = "leveled";